@@ -6,6 +6,43 @@
 
 #include <stdlib.h>
 
+/*
+* The number of patchable chain slots a target places at the end of each block
+* assembled with assemble_block. This is typically one slot for the taken
+* branch, and one slot for the fall-through.
+*/
+#define CHAIN_SLOTS 2
+
+/*
+* Code in the jit is placed JIT_CODE_ALIGN aligned, and preceeded by a header
+* of JIT_BLOCK_HEADER_SIZE bytes. The first 8 bytes of the header hold the
+* vaddr the code was translated from.
+*/
+#define JIT_CODE_ALIGN 16
+#define JIT_BLOCK_HEADER_SIZE 16
+
+/*
+* The jit keeps a direct-mapped table of JIT_LOOKUP_SIZE jit_lookup entries,
+* so generated code can find the code for a vaddr without returning to the
+* jit. The 64-bit variable "__JIT_LOOKUP__" holds a pointer to the table, and
+* the entry for vaddr is at index JIT_LOOKUP_HASH(vaddr). An entry is a hit if
+* its code is not NULL, and the vaddr in the header before its code matches.
+*
+* An entry is a single pointer, so the jit can replace it with one store while
+* code running on other threads reads it.
+*/
+#define JIT_LOOKUP_BITS 12
+#define JIT_LOOKUP_SIZE (1 << JIT_LOOKUP_BITS)
+#define JIT_LOOKUP_HASH(vaddr) \
+    ((((vaddr) >> 2) ^ (vaddr)) & (JIT_LOOKUP_SIZE - 1))
+
+struct jit_lookup {
+    const void * code;
+};
+
+struct boper;
+struct byte_buf;
+
 struct arch_source {
     const char  * (* ip_variable_identifier) ();
     unsigned int  (* ip_variable_bits) ();
@@ -19,13 +56,85 @@ struct arch_source {
         size_t size,
         uint64_t address
     );
+    /*
+    * Finds the statically known successors of the block translate_block
+    * would translate at address, such as jump targets and the fall-through.
+    * Writes up to max of them to successors, and returns how many it wrote.
+    * Blocks with a successor which is not known, such as a return, have
+    * none. May be NULL.
+    */
+    unsigned int (* block_successors) (
+        const void * buf,
+        size_t size,
+        uint64_t address,
+        uint64_t * successors,
+        unsigned int max
+    );
+    /*
+    * Returns the number of bytes of buf translate_block would translate at
+    * address, or 0 if that is not known. May be NULL.
+    */
+    size_t (* block_size) (const void * buf, size_t size, uint64_t address);
+    /*
+    * Returns the number of guest instructions in the block translate_block
+    * would translate at address, or 0 if that is not known. May be NULL.
+    */
+    unsigned int (* block_instructions) (
+        const void * buf,
+        size_t size,
+        uint64_t address
+    );
+    /*
+    * Returns 1 if the variable identifier is a guest flag, which most
+    * instructions write and few read. Writes to flags which are written
+    * again before they are read, in the block or in every one of its
+    * block_successors, are removed. May be NULL.
+    */
+    int (* is_flag) (const char * identifier);
 };
 
 struct arch_target {
     struct byte_buf * (* assemble) (struct list * btins_list,
                                   struct varstore * varstore);
     unsigned int (* execute) (const void * code, struct varstore * varstore);
+
+    /*
+    * Block chaining. A target which does not support chaining sets all of
+    * these to NULL.
+    */
+
+    /*
+    * Assembles btins_list as a jit block. Instead of returning directly, the
+    * block exits through CHAIN_SLOTS chain slots which compare the instruction
+    * pointer, ip, against the vaddr they were chained to, and jump straight to
+    * that block's code on a match. When no slot matches, the block may probe
+    * the jit lookup table for ip. If that misses too, the block writes the
+    * address of its own code to the 64-bit variable "__JIT_EXIT__" and returns
+    * 0.
+    */
+    struct byte_buf * (* assemble_block) (struct list * btins_list,
+                                          struct varstore * varstore,
+                                          const struct boper * ip);
+    /* Returns a pointer to chain slot n of a block, or NULL */
+    void * (* chain_slot) (void * code, size_t code_size, unsigned int n);
+    /*
+    * Patches a chain slot to jump to code when ip == vaddr. Other threads may
+    * be running the slot while it is patched, so no partially patched slot
+    * may jump anywhere but where an unchained slot would.
+    */
+    int    (* chain)      (void * slot, uint64_t vaddr, const void * code);
+    /* Restores a chain slot to its unchained state, with the same care */
+    int    (* unchain)    (void * slot);
+
+    /*
+    * Assembles a dispatcher, which is passed to execute in place of a block.
+    * It repeatedly looks up ip in the jit lookup table and runs the code it
+    * finds. It returns 0 when the lookup misses, or the return code of the
+    * block if that is not 0. May be NULL.
+    */
+    struct byte_buf * (* dispatcher) (struct varstore * varstore,
+                                      const struct boper * ip);
 };
 
 
-#endif
\ No newline at end of file
+#endif
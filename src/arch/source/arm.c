@@ -3,13 +3,18 @@
 #include "btlog.h"
 #include "bt/bins.h"
 
+#include <string.h>
 #include <vex/libvex.h>
 
 const struct arch_source arch_source_arm = {
     arm_ip_variable_identifier,
     arm_ip_variable_bits,
     arm_translate_ins,
-    arm_translate_block
+    arm_translate_block,
+    NULL,
+    NULL,
+    NULL,
+    arm_is_flag
 };
 
 
@@ -23,6 +28,14 @@ unsigned int arm_ip_variable_bits () {
 }
 
 
+int arm_is_flag (const char * identifier) {
+    return    (strcmp(identifier, "N") == 0)
+           || (strcmp(identifier, "Z") == 0)
+           || (strcmp(identifier, "C") == 0)
+           || (strcmp(identifier, "V") == 0);
+}
+
+
 struct asarm_cs_reg_table_entry {
     arm_reg cs_reg;
     const char * name;
@@ -13,6 +13,8 @@ const char *  arm_ip_variable_identifier ();
 
 unsigned int  arm_ip_variable_bits ();
 
+int           arm_is_flag (const char * identifier);
+
 struct list * arm_translate_ins   (
     const void * buf,
     size_t size,
@@ -3,13 +3,18 @@
 #include "bt/bins.h"
 
 #include <stdio.h>
+#include <string.h>
 
 
 const struct arch_source arch_source_hsvm = {
     hsvm_ip_variable_identifier,
     hsvm_ip_variable_bits,
     hsvm_translate_ins,
-    hsvm_translate_block
+    hsvm_translate_block,
+    hsvm_block_successors,
+    hsvm_block_size,
+    hsvm_block_instructions,
+    hsvm_is_flag
 };
 
 
@@ -214,56 +219,18 @@ struct list * hsvm_translate_arith (const uint8_t * u8buf, size_t size) {
 
 struct list * hsvm_store16 (const struct boper * address,
                             const struct boper * value) {
+    // hsvm is big-endian
     struct list * list = list_create();
-    // store high byte
-    list_append_(list, bins_shr_(boper_variable(16, "t16"),
-                                 OCOPY(value),
-                                 boper_constant(16, 8)));
-    list_append_(list, bins_trun_(boper_variable(8, "t8"),
-                                  boper_variable(16, "t16")));
-    list_append_(list, bins_store_(OCOPY(address), boper_variable(8, "t8")));
-    // store low byte
-    list_append_(list, bins_and_(boper_variable(16, "t16"),
-                                 OCOPY(value),
-                                 boper_constant(16, 0xff)));
-    list_append_(list, bins_trun_(boper_variable(8, "t8"), boper_variable(16, "t16")));
-    list_append_(list, bins_add_(boper_variable(16, "t16"),
-                                 OCOPY(address),
-                                 boper_constant(16, 1)));
-    list_append_(list, bins_store_(boper_variable(16, "t16"),
-                                   boper_variable(8, "t8")));
+    list_append_(list, bins_storebe_(OCOPY(address), OCOPY(value)));
     return list;
 }
 
 
 struct list * hsvm_load16 (const struct boper * address,
                            const struct boper * dst) {
-    // if address == dst, such as load r0, r0; we will have issues if we don't
-    // use a temporary value to load into
-    struct boper * tmpload = boper_variable(16, "tmpload");
-
+    // the address is read before dst is written, so load r0, r0 is fine
     struct list * list = list_create();
-    // load high byte
-    list_append_(list, bins_load_(boper_variable(8, "t8"),
-                                  OCOPY(address)));
-    list_append_(list, bins_zext_(boper_variable(16, "t16"),
-                                  boper_variable(8, "t8")));
-    list_append_(list, bins_shl_(OCOPY(tmpload),
-                                 boper_variable(16, "t16"),
-                                 boper_constant(16, 8)));
-    // load low byte
-    list_append_(list, bins_add_(boper_variable(16, "t16"),
-                                 OCOPY(address),
-                                 boper_constant(16, 1)));
-    list_append_(list, bins_load_(boper_variable(8, "t8"),
-                                  boper_variable(16, "t16")));
-    list_append_(list, bins_zext_(boper_variable(16, "t16"),
-                                  boper_variable(8, "t8")));
-    list_append_(list, bins_or_(OCOPY(dst),
-                                OCOPY(tmpload),
-                                boper_variable(16, "t16")));
-
-    ODEL(tmpload);
+    list_append_(list, bins_loadbe_(OCOPY(dst), OCOPY(address)));
     return list;
 }
 
@@ -390,33 +357,33 @@ struct list * hsvm_translate_ins (
                                      boper_variable(16, "rip"),
                                      boper_constant(16, 4)));
         if (u8buf[0] == OP_JE)
-            list_append_(list, bins_cmpeq_(boper_variable(1, "t1"),
+            list_append_(list, bins_cmpeq_(boper_temporary(1, "t1"),
                                            boper_variable(16, "flags"),
                                            boper_constant(16, 0)));
         else if (u8buf[0] == OP_JL)
-            list_append_(list, bins_cmplts_(boper_variable(1, "t1"),
+            list_append_(list, bins_cmplts_(boper_temporary(1, "t1"),
                                             boper_variable(16, "flags"),
                                             boper_constant(16, 0)));
         else if (u8buf[0] == OP_JLE)
-            list_append_(list, bins_cmples_(boper_variable(1, "t1"),
+            list_append_(list, bins_cmples_(boper_temporary(1, "t1"),
                                             boper_variable(16, "flags"),
                                             boper_constant(16, 0)));
         else if (u8buf[0] == OP_JG)
-            list_append_(list, bins_cmplts_(boper_variable(1, "t1"),
+            list_append_(list, bins_cmplts_(boper_temporary(1, "t1"),
                                             boper_constant(16, 0),
                                             boper_variable(16, "flags")));
         else if (u8buf[0] == OP_JGE)
-            list_append_(list, bins_cmples_(boper_variable(1, "t1"),
+            list_append_(list, bins_cmples_(boper_temporary(1, "t1"),
                                             boper_constant(16, 0),
                                             boper_variable(16, "flags")));
-        list_append_(list, bins_zext_(boper_variable(16, "t32"),
-                                      boper_variable(1, "t1")));
-        list_append_(list, bins_umul_(boper_variable(16, "t32"),
+        list_append_(list, bins_zext_(boper_temporary(16, "t32"),
+                                      boper_temporary(1, "t1")));
+        list_append_(list, bins_umul_(boper_temporary(16, "t32"),
                                       lval,
-                                      boper_variable(16, "t32")));
+                                      boper_temporary(16, "t32")));
         list_append_(list, bins_add_(boper_variable(16, "rip"),
                                      boper_variable(16, "rip"),
-                                     boper_variable(16, "t32")));
+                                     boper_temporary(16, "t32")));
         lval = NULL;
     }
     // call, callr
@@ -483,8 +450,8 @@ struct list * hsvm_translate_ins (
         list_append_(list, bins_add_(boper_variable(16, "rip"),
                                      boper_variable(16, "rip"),
                                      boper_constant(16, 4)));
-        list_append_(list, bins_load_(boper_variable(8, "t8"), lval));
-        list_append_(list, bins_zext_(ra, boper_variable(8, "t8")));
+        list_append_(list, bins_load_(boper_temporary(8, "t8"), lval));
+        list_append_(list, bins_zext_(ra, boper_temporary(8, "t8")));
         ra = NULL;
         lval = NULL;
     }
@@ -493,8 +460,8 @@ struct list * hsvm_translate_ins (
         list_append_(list, bins_add_(boper_variable(16, "rip"),
                                      boper_variable(16, "rip"),
                                      boper_constant(16, 4)));
-        list_append_(list, bins_load_(boper_variable(8, "t8"), rb));
-        list_append_(list, bins_zext_(ra, boper_variable(8, "t8")));
+        list_append_(list, bins_load_(boper_temporary(8, "t8"), rb));
+        list_append_(list, bins_zext_(ra, boper_temporary(8, "t8")));
         ra = NULL;
         rb = NULL;
     }
@@ -518,8 +485,8 @@ struct list * hsvm_translate_ins (
         list_append_(list, bins_add_(boper_variable(16, "rip"),
                                      boper_variable(16, "rip"),
                                      boper_constant(16, 4)));
-        list_append_(list, bins_trun_(boper_variable(8, "t8"), ra));
-        list_append_(list, bins_store_(lval, boper_variable(8, "t8")));
+        list_append_(list, bins_trun_(boper_temporary(8, "t8"), ra));
+        list_append_(list, bins_store_(lval, boper_temporary(8, "t8")));
         ra = NULL;
         lval = NULL;
     }
@@ -527,8 +494,8 @@ struct list * hsvm_translate_ins (
         list_append_(list, bins_add_(boper_variable(16, "rip"),
                                      boper_variable(16, "rip"),
                                      boper_constant(16, 4)));
-        list_append_(list, bins_trun_(boper_variable(8, "t8"), rb));
-        list_append_(list, bins_store_(ra, boper_variable(8, "t8")));
+        list_append_(list, bins_trun_(boper_temporary(8, "t8"), rb));
+        list_append_(list, bins_store_(ra, boper_temporary(8, "t8")));
         ra = NULL;
         rb = NULL;
     }
@@ -646,6 +613,29 @@ struct list * hsvm_translate_ins (
 }
 
 
+/* Returns 1 if opcode is the last instruction in a block */
+static int hsvm_ends_block (uint8_t opcode) {
+    switch (opcode) {
+    case OP_JMP :
+    case OP_JE :
+    case OP_JNE :
+    case OP_JL :
+    case OP_JLE :
+    case OP_JG :
+    case OP_JGE :
+    case OP_CALL :
+    case OP_CALLR :
+    case OP_IN :
+    case OP_OUT :
+    case OP_RET :
+    case OP_HLT :
+    case OP_SYSCALL :
+        return 1;
+    }
+    return 0;
+}
+
+
 struct list * hsvm_translate_block (
     const void * buf,
     size_t size,
@@ -668,27 +658,85 @@ struct list * hsvm_translate_block (
         list_append_list(list, ins_list);
         ODEL(ins_list);
 
-        int break_loop = 0;
-        switch (u8buf[offset]) {
-        case OP_JMP :
-        case OP_JE :
-        case OP_JNE :
-        case OP_JL :
-        case OP_JLE :
-        case OP_JGE :
-        case OP_CALL :
-        case OP_CALLR :
-        case OP_IN :
-        case OP_OUT :
-        case OP_RET :
-        case OP_HLT :
-        case OP_SYSCALL :
-            break_loop = 1;
-            break;
-        }
-        if (break_loop)
+        if (hsvm_ends_block(u8buf[offset]))
             break;
     }
 
     return list;
+}
+
+
+unsigned int hsvm_block_successors (
+    const void * buf,
+    size_t size,
+    uint64_t address,
+    uint64_t * successors,
+    unsigned int max
+) {
+    const uint8_t * u8buf = (const uint8_t *) buf;
+
+    size_t offset;
+    for (offset = 0; offset + 4 <= size; offset += 4) {
+        if (hsvm_ends_block(u8buf[offset]))
+            break;
+    }
+    if (offset + 4 > size)
+        return 0;
+
+    uint16_t next = address + offset + 4;
+    uint16_t target = next + ((u8buf[offset + 2] << 8) | u8buf[offset + 3]);
+
+    uint64_t found[2];
+    unsigned int found_n = 0;
+    switch (u8buf[offset]) {
+    case OP_JMP :
+    case OP_CALL :
+        found[found_n++] = target;
+        break;
+    case OP_JE :
+    case OP_JNE :
+    case OP_JL :
+    case OP_JLE :
+    case OP_JG :
+    case OP_JGE :
+        found[found_n++] = target;
+        found[found_n++] = next;
+        break;
+    case OP_IN :
+    case OP_OUT :
+    case OP_HLT :
+    case OP_SYSCALL :
+        found[found_n++] = next;
+        break;
+    }
+
+    unsigned int i;
+    for (i = 0; (i < found_n) && (i < max); i++)
+        successors[i] = found[i];
+    return i;
+}
+
+
+size_t hsvm_block_size (const void * buf, size_t size, uint64_t address) {
+    const uint8_t * u8buf = (const uint8_t *) buf;
+
+    size_t offset;
+    for (offset = 0; offset + 4 <= size; offset += 4) {
+        if (hsvm_ends_block(u8buf[offset]))
+            return offset + 4;
+    }
+    return size;
+}
+
+
+unsigned int hsvm_block_instructions (const void * buf,
+                                      size_t size,
+                                      uint64_t address) {
+    /* every instruction is 4 bytes */
+    return hsvm_block_size(buf, size, address) / 4;
+}
+
+
+int hsvm_is_flag (const char * identifier) {
+    return strcmp(identifier, "flags") == 0;
 }
\ No newline at end of file
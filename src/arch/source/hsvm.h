@@ -20,5 +20,17 @@ struct list * hsvm_translate_block (
     size_t size,
     uint64_t address
 );
+unsigned int hsvm_block_successors (
+    const void * buf,
+    size_t size,
+    uint64_t address,
+    uint64_t * successors,
+    unsigned int max
+);
+size_t hsvm_block_size (const void * buf, size_t size, uint64_t address);
+unsigned int hsvm_block_instructions (const void * buf,
+                                      size_t size,
+                                      uint64_t address);
+int hsvm_is_flag (const char * identifier);
 
 #endif
\ No newline at end of file
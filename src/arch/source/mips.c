@@ -14,7 +14,8 @@ const struct arch_source arch_source_mips = {
     mips_ip_variable_identifier,
     mips_ip_variable_bits,
     mips_translate_ins,
-    mips_translate_block
+    mips_translate_block,
+    NULL
 };
 
 
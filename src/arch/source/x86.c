@@ -19,7 +19,8 @@ const struct arch_source arch_source_x86 = {
     asx86_ip_variable_identifier,
     asx86_ip_variable_bits,
     asx86_translate_ins,
-    asx86_translate_block
+    asx86_translate_block,
+    NULL
 };
 
 
@@ -74,41 +75,41 @@ const struct index_string reg_strings[] = {
 int asx86_store_le32_ (struct list * list,
                        struct boper * address,
                        struct boper * value) {
-    list_append_(list, bins_trun_(boper_variable(8, "t8"), OCOPY(value)));
-    list_append_(list, bins_store_(OCOPY(address), boper_variable(8, "t8")));
+    list_append_(list, bins_trun_(boper_temporary(8, "t8"), OCOPY(value)));
+    list_append_(list, bins_store_(OCOPY(address), boper_temporary(8, "t8")));
 
-    list_append_(list, bins_shr_(boper_variable(32, "t32"),
+    list_append_(list, bins_shr_(boper_temporary(32, "t32"),
                                  OCOPY(value),
                                  boper_constant(32, 8)));
-    list_append_(list, bins_trun_(boper_variable(8, "t8"),
-                                  boper_variable(32, "t32")));
+    list_append_(list, bins_trun_(boper_temporary(8, "t8"),
+                                  boper_temporary(32, "t32")));
     list_append_(list, bins_add_(boper_variable(32, "addr"),
                                  OCOPY(address),
                                  boper_constant(32, 1)));
     list_append_(list, bins_store_(boper_variable(32, "addr"),
-                                   boper_variable(8, "t8")));
+                                   boper_temporary(8, "t8")));
 
-    list_append_(list, bins_shr_(boper_variable(32, "t32"),
+    list_append_(list, bins_shr_(boper_temporary(32, "t32"),
                                  OCOPY(value),
                                  boper_constant(32, 16)));
-    list_append_(list, bins_trun_(boper_variable(8, "t8"),
-                                  boper_variable(32, "t32")));
+    list_append_(list, bins_trun_(boper_temporary(8, "t8"),
+                                  boper_temporary(32, "t32")));
     list_append_(list, bins_add_(boper_variable(32, "addr"),
                                  OCOPY(address),
                                  boper_constant(32, 2)));
     list_append_(list, bins_store_(boper_variable(32, "addr"),
-                                   boper_variable(8, "t8")));
+                                   boper_temporary(8, "t8")));
 
-    list_append_(list, bins_shr_(boper_variable(32, "t32"),
+    list_append_(list, bins_shr_(boper_temporary(32, "t32"),
                                  value,
                                  boper_constant(32, 24)));
-    list_append_(list, bins_trun_(boper_variable(8, "t8"),
-                                  boper_variable(32, "t32")));
+    list_append_(list, bins_trun_(boper_temporary(8, "t8"),
+                                  boper_temporary(32, "t32")));
     list_append_(list, bins_add_(boper_variable(32, "addr"),
                                  address,
                                  boper_constant(32, 3)));
     list_append_(list, bins_store_(boper_variable(32, "addr"),
-                                   boper_variable(8, "t8")));
+                                   boper_temporary(8, "t8")));
     return 0;
 }
 
@@ -116,19 +117,19 @@ int asx86_store_le32_ (struct list * list,
 int asx86_store_le16_ (struct list * list,
                        struct boper * address,
                        struct boper * value) {
-    list_append_(list, bins_trun_(boper_variable(8, "t8"), OCOPY(value)));
-    list_append_(list, bins_store_(OCOPY(address), boper_variable(8, "t8")));
+    list_append_(list, bins_trun_(boper_temporary(8, "t8"), OCOPY(value)));
+    list_append_(list, bins_store_(OCOPY(address), boper_temporary(8, "t8")));
 
-    list_append_(list, bins_shr_(boper_variable(16, "t16"),
+    list_append_(list, bins_shr_(boper_temporary(16, "t16"),
                                  value,
                                  boper_constant(16, 8)));
-    list_append_(list, bins_trun_(boper_variable(8, "t8"),
-                                  boper_variable(16, "t16")));
+    list_append_(list, bins_trun_(boper_temporary(8, "t8"),
+                                  boper_temporary(16, "t16")));
     list_append_(list, bins_add_(boper_variable(32, "addr"),
                                  address,
                                  boper_constant(32, 1)));
     list_append_(list, bins_store(boper_variable(32, "addr"),
-                                  boper_variable(8, "t8")));
+                                  boper_temporary(8, "t8")));
 
     return 0;
 }
@@ -1,15 +1,26 @@
 #include "amd64.h"
 
 #include "btlog.h"
+#include "bt/ir.h"
 #include "container/memmap.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
 
 
 const struct arch_target arch_target_amd64 = {
     amd64_assemble,
-    amd64_execute
+    amd64_execute,
+    amd64_assemble_block,
+    amd64_chain_slot,
+    amd64_chain,
+    amd64_unchain,
+    amd64_dispatcher
 };
 
 /*
@@ -18,6 +29,8 @@ When calling into hand-assembled code:
 1) rbp points to the variable_space buffer
 2) We only treat eax, ebx, ecx, edx, esi, edi as GPRs. Prefer eax/ebx/ecx/edx.
 3) Never use esi or edi when operand size <= 8
+4) r8 - r15 only ever hold variables, see struct amd64_alloc
+5) rbx is where a fault in a direct memmap resumes, see amd64_access
 */
 
 #define REG_RAX 0x0
@@ -28,14 +41,123 @@ When calling into hand-assembled code:
 #define REG_RBP 0x5
 #define REG_RSI 0x6
 #define REG_RDI 0x7
+#define REG_R8  0x8
+#define REG_R9  0x9
+#define REG_R10 0xa
+#define REG_R11 0xb
+#define REG_R12 0xc
+#define REG_R13 0xd
+#define REG_R14 0xe
+#define REG_R15 0xf
+
+
+/* see struct amd64_peephole_stats */
+static int amd64_peephole = 1;
+static struct amd64_peephole_stats amd64_peephole_totals;
+
+/* Counts one peephole optimization. Blocks may be assembled by any thread. */
+static void amd64_peephole_count (unsigned int * counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+
+void amd64_set_peephole (int enabled) {
+    amd64_peephole = enabled;
+}
+
+
+void amd64_get_peephole_stats (struct amd64_peephole_stats * stats) {
+    stats->blocks = __atomic_load_n(&amd64_peephole_totals.blocks,
+                                    __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&amd64_peephole_totals.bytes,
+                                   __ATOMIC_RELAXED);
+    stats->reloads = __atomic_load_n(&amd64_peephole_totals.reloads,
+                                     __ATOMIC_RELAXED);
+    stats->pushes = __atomic_load_n(&amd64_peephole_totals.pushes,
+                                    __ATOMIC_RELAXED);
+    stats->immediates = __atomic_load_n(&amd64_peephole_totals.immediates,
+                                        __ATOMIC_RELAXED);
+    stats->identities = __atomic_load_n(&amd64_peephole_totals.identities,
+                                        __ATOMIC_RELAXED);
+    stats->short_forms = __atomic_load_n(&amd64_peephole_totals.short_forms,
+                                         __ATOMIC_RELAXED);
+    stats->constants = __atomic_load_n(&amd64_peephole_totals.constants,
+                                       __ATOMIC_RELAXED);
+    stats->leas = __atomic_load_n(&amd64_peephole_totals.leas,
+                                  __ATOMIC_RELAXED);
+}
+
+
+/* Returns 1 if imm is a 32-bit immediate, sign-extended to 64 bits */
+static int amd64_simm32 (uint64_t imm) {
+    return (imm < 0x80000000ULL) || (imm >= 0xffffffff80000000ULL);
+}
+
+
+/* Returns 1 if the low bits of imm are an 8-bit immediate, sign-extended */
+static int amd64_simm8 (uint64_t imm, unsigned int bits) {
+    uint64_t mask = (bits == 64) ? 0xffffffffffffffffULL : (1ULL << bits) - 1;
+    uint64_t extended = (uint64_t) (int64_t) (int8_t) (imm & 0xff);
+    return ((imm ^ extended) & mask) == 0;
+}
+
+
+/*
+* Set while assembling code whose size must not change, see
+* amd64_assemble_block. Blocks are assembled by any thread.
+*/
+static __thread int amd64_fixed = 0;
+
+
+/*
+* Returns 1 if encoders may pick the short forms of instructions, with 8-bit
+* immediates and displacements.
+*/
+static int amd64_short (void) {
+    return amd64_peephole && (! amd64_fixed);
+}
+
+
+/*
+* Appends the REX prefix an instruction needs, if any. w selects a 64-bit
+* operand, r is the register in ModRM.reg, and rm the register in ModRM.rm or
+* the opcode.
+*/
+static int rex (struct byte_buf * bb,
+                int w,
+                unsigned int r,
+                unsigned int rm) {
+    uint8_t prefix = 0x40;
+    if (w)
+        prefix |= 0x08;
+    if (r & 8)
+        prefix |= 0x04;
+    if (rm & 8)
+        prefix |= 0x01;
+    if (prefix != 0x40)
+        byte_buf_append(bb, prefix);
+    return 0;
+}
 
 
 int rm_off32_r (struct byte_buf * bb,
                 unsigned int r,
                 unsigned int rm,
                 uint32_t off32) {
-    byte_buf_append(bb, 0x80 | (r << 3) | rm);
-    byte_buf_append_le32(bb, off32);
+    int disp8 = amd64_short() && (((int32_t) off32) == ((int8_t) off32));
+    if (disp8)
+        byte_buf_append(bb, 0x40 | ((r & 7) << 3) | (rm & 7));
+    else
+        byte_buf_append(bb, 0x80 | ((r & 7) << 3) | (rm & 7));
+    // rsp and r12 in ModRM.rm mean a SIB byte follows
+    if ((rm & 7) == REG_RSP)
+        byte_buf_append(bb, 0x24);
+    if (disp8) {
+        amd64_peephole_count(&amd64_peephole_totals.short_forms);
+        byte_buf_append(bb, off32);
+    }
+    else
+        byte_buf_append_le32(bb, off32);
     return 0;
 }
 
@@ -54,6 +176,7 @@ enum {
     JCC_JGE,
     JCC_JL,
     JCC_JLE,
+    JCC_JNE,
 };
 
 struct op_byte jcc_op_bytes [] = {
@@ -66,6 +189,7 @@ struct op_byte jcc_op_bytes [] = {
     {0x7d, 0x8d}, // JGE
     {0x7c, 0x8c}, // JL
     {0x7e, 0x8e}, // JLE
+    {0x75, 0x85}, // JNE
 };
 
 enum {
@@ -75,6 +199,7 @@ enum {
     OP_SUB_RM_R,
     OP_XOR_RM_R,
     OP_MOV_RM_R_RM_R,
+    OP_CMP_RM_R,
 };
 
 struct op_byte op_rm_r_bytes [] = {
@@ -84,6 +209,7 @@ struct op_byte op_rm_r_bytes [] = {
     {0x28, 0x29}, // sub
     {0x30, 0x31}, // xor
     {0x88, 0x89}, // mov rm r
+    {0x38, 0x39}, // cmp rm r
 };
 
 int op_rm_r (struct byte_buf * bb,
@@ -94,6 +220,13 @@ int op_rm_r (struct byte_buf * bb,
              unsigned int bits) {
     switch (bits) {
     case 1 :
+        /* the low bit these give only depends on the low bits they are
+           given, so the result alone needs masking */
+        if (amd64_peephole) {
+            op_rm_r(bb, op, rm, off32, r, 8);
+            amd64_peephole_count(&amd64_peephole_totals.pushes);
+            return and_rm_imm(bb, rm, off32, 1, 8);
+        }
         // and [rm+off32] and r with 1
         and_rm_imm(bb, rm, off32, 1, 8);
         push_r64(bb, r);
@@ -105,17 +238,20 @@ int op_rm_r (struct byte_buf * bb,
         pop_r64(bb, r);
         return 0;
     case 8 :
+        rex(bb, 0, r, rm);
         byte_buf_append(bb, op_rm_r_bytes[op].op8);
         return rm_off32_r(bb, r, rm, off32);
     case 16 :
         byte_buf_append(bb, 0x66);
+        rex(bb, 0, r, rm);
         byte_buf_append(bb, op_rm_r_bytes[op].op32);
         return rm_off32_r(bb, r, rm, off32);
     case 32 :
+        rex(bb, 0, r, rm);
         byte_buf_append(bb, op_rm_r_bytes[op].op32);
         return rm_off32_r(bb, r, rm, off32);
     case 64 :
-        byte_buf_append(bb, 0x48);
+        rex(bb, 1, r, rm);
         byte_buf_append(bb, op_rm_r_bytes[op].op32);
         return rm_off32_r(bb, r, rm, off32);
     }
@@ -123,17 +259,29 @@ int op_rm_r (struct byte_buf * bb,
 }
 
 enum {
-    OP_AND_RM_IMM
+    OP_ADD_RM_IMM,
+    OP_AND_RM_IMM,
+    OP_OR_RM_IMM,
+    OP_SUB_RM_IMM,
+    OP_XOR_RM_IMM
 };
 
 struct op_rm_imm_byte {
     unsigned int op8;
     unsigned int op32;
+    /* the form taking an 8-bit immediate, sign-extended */
+    unsigned int op_simm8;
+    /* ModRM.reg, which selects the operation */
+    unsigned int digit;
     unsigned int op_rm_r;
 };
 
 struct op_rm_imm_byte op_rm_imm_bytes [] = {
-    {0x80, 0x81, OP_AND_RM_R}
+    {0x80, 0x81, 0x83, 0, OP_ADD_RM_R},
+    {0x80, 0x81, 0x83, 4, OP_AND_RM_R},
+    {0x80, 0x81, 0x83, 1, OP_OR_RM_R},
+    {0x80, 0x81, 0x83, 5, OP_SUB_RM_R},
+    {0x80, 0x81, 0x83, 6, OP_XOR_RM_R}
 };
 
 int op_rm_imm (struct byte_buf * bb,
@@ -142,35 +290,48 @@ int op_rm_imm (struct byte_buf * bb,
                uint32_t off32,
                uint64_t imm,
                unsigned int bits) {
+    unsigned int digit = op_rm_imm_bytes[op].digit;
     switch (bits) {
     case 1 :
         and_rm_imm(bb, rm, off32, 1, 8);
-        byte_buf_append(bb, op_rm_imm_bytes[op].op8);
-        byte_buf_append(bb, 0xa0 | rm);
-        byte_buf_append_le32(bb, off32);
-        byte_buf_append(bb, imm & 1);
+        op_rm_imm(bb, op, rm, off32, imm & 1, 8);
         and_rm_imm(bb, rm, off32, 1, 8);
         return 0;
     case 8 :
+        rex(bb, 0, 0, rm);
         byte_buf_append(bb, op_rm_imm_bytes[op].op8);
-        byte_buf_append(bb, 0xa0 | rm);
-        byte_buf_append_le32(bb, off32);
+        rm_off32_r(bb, digit, rm, off32);
         byte_buf_append(bb, imm);
         return 0;
     case 16 :
-        byte_buf_append(bb, 0x66);
-        byte_buf_append(bb, op_rm_imm_bytes[op].op32);
-        byte_buf_append(bb, 0xa0 | rm);
-        byte_buf_append_le32(bb, off32);
-        byte_buf_append_le16(bb, imm);
-        return 0;
     case 32 :
+    case 64 : {
+        if ((bits == 64) && (! amd64_simm32(imm)))
+            break;
+        if (bits == 16)
+            byte_buf_append(bb, 0x66);
+        rex(bb, bits == 64, 0, rm);
+        if (amd64_short() && amd64_simm8(imm, bits)) {
+            amd64_peephole_count(&amd64_peephole_totals.short_forms);
+            byte_buf_append(bb, op_rm_imm_bytes[op].op_simm8);
+            rm_off32_r(bb, digit, rm, off32);
+            byte_buf_append(bb, imm);
+            return 0;
+        }
         byte_buf_append(bb, op_rm_imm_bytes[op].op32);
-        byte_buf_append(bb, 0xa0 | rm);
-        byte_buf_append_le32(bb, off32);
-        byte_buf_append_le32(bb, imm);
+        rm_off32_r(bb, digit, rm, off32);
+        if (bits == 16)
+            byte_buf_append_le16(bb, imm);
+        else
+            byte_buf_append_le32(bb, imm);
         return 0;
-    case 64 : {
+    }
+    default :
+        return -1;
+    }
+
+    // a 64-bit immediate goes through a register
+    {
         unsigned int rhs = REG_RAX;
         if (rm == REG_RAX)
             rhs = REG_RBX;
@@ -180,8 +341,6 @@ int op_rm_imm (struct byte_buf * bb,
         pop_r64(bb, rhs);
         return 0;
     }
-    }
-    return -1;
 }
 
 
@@ -190,13 +349,17 @@ enum {
     OP_AND_R_R,
     OP_CMP_R_R,
     OP_SUB_R_R,
+    OP_XOR_R_R,
+    OP_OR_R_R,
 };
 
 struct op_byte op_r_r_bytes [] = {
     {0x00, 0x01},
     {0x20, 0x21},
     {0x38, 0x39},
-    {0x28, 0x29}
+    {0x28, 0x29},
+    {0x30, 0x31},
+    {0x08, 0x09}
 };
 
 int op_r_r (struct byte_buf * bb,
@@ -206,6 +369,12 @@ int op_r_r (struct byte_buf * bb,
             unsigned int bits) {
     switch (bits) {
     case 1 :
+        /* as in op_rm_r, but a compare needs both operands masked */
+        if (amd64_peephole && (op != OP_CMP_R_R)) {
+            op_r_r(bb, op, dst, rhs, 8);
+            amd64_peephole_count(&amd64_peephole_totals.pushes);
+            return and_r_imm(bb, dst, 1, 8);
+        }
         push_r64(bb, rhs);
         and_r_imm(bb, dst, 1, 1);
         and_r_imm(bb, rhs, 1, 1);
@@ -214,22 +383,25 @@ int op_r_r (struct byte_buf * bb,
         pop_r64(bb, rhs);
         return 0;
     case 8 :
+        rex(bb, 0, rhs, dst);
         byte_buf_append(bb, op_r_r_bytes[op].op8);
-        byte_buf_append(bb, 0xc0 | (rhs << 3) | dst);
+        byte_buf_append(bb, 0xc0 | ((rhs & 7) << 3) | (dst & 7));
         return 0;
     case 16 :
         byte_buf_append(bb, 0x66);
+        rex(bb, 0, rhs, dst);
         byte_buf_append(bb, op_r_r_bytes[op].op32);
-        byte_buf_append(bb, 0xc0 | (rhs << 3) | dst);
+        byte_buf_append(bb, 0xc0 | ((rhs & 7) << 3) | (dst & 7));
         return 0;
     case 32 :
+        rex(bb, 0, rhs, dst);
         byte_buf_append(bb, op_r_r_bytes[op].op32);
-        byte_buf_append(bb, 0xc0 | (rhs << 3) | dst);
+        byte_buf_append(bb, 0xc0 | ((rhs & 7) << 3) | (dst & 7));
         return 0;
     case 64 :
-        byte_buf_append(bb, 0x48);
+        rex(bb, 1, rhs, dst);
         byte_buf_append(bb, op_r_r_bytes[op].op32);
-        byte_buf_append(bb, 0xc0 | (rhs << 3) | dst);
+        byte_buf_append(bb, 0xc0 | ((rhs & 7) << 3) | (dst & 7));
         return 0;
     }
 
@@ -241,22 +413,28 @@ enum {
     OP_ADD_R_IMM,
     OP_AND_R_IMM,
     OP_CMP_R_IMM,
-    OP_SUB_R_IMM
+    OP_SUB_R_IMM,
+    OP_OR_R_IMM,
+    OP_XOR_R_IMM
 };
 
 struct op_r_imm_byte {
     unsigned int op8;
     unsigned int op32;
+    /* the form taking an 8-bit immediate, sign-extended */
+    unsigned int op_simm8;
     unsigned char operand_byte;
     unsigned int op_r_r;
 };
 
 
 struct op_r_imm_byte op_r_imm_bytes [] = {
-    {0x80, 0x81, 0xc0, OP_ADD_R_R},
-    {0x80, 0x81, 0xe0, OP_AND_R_R},
-    {0x80, 0x81, 0xf8, OP_CMP_R_R},
-    {0x80, 0x81, 0xe8, OP_SUB_R_R}
+    {0x80, 0x81, 0x83, 0xc0, OP_ADD_R_R},
+    {0x80, 0x81, 0x83, 0xe0, OP_AND_R_R},
+    {0x80, 0x81, 0x83, 0xf8, OP_CMP_R_R},
+    {0x80, 0x81, 0x83, 0xe8, OP_SUB_R_R},
+    {0x80, 0x81, 0x83, 0xc8, OP_OR_R_R},
+    {0x80, 0x81, 0x83, 0xf0, OP_XOR_R_R}
 };
 
 
@@ -276,29 +454,15 @@ int op_r_imm (struct byte_buf * bb,
         }
         return 0;
     case 8 :
+        rex(bb, 0, 0, dst);
         byte_buf_append(bb, op_r_imm_bytes[op].op8);
-        byte_buf_append(bb, op_r_imm_bytes[op].operand_byte | dst);
+        byte_buf_append(bb, op_r_imm_bytes[op].operand_byte | (dst & 7));
         byte_buf_append(bb, imm);
         return 0;
     case 16 :
-        byte_buf_append(bb, 0x66);
-        byte_buf_append(bb, op_r_imm_bytes[op].op32);
-        byte_buf_append(bb, op_r_imm_bytes[op].operand_byte | dst);
-        byte_buf_append_le16(bb, imm);
-        return 0;
     case 32 :
-        byte_buf_append(bb, op_r_imm_bytes[op].op32);
-        byte_buf_append(bb, op_r_imm_bytes[op].operand_byte | dst);
-        byte_buf_append_le32(bb, imm);
-        return 0;
     case 64 : {
-        if (imm < 0x100000000) {
-            byte_buf_append(bb, 0x48);
-            byte_buf_append(bb, op_r_imm_bytes[op].op32);
-            byte_buf_append(bb, op_r_imm_bytes[op].operand_byte | dst);
-            byte_buf_append_le32(bb, imm);
-        }
-        else {
+        if ((bits == 64) && (! amd64_simm32(imm))) {
             int rhs = REG_RAX;
             if (dst == REG_RAX)
                 rhs = REG_RCX;
@@ -306,7 +470,24 @@ int op_r_imm (struct byte_buf * bb,
             mov_r_imm(bb, rhs, imm, 64);
             op_r_r(bb, op_r_imm_bytes[op].op_r_r, dst, rhs, 64);
             pop_r64(bb, rhs);
+            return 0;
+        }
+        if (bits == 16)
+            byte_buf_append(bb, 0x66);
+        rex(bb, bits == 64, 0, dst);
+        if (amd64_short() && amd64_simm8(imm, bits)) {
+            amd64_peephole_count(&amd64_peephole_totals.short_forms);
+            byte_buf_append(bb, op_r_imm_bytes[op].op_simm8);
+            byte_buf_append(bb, op_r_imm_bytes[op].operand_byte | (dst & 7));
+            byte_buf_append(bb, imm);
+            return 0;
         }
+        byte_buf_append(bb, op_r_imm_bytes[op].op32);
+        byte_buf_append(bb, op_r_imm_bytes[op].operand_byte | (dst & 7));
+        if (bits == 16)
+            byte_buf_append_le16(bb, imm);
+        else
+            byte_buf_append_le32(bb, imm);
         return 0;
     }
     }
@@ -374,6 +555,33 @@ int and_rm_r (struct byte_buf * bb,
 }
 
 
+int bswap_r (struct byte_buf * bb, unsigned int r, unsigned int bits) {
+    switch (bits) {
+    case 8 :
+        return 0;
+    case 16 :
+        // rol r16, 8
+        byte_buf_append(bb, 0x66);
+        rex(bb, 0, 0, r);
+        byte_buf_append(bb, 0xc1);
+        byte_buf_append(bb, 0xc0 | (r & 7));
+        byte_buf_append(bb, 8);
+        return 0;
+    case 32 :
+        rex(bb, 0, 0, r);
+        byte_buf_append(bb, 0x0f);
+        byte_buf_append(bb, 0xc8 | (r & 7));
+        return 0;
+    case 64 :
+        rex(bb, 1, 0, r);
+        byte_buf_append(bb, 0x0f);
+        byte_buf_append(bb, 0xc8 | (r & 7));
+        return 0;
+    }
+    return -1;
+}
+
+
 int call_r (struct byte_buf * bb, unsigned int r) {
     byte_buf_append(bb, 0xff);
     byte_buf_append(bb, 0xd0 | r);
@@ -397,6 +605,15 @@ int cmp_r_r (struct byte_buf * bb,
 }
 
 
+int cmp_rm_r (struct byte_buf * bb,
+              unsigned int rm,
+              uint32_t off32,
+              unsigned int r,
+              unsigned int bits) {
+    return op_rm_r(bb, OP_CMP_RM_R, rm, off32, r, bits);
+}
+
+
 int div_r64_r64 (struct byte_buf * bb, unsigned int lhs, unsigned int rhs) {
     // save
     if (lhs != REG_RAX)
@@ -435,13 +652,6 @@ int jcc (struct byte_buf * bb, unsigned int condition, int offset) {
         byte_buf_append(bb, offset);
         return 0;
     }
-    else if (abs_offset < 0x7ff0) {
-        byte_buf_append(bb, 0x66);
-        byte_buf_append(bb, 0x0f);
-        byte_buf_append(bb, jcc_op_bytes[condition].op32);
-        byte_buf_append(bb, offset);
-        return 0;
-    }
     else if (abs_offset < 0x7ffffff0) {
         byte_buf_append(bb, 0x0f);
         byte_buf_append(bb, jcc_op_bytes[condition].op32);
@@ -462,14 +672,7 @@ int jmp (struct byte_buf * bb, int offset) {
         byte_buf_append(bb, offset);
         return 0;
     }
-    else if (abs_offset < 0x7ff0) {
-        byte_buf_append(bb, 0x66);
-        byte_buf_append(bb, 0xe9);
-        byte_buf_append_le16(bb, offset);
-        return 0;
-    }
     else if (abs_offset < 0x7ffffff0) {
-        byte_buf_append(bb, 0x0f);
         byte_buf_append(bb, 0xe9);
         byte_buf_append_le32(bb, offset);
         return 0;
@@ -478,6 +681,129 @@ int jmp (struct byte_buf * bb, int offset) {
 }
 
 
+int jmp_r (struct byte_buf * bb, unsigned int r) {
+    byte_buf_append(bb, 0xff);
+    byte_buf_append(bb, 0xe0 | r);
+    return 0;
+}
+
+
+int jmp_rel32 (struct byte_buf * bb, int32_t offset) {
+    byte_buf_append(bb, 0xe9);
+    byte_buf_append_le32(bb, offset);
+    return 0;
+}
+
+
+int jcc_rel32 (struct byte_buf * bb, unsigned int condition, int32_t offset) {
+    byte_buf_append(bb, 0x0f);
+    byte_buf_append(bb, jcc_op_bytes[condition].op32);
+    byte_buf_append_le32(bb, offset);
+    return 0;
+}
+
+
+int imul_r_r_imm (struct byte_buf * bb,
+                  unsigned int dst,
+                  unsigned int src,
+                  uint64_t imm,
+                  unsigned int bits) {
+    if ((bits != 16) && (bits != 32) && (bits != 64))
+        return -1;
+    if ((bits == 64) && (! amd64_simm32(imm)))
+        return -1;
+    if (bits == 16)
+        byte_buf_append(bb, 0x66);
+    rex(bb, bits == 64, dst, src);
+    int imm8 = amd64_short() && amd64_simm8(imm, bits);
+    byte_buf_append(bb, imm8 ? 0x6b : 0x69);
+    byte_buf_append(bb, 0xc0 | ((dst & 7) << 3) | (src & 7));
+    if (imm8) {
+        amd64_peephole_count(&amd64_peephole_totals.short_forms);
+        byte_buf_append(bb, imm);
+    }
+    else if (bits == 16)
+        byte_buf_append_le16(bb, imm);
+    else
+        byte_buf_append_le32(bb, imm);
+    return 0;
+}
+
+
+int lea_r_rm (struct byte_buf * bb,
+              unsigned int r,
+              unsigned int rm,
+              uint32_t off32,
+              unsigned int bits) {
+    if ((bits != 32) && (bits != 64))
+        return -1;
+    rex(bb, bits == 64, r, rm);
+    byte_buf_append(bb, 0x8d);
+    return rm_off32_r(bb, r, rm, off32);
+}
+
+
+int lea_r_sib (struct byte_buf * bb,
+               unsigned int r,
+               int base,
+               unsigned int index,
+               unsigned int scale,
+               unsigned int bits) {
+    uint8_t ss;
+    switch (scale) {
+    case 1 : ss = 0; break;
+    case 2 : ss = 1; break;
+    case 4 : ss = 2; break;
+    case 8 : ss = 3; break;
+    default : return -1;
+    }
+    // rsp can't be an index
+    if (((bits != 32) && (bits != 64)) || (index == REG_RSP))
+        return -1;
+
+    uint8_t prefix = 0x40;
+    if (bits == 64)
+        prefix |= 0x08;
+    if (r & 8)
+        prefix |= 0x04;
+    if (index & 8)
+        prefix |= 0x02;
+    if ((base >= 0) && (base & 8))
+        prefix |= 0x01;
+    if (prefix != 0x40)
+        byte_buf_append(bb, prefix);
+    byte_buf_append(bb, 0x8d);
+
+    uint8_t sib = (ss << 6) | ((index & 7) << 3);
+    if (base < 0) {
+        // no base is a base of rbp with no displacement
+        byte_buf_append(bb, 0x04 | ((r & 7) << 3));
+        byte_buf_append(bb, sib | REG_RBP);
+        byte_buf_append_le32(bb, 0);
+    }
+    else if ((base & 7) == REG_RBP) {
+        // and so rbp and r13 need a displacement of 0
+        byte_buf_append(bb, 0x44 | ((r & 7) << 3));
+        byte_buf_append(bb, sib | (base & 7));
+        byte_buf_append(bb, 0);
+    }
+    else {
+        byte_buf_append(bb, 0x04 | ((r & 7) << 3));
+        byte_buf_append(bb, sib | (base & 7));
+    }
+    return 0;
+}
+
+
+int lea_r_rip (struct byte_buf * bb, unsigned int r, int32_t off32) {
+    byte_buf_append(bb, 0x48);
+    byte_buf_append(bb, 0x8d);
+    byte_buf_append(bb, 0x05 | (r << 3));
+    byte_buf_append_le32(bb, off32);
+    return 0;
+}
+
+
 int mod_r64_r64 (struct byte_buf * bb, unsigned int lhs, unsigned int rhs) {
     // save
     if (lhs != REG_RAX)
@@ -514,21 +840,24 @@ int mov_r_imm (struct byte_buf * bb,
     case 1 :
         return mov_r_imm(bb, r, imm & 1, 8);
     case 8 :
-        byte_buf_append(bb, 0xb0 | r);
+        rex(bb, 0, 0, r);
+        byte_buf_append(bb, 0xb0 | (r & 7));
         byte_buf_append(bb, imm);
         return 0;
     case 16 :
         byte_buf_append(bb, 0x66);
-        byte_buf_append(bb, 0xb8 | r);
+        rex(bb, 0, 0, r);
+        byte_buf_append(bb, 0xb8 | (r & 7));
         byte_buf_append_le16(bb, imm);
         return 0;
     case 32 :
-        byte_buf_append(bb, 0xb8 | r);
+        rex(bb, 0, 0, r);
+        byte_buf_append(bb, 0xb8 | (r & 7));
         byte_buf_append_le32(bb, imm);
         return 0;
     case 64 :
-        byte_buf_append(bb, 0x48);
-        byte_buf_append(bb, 0xb8 | r);
+        rex(bb, 1, 0, r);
+        byte_buf_append(bb, 0xb8 | (r & 7));
         byte_buf_append_le64(bb, imm);
         return 0;
     }
@@ -546,22 +875,25 @@ int mov_r_r (struct byte_buf * bb,
         and_r_imm(bb, dst, 1, 1);
         return 0;
     case 8 :
+        rex(bb, 0, rhs, dst);
         byte_buf_append(bb, 0x88);
-        byte_buf_append(bb, 0xc0 | (rhs << 3) | dst);
+        byte_buf_append(bb, 0xc0 | ((rhs & 7) << 3) | (dst & 7));
         return 0;
     case 16 :
         byte_buf_append(bb, 0x66);
+        rex(bb, 0, rhs, dst);
         byte_buf_append(bb, 0x89);
-        byte_buf_append(bb, 0xc0 | (rhs << 3) | dst);
+        byte_buf_append(bb, 0xc0 | ((rhs & 7) << 3) | (dst & 7));
         return 0;
     case 32 :
+        rex(bb, 0, rhs, dst);
         byte_buf_append(bb, 0x89);
-        byte_buf_append(bb, 0xc0 | (rhs << 3) | dst);
+        byte_buf_append(bb, 0xc0 | ((rhs & 7) << 3) | (dst & 7));
         return 0;
     case 64 :
-        byte_buf_append(bb, 0x48);
+        rex(bb, 1, rhs, dst);
         byte_buf_append(bb, 0x89);
-        byte_buf_append(bb, 0xc0 | (rhs << 3) | dst);
+        byte_buf_append(bb, 0xc0 | ((rhs & 7) << 3) | (dst & 7));
         return 0;
     }
     return -1;
@@ -581,27 +913,22 @@ int mov_r_rm (struct byte_buf * bb,
         return 0;
     }
     case 8 :
+        rex(bb, 0, r, rm);
         byte_buf_append(bb, 0x8a);
-        byte_buf_append(bb, 0x80 | (r << 3) | rm);
-        byte_buf_append_le32(bb, off32);
-        return 0;
+        return rm_off32_r(bb, r, rm, off32);
     case 16 :
         byte_buf_append(bb, 0x66);
+        rex(bb, 0, r, rm);
         byte_buf_append(bb, 0x8b);
-        byte_buf_append(bb, 0x80 | (r << 3) | rm);
-        byte_buf_append_le32(bb, off32);
-        return 0;
+        return rm_off32_r(bb, r, rm, off32);
     case 32 :
+        rex(bb, 0, r, rm);
         byte_buf_append(bb, 0x8b);
-        byte_buf_append(bb, 0x80 | (r << 3) | rm);
-        byte_buf_append_le32(bb, off32);
-        return 0;
+        return rm_off32_r(bb, r, rm, off32);
     case 64 : {
-        byte_buf_append(bb, 0x48);
+        rex(bb, 1, r, rm);
         byte_buf_append(bb, 0x8b);
-        byte_buf_append(bb, 0x80 | (r << 3) | rm);
-        byte_buf_append_le32(bb, off32);
-        return 0;
+        return rm_off32_r(bb, r, rm, off32);
     }
     }
     return -1;
@@ -618,25 +945,34 @@ int mov_rm_imm (struct byte_buf * bb,
         mov_rm_imm(bb, rm, off32, imm & 1, 8);
         return 0;
     case 8 :
+        rex(bb, 0, 0, rm);
         byte_buf_append(bb, 0xc6);
-        byte_buf_append(bb, 0x80 | rm);
-        byte_buf_append_le32(bb, off32);
+        rm_off32_r(bb, 0, rm, off32);
         byte_buf_append(bb, imm);
         return 0;
     case 16 :
         byte_buf_append(bb, 0x66);
+        rex(bb, 0, 0, rm);
         byte_buf_append(bb, 0xc7);
-        byte_buf_append(bb, 0x80 | rm);
-        byte_buf_append_le32(bb, off32);
+        rm_off32_r(bb, 0, rm, off32);
         byte_buf_append_le16(bb, imm);
         return 0;
     case 32 :
+        rex(bb, 0, 0, rm);
         byte_buf_append(bb, 0xc7);
-        byte_buf_append(bb, 0x80 | rm);
-        byte_buf_append_le32(bb, off32);
+        rm_off32_r(bb, 0, rm, off32);
         byte_buf_append_le32(bb, imm);
         return 0;
     case 64 : {
+        // mov rm, imm32 sign-extends
+        if (amd64_peephole && amd64_simm32(imm)) {
+            amd64_peephole_count(&amd64_peephole_totals.immediates);
+            rex(bb, 1, 0, rm);
+            byte_buf_append(bb, 0xc7);
+            rm_off32_r(bb, 0, rm, off32);
+            byte_buf_append_le32(bb, imm);
+            return 0;
+        }
         unsigned int rhs = REG_RAX;
         if (rm == REG_RAX)
             rhs = REG_RCX;
@@ -812,6 +1148,14 @@ int mul_r64_r64 (struct byte_buf * bb, unsigned int lhs, unsigned int rhs) {
 
 
 
+int or_r_r (struct byte_buf * bb,
+            unsigned int dst,
+            unsigned int rhs,
+            unsigned int bits) {
+    return op_r_r(bb, OP_OR_R_R, dst, rhs, bits);
+}
+
+
 /*************************************
 * or [REG+OFF32], REG
 *************************************/
@@ -825,13 +1169,15 @@ int or_rm_r (struct byte_buf * bb,
 
 
 int pop_r64 (struct byte_buf * bb, unsigned int reg) {
-    byte_buf_append(bb, 0x58 | reg);
+    rex(bb, 0, 0, reg);
+    byte_buf_append(bb, 0x58 | (reg & 7));
     return 0;
 }
 
 
 int push_r64 (struct byte_buf * bb, unsigned int reg) {
-    byte_buf_append(bb, 0x50 | reg);
+    rex(bb, 0, 0, reg);
+    byte_buf_append(bb, 0x50 | (reg & 7));
     return 0;
 }
 
@@ -888,6 +1234,112 @@ int shl_r64_r64 (struct byte_buf * bb,
 }
 
 
+enum {
+    OP_SHL_IMM,
+    OP_SHR_IMM
+};
+
+/* ModRM.reg of the shift group, which selects the shift */
+unsigned int op_shift_imm_digits [] = {
+    4, // shl
+    5  // shr
+};
+
+/*
+* Shifts rm, a register when mod is 3, or [rm+off32] otherwise, by imm. A
+* shift by 1 has a form without the immediate.
+*/
+static int op_shift_imm (struct byte_buf * bb,
+                         unsigned int op,
+                         int mod,
+                         unsigned int rm,
+                         uint32_t off32,
+                         uint8_t imm,
+                         unsigned int bits) {
+    unsigned int digit = op_shift_imm_digits[op];
+    int one = amd64_short() && (imm == 1);
+    switch (bits) {
+    case 8 :
+        rex(bb, 0, 0, rm);
+        byte_buf_append(bb, one ? 0xd0 : 0xc0);
+        break;
+    case 16 :
+        byte_buf_append(bb, 0x66);
+        rex(bb, 0, 0, rm);
+        byte_buf_append(bb, one ? 0xd1 : 0xc1);
+        break;
+    case 32 :
+    case 64 :
+        rex(bb, bits == 64, 0, rm);
+        byte_buf_append(bb, one ? 0xd1 : 0xc1);
+        break;
+    default :
+        return -1;
+    }
+    if (mod == 3)
+        byte_buf_append(bb, 0xc0 | (digit << 3) | (rm & 7));
+    else
+        rm_off32_r(bb, digit, rm, off32);
+    if (one)
+        amd64_peephole_count(&amd64_peephole_totals.short_forms);
+    else
+        byte_buf_append(bb, imm);
+    return 0;
+}
+
+
+int shl_r_imm (struct byte_buf * bb,
+               unsigned int r,
+               uint8_t imm,
+               unsigned int bits) {
+    return op_shift_imm(bb, OP_SHL_IMM, 3, r, 0, imm, bits);
+}
+
+
+int shl_rm_imm (struct byte_buf * bb,
+                unsigned int rm,
+                uint32_t off32,
+                uint8_t imm,
+                unsigned int bits) {
+    return op_shift_imm(bb, OP_SHL_IMM, 2, rm, off32, imm, bits);
+}
+
+
+int shr_r_imm (struct byte_buf * bb,
+               unsigned int r,
+               uint8_t imm,
+               unsigned int bits) {
+    return op_shift_imm(bb, OP_SHR_IMM, 3, r, 0, imm, bits);
+}
+
+
+int shr_rm_imm (struct byte_buf * bb,
+                unsigned int rm,
+                uint32_t off32,
+                uint8_t imm,
+                unsigned int bits) {
+    return op_shift_imm(bb, OP_SHR_IMM, 2, rm, off32, imm, bits);
+}
+
+
+int shl_r64_imm (struct byte_buf * bb, unsigned int r, uint8_t imm) {
+    byte_buf_append(bb, 0x48);
+    byte_buf_append(bb, 0xc1);
+    byte_buf_append(bb, 0xe0 | r);
+    byte_buf_append(bb, imm);
+    return 0;
+}
+
+
+int shr_r64_imm (struct byte_buf * bb, unsigned int r, uint8_t imm) {
+    byte_buf_append(bb, 0x48);
+    byte_buf_append(bb, 0xc1);
+    byte_buf_append(bb, 0xe8 | r);
+    byte_buf_append(bb, imm);
+    return 0;
+}
+
+
 int shr_r64_r64 (struct byte_buf * bb,
                  unsigned int lhs,
                  unsigned int rhs) {
@@ -951,7 +1403,7 @@ int sub_r_r (struct byte_buf * bb,
              unsigned int dst,
              unsigned int rhs,
              unsigned int bits) {
-    return op_r_imm(bb, OP_SUB_R_R, dst, rhs, bits);
+    return op_r_r(bb, OP_SUB_R_R, dst, rhs, bits);
 }
 
 
@@ -964,6 +1416,14 @@ int sub_rm_r (struct byte_buf * bb,
 }
 
 
+int xor_r_r (struct byte_buf * bb,
+             unsigned int dst,
+             unsigned int rhs,
+             unsigned int bits) {
+    return op_r_r(bb, OP_XOR_R_R, dst, rhs, bits);
+}
+
+
 int xor_rm_r (struct byte_buf * bb,
               unsigned int rm,
               uint32_t off32,
@@ -980,9 +1440,9 @@ int amd64_load_r_boper (struct byte_buf * bb,
     if (boper_type(boper) == BOPER_CONSTANT)
         return mov_r_imm(bb, reg, boper_value(boper), boper_bits(boper));
     else {
-        size_t offset = varstore_offset_create(varstore,
-                                               boper_identifier(boper),
-                                               boper_bits(boper));
+        size_t offset = varstore_offset_create_id(varstore,
+                                                  boper_id(boper),
+                                                  boper_bits(boper));
         return mov_r_rm(bb, reg, REG_RBP, offset, boper_bits(boper));
     }
 }
@@ -992,9 +1452,9 @@ int amd64_store_boper_r (struct byte_buf * bb,
                          struct varstore * varstore,
                          struct boper * boper,
                          unsigned int reg) {
-    size_t offset = varstore_offset_create(varstore,
-                                           boper_identifier(boper),
-                                           boper_bits(boper));
+    size_t offset = varstore_offset_create_id(varstore,
+                                              boper_id(boper),
+                                              boper_bits(boper));
     return mov_rm_r(bb, REG_RBP, offset, reg, boper_bits(boper));
 }
 
@@ -1003,45 +1463,865 @@ int amd64_store_boper_imm (struct byte_buf * bb,
                            struct varstore * varstore,
                            struct boper * boper,
                            uint64_t imm) {
-    size_t offset = varstore_offset_create(varstore,
-                                           boper_identifier(boper),
-                                           boper_bits(boper));
+    size_t offset = varstore_offset_create_id(varstore,
+                                              boper_id(boper),
+                                              boper_bits(boper));
     return mov_rm_imm(bb, REG_RBP, offset, imm, boper_bits(boper));
 }
 
 
-struct byte_buf * amd64_assemble_bins (
-    struct bins * bins,
-    struct varstore * varstore
-) {
-    int error = 0;
-    struct byte_buf * bb = byte_buf_create();
+/*
+* Variables kept in host registers while a block runs.
+*
+* Every variable a block uses more than once is live from its first use to its
+* last, and a linear scan over those intervals gives as many as fit one of
+* amd64_alloc_regs. A variable is loaded when its interval starts, and written
+* back to the varstore when it ends, when the block leaves, and before hooks
+* and memmap calls. Intervals touching the range from a branch to its label
+* are widened to cover all of it, so nothing is loaded or written back in code
+* which may be skipped.
+*
+* Temporaries always get an interval, and are never loaded or written back,
+* other than around calls which clobber the register holding them.
+*/
+#define AMD64_ALLOC_REGS 8
+
+/* callee-saved registers first, so calls leave them be */
+static const unsigned int amd64_alloc_regs[AMD64_ALLOC_REGS] = {
+    REG_R12, REG_R13, REG_R14, REG_R15, REG_R8, REG_R9, REG_R10, REG_R11
+};
+
+struct amd64_interval {
+    /* the variable, as an operand of the block's ir */
+    const struct boper * variable;
+    /* the indexes of the first and last bins which use variable */
+    unsigned int start;
+    unsigned int end;
+    unsigned int uses;
+    /* set when the first use writes variable without reading it, so it
+       needn't be loaded */
+    int written_first;
+    /* index into amd64_alloc_regs, or -1 if variable stays in the varstore */
+    int slot;
+};
+
+struct amd64_alloc {
+    struct amd64_interval * intervals;
+    unsigned int intervals_size;
+    /* the next interval to start */
+    unsigned int next;
+    /* the interval each register holds, or -1 */
+    int held[AMD64_ALLOC_REGS];
+    /* set when a register was written since the varstore last saw it */
+    int dirty[AMD64_ALLOC_REGS];
+    /* index of the next bins we assemble */
+    unsigned int index;
+    /* set while assembling instructions a branch may skip */
+    unsigned int conditional;
+    /* When the last instruction assembled into store_bb is a store of
+       store_reg to the variable at store_offset, store_bb is store_length
+       bytes long. Reading the variable back then needs no load. */
+    const struct byte_buf * store_bb;
+    size_t store_length;
+    unsigned int store_reg;
+    size_t store_offset;
+    unsigned int store_bits;
+};
+
 
+/* Operands of an ir are interned, so equal variables are the same operand */
+static int amd64_same_variable (const struct boper * lhs,
+                                const struct boper * rhs) {
+    return (lhs == rhs) && (boper_type(lhs) != BOPER_CONSTANT);
+}
+
+
+/* Returns 1 if bins writes all of oper[0] without reading it first */
+static int amd64_writes_first (const struct bins * bins) {
     switch (bins->op) {
-        // arithmetic instructions that operate directly against rm
-        case BOP_ADD :
-        case BOP_SUB :
-        case BOP_AND :
-        case BOP_OR  :
-        case BOP_XOR : {
-            // if we need to move lhs into dst
-            if (boper_cmp(bins->oper[0], bins->oper[1])) {
-                if (boper_type(bins->oper[1]) == BOPER_CONSTANT)
-                    amd64_store_boper_imm(bb,
-                                          varstore,
-                                          bins->oper[0],
-                                          boper_value(bins->oper[1]));
-                else {
-                    amd64_load_r_boper(bb,
-                                       varstore,
-                                       REG_RAX,
-                                       bins->oper[1]);
-                    amd64_store_boper_r(bb,
-                                        varstore,
-                                        bins->oper[0],
-                                        REG_RAX);
-                }
-            }
+    case BOP_ADD :
+    case BOP_SUB :
+    case BOP_UMUL :
+    case BOP_UDIV :
+    case BOP_UMOD :
+    case BOP_AND :
+    case BOP_OR :
+    case BOP_XOR :
+    case BOP_SHL :
+    case BOP_SHR :
+    case BOP_CMPEQ :
+    case BOP_CMPLTU :
+    case BOP_CMPLTS :
+    case BOP_CMPLEU :
+    case BOP_CMPLES :
+        return    (! amd64_same_variable(bins->oper[0], bins->oper[1]))
+               && (! amd64_same_variable(bins->oper[0], bins->oper[2]));
+    case BOP_SEXT :
+    case BOP_ZEXT :
+    case BOP_TRUN :
+    case BOP_LOAD :
+    case BOP_LOADBE :
+        return ! amd64_same_variable(bins->oper[0], bins->oper[1]);
+    }
+    return 0;
+}
+
+
+static void amd64_alloc_delete (struct amd64_alloc * alloc) {
+    free(alloc->intervals);
+    free(alloc);
+}
+
+
+/* Finds the intervals of ir's variables, and gives them registers */
+static struct amd64_alloc * amd64_alloc_create (const struct ir * ir) {
+    struct amd64_alloc * alloc = malloc(sizeof(struct amd64_alloc));
+    alloc->intervals = NULL;
+    alloc->intervals_size = 0;
+    alloc->next = 0;
+    alloc->index = 0;
+    alloc->conditional = 0;
+    alloc->store_bb = NULL;
+    unsigned int i;
+    for (i = 0; i < AMD64_ALLOC_REGS; i++) {
+        alloc->held[i] = -1;
+        alloc->dirty[i] = 0;
+    }
+
+    unsigned int size = ir->size;
+    if (size == 0)
+        return alloc;
+
+    /* the first and last index of the outermost range from a branch to its
+       label each index is in, or the index itself */
+    unsigned int * range_start = malloc(sizeof(unsigned int) * size);
+    unsigned int * range_end = malloc(sizeof(unsigned int) * size);
+    alloc->intervals = malloc(sizeof(struct amd64_interval) * ir->opers_size);
+    /* the interval of each operand of ir, or -1 */
+    int * oper_interval = malloc(sizeof(int) * ir->opers_size);
+    for (i = 0; i < ir->opers_size; i++)
+        oper_interval[i] = -1;
+
+    int in_range = 0;
+    unsigned int start = 0;
+    for (i = 0; i < size; i++) {
+        const struct bins * bins = &(ir->bins[i]);
+        if (in_range && (i > range_end[start]))
+            in_range = 0;
+        if (bins_is_branch(bins)) {
+            unsigned int end = ir->targets[i];
+            if (end == IR_NONE)
+                end = size - 1;
+            if (! in_range) {
+                in_range = 1;
+                start = i;
+                range_end[start] = end;
+            }
+            else if (end > range_end[start])
+                range_end[start] = end;
+        }
+        range_start[i] = in_range ? start : i;
+        if (! in_range)
+            range_end[i] = i;
+
+        unsigned int j;
+        for (j = 0; j < 3; j++) {
+            const struct boper * boper = bins->oper[j];
+            if ((boper == NULL) || (boper_type(boper) == BOPER_CONSTANT))
+                continue;
+
+            unsigned int index = ir_index(ir, boper);
+            if (oper_interval[index] == -1)
+                oper_interval[index] = alloc->intervals_size;
+            struct amd64_interval * interval;
+            interval = &(alloc->intervals[oper_interval[index]]);
+            if (oper_interval[index] == (int) alloc->intervals_size) {
+                interval->variable = boper;
+                interval->start = i;
+                interval->uses = 0;
+                interval->written_first =    (j == 0)
+                                          && (range_start[i] == i)
+                                          && amd64_writes_first(bins);
+                interval->slot = -1;
+                alloc->intervals_size++;
+            }
+            interval->end = i;
+            interval->uses++;
+        }
+    }
+    free(oper_interval);
+
+    for (i = 0; i < alloc->intervals_size; i++) {
+        struct amd64_interval * interval = &(alloc->intervals[i]);
+        interval->start = range_start[interval->start];
+        interval->end = range_end[range_start[interval->end]];
+    }
+    free(range_start);
+    free(range_end);
+
+    /* Intervals were found in order of their start. The active interval
+       holding each register, or -1. */
+    int active[AMD64_ALLOC_REGS];
+    for (i = 0; i < AMD64_ALLOC_REGS; i++)
+        active[i] = -1;
+
+    for (i = 0; i < alloc->intervals_size; i++) {
+        struct amd64_interval * interval = &(alloc->intervals[i]);
+        /* a load and a write back cost more than one access */
+        if (    (boper_type(interval->variable) != BOPER_TEMPORARY)
+             && ((interval->uses < 2) || (interval->start == interval->end)))
+            continue;
+
+        int free_slot = -1;
+        int furthest = -1;
+        unsigned int s;
+        for (s = 0; s < AMD64_ALLOC_REGS; s++) {
+            if (    (active[s] != -1)
+                 && (alloc->intervals[active[s]].end < interval->start))
+                active[s] = -1;
+            if ((active[s] == -1) && (free_slot == -1))
+                free_slot = s;
+            else if (    (active[s] != -1)
+                      && (    (furthest == -1)
+                           || (    alloc->intervals[active[s]].end
+                                 > alloc->intervals[active[furthest]].end)))
+                furthest = s;
+        }
+
+        if (free_slot == -1) {
+            /* spill whichever of us lives longest */
+            if (alloc->intervals[active[furthest]].end <= interval->end)
+                continue;
+            alloc->intervals[active[furthest]].slot = -1;
+            free_slot = furthest;
+        }
+        interval->slot = free_slot;
+        active[free_slot] = i;
+    }
+
+    return alloc;
+}
+
+
+/* Returns the register holding boper, or -1 if it is not in one */
+static int amd64_alloc_reg (const struct amd64_alloc * alloc,
+                            const struct boper * boper) {
+    if ((alloc == NULL) || (boper_type(boper) == BOPER_CONSTANT))
+        return -1;
+    unsigned int s;
+    for (s = 0; s < AMD64_ALLOC_REGS; s++) {
+        if (    (alloc->held[s] != -1)
+             && amd64_same_variable(alloc->intervals[alloc->held[s]].variable,
+                                    boper))
+            return amd64_alloc_regs[s];
+    }
+    return -1;
+}
+
+
+static void amd64_alloc_dirty (struct amd64_alloc * alloc, unsigned int reg) {
+    unsigned int s;
+    for (s = 0; s < AMD64_ALLOC_REGS; s++) {
+        if (amd64_alloc_regs[s] == reg)
+            alloc->dirty[s] = 1;
+    }
+}
+
+
+/* Returns 1 if the register in slot s holds a temporary */
+static int amd64_alloc_temporary (const struct amd64_alloc * alloc,
+                                  unsigned int s) {
+    const struct boper * variable = alloc->intervals[alloc->held[s]].variable;
+    return boper_type(variable) == BOPER_TEMPORARY;
+}
+
+
+static int amd64_alloc_write_back (struct byte_buf * bb,
+                                   struct varstore * varstore,
+                                   struct amd64_alloc * alloc,
+                                   unsigned int s) {
+    const struct boper * variable = alloc->intervals[alloc->held[s]].variable;
+    size_t offset = varstore_offset_create_id(varstore,
+                                              boper_id(variable),
+                                              boper_bits(variable));
+    return mov_rm_r(bb,
+                    REG_RBP,
+                    offset,
+                    amd64_alloc_regs[s],
+                    boper_bits(variable));
+}
+
+
+static int amd64_alloc_load (struct byte_buf * bb,
+                             struct varstore * varstore,
+                             struct amd64_alloc * alloc,
+                             unsigned int s) {
+    const struct boper * variable = alloc->intervals[alloc->held[s]].variable;
+    size_t offset = varstore_offset_create_id(varstore,
+                                              boper_id(variable),
+                                              boper_bits(variable));
+    return mov_r_rm(bb,
+                    amd64_alloc_regs[s],
+                    REG_RBP,
+                    offset,
+                    boper_bits(variable));
+}
+
+
+/*
+* Writes every register written since the varstore last saw it back to the
+* varstore. Code which leaves passes leaving, and the registers stay dirty
+* for the code which doesn't. Temporaries are only written back from the
+* registers calls clobber, and never when leaving.
+*/
+static void amd64_alloc_flush (struct byte_buf * bb,
+                               struct varstore * varstore,
+                               struct amd64_alloc * alloc,
+                               int leaving) {
+    if (alloc == NULL)
+        return;
+    unsigned int s;
+    for (s = 0; s < AMD64_ALLOC_REGS; s++) {
+        if ((alloc->held[s] == -1) || (! alloc->dirty[s]))
+            continue;
+        if (    amd64_alloc_temporary(alloc, s)
+             && (leaving || (amd64_alloc_regs[s] >= REG_R12)))
+            continue;
+        amd64_alloc_write_back(bb, varstore, alloc, s);
+        /* code branching past here did not write back */
+        if ((! leaving) && (alloc->conditional == 0))
+            alloc->dirty[s] = 0;
+    }
+}
+
+
+/*
+* Reloads registers from the varstore after a call, all of them if the call
+* may have written variables, or only those the call may clobber.
+*/
+static void amd64_alloc_reload (struct byte_buf * bb,
+                                struct varstore * varstore,
+                                struct amd64_alloc * alloc,
+                                int all) {
+    if (alloc == NULL)
+        return;
+    unsigned int s;
+    for (s = 0; s < AMD64_ALLOC_REGS; s++) {
+        if (alloc->held[s] == -1)
+            continue;
+        if (    (all && (! amd64_alloc_temporary(alloc, s)))
+             || (amd64_alloc_regs[s] < REG_R12))
+            amd64_alloc_load(bb, varstore, alloc, s);
+    }
+}
+
+
+/*
+* Called before each bins is assembled. Writes back and frees the registers
+* of intervals which ended, and loads those of intervals starting here.
+*/
+static void amd64_alloc_step (struct byte_buf * bb,
+                              struct varstore * varstore,
+                              struct amd64_alloc * alloc) {
+    if (alloc == NULL)
+        return;
+
+    unsigned int s;
+    for (s = 0; s < AMD64_ALLOC_REGS; s++) {
+        if (    (alloc->held[s] == -1)
+             || (alloc->intervals[alloc->held[s]].end >= alloc->index))
+            continue;
+        if (alloc->dirty[s] && (! amd64_alloc_temporary(alloc, s)))
+            amd64_alloc_write_back(bb, varstore, alloc, s);
+        alloc->held[s] = -1;
+        alloc->dirty[s] = 0;
+    }
+
+    while (    (alloc->next < alloc->intervals_size)
+            && (alloc->intervals[alloc->next].start == alloc->index)) {
+        struct amd64_interval * interval = &(alloc->intervals[alloc->next]);
+        if (interval->slot != -1) {
+            alloc->held[interval->slot] = alloc->next;
+            alloc->dirty[interval->slot] = 0;
+            if (    (! interval->written_first)
+                 && (boper_type(interval->variable) != BOPER_TEMPORARY))
+                amd64_alloc_load(bb, varstore, alloc, interval->slot);
+        }
+        alloc->next++;
+    }
+
+    alloc->index++;
+}
+
+
+/* Loads boper into reg, wherever the variable is */
+static int amd64_read (struct byte_buf * bb,
+                       struct varstore * varstore,
+                       struct amd64_alloc * alloc,
+                       unsigned int reg,
+                       struct boper * boper) {
+    int src = amd64_alloc_reg(alloc, boper);
+    if (src != -1)
+        return mov_r_r(bb, reg, src, boper_bits(boper));
+
+    unsigned int bits = boper_bits(boper);
+    if (    amd64_peephole
+         && (alloc != NULL)
+         && (alloc->store_bb == bb)
+         && (alloc->store_length == byte_buf_length(bb))
+         && (boper_type(boper) != BOPER_CONSTANT)
+         && (bits == alloc->store_bits)
+         && (bits != 1)) {
+        size_t offset = varstore_offset_create_id(varstore,
+                                                  boper_id(boper),
+                                                  bits);
+        if (offset == alloc->store_offset) {
+            amd64_peephole_count(&amd64_peephole_totals.reloads);
+            /* a 32-bit load would have zeroed the upper half */
+            if ((reg != alloc->store_reg) || (bits == 32))
+                return mov_r_r(bb, reg, alloc->store_reg, bits);
+            return 0;
+        }
+    }
+    return amd64_load_r_boper(bb, varstore, reg, boper);
+}
+
+
+/* Stores reg into the variable boper, wherever it is */
+static int amd64_write (struct byte_buf * bb,
+                        struct varstore * varstore,
+                        struct amd64_alloc * alloc,
+                        struct boper * boper,
+                        unsigned int reg) {
+    int dst = amd64_alloc_reg(alloc, boper);
+    if (dst != -1) {
+        amd64_alloc_dirty(alloc, dst);
+        return mov_r_r(bb, dst, reg, boper_bits(boper));
+    }
+    int error = amd64_store_boper_r(bb, varstore, boper, reg);
+    if (alloc != NULL) {
+        alloc->store_bb = bb;
+        alloc->store_length = byte_buf_length(bb);
+        alloc->store_reg = reg;
+        alloc->store_offset = varstore_offset_create_id(varstore,
+                                                        boper_id(boper),
+                                                        boper_bits(boper));
+        alloc->store_bits = boper_bits(boper);
+    }
+    return error;
+}
+
+
+static int amd64_write_imm (struct byte_buf * bb,
+                            struct varstore * varstore,
+                            struct amd64_alloc * alloc,
+                            struct boper * boper,
+                            uint64_t imm) {
+    int dst = amd64_alloc_reg(alloc, boper);
+    if (dst != -1) {
+        amd64_alloc_dirty(alloc, dst);
+        return mov_r_imm(bb, dst, imm, boper_bits(boper));
+    }
+    return amd64_store_boper_imm(bb, varstore, boper, imm);
+}
+
+
+/*
+* Returns the memmap function a BOP_LOAD, BOP_STORE, BOP_LOADBE or BOP_STOREBE
+* of bits calls, or NULL if there is none.
+*/
+static const void * amd64_memmap_function (int op, unsigned int bits) {
+    switch (op) {
+    case BOP_LOAD :
+        switch (bits) {
+        case 8 : return memmap_get_u8;
+        case 16 : return memmap_get_u16_le;
+        case 32 : return memmap_get_u32_le;
+        case 64 : return memmap_get_u64_le;
+        }
+        break;
+    case BOP_LOADBE :
+        switch (bits) {
+        case 8 : return memmap_get_u8;
+        case 16 : return memmap_get_u16_be;
+        case 32 : return memmap_get_u32_be;
+        case 64 : return memmap_get_u64_be;
+        }
+        break;
+    case BOP_STORE :
+        switch (bits) {
+        case 8 : return memmap_set_u8;
+        case 16 : return memmap_set_u16_le;
+        case 32 : return memmap_set_u32_le;
+        case 64 : return memmap_set_u64_le;
+        }
+        break;
+    }
+    return NULL;
+}
+
+
+/*
+* Probes the tlb of the memmap in rdi for a bits wide access at the address
+* in rsi, comparing the entry's field at field_offset, read or write, with
+* the granule the access ends in. Leaves rax pointing at the entry, and the
+* flags equal on a hit. An access straddling two granules always misses.
+*/
+static void amd64_tlb_probe (struct byte_buf * bb,
+                             size_t field_offset,
+                             unsigned int bits) {
+    assert(sizeof(struct memmap_tlb) == (1 << 5));
+    // rax = &memmap->tlb[MEMMAP_TLB_INDEX(address)]
+    mov_r_r(bb, REG_RAX, REG_RSI, 64);
+    shr_r64_imm(bb, REG_RAX, MEMMAP_TLB_SHIFT);
+    and_r_imm(bb, REG_RAX, MEMMAP_TLB_SIZE - 1, 64);
+    shl_r64_imm(bb, REG_RAX, 5);
+    add_r_r(bb, REG_RAX, REG_RDI, 64);
+    // rcx = granule of the last byte
+    mov_r_r(bb, REG_RCX, REG_RSI, 64);
+    if (bits > 8)
+        add_r_imm(bb, REG_RCX, bits / 8 - 1, 64);
+    and_r_imm(bb, REG_RCX, ~((uint64_t) MEMMAP_TLB_GRANULE - 1), 64);
+    cmp_rm_r(bb,
+             REG_RAX,
+             offsetof(struct memmap, tlb) + field_offset,
+             REG_RCX,
+             64);
+}
+
+
+/* After a hit in amd64_tlb_probe, sets rcx to the host address of rsi */
+static void amd64_tlb_host (struct byte_buf * bb) {
+    mov_r_rm(bb,
+             REG_RCX,
+             REG_RAX,
+             offsetof(struct memmap, tlb) + offsetof(struct memmap_tlb, addend),
+             64);
+    add_r_r(bb, REG_RCX, REG_RSI, 64);
+}
+
+
+/*
+* Assembles a bits wide load or store, with the memmap in rdi and the address
+* in rsi. When the access lies in the memmap's direct mapping, or its tlb
+* entry at field_offset hits, rcx is set to the host address and access runs.
+* Otherwise miss runs. All three fall through to the end.
+*
+* While a direct access runs, rbx holds the address amd64_direct_resume
+* resumes at if the page is not mapped, which leaves with result. access must
+* start with the instruction which touches memory, as that is how
+* amd64_direct_resume knows the fault is ours.
+*/
+static void amd64_access (struct byte_buf * bb,
+                          struct varstore * varstore,
+                          struct amd64_alloc * alloc,
+                          const struct byte_buf * access,
+                          const struct byte_buf * miss,
+                          size_t field_offset,
+                          unsigned int bits,
+                          unsigned int result) {
+    struct byte_buf * hit = byte_buf_create();
+    amd64_tlb_host(hit);
+    byte_buf_append_byte_buf(hit, access);
+    jmp(hit, byte_buf_length(miss));
+
+    struct byte_buf * tlb = byte_buf_create();
+    amd64_tlb_probe(tlb, field_offset, bits);
+    jcc(tlb, JCC_JNE, byte_buf_length(hit));
+    byte_buf_append_byte_buf(tlb, hit);
+    byte_buf_append_byte_buf(tlb, miss);
+
+    struct byte_buf * fault = byte_buf_create();
+    amd64_alloc_flush(fault, varstore, alloc, 1);
+    mov_r_imm(fault, REG_RAX, result, 64);
+    ret(fault);
+
+    struct byte_buf * skip = byte_buf_create();
+    jmp(skip, byte_buf_length(fault) + byte_buf_length(tlb));
+
+    struct byte_buf * direct = byte_buf_create();
+    mov_r_rm(direct, REG_RCX, REG_RDI, offsetof(struct memmap, direct), 64);
+    add_r_r(direct, REG_RCX, REG_RSI, 64);
+    lea_r_rip(direct,
+              REG_RBX,
+              byte_buf_length(access) + byte_buf_length(skip));
+    byte_buf_append_byte_buf(direct, access);
+    byte_buf_append_byte_buf(direct, skip);
+    byte_buf_append_byte_buf(direct, fault);
+
+    // direct_limit is 0 for memmaps without a direct mapping
+    cmp_rm_r(bb, REG_RDI, offsetof(struct memmap, direct_limit), REG_RSI, 64);
+    jcc(bb, JCC_JBE, byte_buf_length(direct));
+    byte_buf_append_byte_buf(bb, direct);
+    byte_buf_append_byte_buf(bb, tlb);
+
+    ODEL(hit);
+    ODEL(tlb);
+    ODEL(fault);
+    ODEL(skip);
+    ODEL(direct);
+}
+
+
+/*
+* Assembles oper[0] = oper[0] OP oper[2] of the BOP_ADD, BOP_SUB, BOP_AND,
+* BOP_OR and BOP_XOR bins, where oper[2] is a constant, without moving the
+* constant into a register first, and without anything when the constant
+* leaves oper[0] as it is.
+* @return 0 if bins was assembled, non-zero if it needs the constant in rax.
+*/
+static int amd64_assemble_imm (struct byte_buf * bb,
+                               const struct bins * bins,
+                               struct varstore * varstore,
+                               struct amd64_alloc * alloc) {
+    unsigned int bits = boper_bits(bins->oper[0]);
+    uint64_t imm = boper_value(bins->oper[2]);
+    uint64_t mask = (bits == 64) ? 0xffffffffffffffffULL : (1ULL << bits) - 1;
+
+    if (    ((bins->op == BOP_AND) && ((imm & mask) == mask))
+         || ((bins->op != BOP_AND) && (imm == 0))) {
+        amd64_peephole_count(&amd64_peephole_totals.identities);
+        return 0;
+    }
+
+    if ((bits == 1) || ((bits == 64) && (! amd64_simm32(imm))))
+        return -1;
+
+    unsigned int op_r = OP_ADD_R_IMM;
+    unsigned int op_rm = OP_ADD_RM_IMM;
+    switch (bins->op) {
+    case BOP_SUB : op_r = OP_SUB_R_IMM; op_rm = OP_SUB_RM_IMM; break;
+    case BOP_AND : op_r = OP_AND_R_IMM; op_rm = OP_AND_RM_IMM; break;
+    case BOP_OR  : op_r = OP_OR_R_IMM;  op_rm = OP_OR_RM_IMM;  break;
+    case BOP_XOR : op_r = OP_XOR_R_IMM; op_rm = OP_XOR_RM_IMM; break;
+    }
+
+    amd64_peephole_count(&amd64_peephole_totals.immediates);
+    int dst = amd64_alloc_reg(alloc, bins->oper[0]);
+    if (dst != -1) {
+        amd64_alloc_dirty(alloc, dst);
+        return op_r_imm(bb, op_r, dst, imm, bits);
+    }
+    size_t offset = varstore_offset_create_id(varstore,
+                                              boper_id(bins->oper[0]),
+                                              bits);
+    return op_rm_imm(bb, op_rm, REG_RBP, offset, imm, bits);
+}
+
+
+/* Moves src, a variable or a constant, into the variable dst */
+static int amd64_assemble_copy (struct byte_buf * bb,
+                                struct varstore * varstore,
+                                struct amd64_alloc * alloc,
+                                struct boper * dst,
+                                struct boper * src) {
+    if (boper_type(src) == BOPER_CONSTANT)
+        return amd64_write_imm(bb, varstore, alloc, dst, boper_value(src));
+    amd64_read(bb, varstore, alloc, REG_RAX, src);
+    return amd64_write(bb, varstore, alloc, dst, REG_RAX);
+}
+
+
+/*
+* Assembles the BOP_ADD oper[0] = oper[1] + oper[2] as a single lea, when
+* oper[0] and oper[1] are in different registers, and oper[2] is a constant
+* or in a register.
+* @return 0 if bins was assembled, non-zero otherwise.
+*/
+static int amd64_assemble_lea (struct byte_buf * bb,
+                               const struct bins * bins,
+                               struct amd64_alloc * alloc) {
+    unsigned int bits = boper_bits(bins->oper[0]);
+    if ((bits != 32) && (bits != 64))
+        return -1;
+    int dst = amd64_alloc_reg(alloc, bins->oper[0]);
+    int lhs = amd64_alloc_reg(alloc, bins->oper[1]);
+    if ((dst == -1) || (lhs == -1) || (dst == lhs))
+        return -1;
+
+    if (boper_type(bins->oper[2]) == BOPER_CONSTANT) {
+        uint64_t imm = boper_value(bins->oper[2]);
+        // lea sign-extends its displacement
+        if ((bits == 64) && (! amd64_simm32(imm)))
+            return -1;
+        lea_r_rm(bb, dst, lhs, imm, bits);
+    }
+    else {
+        int rhs = amd64_alloc_reg(alloc, bins->oper[2]);
+        if (rhs == -1)
+            return -1;
+        lea_r_sib(bb, dst, lhs, rhs, 1, bits);
+    }
+    amd64_alloc_dirty(alloc, dst);
+    amd64_peephole_count(&amd64_peephole_totals.leas);
+    return 0;
+}
+
+
+/* Returns n where imm is 2^n, or -1 if imm is not a power of two */
+static int amd64_log2 (uint64_t imm) {
+    if ((imm == 0) || (imm & (imm - 1)))
+        return -1;
+    int n = 0;
+    while (imm >>= 1)
+        n++;
+    return n;
+}
+
+
+/*
+* Assembles the BOP_UMUL, BOP_UDIV, BOP_UMOD, BOP_SHL and BOP_SHR
+* oper[0] = oper[1] OP oper[2], where oper[2] is a constant, without the
+* 64-bit operation on rax and rbx. Shifts are done in place at the width of
+* oper[0], multiplies and divides by a power of two become shifts or an and,
+* and other multiplies an imul by the constant.
+* @return 0 if bins was assembled, non-zero if it needs the generic
+*         operation.
+*/
+static int amd64_assemble_constant (struct byte_buf * bb,
+                                    const struct bins * bins,
+                                    struct varstore * varstore,
+                                    struct amd64_alloc * alloc) {
+    unsigned int bits = boper_bits(bins->oper[0]);
+    unsigned int rhs_bits = boper_bits(bins->oper[2]);
+    if ((bits == 1) || (boper_bits(bins->oper[1]) != bits))
+        return -1;
+    uint64_t imm = boper_value(bins->oper[2]);
+    if (rhs_bits < 64)
+        imm &= (1ULL << rhs_bits) - 1;
+
+    int op = bins->op;
+    int n = amd64_log2(imm);
+    switch (op) {
+    case BOP_UMUL :
+        if (n != -1) {
+            op = BOP_SHL;
+            imm = n;
+        }
+        break;
+    case BOP_UDIV :
+        if (n == -1)
+            return -1;
+        op = BOP_SHR;
+        imm = n;
+        break;
+    case BOP_UMOD :
+        if (n == -1)
+            return -1;
+        op = BOP_AND;
+        imm--;
+        break;
+    }
+
+    int dst = amd64_alloc_reg(alloc, bins->oper[0]);
+    size_t offset = 0;
+    if (dst == -1)
+        offset = varstore_offset_create_id(varstore,
+                                           boper_id(bins->oper[0]),
+                                           bits);
+
+    if (op == BOP_UMUL) {
+        if ((bits == 64) && (! amd64_simm32(imm)))
+            return -1;
+        int src = amd64_alloc_reg(alloc, bins->oper[1]);
+        if (src == -1) {
+            src = REG_RAX;
+            if (boper_type(bins->oper[1]) == BOPER_CONSTANT)
+                mov_r_imm(bb, REG_RAX, boper_value(bins->oper[1]), bits);
+            else
+                amd64_read(bb, varstore, alloc, REG_RAX, bins->oper[1]);
+        }
+        // the low bits of a wider multiply are the same
+        unsigned int imul_bits = (bits < 32) ? 32 : bits;
+        if (dst != -1) {
+            imul_r_r_imm(bb, dst, src, imm, imul_bits);
+            amd64_alloc_dirty(alloc, dst);
+        }
+        else {
+            imul_r_r_imm(bb, REG_RAX, src, imm, imul_bits);
+            amd64_write(bb, varstore, alloc, bins->oper[0], REG_RAX);
+        }
+        amd64_peephole_count(&amd64_peephole_totals.constants);
+        return 0;
+    }
+
+    // as with the generic shift, shifting every bit out leaves 0
+    if (((op == BOP_SHL) || (op == BOP_SHR)) && (imm >= bits)) {
+        amd64_write_imm(bb, varstore, alloc, bins->oper[0], 0);
+        amd64_peephole_count(&amd64_peephole_totals.constants);
+        return 0;
+    }
+
+    // a short shift into another register is a lea
+    int lhs = amd64_alloc_reg(alloc, bins->oper[1]);
+    if (    (op == BOP_SHL)
+         && (imm >= 1)
+         && (imm <= 3)
+         && ((bits == 32) || (bits == 64))
+         && (dst != -1)
+         && (lhs != -1)
+         && (dst != lhs)) {
+        if (imm == 1)
+            lea_r_sib(bb, dst, lhs, lhs, 1, bits);
+        else
+            lea_r_sib(bb, dst, -1, lhs, 1 << imm, bits);
+        amd64_alloc_dirty(alloc, dst);
+        amd64_peephole_count(&amd64_peephole_totals.leas);
+        return 0;
+    }
+
+    if (boper_cmp(bins->oper[0], bins->oper[1]))
+        amd64_assemble_copy(bb, varstore, alloc, bins->oper[0], bins->oper[1]);
+
+    if (dst != -1) {
+        switch (op) {
+        case BOP_SHL : shl_r_imm(bb, dst, imm, bits); break;
+        case BOP_SHR : shr_r_imm(bb, dst, imm, bits); break;
+        case BOP_AND : and_r_imm(bb, dst, imm, bits); break;
+        }
+        amd64_alloc_dirty(alloc, dst);
+    }
+    else {
+        switch (op) {
+        case BOP_SHL : shl_rm_imm(bb, REG_RBP, offset, imm, bits); break;
+        case BOP_SHR : shr_rm_imm(bb, REG_RBP, offset, imm, bits); break;
+        case BOP_AND : and_rm_imm(bb, REG_RBP, offset, imm, bits); break;
+        }
+    }
+    amd64_peephole_count(&amd64_peephole_totals.constants);
+    return 0;
+}
+
+
+/* Assembles bins, and appends the result to bb */
+static int amd64_assemble_bins (struct byte_buf * bb,
+                                const struct bins * bins,
+                                struct varstore * varstore,
+                                struct amd64_alloc * alloc) {
+    int error = 0;
+
+    switch (bins->op) {
+        // arithmetic instructions that operate directly against rm
+        case BOP_ADD :
+        case BOP_SUB :
+        case BOP_AND :
+        case BOP_OR  :
+        case BOP_XOR : {
+            if (    amd64_peephole
+                 && (bins->op == BOP_ADD)
+                 && (amd64_assemble_lea(bb, bins, alloc) == 0))
+                break;
+            // if we need to move lhs into dst
+            if (boper_cmp(bins->oper[0], bins->oper[1]))
+                amd64_assemble_copy(bb,
+                                    varstore,
+                                    alloc,
+                                    bins->oper[0],
+                                    bins->oper[1]);
+            if (    amd64_peephole
+                 && (boper_type(bins->oper[2]) == BOPER_CONSTANT)
+                 && (amd64_assemble_imm(bb, bins, varstore, alloc) == 0))
+                break;
             // load rhs into register
             if (boper_type(bins->oper[2]) == BOPER_CONSTANT) {
                 mov_r_imm(bb,
@@ -1049,16 +2329,26 @@ struct byte_buf * amd64_assemble_bins (
                           boper_value(bins->oper[2]),
                           boper_bits(bins->oper[2]));
             }
-            else {
-                amd64_load_r_boper(bb,
-                                   varstore,
-                                   REG_RAX,
-                                   bins->oper[2]);
+            else
+                amd64_read(bb, varstore, alloc, REG_RAX, bins->oper[2]);
+            // dst is in a register
+            int dst = amd64_alloc_reg(alloc, bins->oper[0]);
+            if (dst != -1) {
+                unsigned int bits = boper_bits(bins->oper[0]);
+                switch (bins->op) {
+                case BOP_ADD : add_r_r(bb, dst, REG_RAX, bits); break;
+                case BOP_SUB : sub_r_r(bb, dst, REG_RAX, bits); break;
+                case BOP_AND : and_r_r(bb, dst, REG_RAX, bits); break;
+                case BOP_OR  : or_r_r(bb, dst, REG_RAX, bits); break;
+                case BOP_XOR : xor_r_r(bb, dst, REG_RAX, bits); break;
+                }
+                amd64_alloc_dirty(alloc, dst);
+                break;
             }
             // get offset to dst
-            size_t offset = varstore_offset_create(varstore,
-                                                   boper_identifier(bins->oper[0]),
-                                                   boper_bits(bins->oper[0]));
+            size_t offset = varstore_offset_create_id(varstore,
+                                                      boper_id(bins->oper[0]),
+                                                      boper_bits(bins->oper[0]));
             switch (bins->op) {
             case BOP_ADD :
                 add_rm_r(bb, REG_RBP, offset, REG_RAX, boper_bits(bins->oper[0]));
@@ -1084,9 +2374,13 @@ struct byte_buf * amd64_assemble_bins (
         case BOP_UMOD :
         case BOP_SHL :
         case BOP_SHR : {
+            if (    amd64_peephole
+                 && (boper_type(bins->oper[2]) == BOPER_CONSTANT)
+                 && (amd64_assemble_constant(bb, bins, varstore, alloc) == 0))
+                break;
             // load lhs and rhs into RAX and RBX
-            amd64_load_r_boper(bb, varstore, REG_RAX, bins->oper[1]);
-            amd64_load_r_boper(bb, varstore, REG_RBX, bins->oper[2]);
+            amd64_read(bb, varstore, alloc, REG_RAX, bins->oper[1]);
+            amd64_read(bb, varstore, alloc, REG_RBX, bins->oper[2]);
             // are these 64-bit operands?
             if (boper_bits(bins->oper[1]) != 64) {
                 movzx_r_r(bb, REG_RAX, 64, REG_RAX, boper_bits(bins->oper[1]));
@@ -1111,7 +2405,7 @@ struct byte_buf * amd64_assemble_bins (
                 break;
             }
             // store result
-            amd64_store_boper_r(bb, varstore, bins->oper[0], REG_RAX);
+            amd64_write(bb, varstore, alloc, bins->oper[0], REG_RAX);
             break;
         }
         // our conditionals
@@ -1145,7 +2439,7 @@ struct byte_buf * amd64_assemble_bins (
                           boper_value(bins->oper[1]),
                           boper_bits(bins->oper[1]));
             else
-                amd64_load_r_boper(cmpop, varstore, REG_RAX, bins->oper[1]);
+                amd64_read(cmpop, varstore, alloc, REG_RAX, bins->oper[1]);
 
             if (boper_type(bins->oper[2]) == BOPER_CONSTANT)
                 mov_r_imm(cmpop,
@@ -1153,7 +2447,7 @@ struct byte_buf * amd64_assemble_bins (
                           boper_value(bins->oper[2]),
                           boper_bits(bins->oper[2]));
             else
-                amd64_load_r_boper(cmpop, varstore, REG_RCX, bins->oper[2]);
+                amd64_read(cmpop, varstore, alloc, REG_RCX, bins->oper[2]);
 
             cmp_r_r(cmpop, REG_RAX, REG_RCX, boper_bits(bins->oper[1]));
 
@@ -1184,7 +2478,7 @@ struct byte_buf * amd64_assemble_bins (
             byte_buf_append_byte_buf(bb, al0);
             byte_buf_append_byte_buf(bb, al1);
 
-            amd64_store_boper_r(bb, varstore, bins->oper[0], REG_RAX);
+            amd64_write(bb, varstore, alloc, bins->oper[0], REG_RAX);
 
             ODEL(cmpop);
             ODEL(al0);
@@ -1192,57 +2486,87 @@ struct byte_buf * amd64_assemble_bins (
             break;
         }
         case BOP_SEXT :
-            if (amd64_load_r_boper(bb, varstore, REG_RAX, bins->oper[1]))
-                btlog("[amd64_assemble] BOP_SEXT amd64_load_r_boper error");
+            if (amd64_read(bb, varstore, alloc, REG_RAX, bins->oper[1]))
+                BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                      "[amd64_assemble] BOP_SEXT amd64_read error");
             if (movsx_r_r(bb,
                           REG_RAX,
                           boper_bits(bins->oper[0]),
                           REG_RAX,
                           boper_bits(bins->oper[1])))
-                btlog("[amd64_assemble] BOP_SEXT movsx_r_r error");
-            if (amd64_store_boper_r(bb, varstore, bins->oper[0], REG_RAX))
-                btlog("[amd64_assemble] BOP_SEXT amd64_store_boper error");
+                BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                      "[amd64_assemble] BOP_SEXT movsx_r_r error");
+            if (amd64_write(bb, varstore, alloc, bins->oper[0], REG_RAX))
+                BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                      "[amd64_assemble] BOP_SEXT amd64_write error");
             break;
         case BOP_ZEXT :
-            btlog("[amd64_assemble] BOP_ZEXT");
-            if (amd64_load_r_boper(bb, varstore, REG_RAX, bins->oper[1]))
-                btlog("[amd64_assemble] ZEXT amd64_load_r_boper error");
+            BTLOG(BTLOG_TARGET, BTLOG_TRACE, "[amd64_assemble] BOP_ZEXT");
+            if (amd64_read(bb, varstore, alloc, REG_RAX, bins->oper[1]))
+                BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                      "[amd64_assemble] ZEXT amd64_read error");
             if (movzx_r_r(bb,
                           REG_RAX,
                           boper_bits(bins->oper[0]),
                           REG_RAX,
                           boper_bits(bins->oper[1])))
-                btlog("[amd64_assemble] ZEXT movzx_r_r error");
-            if (amd64_store_boper_r(bb, varstore, bins->oper[0], REG_RAX))
-                btlog("[amd64_assemble] ZEXT amd64_store_boper");
+                BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                      "[amd64_assemble] ZEXT movzx_r_r error");
+            if (amd64_write(bb, varstore, alloc, bins->oper[0], REG_RAX))
+                BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                      "[amd64_assemble] ZEXT amd64_write error");
             break;
         case BOP_TRUN :
-            amd64_load_r_boper(bb, varstore, REG_RAX, bins->oper[1]);
-            amd64_store_boper_r(bb, varstore, bins->oper[0], REG_RAX);
+            amd64_read(bb, varstore, alloc, REG_RAX, bins->oper[1]);
+            amd64_write(bb, varstore, alloc, bins->oper[0], REG_RAX);
             break;
-        case BOP_LOAD : {
-            /* set up call to mmap_get_u8 */
+        case BOP_LOAD :
+        case BOP_LOADBE : {
+            /* set up call to the memmap_get function for this width */
+            unsigned int bits = boper_bits(bins->oper[0]);
+            const void * function = amd64_memmap_function(bins->op, bits);
             size_t offset;
             if (varstore_offset(varstore, "__MEMMAP__", 64, &offset)) {
                 fprintf(stderr, "__MEMMAP__ not found\n");
                 error = -1;
                 break;
             }
-            // prepare call
+            if (function == NULL) {
+                BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                      "[amd64_assemble] invalid load bits %u", bits);
+                error = -1;
+                break;
+            }
             mov_r_rm(bb, REG_RDI, REG_RBP, offset, 64);
-            amd64_load_r_boper(bb, varstore, REG_RSI, bins->oper[1]);
+            amd64_read(bb, varstore, alloc, REG_RSI, bins->oper[1]);
             movzx_r_r(bb, REG_RSI, 64, REG_RSI, boper_bits(bins->oper[1]));
+
+            // a hit reads the value straight from the page
+            struct byte_buf * access = byte_buf_create();
+            mov_r_rm(access, REG_RAX, REG_RCX, 0, bits);
+            if (bins->op == BOP_LOADBE)
+                bswap_r(access, REG_RAX, bits);
+
+            // a miss calls memmap_get, which refills the entry
+            struct byte_buf * miss = byte_buf_create();
+            // prepare call, which may fail and leave. A hit skips the write
+            // back, so registers stay dirty
+            if (alloc != NULL)
+                alloc->conditional++;
+            amd64_alloc_flush(miss, varstore, alloc, 0);
+            if (alloc != NULL)
+                alloc->conditional--;
             // create scratch space
             // we must align RSP to a 16-byte boundary or macosx complains
-            mov_r_r(bb, REG_RAX, REG_RSP, 64);
-            and_r_imm(bb, REG_RSP, 0xfffffff0, 64);
-            push_r64(bb, REG_RAX);
-            sub_r_imm(bb, REG_RSP, 8, 64);
-            mov_r_r(bb, REG_RDX, REG_RSP, 64);
+            mov_r_r(miss, REG_RAX, REG_RSP, 64);
+            and_r_imm(miss, REG_RSP, 0xfffffffffffffff0, 64);
+            push_r64(miss, REG_RAX);
+            sub_r_imm(miss, REG_RSP, 8, 64);
+            mov_r_r(miss, REG_RDX, REG_RSP, 64);
 
             // execute call
-            mov_r_imm(bb, REG_RAX, (uint64_t) memmap_get_u8, 64);
-            call_r(bb, REG_RAX);
+            mov_r_imm(miss, REG_RAX, (uint64_t) function, 64);
+            call_r(miss, REG_RAX);
 
             // clean up scratch space
 
@@ -1254,54 +2578,91 @@ struct byte_buf * amd64_assemble_bins (
             mov_r_imm(fail, REG_RAX, 1, 64); // set result
             ret(fail);
 
-            // if success, read byte off stack and set variable
+            // if success, read value off stack and set variable
             struct byte_buf * success = byte_buf_create();
             // mov al, [rsp+0x00000000] is not a valid instruction
             mov_r_r(success, REG_RAX, REG_RSP, 64);
-            mov_r_rm(success, REG_RAX, REG_RAX, 0, 8);
-            amd64_store_boper_r(success, varstore, bins->oper[0], REG_RAX);
+            mov_r_rm(success, REG_RAX, REG_RAX, 0, bits);
+            amd64_alloc_reload(success, varstore, alloc, 0);
             // clean up stack
             add_r_imm(success, REG_RSP, 8, 64);
             pop_r64(success, REG_RSP);
 
             // compare result of our call and execution conditionally
-            cmp_r_imm(bb, REG_RAX, 0, 64);
-            jcc(bb, JCC_JE, byte_buf_length(fail));
-            byte_buf_append_byte_buf(bb, fail);
-            byte_buf_append_byte_buf(bb, success);
+            cmp_r_imm(miss, REG_RAX, 0, 64);
+            jcc(miss, JCC_JE, byte_buf_length(fail));
+            byte_buf_append_byte_buf(miss, fail);
+            byte_buf_append_byte_buf(miss, success);
+
+            amd64_access(bb,
+                         varstore,
+                         alloc,
+                         access,
+                         miss,
+                         offsetof(struct memmap_tlb, read),
+                         bits,
+                         1);
+            // every path leaves the value in rax
+            amd64_write(bb, varstore, alloc, bins->oper[0], REG_RAX);
 
             ODEL(fail);
             ODEL(success);
+            ODEL(access);
+            ODEL(miss);
             break;
         }
-        case BOP_STORE : {
-            // set up a call to mmap_set_u8
+        case BOP_STORE :
+        case BOP_STOREBE : {
+            // set up a call to the memmap_set function for this width. A
+            // big-endian store is a little-endian store of the value swapped
+            unsigned int bits = boper_bits(bins->oper[1]);
+            const void * function = amd64_memmap_function(BOP_STORE, bits);
             size_t offset;
             if (varstore_offset(varstore, "__MEMMAP__", 64, &offset)) {
                 fprintf(stderr, "__MEMMAP__ not found\n");
                 error = -1;
                 break;
             }
+            if (function == NULL) {
+                BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                      "[amd64_assemble] invalid store bits %u", bits);
+                error = -1;
+                break;
+            }
 
-            // prepare call
             mov_r_rm(bb, REG_RDI, REG_RBP, offset, 64);
-            amd64_load_r_boper(bb, varstore, REG_RSI, bins->oper[0]);
+            amd64_read(bb, varstore, alloc, REG_RSI, bins->oper[0]);
             movzx_r_r(bb, REG_RSI, 64, REG_RSI, boper_bits(bins->oper[0]));
             // move value into rdx
-            amd64_load_r_boper(bb, varstore, REG_RDX, bins->oper[1]);
+            amd64_read(bb, varstore, alloc, REG_RDX, bins->oper[1]);
             movzx_r_r(bb, REG_RDX, 64, REG_RDX, boper_bits(bins->oper[1]));
+            if (bins->op == BOP_STOREBE)
+                bswap_r(bb, REG_RDX, bits);
+
+            // a hit writes the value straight to the page
+            struct byte_buf * access = byte_buf_create();
+            mov_rm_r(access, REG_RCX, 0, REG_RDX, bits);
+
+            // a miss calls memmap_set, which refills the entry. A hit skips
+            // the write back, so registers stay dirty
+            struct byte_buf * miss = byte_buf_create();
+            if (alloc != NULL)
+                alloc->conditional++;
+            amd64_alloc_flush(miss, varstore, alloc, 0);
+            if (alloc != NULL)
+                alloc->conditional--;
             // we must align RSP to a 16-byte boundary or macosx complains
-            mov_r_r(bb, REG_RAX, REG_RSP, 64);
-            and_r_imm(bb, REG_RSP, 0xfffffff0, 64);
-            push_r64(bb, REG_RAX);
-            sub_r_imm(bb, REG_RSP, 8, 64);
+            mov_r_r(miss, REG_RAX, REG_RSP, 64);
+            and_r_imm(miss, REG_RSP, 0xfffffffffffffff0, 64);
+            push_r64(miss, REG_RAX);
+            sub_r_imm(miss, REG_RSP, 8, 64);
             // execute call
-            mov_r_imm(bb, REG_RAX, (uint64_t) memmap_set_u8, 64);
-            call_r(bb, REG_RAX);
+            mov_r_imm(miss, REG_RAX, (uint64_t) function, 64);
+            call_r(miss, REG_RAX);
 
             // clean up stack
-            add_r_imm(bb, REG_RSP, 8, 64);
-            pop_r64(bb, REG_RSP);
+            add_r_imm(miss, REG_RSP, 8, 64);
+            pop_r64(miss, REG_RSP);
 
             // if fail, set rax to 2 and return
             struct byte_buf * fail = byte_buf_create();
@@ -1309,92 +2670,471 @@ struct byte_buf * amd64_assemble_bins (
             ret(fail);
 
             // compare result and execute fail condition if necessary
-            cmp_r_imm(bb, REG_RAX, 0, 64);
-            jcc(bb, JCC_JE, byte_buf_length(fail));
+            cmp_r_imm(miss, REG_RAX, 0, 64);
+            jcc(miss, JCC_JE, byte_buf_length(fail));
+
+            byte_buf_append_byte_buf(miss, fail);
+            amd64_alloc_reload(miss, varstore, alloc, 0);
 
-            byte_buf_append_byte_buf(bb, fail);
+            amd64_access(bb,
+                         varstore,
+                         alloc,
+                         access,
+                         miss,
+                         offsetof(struct memmap_tlb, write),
+                         bits,
+                         2);
 
             ODEL(fail);
+            ODEL(access);
+            ODEL(miss);
             break;
         }
         case BOP_HLT :
             // return 3
+            amd64_alloc_flush(bb, varstore, alloc, 1);
             mov_r_imm(bb, REG_RAX, 3, 64);
             ret(bb);
             break;
-        case BOP_HOOK :
-            mov_r_imm(bb, REG_RDI, (uint64_t) varstore, 64);
+        case BOP_FUEL : {
+            /* subtract the cost, and if that borrows, put it back and
+               return 4 */
+            size_t offset = varstore_offset_create(varstore,
+                                                   "__JIT_FUEL__",
+                                                   64);
+            mov_r_imm(bb, REG_RAX, boper_value(bins->oper[0]), 64);
+            sub_rm_r(bb, REG_RBP, offset, REG_RAX, 64);
+
+            struct byte_buf * empty = byte_buf_create();
+            add_rm_r(empty, REG_RBP, offset, REG_RAX, 64);
+            amd64_alloc_flush(empty, varstore, alloc, 1);
+            mov_r_imm(empty, REG_RAX, 4, 64);
+            ret(empty);
+
+            jcc(bb, JCC_JAE, byte_buf_length(empty));
+            byte_buf_append_byte_buf(bb, empty);
+            ODEL(empty);
+            break;
+        }
+        case BOP_HOOK : {
+            /* hooks get the varstore running the block, which may not be
+               the one it was assembled with */
+            size_t offset = varstore_offset_create(varstore,
+                                                   "__VARSTORE__",
+                                                   64);
+            /* hooks may read and write any variable */
+            amd64_alloc_flush(bb, varstore, alloc, 0);
+            // blocks don't know how the stack is aligned, so align it as
+            // a BOP_LOAD miss does
+            mov_r_r(bb, REG_RAX, REG_RSP, 64);
+            and_r_imm(bb, REG_RSP, 0xfffffffffffffff0, 64);
+            push_r64(bb, REG_RAX);
+            sub_r_imm(bb, REG_RSP, 8, 64);
+            mov_r_rm(bb, REG_RDI, REG_RBP, offset, 64);
             mov_r_imm(bb, REG_RAX, (uint64_t) bins->hook, 64);
             call_r(bb, REG_RAX);
+            add_r_imm(bb, REG_RSP, 8, 64);
+            pop_r64(bb, REG_RSP);
+            amd64_alloc_reload(bb, varstore, alloc, 1);
+            break;
+        }
+        case BOP_CE :
+            /* translators' shorthand, see bins_lower_ce */
+            error = -1;
             break;
     }
 
-    if (error) {
-        ODEL(bb);
-        return NULL;
-    }
-
-    return bb;
+    return error;
 }
 
 
-struct byte_buf * amd64_assemble (struct list * btins_list,
-                                  struct varstore * varstore) {
-    int error = 0;
-
-    struct byte_buf * bb = byte_buf_create();
-    struct list_it * it;
-    for (it = list_it(btins_list); it != NULL; it = list_it_next(it)) {
-        struct bins * bins = list_it_data(it);
-
-        if (bins->op == BOP_CE) {
-            struct list * ce_btins_list;
-            
-            struct list_it * be_btins_first = list_it_next(it);
-            struct list_it * be_btins_last = be_btins_first;
-
-            unsigned int ins_n = boper_value(bins->oper[1]);
-            while (ins_n--) {
-                be_btins_last = list_it_next(be_btins_last);
-            }
+/* A branch, to be pointed at its label once the label is assembled */
+struct amd64_fixup {
+    /* offset in the block's code of the branch's rel32 */
+    size_t offset;
+    /* index of the label in the ir */
+    unsigned int target;
+};
 
-            ce_btins_list = list_slice(btins_list, it, be_btins_last);
-            struct byte_buf * bb_ce = amd64_assemble(ce_btins_list, varstore);
-            ODEL(ce_btins_list);
 
-            amd64_load_r_boper(bb, varstore, REG_RAX, bins->oper[0]);
-            cmp_r_imm(bb, REG_RAX, 0, 0);
-            jcc(bb, JCC_JE, byte_buf_length(bb_ce));
+/*
+* Assembles the bins of ir and appends the result to bb, without emitting a
+* way to leave the code. Branches only go forward, so each is assembled with a
+* rel32 of 0 which is fixed up when its label is reached.
+*/
+static int amd64_assemble_ir (struct byte_buf * bb,
+                              const struct ir * ir,
+                              struct varstore * varstore,
+                              struct amd64_alloc * alloc) {
+    struct amd64_fixup * fixups;
+    fixups = malloc(sizeof(struct amd64_fixup) * (ir->size + 1));
+    unsigned int fixups_size = 0;
+    int error = 0;
 
-            byte_buf_append_byte_buf(bb, bb_ce);
-            ODEL(bb_ce);
+    unsigned int i;
+    for (i = 0; i < ir->size; i++) {
+        const struct bins * bins = &(ir->bins[i]);
+        amd64_alloc_step(bb, varstore, alloc);
+
+        if (bins->op == BOP_LABEL) {
+            unsigned int f = 0;
+            while (f < fixups_size) {
+                if (fixups[f].target == i) {
+                    size_t next = fixups[f].offset + 4;
+                    byte_buf_set_le32(bb,
+                                      fixups[f].offset,
+                                      byte_buf_length(bb) - next);
+                    fixups[f] = fixups[--fixups_size];
+                }
+                else
+                    f++;
+            }
+            alloc->conditional = fixups_size;
+            /* code branching here did not store anything */
+            alloc->store_bb = NULL;
         }
-        else {
-            struct byte_buf * bins_bb = amd64_assemble_bins(bins, varstore);
-            if (bins_bb == NULL) {
+        else if (bins_is_branch(bins)) {
+            if (ir->targets[i] == IR_NONE) {
                 error = -1;
                 break;
             }
-            byte_buf_append_byte_buf(bb, bins_bb);
-            ODEL(bins_bb);
+            if (bins->op == BOP_BRZ) {
+                unsigned int flag_bits = boper_bits(bins->oper[0]);
+                if (flag_bits == 1)
+                    flag_bits = 8;
+                amd64_read(bb, varstore, alloc, REG_RAX, bins->oper[0]);
+                cmp_r_imm(bb, REG_RAX, 0, flag_bits);
+                jcc_rel32(bb, JCC_JE, 0);
+            }
+            else
+                jmp_rel32(bb, 0);
+            fixups[fixups_size].offset = byte_buf_length(bb) - 4;
+            fixups[fixups_size].target = ir->targets[i];
+            fixups_size++;
+            alloc->conditional = fixups_size;
         }
+        else {
+            error = amd64_assemble_bins(bb, bins, varstore, alloc);
+            if (error)
+                break;
+        }
+    }
 
+    alloc->conditional = 0;
+    free(fixups);
+    return error;
+}
+
+
+/*
+* Assembles every instruction in btins_list and appends the result to bb,
+* without emitting a way to leave the code.
+*/
+static int amd64_assemble_list (struct byte_buf * bb,
+                                struct list * btins_list,
+                                struct varstore * varstore) {
+    struct ir * ir = ir_create(btins_list);
+    struct amd64_alloc * alloc = amd64_alloc_create(ir);
+    int error = amd64_assemble_ir(bb, ir, varstore, alloc);
+    amd64_alloc_flush(bb, varstore, alloc, 1);
+    amd64_alloc_delete(alloc);
+    ODEL(ir);
+
+    amd64_peephole_count(&amd64_peephole_totals.blocks);
+    __atomic_fetch_add(&amd64_peephole_totals.bytes,
+                       byte_buf_length(bb),
+                       __ATOMIC_RELAXED);
+    return error;
+}
+
+
+struct byte_buf * amd64_assemble (struct list * btins_list,
+                                  struct varstore * varstore) {
+    struct byte_buf * bb = byte_buf_create();
+    if (amd64_assemble_list(bb, btins_list, varstore)) {
+        ODEL(bb);
+        return NULL;
     }
-    if (error) {
+    mov_r_imm(bb, REG_RAX, 0, 64);
+    ret(bb);
+    return bb;
+}
+
+
+/* Loads the zero-extended instruction pointer into rcx */
+static int amd64_load_ip (struct byte_buf * bb,
+                          struct varstore * varstore,
+                          const struct boper * ip) {
+    if (amd64_load_r_boper(bb, varstore, REG_RCX, (struct boper *) ip))
+        return -1;
+    if (boper_bits(ip) < 64)
+        return movzx_r_r(bb, REG_RCX, 64, REG_RCX, boper_bits(ip));
+    return 0;
+}
+
+
+/*
+* Looks up the vaddr in rcx in the jit lookup table, leaving the code for it
+* in rax, or 0 if there's no entry for rcx. Clobbers rdx.
+*   mov rax, [rax]
+*   cmp rax, 0
+*   je done
+*   mov rdx, [rax - JIT_BLOCK_HEADER_SIZE]
+*   cmp rdx, rcx
+*   je done
+*   xor eax, eax
+* done:
+*/
+static int amd64_lookup (struct byte_buf * bb, struct varstore * varstore) {
+    size_t lookup_offset = varstore_offset_create(varstore,
+                                                  "__JIT_LOOKUP__",
+                                                  64);
+    mov_r_rm(bb, REG_RDX, REG_RBP, lookup_offset, 64);
+    mov_r_r(bb, REG_RAX, REG_RCX, 64);
+    shr_r64_imm(bb, REG_RAX, 2);
+    xor_r_r(bb, REG_RAX, REG_RCX, 64);
+    and_r_imm(bb, REG_RAX, JIT_LOOKUP_SIZE - 1, 64);
+    shl_r64_imm(bb, REG_RAX, 3);
+    add_r_r(bb, REG_RAX, REG_RDX, 64);
+    mov_r_rm(bb, REG_RAX, REG_RAX, offsetof(struct jit_lookup, code), 64);
+
+    struct byte_buf * check = byte_buf_create();
+    mov_r_rm(check, REG_RDX, REG_RAX, -JIT_BLOCK_HEADER_SIZE, 64);
+    cmp_r_r(check, REG_RDX, REG_RCX, 64);
+    jcc(check, JCC_JE, 2);
+    xor_r_r(check, REG_RAX, REG_RAX, 32);
+
+    cmp_r_imm(bb, REG_RAX, 0, 64);
+    jcc(bb, JCC_JE, byte_buf_length(check));
+    byte_buf_append_byte_buf(bb, check);
+    ODEL(check);
+    return 0;
+}
+
+
+/*
+* A chain slot is:
+*   mov rax, vaddr      48 b8 <imm64>
+*   cmp rcx, rax        48 39 c1
+*   jne next_slot       75 05
+*   jmp target          e9 <rel32>
+* An unchained slot has a vaddr and rel32 of 0, and jumps to the next
+* instruction. The slots start 4-byte aligned, so each rel32 is aligned and
+* can be patched with a single store. The slots are followed by a probe of the jit lookup table:
+*   amd64_lookup
+*   cmp rax, 0
+*   je exit
+*   jmp rax
+* And finally the exit:
+*   lea rax, [rip - x]  48 8d 05 <disp32>
+*   mov [rbp + y], rax  48 89 85 <off32>
+*   mov rax, 0          48 b8 <imm64>
+*   ret                 c3
+*/
+#define AMD64_CHAIN_SLOT_SIZE 20
+#define AMD64_CHAIN_SLOT_VADDR 2
+#define AMD64_CHAIN_SLOT_REL32 16
+#define AMD64_CHAIN_PROBE_SIZE 72
+#define AMD64_CHAIN_EXIT_SIZE 25
+
+struct byte_buf * amd64_assemble_block (struct list * btins_list,
+                                        struct varstore * varstore,
+                                        const struct boper * ip) {
+    struct byte_buf * bb = byte_buf_create();
+    if (amd64_assemble_list(bb, btins_list, varstore)) {
         ODEL(bb);
         return NULL;
     }
+
+    amd64_load_ip(bb, varstore, ip);
+    /* code is placed JIT_CODE_ALIGN aligned */
+    while (byte_buf_length(bb) & 3)
+        byte_buf_append(bb, 0x90);
+
+    /* the slots, probe and exit are found by their size, so they keep their
+       long forms */
+    amd64_fixed++;
+    unsigned int i;
+    for (i = 0; i < CHAIN_SLOTS; i++) {
+        size_t slot_start = byte_buf_length(bb);
+        mov_r_imm(bb, REG_RAX, 0, 64);
+        cmp_r_r(bb, REG_RCX, REG_RAX, 64);
+        jcc(bb, JCC_JNE, 5);
+        jmp_rel32(bb, 0);
+        assert(byte_buf_length(bb) - slot_start == AMD64_CHAIN_SLOT_SIZE);
+    }
+
+    size_t probe_start = byte_buf_length(bb);
+    amd64_lookup(bb, varstore);
+    cmp_r_imm(bb, REG_RAX, 0, 64);
+    jcc(bb, JCC_JE, 2);
+    jmp_r(bb, REG_RAX);
+    assert(byte_buf_length(bb) - probe_start == AMD64_CHAIN_PROBE_SIZE);
+
+    size_t exit_start = byte_buf_length(bb);
+    size_t exit_offset = varstore_offset_create(varstore, "__JIT_EXIT__", 64);
+    lea_r_rip(bb, REG_RAX, -((int32_t) byte_buf_length(bb) + 7));
+    mov_rm_r(bb, REG_RBP, exit_offset, REG_RAX, 64);
     mov_r_imm(bb, REG_RAX, 0, 64);
     ret(bb);
+    assert(byte_buf_length(bb) - exit_start == AMD64_CHAIN_EXIT_SIZE);
+    amd64_fixed--;
+
     return bb;
 }
 
 
+/*
+* The dispatcher is:
+*   sub rsp, 8          keep the stack aligned as if blocks were called
+*                       directly from amd64_execute
+* loop:
+*   rcx = ip
+*   amd64_lookup
+*   cmp rax, 0
+*   je done
+*   call rax
+*   cmp rax, 0
+*   je loop
+* done:
+*   add rsp, 8
+*   ret
+*/
+struct byte_buf * amd64_dispatcher (struct varstore * varstore,
+                                    const struct boper * ip) {
+    struct byte_buf * done = byte_buf_create();
+    add_r_imm(done, REG_RSP, 8, 64);
+    ret(done);
+
+    struct byte_buf * loop = byte_buf_create();
+    amd64_load_ip(loop, varstore, ip);
+    amd64_lookup(loop, varstore);
+    cmp_r_imm(loop, REG_RAX, 0, 64);
+
+    struct byte_buf * run = byte_buf_create();
+    call_r(run, REG_RAX);
+    cmp_r_imm(run, REG_RAX, 0, 64);
+    // je loop, offset is from the end of this 2 or 6 byte jcc
+    size_t back = byte_buf_length(loop) + 2 + byte_buf_length(run);
+    if (back + 2 < 0x78)
+        jcc(run, JCC_JE, -((int) back + 2));
+    else
+        jcc(run, JCC_JE, -((int) back + 6));
+
+    jcc(loop, JCC_JE, byte_buf_length(run));
+
+    struct byte_buf * bb = byte_buf_create();
+    sub_r_imm(bb, REG_RSP, 8, 64);
+    byte_buf_append_byte_buf(bb, loop);
+    byte_buf_append_byte_buf(bb, run);
+    byte_buf_append_byte_buf(bb, done);
+
+    ODEL(done);
+    ODEL(loop);
+    ODEL(run);
+
+    return bb;
+}
+
+
+void * amd64_chain_slot (void * code, size_t code_size, unsigned int n) {
+    if (n >= CHAIN_SLOTS)
+        return NULL;
+    size_t slots_size = CHAIN_SLOTS * AMD64_CHAIN_SLOT_SIZE;
+    if (code_size < slots_size
+                    + AMD64_CHAIN_PROBE_SIZE
+                    + AMD64_CHAIN_EXIT_SIZE)
+        return NULL;
+
+    uint8_t * slots = (uint8_t *) code
+                      + code_size
+                      - AMD64_CHAIN_EXIT_SIZE
+                      - AMD64_CHAIN_PROBE_SIZE
+                      - slots_size;
+    return &(slots[n * AMD64_CHAIN_SLOT_SIZE]);
+}
+
+
+int amd64_chain (void * slot, uint64_t vaddr, const void * code) {
+    uint8_t * s = slot;
+    int64_t rel = (const uint8_t *) code - (s + AMD64_CHAIN_SLOT_SIZE);
+    if ((rel > INT32_MAX) || (rel < INT32_MIN))
+        return -1;
+
+    /* While the vaddr is written the rel32 is still 0, so a torn vaddr only
+       ever jumps to the next instruction */
+    int32_t rel32 = rel;
+    memcpy(&(s[AMD64_CHAIN_SLOT_VADDR]), &vaddr, sizeof(vaddr));
+    __atomic_store_n((int32_t *) &(s[AMD64_CHAIN_SLOT_REL32]),
+                     rel32,
+                     __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+int amd64_unchain (void * slot) {
+    uint8_t * s = slot;
+    uint64_t vaddr = 0;
+    __atomic_store_n((int32_t *) &(s[AMD64_CHAIN_SLOT_REL32]),
+                     0,
+                     __ATOMIC_RELEASE);
+    memcpy(&(s[AMD64_CHAIN_SLOT_VADDR]), &vaddr, sizeof(vaddr));
+    return 0;
+}
+
+
+/* indices of rbx and rip in a ucontext's gregs, glibc's names for them clash
+   with ours */
+#define AMD64_GREG_RBX 11
+#define AMD64_GREG_RIP 16
+
+static pthread_once_t amd64_direct_once = PTHREAD_ONCE_INIT;
+
+
+/*
+* Resumes an access to a page a direct memmap does not have at rbx, which
+* leaves the block as a failed memmap_get or memmap_set would. See
+* memmap_set_direct_resume.
+*
+* The fault is only ours when it is at the start of an access of
+* amd64_access, right after the lea which pointed rbx past it. A fault
+* anywhere else, such as in a hook or in memmap itself, is left alone.
+*/
+static int amd64_direct_resume (void * context) {
+#ifdef __linux__
+    ucontext_t * ucontext = context;
+    greg_t * gregs = ucontext->uc_mcontext.gregs;
+    const uint8_t * rip = (const uint8_t *) gregs[AMD64_GREG_RIP];
+
+    // lea rbx, [rip + offset]
+    int32_t offset;
+    memcpy(&offset, &(rip[-4]), sizeof(offset));
+    if (    (rip[-7] != 0x48)
+         || (rip[-6] != 0x8d)
+         || (rip[-5] != (0x05 | (REG_RBX << 3)))
+         || ((greg_t) (rip + offset) != gregs[AMD64_GREG_RBX]))
+        return -1;
+
+    gregs[AMD64_GREG_RIP] = gregs[AMD64_GREG_RBX];
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+
+static void amd64_direct_install (void) {
+    memmap_set_direct_resume(amd64_direct_resume);
+}
+
+
 unsigned int amd64_execute (const void * code,
                             struct varstore * varstore) {
     unsigned int result;
     void * data_buf = varstore_data_buf(varstore);
 
+    pthread_once(&amd64_direct_once, amd64_direct_install);
+
     asm(
         "push %%rbx;"
         "push %%rbp;"
@@ -1409,9 +3149,12 @@ unsigned int amd64_execute (const void * code,
         "pop %%rbp;"
         "pop %%rbx;"
         "mov %%eax, %0;"
-        : "=r" (result)
-        : "r" (data_buf), "r" (code)
-        : "rax", "rcx", "rdx", "rdi", "rsi"
+        /* with r8 - r15 clobbered there are too few registers left to pick
+           from, so pin data_buf and code where rbp can't be chosen */
+        : "=r" (result), "+d" (data_buf), "+c" (code)
+        :
+        : "rax", "rdi", "rsi",
+          "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
     );
     /*
     asm(
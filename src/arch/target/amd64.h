@@ -12,6 +12,42 @@
 extern const struct arch_target arch_target_amd64;
 
 
+/*
+Peephole optimizations made while assembling. The counts cover every block
+assembled by any jit since the process started, and with amd64_set_peephole
+turning the optimizations off, bytes gives the size to compare against.
+*/
+struct amd64_peephole_stats {
+    /* number of blocks assembled, and the bytes of code assembled for them */
+    unsigned int blocks;
+    size_t bytes;
+    /* loads of a variable straight after a store to it, replaced with a
+       register move or nothing */
+    unsigned int reloads;
+    /* 1-bit operations done without saving, masking and restoring their
+       source register */
+    unsigned int pushes;
+    /* moves of a constant into rax for an operation which can take the
+       constant as an immediate */
+    unsigned int immediates;
+    /* operations with a constant which leaves the destination as it is,
+       like the or dst, src, 0 of a move, which are left out */
+    unsigned int identities;
+    /* instructions encoded with an 8-bit immediate or displacement */
+    unsigned int short_forms;
+    /* shifts, multiplies and divides by a constant done with a single
+       instruction rather than through rax and rbx */
+    unsigned int constants;
+    /* adds and shifts into another register done with a single lea */
+    unsigned int leas;
+};
+
+/* Turns the peephole optimizations on, the default, or off */
+void amd64_set_peephole (int enabled);
+
+void amd64_get_peephole_stats (struct amd64_peephole_stats * stats);
+
+
 struct byte_buf * amd64_assemble (struct list * btins_list,
                                   struct varstore * varstore);
 
@@ -22,10 +58,30 @@ Return codes:
 1 - Error reading from MMU
 2 - Error writing to MMO
 3 - Encountered HLT instruction
+4 - Ran out of fuel
 */
 unsigned int amd64_execute (const void * code,
                             struct varstore * varstore);
 
+/*
+Assembles btins_list as a chainable jit block. See struct arch_target.
+*/
+struct byte_buf * amd64_assemble_block (struct list * btins_list,
+                                        struct varstore * varstore,
+                                        const struct boper * ip);
+
+/*
+Assembles a dispatcher stub for chainable jit blocks. See struct arch_target.
+*/
+struct byte_buf * amd64_dispatcher (struct varstore * varstore,
+                                    const struct boper * ip);
+
+void * amd64_chain_slot (void * code, size_t code_size, unsigned int n);
+
+int amd64_chain (void * slot, uint64_t vaddr, const void * code);
+
+int amd64_unchain (void * slot);
+
 int amd64_load_r_boper (struct byte_buf * bb,
                         struct varstore * varstore,
                         unsigned int reg,
@@ -79,6 +135,9 @@ int and_rm_r (struct byte_buf * bb,
               unsigned int r,
               unsigned int bits);
 
+/* Reverses the order of the low bits / 8 bytes of r */
+int bswap_r (struct byte_buf * bb, unsigned int r, unsigned int bits);
+
 int call_r (struct byte_buf * bb, unsigned int r);
 
 int cmp_r_imm (struct byte_buf * bb,
@@ -91,12 +150,49 @@ int cmp_r_r (struct byte_buf * bb,
              unsigned int rhs,
              unsigned int bits);
 
+int cmp_rm_r (struct byte_buf * bb,
+              unsigned int rm,
+              uint32_t off32,
+              unsigned int r,
+              unsigned int bits);
+
 int div_r64_r64 (struct byte_buf * bb, unsigned int lhs, unsigned int rhs);
 
 int jcc (struct byte_buf * bb, unsigned int condition, int offset);
 
 int jmp (struct byte_buf * bb, int offset);
 
+int jmp_r (struct byte_buf * bb, unsigned int r);
+
+int jmp_rel32 (struct byte_buf * bb, int32_t offset);
+
+int jcc_rel32 (struct byte_buf * bb, unsigned int condition, int32_t offset);
+
+/* imul dst, src, imm, the low bits of which are those of an unsigned
+   multiply */
+int imul_r_r_imm (struct byte_buf * bb,
+                  unsigned int dst,
+                  unsigned int src,
+                  uint64_t imm,
+                  unsigned int bits);
+
+/* lea r, [rm + off32] */
+int lea_r_rm (struct byte_buf * bb,
+              unsigned int r,
+              unsigned int rm,
+              uint32_t off32,
+              unsigned int bits);
+
+/* lea r, [base + index * scale], or [index * scale] for a base of -1 */
+int lea_r_sib (struct byte_buf * bb,
+               unsigned int r,
+               int base,
+               unsigned int index,
+               unsigned int scale,
+               unsigned int bits);
+
+int lea_r_rip (struct byte_buf * bb, unsigned int r, int32_t off32);
+
 int mod_r64_r64 (struct byte_buf * bb, unsigned int lhs, unsigned int rhs);
 
 int mov_r_imm (struct byte_buf * bb,
@@ -143,6 +239,11 @@ int movzx_r_r (struct byte_buf * bb,
 
 int mul_r64_r64 (struct byte_buf * bb, unsigned int lhs, unsigned int rhs);
 
+int or_r_r (struct byte_buf * bb,
+            unsigned int dst,
+            unsigned int rhs,
+            unsigned int bits);
+
 int or_rm_r (struct byte_buf * bb,
              unsigned int rm,
              uint32_t off32,
@@ -157,6 +258,32 @@ int ret (struct byte_buf * bb);
 
 int shl_r64_r64 (struct byte_buf * bb, unsigned int lhs, unsigned int rhs);
 
+int shl_r64_imm (struct byte_buf * bb, unsigned int r, uint8_t imm);
+
+int shl_r_imm (struct byte_buf * bb,
+               unsigned int r,
+               uint8_t imm,
+               unsigned int bits);
+
+int shl_rm_imm (struct byte_buf * bb,
+                unsigned int rm,
+                uint32_t off32,
+                uint8_t imm,
+                unsigned int bits);
+
+int shr_r_imm (struct byte_buf * bb,
+               unsigned int r,
+               uint8_t imm,
+               unsigned int bits);
+
+int shr_rm_imm (struct byte_buf * bb,
+                unsigned int rm,
+                uint32_t off32,
+                uint8_t imm,
+                unsigned int bits);
+
+int shr_r64_imm (struct byte_buf * bb, unsigned int r, uint8_t imm);
+
 int shr_r64_r64 (struct byte_buf * bb, unsigned int lhs, unsigned int rhs);
 
 int sub_r_imm (struct byte_buf * bb,
@@ -175,10 +302,15 @@ int sub_rm_r (struct byte_buf * bb,
               unsigned int r,
               unsigned int bits);
 
+int xor_r_r (struct byte_buf * bb,
+             unsigned int dst,
+             unsigned int rhs,
+             unsigned int bits);
+
 int xor_rm_r (struct byte_buf * bb,
               unsigned int rm,
               uint32_t off32,
               unsigned int r,
               unsigned int bits);
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
@@ -0,0 +1,402 @@
+#include "interp.h"
+
+#include "btlog.h"
+#include "bt/ir.h"
+#include "container/memmap.h"
+
+#include <string.h>
+
+
+const struct arch_target arch_target_interp = {
+    interp_assemble,
+    interp_execute,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+
+static uint64_t interp_mask (unsigned int bits) {
+    if (bits >= 64)
+        return 0xffffffffffffffffULL;
+    return (1ULL << bits) - 1;
+}
+
+
+static int interp_oper (struct interp_ins * ins,
+                        unsigned int n,
+                        const struct boper * boper,
+                        struct varstore * varstore) {
+    unsigned int bits = boper_bits(boper);
+    if ((bits != 1) && (bits != 8) && (bits != 16) && (bits != 32) && (bits != 64))
+        return -1;
+
+    ins->bits[n] = bits;
+    if (boper_type(boper) == BOPER_CONSTANT) {
+        ins->oper_type |= INTERP_CONSTANT << n;
+        ins->oper[n] = boper_value(boper) & interp_mask(bits);
+    }
+    else
+        ins->oper[n] = varstore_offset_create_id(varstore,
+                                                 boper_id(boper),
+                                                 bits);
+    return 0;
+}
+
+
+struct byte_buf * interp_assemble (struct list * btins_list,
+                                   struct varstore * varstore) {
+    struct byte_buf * bb = byte_buf_create();
+    struct interp_ins ins;
+
+    /* loads and stores find the memmap through this variable */
+    size_t memmap_offset;
+    if (varstore_offset(varstore, "__MEMMAP__", 64, &memmap_offset))
+        memmap_offset = varstore_offset_create(varstore, "__MEMMAP__", 64);
+
+    /* each bins is one interp_ins, so branches skip to their label's
+       index */
+    struct ir * ir = ir_create(btins_list);
+
+    unsigned int index;
+    for (index = 0; index < ir->size; index++) {
+        const struct bins * bins = &(ir->bins[index]);
+
+        memset(&ins, 0, sizeof(ins));
+        ins.op = bins->op;
+
+        unsigned int opers = 0;
+        switch (bins->op) {
+        case BOP_ADD :
+        case BOP_SUB :
+        case BOP_UMUL :
+        case BOP_UDIV :
+        case BOP_UMOD :
+        case BOP_AND :
+        case BOP_OR :
+        case BOP_XOR :
+        case BOP_SHL :
+        case BOP_SHR :
+        case BOP_CMPEQ :
+        case BOP_CMPLTU :
+        case BOP_CMPLTS :
+        case BOP_CMPLEU :
+        case BOP_CMPLES :
+            opers = 3;
+            break;
+        case BOP_SEXT :
+        case BOP_ZEXT :
+        case BOP_TRUN :
+        case BOP_LOAD :
+        case BOP_STORE :
+        case BOP_LOADBE :
+        case BOP_STOREBE :
+            opers = 2;
+            break;
+        case BOP_BRZ :
+            opers = 1;
+            /* fall through */
+        case BOP_BR :
+            if (ir->targets[index] == IR_NONE) {
+                BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                      "[interp_assemble] branch to a label not after it");
+                ODEL(ir);
+                ODEL(bb);
+                return NULL;
+            }
+            ins.skip = ir->targets[index] - index;
+            break;
+        case BOP_FUEL :
+            opers = 1;
+            break;
+        case BOP_HLT :
+        case BOP_COMMENT :
+        case BOP_LABEL :
+            break;
+        case BOP_HOOK :
+            ins.hook = bins->hook;
+            break;
+        default :
+            BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                  "[interp_assemble] unknown op %d", bins->op);
+            ODEL(ir);
+            ODEL(bb);
+            return NULL;
+        }
+
+        unsigned int i;
+        for (i = 0; i < opers; i++) {
+            if (interp_oper(&ins, i, bins->oper[i], varstore)) {
+                BTLOG(BTLOG_TARGET, BTLOG_ERROR,
+                      "[interp_assemble] invalid operand bits %u",
+                      boper_bits(bins->oper[i]));
+                ODEL(ir);
+                ODEL(bb);
+                return NULL;
+            }
+        }
+
+        /* the memmap lives in the third operand of loads and stores */
+        if (    (bins->op == BOP_LOAD)
+             || (bins->op == BOP_STORE)
+             || (bins->op == BOP_LOADBE)
+             || (bins->op == BOP_STOREBE))
+            ins.oper[2] = memmap_offset;
+        /* and the fuel in the second operand of BOP_FUEL */
+        if (bins->op == BOP_FUEL)
+            ins.oper[1] = varstore_offset_create(varstore, "__JIT_FUEL__", 64);
+
+        byte_buf_append_bytes(bb, (const uint8_t *) &ins, sizeof(ins));
+    }
+    ODEL(ir);
+
+    memset(&ins, 0, sizeof(ins));
+    ins.op = INTERP_END;
+    byte_buf_append_bytes(bb, (const uint8_t *) &ins, sizeof(ins));
+
+    return bb;
+}
+
+
+static uint64_t interp_get (const uint8_t * data_buf,
+                            const struct interp_ins * ins,
+                            unsigned int n) {
+    if (ins->oper_type & (INTERP_CONSTANT << n))
+        return ins->oper[n];
+
+    const uint8_t * p = &(data_buf[ins->oper[n]]);
+    switch (ins->bits[n]) {
+    case 1 : return *p & 1;
+    case 8 : return *p;
+    case 16 : return *((const uint16_t *) p);
+    case 32 : return *((const uint32_t *) p);
+    default : return *((const uint64_t *) p);
+    }
+}
+
+
+static void interp_set (uint8_t * data_buf,
+                        const struct interp_ins * ins,
+                        uint64_t value) {
+    uint8_t * p = &(data_buf[ins->oper[0]]);
+    switch (ins->bits[0]) {
+    case 1 : *p = value & 1; break;
+    case 8 : *p = value; break;
+    case 16 : *((uint16_t *) p) = value; break;
+    case 32 : *((uint32_t *) p) = value; break;
+    default : *((uint64_t *) p) = value; break;
+    }
+}
+
+
+/* Reads bits from address in memmap, returns non-zero on failure */
+static int interp_load (const struct memmap * memmap,
+                        uint64_t address,
+                        unsigned int bits,
+                        int big_endian,
+                        uint64_t * value) {
+    int error = -1;
+    uint8_t u8;
+    uint16_t u16;
+    uint32_t u32;
+    switch (bits) {
+    case 8 :
+        error = memmap_get_u8(memmap, address, &u8);
+        *value = u8;
+        break;
+    case 16 :
+        if (big_endian)
+            error = memmap_get_u16_be(memmap, address, &u16);
+        else
+            error = memmap_get_u16_le(memmap, address, &u16);
+        *value = u16;
+        break;
+    case 32 :
+        if (big_endian)
+            error = memmap_get_u32_be(memmap, address, &u32);
+        else
+            error = memmap_get_u32_le(memmap, address, &u32);
+        *value = u32;
+        break;
+    case 64 :
+        if (big_endian)
+            error = memmap_get_u64_be(memmap, address, value);
+        else
+            error = memmap_get_u64_le(memmap, address, value);
+        break;
+    }
+    return error;
+}
+
+
+/* Writes bits of value to address in memmap, returns non-zero on failure */
+static int interp_store (struct memmap * memmap,
+                         uint64_t address,
+                         unsigned int bits,
+                         int big_endian,
+                         uint64_t value) {
+    switch (bits) {
+    case 8 :
+        return memmap_set_u8(memmap, address, value);
+    case 16 :
+        if (big_endian)
+            return memmap_set_u16_be(memmap, address, value);
+        return memmap_set_u16_le(memmap, address, value);
+    case 32 :
+        if (big_endian)
+            return memmap_set_u32_be(memmap, address, value);
+        return memmap_set_u32_le(memmap, address, value);
+    case 64 :
+        if (big_endian)
+            return memmap_set_u64_be(memmap, address, value);
+        return memmap_set_u64_le(memmap, address, value);
+    }
+    return -1;
+}
+
+
+/* sign-extends the low bits of value to 64 bits */
+static int64_t interp_signed (uint64_t value, unsigned int bits) {
+    if (bits >= 64)
+        return (int64_t) value;
+    uint64_t sign = 1ULL << (bits - 1);
+    return (int64_t) ((value ^ sign) - sign);
+}
+
+
+unsigned int interp_execute (const void * code, struct varstore * varstore) {
+    static const void * const dispatch[INTERP_OPS] = {
+        [BOP_ADD] = &&op_add,
+        [BOP_SUB] = &&op_sub,
+        [BOP_UMUL] = &&op_umul,
+        [BOP_UDIV] = &&op_udiv,
+        [BOP_UMOD] = &&op_umod,
+        [BOP_AND] = &&op_and,
+        [BOP_OR] = &&op_or,
+        [BOP_XOR] = &&op_xor,
+        [BOP_SHL] = &&op_shl,
+        [BOP_SHR] = &&op_shr,
+        [BOP_CMPEQ] = &&op_cmpeq,
+        [BOP_CMPLTU] = &&op_cmpltu,
+        [BOP_CMPLTS] = &&op_cmplts,
+        [BOP_CMPLEU] = &&op_cmpleu,
+        [BOP_CMPLES] = &&op_cmples,
+        [BOP_SEXT] = &&op_sext,
+        [BOP_ZEXT] = &&op_zext,
+        [BOP_TRUN] = &&op_zext,
+        [BOP_STORE] = &&op_store,
+        [BOP_LOAD] = &&op_load,
+        [BOP_STOREBE] = &&op_store,
+        [BOP_LOADBE] = &&op_load,
+        [BOP_LABEL] = &&op_next,
+        [BOP_BRZ] = &&op_brz,
+        [BOP_BR] = &&op_br,
+        [BOP_HLT] = &&op_hlt,
+        [BOP_FUEL] = &&op_fuel,
+        [BOP_COMMENT] = &&op_next,
+        [BOP_HOOK] = &&op_hook,
+        [INTERP_END] = &&op_end
+    };
+
+    /* operands are offsets into data_buf, which only moves if a hook creates
+       variables */
+    uint8_t * data_buf = varstore_data_buf(varstore);
+    const struct interp_ins * ins = code;
+    uint64_t lhs, rhs;
+
+#define DISPATCH() goto *dispatch[ins->op]
+#define NEXT() do { ins++; DISPATCH(); } while (0)
+#define LHS interp_get(data_buf, ins, 1)
+#define RHS interp_get(data_buf, ins, 2)
+#define SET(value) interp_set(data_buf, ins, (value))
+
+    DISPATCH();
+
+op_add : SET(LHS + RHS); NEXT();
+op_sub : SET(LHS - RHS); NEXT();
+op_umul : SET(LHS * RHS); NEXT();
+op_udiv :
+    rhs = RHS;
+    SET(rhs == 0 ? 0 : LHS / rhs);
+    NEXT();
+op_umod :
+    rhs = RHS;
+    SET(rhs == 0 ? 0 : LHS % rhs);
+    NEXT();
+op_and : SET(LHS & RHS); NEXT();
+op_or : SET(LHS | RHS); NEXT();
+op_xor : SET(LHS ^ RHS); NEXT();
+/* counts of 64 and up shift everything out, as they do in amd64 */
+op_shl :
+    rhs = RHS;
+    SET(rhs >= 64 ? 0 : LHS << rhs);
+    NEXT();
+op_shr :
+    rhs = RHS;
+    SET(rhs >= 64 ? 0 : LHS >> rhs);
+    NEXT();
+op_cmpeq : SET(LHS == RHS); NEXT();
+op_cmpltu : SET(LHS < RHS); NEXT();
+op_cmplts :
+    SET(interp_signed(LHS, ins->bits[1]) < interp_signed(RHS, ins->bits[1]));
+    NEXT();
+op_cmpleu : SET(LHS <= RHS); NEXT();
+op_cmples :
+    SET(interp_signed(LHS, ins->bits[1]) <= interp_signed(RHS, ins->bits[1]));
+    NEXT();
+op_sext : SET(interp_signed(LHS, ins->bits[1])); NEXT();
+op_zext : SET(LHS); NEXT();
+op_load : {
+    uint64_t value;
+    struct memmap * memmap = *((struct memmap **) &(data_buf[ins->oper[2]]));
+    if (interp_load(memmap,
+                    LHS,
+                    ins->bits[0],
+                    ins->op == BOP_LOADBE,
+                    &value))
+        return 1;
+    SET(value);
+    NEXT();
+}
+op_store : {
+    struct memmap * memmap = *((struct memmap **) &(data_buf[ins->oper[2]]));
+    lhs = interp_get(data_buf, ins, 0);
+    if (interp_store(memmap,
+                     lhs,
+                     ins->bits[1],
+                     ins->op == BOP_STOREBE,
+                     LHS))
+        return 2;
+    NEXT();
+}
+op_brz :
+    if (interp_get(data_buf, ins, 0) == 0)
+        ins += ins->skip;
+    NEXT();
+op_br :
+    ins += ins->skip;
+    NEXT();
+op_hlt : return 3;
+op_fuel : {
+    uint64_t * fuel = (uint64_t *) &(data_buf[ins->oper[1]]);
+    if (*fuel < ins->oper[0])
+        return 4;
+    *fuel -= ins->oper[0];
+    NEXT();
+}
+op_hook :
+    ins->hook(varstore);
+    /* hooks may create variables */
+    data_buf = varstore_data_buf(varstore);
+    NEXT();
+op_next : NEXT();
+op_end : return 0;
+
+#undef DISPATCH
+#undef NEXT
+#undef LHS
+#undef RHS
+#undef SET
+}
@@ -0,0 +1,61 @@
+#ifndef interp_HEADER
+#define interp_HEADER
+
+#include <stdint.h>
+
+#include "arch/arch.h"
+#include "bt/bins.h"
+#include "container/byte_buf.h"
+#include "container/list.h"
+#include "container/varstore.h"
+
+/*
+* interp is an arch_target which does not generate native code. assemble
+* lowers a bins list to a flat array of interp_ins, with variables resolved to
+* varstore offsets up front, and execute runs that array with a
+* threaded-dispatch loop.
+*
+* Assembling is much cheaper than for a native target, so the jit uses interp
+* for blocks it has not seen run often. See jit_set_tiering.
+*/
+
+extern const struct arch_target arch_target_interp;
+
+/* oper_type flags, one bit per operand */
+#define INTERP_CONSTANT 1
+
+/* interp opcodes which have no matching bins op */
+enum {
+    /* stops execution and returns 0 */
+    INTERP_END = BOP_HOOK + 1,
+    INTERP_OPS
+};
+
+struct interp_ins {
+    uint8_t op;
+    /* bit n set when oper[n] is a constant */
+    uint8_t oper_type;
+    uint8_t bits[3];
+    /* for branches, the number of interp_ins to skip, which puts them past
+       their label */
+    uint32_t skip;
+    /* varstore offset of each variable operand, or the constant's value */
+    uint64_t oper[3];
+    void (* hook) (void *);
+};
+
+
+struct byte_buf * interp_assemble (struct list * btins_list,
+                                   struct varstore * varstore);
+
+/*
+Return codes match amd64_execute:
+0 - Execution Successful
+1 - Error reading from MMU
+2 - Error writing to MMU
+3 - Encountered HLT instruction
+4 - Ran out of fuel
+*/
+unsigned int interp_execute (const void * code, struct varstore * varstore);
+
+#endif
@@ -30,8 +30,14 @@ const struct bins_string bins_strings [] = {
     {BOP_TRUN,   "trun"},
     {BOP_STORE,  "store"},
     {BOP_LOAD,   "load"},
+    {BOP_STOREBE, "storebe"},
+    {BOP_LOADBE,  "loadbe"},
     {BOP_CE,     "ce"},
+    {BOP_LABEL,  "label"},
+    {BOP_BRZ,    "brz"},
+    {BOP_BR,     "br"},
     {BOP_HLT,    "hlt"},
+    {BOP_FUEL,   "fuel"},
     {BOP_COMMENT, "comment"},
     {BOP_HOOK,    "hook"},
     {-1, NULL}
@@ -53,10 +59,16 @@ struct boper * boper_create (unsigned int type,
     object_init(&(boper->oh), &boper_vtable);
     boper->type = type;
     boper->bits = bits;
-    if (identifier != NULL)
-        boper->identifier = strdup(identifier);
-    else
-        boper->identifier = NULL;
+    boper->identifier = NULL;
+    boper->id = SYMTAB_NONE;
+    if (identifier != NULL) {
+        boper->id = symtab_id(identifier);
+        if (boper->id == SYMTAB_NONE) {
+            free(boper);
+            return NULL;
+        }
+        boper->identifier = symtab_name(boper->id);
+    }
     boper->value = value;
 
     return boper;
@@ -68,23 +80,30 @@ struct boper * boper_variable (unsigned int bits, const char * identifier) {
 }
 
 
+struct boper * boper_temporary (unsigned int bits, const char * identifier) {
+    return boper_create(BOPER_TEMPORARY, bits, identifier, 0);
+}
+
+
 struct boper * boper_constant (unsigned int bits, uint64_t value) {
     return boper_create(BOPER_CONSTANT, bits, NULL, value);
 }
 
 
 void boper_delete (struct boper * boper) {
-    if (boper->identifier != NULL)
-        free((void *) boper->identifier);
     free(boper);
 }
 
 
 struct boper * boper_copy (const struct boper * boper) {
-    return boper_create(boper->type,
-                        boper->bits,
-                        boper->identifier,
-                        boper->value);
+    struct boper * copy = malloc(sizeof(struct boper));
+    object_init(&(copy->oh), &boper_vtable);
+    copy->type = boper->type;
+    copy->bits = boper->bits;
+    copy->identifier = boper->identifier;
+    copy->id = boper->id;
+    copy->value = boper->value;
+    return copy;
 }
 
 
@@ -104,7 +123,11 @@ int boper_cmp (const struct boper * lhs, const struct boper * rhs) {
             return 1;
         return 0;
     }
-    return strcmp(lhs->identifier, rhs->identifier);
+    else if (lhs->id < rhs->id)
+        return -1;
+    else if (lhs->id > rhs->id)
+        return 1;
+    return 0;
 }
 
 
@@ -115,6 +138,11 @@ char * boper_string (const struct boper * boper) {
         s = malloc(size + 32);
         snprintf(s, size + 32, "%s:%u", boper->identifier, boper->bits);
     }
+    else if (boper->type == BOPER_TEMPORARY) {
+        size_t size = strlen(boper->identifier);
+        s = malloc(size + 32);
+        snprintf(s, size + 32, "%%%s:%u", boper->identifier, boper->bits);
+    }
     else if (boper->type == BOPER_CONSTANT) {
         s = malloc(64);
         snprintf(s, 64, "0x%llx:%u",
@@ -131,6 +159,10 @@ const char * boper_identifier (const struct boper * boper) {
     return boper->identifier;
 }
 
+unsigned int boper_id (const struct boper * boper) {
+    return boper->id;
+}
+
 unsigned int boper_bits (const struct boper * boper) {
     return boper->bits;
 }
@@ -257,7 +289,10 @@ char * bins_string (const struct bins * bins) {
     case BOP_TRUN :
     case BOP_STORE :
     case BOP_LOAD :
-    case BOP_CE: {
+    case BOP_STOREBE :
+    case BOP_LOADBE :
+    case BOP_CE:
+    case BOP_BRZ : {
         s = malloc(128);
         char * o0str = boper_string(bins->oper[0]);
         char * o1str = boper_string(bins->oper[1]);
@@ -270,6 +305,16 @@ char * bins_string (const struct bins * bins) {
     case BOP_HLT :
         s = strdup("hlt");
         break;
+    case BOP_FUEL :
+    case BOP_LABEL :
+    case BOP_BR : {
+        s = malloc(128);
+        char * o0str = boper_string(bins->oper[0]);
+        snprintf(s, 128, "%s %s", op_string, o0str);
+        s[127] = '\0';
+        free(o0str);
+        break;
+    }
     case BOP_COMMENT :
         s = strdup("comment");
         break;
@@ -325,6 +370,8 @@ BINS_2OP_DEF(zext, ZEXT)
 BINS_2OP_DEF(trun, TRUN)
 BINS_2OP_DEF(store, STORE)
 BINS_2OP_DEF(load, LOAD)
+BINS_2OP_DEF(storebe, STOREBE)
+BINS_2OP_DEF(loadbe, LOADBE)
 BINS_2OP_DEF(ce, CE)
 
 
@@ -333,6 +380,11 @@ struct bins * bins_hlt () {
 }
 
 
+struct bins * bins_fuel (uint64_t cost) {
+    return bins_create_(BOP_FUEL, boper_constant(64, cost), NULL, NULL);
+}
+
+
 struct bins * bins_comment () {
     return bins_create(BOP_COMMENT, NULL, NULL, NULL);
 }
@@ -345,6 +397,99 @@ struct bins * bins_hook (void (* hook) (void *)) {
 }
 
 
+struct bins * bins_label (uint32_t label) {
+    return bins_create_(BOP_LABEL, boper_constant(32, label), NULL, NULL);
+}
+
+
+struct bins * bins_br (uint32_t label) {
+    return bins_create_(BOP_BR, boper_constant(32, label), NULL, NULL);
+}
+
+
+struct bins * bins_brz (const struct boper * flag, uint32_t label) {
+    return bins_brz_(OCOPY(flag), label);
+}
+
+
+struct bins * bins_brz_ (struct boper * flag, uint32_t label) {
+    return bins_create_(BOP_BRZ, flag, boper_constant(32, label), NULL);
+}
+
+
+uint32_t bins_target (const struct bins * bins) {
+    if (bins->op == BOP_BRZ)
+        return boper_value(bins->oper[1]);
+    return boper_value(bins->oper[0]);
+}
+
+
+int bins_is_branch (const struct bins * bins) {
+    return (bins->op == BOP_BRZ) || (bins->op == BOP_BR);
+}
+
+
+/* A label bins_lower_ce places after the instruction at index end */
+struct bins_ce_label {
+    unsigned int end;
+    uint32_t label;
+};
+
+
+int bins_lower_ce (struct list * binslist) {
+    unsigned int size = list_length(binslist);
+
+    /* new labels come after every label the block has */
+    uint32_t label = 0;
+    struct list_it * it;
+    for (it = list_it(binslist); it != NULL; it = list_it_next(it)) {
+        struct bins * bins = list_it_data(it);
+        if (    ((bins->op == BOP_LABEL) || bins_is_branch(bins))
+             && (bins_target(bins) >= label))
+            label = bins_target(bins) + 1;
+    }
+
+    /* the labels still to place, one for each BOP_CE */
+    struct bins_ce_label * pending = malloc(sizeof(struct bins_ce_label)
+                                            * (size + 1));
+    unsigned int pending_size = 0;
+    int error = 0;
+
+    unsigned int index = 0;
+    for (it = list_it(binslist); it != NULL; it = list_it_next(it)) {
+        struct bins * bins = list_it_data(it);
+        if (bins->op == BOP_CE) {
+            uint64_t end = index + boper_value(bins->oper[1]);
+            if (end >= size) {
+                error = -1;
+                break;
+            }
+            bins->op = BOP_BRZ;
+            ODEL(bins->oper[1]);
+            bins->oper[1] = boper_constant(32, label);
+            pending[pending_size].end = end;
+            pending[pending_size].label = label++;
+            pending_size++;
+        }
+
+        unsigned int i = 0;
+        while (i < pending_size) {
+            if (pending[i].end == index) {
+                list_it_append_(binslist, it, bins_label(pending[i].label));
+                it = list_it_next(it);
+                pending[i] = pending[--pending_size];
+            }
+            else
+                i++;
+        }
+        index++;
+    }
+
+    free(pending);
+    return error;
+}
+
+
 
 struct list * bins_ror (const struct boper * dst,
                         const struct boper * operand,
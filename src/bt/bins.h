@@ -10,6 +10,7 @@
 
 
 #include "container/list.h"
+#include "container/symtab.h"
 #include "object.h"
 
 #include <stdint.h>
@@ -45,11 +46,15 @@ enum {
     BOP_TRUN,
 
     /* Memory read/write instructions */
-    /* stores 8-bit value oper[1] in the address given by oper[0] */
+    /* stores value oper[1], of 8, 16, 32 or 64 bits, little-endian in the
+       address given by oper[0] */
     BOP_STORE,
-    /* loads 8-bit value at address given by oper[1] into variable given by
-       oper[1] */
+    /* loads the little-endian value at address given by oper[1] into
+       variable given by oper[0], of 8, 16, 32 or 64 bits */
     BOP_LOAD,
+    /* BOP_STORE and BOP_LOAD, big-endian */
+    BOP_STOREBE,
+    BOP_LOADBE,
 
     /* Conditionally Execute the next instruction.
     *  The first operand is a 1-byte flag. If the flag is equal to 0, we skip
@@ -57,12 +62,32 @@ enum {
     *  instructions.
     *  The second operand is the number of instructions to execute, and is an
     *  8-bit constant.
+    *  BOP_CE is shorthand for translators. bins_lower_ce rewrites it as a
+    *  BOP_BRZ and a BOP_LABEL before the block goes any further, and nothing
+    *  after the translator accepts it.
     */
     BOP_CE,
 
+    /* Branches within a block.
+    *  Labels are 32-bit constants, each marked by one BOP_LABEL in the
+    *  block, and branches only go forward, to a label after them.
+    *  BOP_LABEL marks where branches to label oper[0] continue.
+    *  BOP_BRZ continues at label oper[1] if oper[0] is 0.
+    *  BOP_BR continues at label oper[0].
+    */
+    BOP_LABEL,
+    BOP_BRZ,
+    BOP_BR,
+
     /* HLT instruction */
     BOP_HLT,
 
+    /* Charges oper[0], a 64-bit constant, to the guest's fuel. If the fuel
+    *  left is less than oper[0], the block stops before doing anything and
+    *  returns 4, leaving the fuel as it was. See jit_execute_fuel.
+    */
+    BOP_FUEL,
+
     /* Auxiliary instructions with no semantic meaning */
     BOP_COMMENT,
     BOP_HOOK
@@ -71,7 +96,11 @@ enum {
 
 enum {
     BOPER_VARIABLE = 0,
-    BOPER_CONSTANT
+    BOPER_CONSTANT,
+    /* A variable local to the block it is in. Blocks write temporaries
+       before they read them, and nothing reads them after the block, or in
+       hooks, so targets may keep them anywhere. */
+    BOPER_TEMPORARY
 };
 
 
@@ -79,7 +108,10 @@ struct boper {
     struct object_header oh;
     unsigned int type;
     unsigned int bits;
+    /* the interned identifier, and its symtab id, or NULL and SYMTAB_NONE
+       for constants */
     const char * identifier;
+    unsigned int id;
     uint64_t value;
 };
 
@@ -97,9 +129,11 @@ struct bins {
 * boper_variable or boper_constant, which will in turn call this function.
 * @param type The type of the boper.
 * @param bits The size of the boper in bits.
-* @param identifier The identifier if the boper, if required.
+* @param identifier The identifier if the boper, if required. It is interned
+*                   in the symtab.
 * @param value The value of the boper, if required.
-* @return An instantiated and initialized boper.
+* @return An instantiated and initialized boper, or NULL if identifier could
+*         not be interned.
 */
 struct boper * boper_create (unsigned int type,
                              unsigned int bits,
@@ -114,6 +148,14 @@ struct boper * boper_create (unsigned int type,
 */
 struct boper * boper_variable (unsigned int bits, const char * identifier);
 
+/**
+* Creates a boper temporary, see BOPER_TEMPORARY.
+* @param bits The size of the temporary in bits.
+* @param identifier The textual identifier of the temporary.
+* @return The resulting boper temporary.
+*/
+struct boper * boper_temporary (unsigned int bits, const char * identifier);
+
 /**
 * Creates a boper constant.
 * @param bits The size of the constant in bits.
@@ -136,8 +178,9 @@ void boper_delete (struct boper * boper);
 struct boper * boper_copy (const struct boper * boper);
 
 /**
-* Compares a boper based on the boper's identifier. Allows bopers to be added
-* to containers which require a cmp method, such as trees.
+* Compares a boper based on the boper's type, bits, and then value or
+* identifier id. Allows bopers to be added to containers which require a cmp
+* method, such as trees. Variables are ordered by id, not by name.
 * @param lhs The left-hand side of the comparison.
 * @param rhs The right-hand size of the comparison.
 * @return -1 if lhs < rhs, 1 if lhs > rhs, or 0 if lhs == rhs.
@@ -148,6 +191,7 @@ int boper_cmp (const struct boper * lhs, const struct boper * rhs);
 char * boper_string (const struct boper * boper);
 unsigned int boper_type       (const struct boper * boper);
 const char * boper_identifier (const struct boper * boper);
+unsigned int boper_id         (const struct boper * boper);
 unsigned int boper_bits       (const struct boper * boper);
 uint64_t     boper_value      (const struct boper * boper);
 
@@ -198,12 +242,34 @@ BINS_2OP_DECL(sext)
 BINS_2OP_DECL(zext)
 BINS_2OP_DECL(trun)
 BINS_2OP_DECL(load)
+BINS_2OP_DECL(storebe)
+BINS_2OP_DECL(loadbe)
 BINS_2OP_DECL(store)
 BINS_2OP_DECL(ce)
 
 struct bins * bins_hlt     ();
+struct bins * bins_fuel    (uint64_t cost);
 struct bins * bins_comment ();
 struct bins * bins_hook    (void (* hook) (void *));
+struct bins * bins_label   (uint32_t label);
+struct bins * bins_br      (uint32_t label);
+struct bins * bins_brz     (const struct boper * flag, uint32_t label);
+struct bins * bins_brz_    (struct boper * flag, uint32_t label);
+
+/* Returns the label a BOP_LABEL marks, or a BOP_BRZ or BOP_BR goes to */
+uint32_t bins_target (const struct bins * bins);
+
+/* Returns 1 if bins is a BOP_BRZ or BOP_BR */
+int bins_is_branch (const struct bins * bins);
+
+/**
+* Rewrites every BOP_CE of a block as a BOP_BRZ to a BOP_LABEL after the
+* instructions it covers, with labels the block does not use yet.
+* @param binslist The bins of the block, rewritten in place.
+* @return 0 on success, non-zero if a BOP_CE covers instructions past the end
+*         of the block.
+*/
+int bins_lower_ce (struct list * binslist);
 
 /*
 * These are convenience functions, or macro instructions. All convenience/macro
@@ -16,12 +16,20 @@ struct btse_var * btse_var_create (unsigned int type) {
     object_init(&(bv->oh), &btse_var_vtable);
     bv->type = type;
     bv->identifier = NULL;
+    bv->id = SYMTAB_NONE;
     bv->lhs = NULL;
     bv->rhs = NULL;
     return bv;
 }
 
 
+/* Interns identifier as the identifier of bv */
+static void btse_var_identify (struct btse_var * bv, const char * identifier) {
+    bv->id = symtab_id(identifier);
+    bv->identifier = symtab_name(bv->id);
+}
+
+
 struct btse_var * btse_var_constant (unsigned int bits, uint64_t value) {
     struct btse_var * bv = btse_var_create(BTSE_VAR_CONSTANT);
     bv->bits = bits;
@@ -34,7 +42,7 @@ struct btse_var * btse_var_variable (const char * identifier,
                                      unsigned int bits,
                                      uint64_t value) {
     struct btse_var * bv = btse_var_create(BTSE_VAR_VARIABLE);
-    bv->identifier = strdup(identifer);
+    btse_var_identify(bv, identifier);
     bv->bits = bits;
     uint64_t mask = (1 << bits) - 1;
     bv->value = value & mask;
@@ -46,7 +54,7 @@ struct btse_var * btse_var_symbolic (const char * identifier,
                                      unsigned int bits) {
     struct btse_var * bv = btse_var_create(BTSE_VAR_SYMBOLIC);
     if (identifier != NULL)
-        bv->identifier = strdup(identifier);
+        btse_var_identify(bv, identifier);
     bv->bits = bits;
     return bv;
 }
@@ -60,8 +68,8 @@ struct btse_var * btse_var_expression_ (unsigned int op,
     struct btse_var * op = btse_var_create(BTSE_VAR_EXPRESSION);
     bv->op = op;
     bv->bits = bits;
-    if (bv->identifier != NULL)
-        bv->identifier = strdup(bv->identifier);
+    if (identifier != NULL)
+        btse_var_identify(bv, identifier);
     bv->lhs = lhs;
     bv->rhs = rhs;
     return bv;
@@ -82,8 +90,6 @@ struct btse_var * btse_var_expression (unsigned int op,
 
 
 void btse_var_delete (struct btse_var * bv) {
-    if (bv->identifier != NULL)
-        free(bv->identifier);
     if (bv->lhs != NULL)
         ODEL(bv->lhs);
     if (bv->rhs != NULL)
@@ -108,7 +114,11 @@ struct btse_var * btse_var_copy (const struct btse_var * bv) {
 
 
 int btse_var_cmp (const struct btse_var * lhs, const struct btse_var * rhs) {
-    return strcmp(lhs->identifier, rhs->identifier);
+    if (lhs->id < rhs->id)
+        return -1;
+    else if (lhs->id > rhs->id)
+        return 1;
+    return 0;
 }
 
 
@@ -177,6 +187,8 @@ struct btse * btse_create (struct memmap * memmap) {
     btse->vars = tree_create();
     btse->symmem = tree_create();
     btse->memmap = OCOPY(memmap);
+    btse->skipping = 0;
+    btse->label = 0;
     return btse;
 }
 
@@ -195,6 +207,8 @@ struct btse * btse_copy (const struct btse * btse) {
     ODEL(copy->symmem);
     copy->vars = OCOPY(btse->vars);
     copy->symmem = OCOPY(btse->symmem);
+    copy->skipping = btse->skipping;
+    copy->label = btse->label;
     return copy;
 }
 
@@ -226,7 +240,8 @@ struct btse_var * btse_var_boper (struct btse * btse,
                                   const struct boper * boper) {
     if (boper_type(boper) == BOPER_CONSTANT)
         return btse_var_constant(boper_bits(boper), boper_value(boper));
-    else if (boper_type(boper) == BOPER_VARIABLE) {
+    else if (    (boper_type(boper) == BOPER_VARIABLE)
+              || (boper_type(boper) == BOPER_TEMPORARY)) {
         struct btse_var * tmp = btse_var_symbolic(boper_identifier(boper),
                                                   boper_bits(boper));
         struct btse_var * bv = tree_fetch(btse, tmp);
@@ -243,6 +258,13 @@ struct btse_var * btse_var_boper (struct btse * btse,
 
 
 int btse_execute (struct btse * btse, struct bins * bins) {
+    /* branches only go forward, so skip until the label we branched to */
+    if (btse->skipping) {
+        if ((bins->op == BOP_LABEL) && (bins_target(bins) == btse->label))
+            btse->skipping = 0;
+        return 0;
+    }
+
     switch (bins->op) {
     case BOP_ADD :
     case BOP_SUB :
@@ -411,10 +433,35 @@ int btse_execute (struct btse * btse, struct bins * bins) {
         ODEL(src);
         break;
     }
-    /* TODO, LOAD/STORE methods */
-    case BOP_STORE : {
-        struct btse_var * address = btse_var_boper(btse, bins->oper[0]);
-        struct btse_var * value = btse_var_boper(btse, bins->oper[1]);
+    /* Memory is not modelled, so whatever a load reads, of any width or
+       endianness, is a new symbolic value, and stores have no effect. */
+    case BOP_LOAD :
+    case BOP_LOADBE :
+        btse_var_set_(btse,
+                      btse_var_symbolic(boper_identifier(bins->oper[0]),
+                                        boper_bits(bins->oper[0])));
+        break;
+    case BOP_STORE :
+    case BOP_STOREBE :
+        break;
+    case BOP_BRZ : {
+        struct btse_var * flag = btse_var_boper(btse, bins->oper[0]);
+        if (    (btse_var_type(flag) == BTSE_VAR_SYMBOLIC)
+             || (btse_var_type(flag) == BTSE_VAR_EXPRESSION)) {
+            ODEL(flag);
+            return -1;
+        }
+        if (btse_var_value(flag) == 0) {
+            btse->skipping = 1;
+            btse->label = bins_target(bins);
+        }
+        ODEL(flag);
+        break;
     }
+    case BOP_BR :
+        btse->skipping = 1;
+        btse->label = bins_target(bins);
+        break;
     }
+    return 0;
 }
@@ -1,7 +1,9 @@
 #ifndef btse_HEADER
 #define btse_HEADER
 
+#include "bins.h"
 #include "memmap.h"
+#include "symtab.h"
 #include "tree.h"
 
 #include <inttypes.h>
@@ -38,7 +40,9 @@ enum {
 
 struct btse_var {
     struct object_header oh;
-    char * identifier;
+    /* the interned identifier, and its symtab id, or NULL and SYMTAB_NONE */
+    const char * identifier;
+    unsigned int id;
     unsigned int bits;
     unsigned int type;
     union {
@@ -86,7 +90,7 @@ struct btse_var * btse_var_symbolic (const char * identifier,
 *
 * @param op The op performed by this expression. One of BTSE_OP_*.
 * @param bits The size of the expression's result in bits.
-* @param identifier An optional identifier. This will be copied. If no
+* @param identifier An optional identifier. This will be interned. If no
 *                   identifier is necessary, this may be set to NULL.
 * @param lhs The left-hand side of the expression. This will not be copied.
 * @param rhs The right-hand side of the expression. This will not be copied.
@@ -120,6 +124,9 @@ struct btse {
     struct tree * vars;
     struct tree * symmem;
     struct memmap * memmap;
+    /* set after a branch was taken, until the BOP_LABEL of label */
+    int skipping;
+    uint32_t label;
 };
 
 
@@ -130,6 +137,12 @@ struct btse * btse_copy   (const struct btse * btse);
 int btse_var_set_ (struct btse * btse, struct btse_var * bv);
 int btse_var_set  (struct btse * btse, const struct btse_var * bv);
 
+/*
+* Executes one bins. Blocks are given one bins after another, and those
+* between a taken branch and its label are skipped.
+* @return 0 on success, non-zero if bins branches on a flag which is not
+*         concrete.
+*/
 int btse_execute (struct btse * btse, struct bins * bins);
 
 #endif
@@ -0,0 +1,151 @@
+#include "ir.h"
+
+#include <string.h>
+
+const struct object_vtable ir_vtable = {
+    (void (*) (void *)) ir_delete,
+    (void * (*) (const void *)) ir_copy,
+    NULL
+};
+
+/*
+* An open addressed hash table of the operands added to an ir so far. It is
+* only needed while the ir is built, but comes from its arena all the same, so
+* building an ir takes a handful of allocations whatever the size of the
+* block.
+*/
+struct ir_tables {
+    struct boper ** opers;
+    unsigned int mask;
+};
+
+
+/* Returns ir's operand equal to boper, adding it if there isn't one */
+static struct boper * ir_oper (struct ir * ir,
+                               struct ir_tables * tables,
+                               const struct boper * boper) {
+    if (boper == NULL)
+        return NULL;
+
+    uint64_t hash = boper->type * 31 + boper->bits;
+    if (boper->type == BOPER_CONSTANT)
+        hash ^= boper->value;
+    else
+        hash ^= (uint64_t) boper->id << 8;
+    hash *= 0x9e3779b97f4a7c15ULL;
+
+    unsigned int slot = (hash >> 32) & tables->mask;
+    while (tables->opers[slot] != NULL) {
+        if (boper_cmp(tables->opers[slot], boper) == 0)
+            return tables->opers[slot];
+        slot = (slot + 1) & tables->mask;
+    }
+
+    /* identifiers are interned in the symtab, and outlive the ir */
+    struct boper * oper = &(ir->opers[ir->opers_size++]);
+    object_init(&(oper->oh), NULL);
+    oper->type = boper->type;
+    oper->bits = boper->bits;
+    oper->identifier = boper->identifier;
+    oper->id = boper->id;
+    oper->value = boper->value;
+    tables->opers[slot] = oper;
+    return oper;
+}
+
+
+/* Creates an ir with room for size bins, and tables to fill it with */
+static struct ir * ir_alloc (unsigned int size, struct ir_tables * tables) {
+    struct ir * ir = malloc(sizeof(struct ir));
+    object_init(&(ir->oh), &ir_vtable);
+    ir->arena = arena_create();
+    ir->size = 0;
+    ir->opers_size = 0;
+
+    /* each bins has at most three distinct operands, and the tables are
+       kept at most half full */
+    unsigned int slots = 8;
+    while (slots < size * 6)
+        slots <<= 1;
+
+    ir->bins = arena_alloc(ir->arena, sizeof(struct bins) * (size + 1));
+    ir->targets = arena_alloc(ir->arena, sizeof(unsigned int) * (size + 1));
+    ir->opers = arena_alloc(ir->arena, sizeof(struct boper) * (size * 3 + 1));
+    tables->opers = arena_alloc(ir->arena, sizeof(struct boper *) * slots);
+    memset(tables->opers, 0, sizeof(struct boper *) * slots);
+    tables->mask = slots - 1;
+    return ir;
+}
+
+
+static void ir_append (struct ir * ir,
+                       struct ir_tables * tables,
+                       const struct bins * bins) {
+    struct bins * flat = &(ir->bins[ir->size++]);
+    object_init(&(flat->oh), NULL);
+    flat->op = bins->op;
+    flat->hook = bins->hook;
+    unsigned int i;
+    for (i = 0; i < 3; i++)
+        flat->oper[i] = ir_oper(ir, tables, bins->oper[i]);
+}
+
+
+/* Finds the label each branch of ir goes to */
+static void ir_link (struct ir * ir) {
+    unsigned int i;
+    for (i = 0; i < ir->size; i++) {
+        ir->targets[i] = IR_NONE;
+        if (! bins_is_branch(&(ir->bins[i])))
+            continue;
+        uint32_t label = bins_target(&(ir->bins[i]));
+        unsigned int j;
+        for (j = i + 1; j < ir->size; j++) {
+            if (    (ir->bins[j].op == BOP_LABEL)
+                 && (bins_target(&(ir->bins[j])) == label)) {
+                ir->targets[i] = j;
+                break;
+            }
+        }
+    }
+}
+
+
+struct ir * ir_create (struct list * btins_list) {
+    struct ir_tables tables;
+    struct ir * ir = ir_alloc(list_length(btins_list), &tables);
+
+    struct list_it * it;
+    for (it = list_it(btins_list); it != NULL; it = list_it_next(it))
+        ir_append(ir, &tables, list_it_data(it));
+    ir_link(ir);
+
+    return ir;
+}
+
+
+void ir_delete (struct ir * ir) {
+    ODEL(ir->arena);
+    free(ir);
+}
+
+
+struct ir * ir_copy (const struct ir * ir) {
+    struct ir_tables tables;
+    struct ir * copy = ir_alloc(ir->size, &tables);
+
+    unsigned int i;
+    for (i = 0; i < ir->size; i++)
+        ir_append(copy, &tables, &(ir->bins[i]));
+    memcpy(copy->targets, ir->targets, sizeof(unsigned int) * ir->size);
+
+    return copy;
+}
+
+
+unsigned int ir_index (const struct ir * ir, const struct boper * boper) {
+    if (    (boper < ir->opers)
+         || (boper >= &(ir->opers[ir->opers_size])))
+        return IR_NONE;
+    return boper - ir->opers;
+}
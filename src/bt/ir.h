@@ -0,0 +1,79 @@
+#ifndef ir_HEADER
+#define ir_HEADER
+
+/*
+* A block's bins laid out flat, for the passes which walk a finished block
+* many times, like assembly.
+*
+* Translators, hooks and opt build and edit a block as a list of bins. Once
+* the list is final, ir_create copies it into one array of bins, and every
+* distinct operand of the block into one array of bopers, both allocated from
+* an arena which goes in one shot with the ir. Operands which compare equal
+* with boper_cmp are the same entry of opers, so passes compare operands by
+* their index, or pointer, instead of by identifier.
+*
+* The bins and bopers of an ir are not objects of their own. Read them, but
+* never ODEL, OCOPY or change them.
+*
+* The ir does not make translation any cheaper. Translators still allocate
+* every bins, boper and list node of a block, and ir_create allocates its
+* arena's chunks on top of those. What the ir saves is work in the passes
+* after it, such as the register allocator finding a variable by its index
+* instead of comparing it against every other operand of the block.
+*/
+
+#include "bt/bins.h"
+#include "container/arena.h"
+#include "container/list.h"
+#include "object.h"
+
+/* ir_index of an operand which is not in the ir */
+#define IR_NONE ((unsigned int) -1)
+
+struct ir {
+    struct object_header oh;
+    struct arena * arena;
+    /* the bins of the block, in order */
+    struct bins * bins;
+    unsigned int size;
+    /* the distinct operands of the block, in the order they first appear */
+    struct boper * opers;
+    unsigned int opers_size;
+    /* for each bins which is a branch, the index of the BOP_LABEL it goes
+       to, or IR_NONE if there is no such label after it */
+    unsigned int * targets;
+};
+
+
+/**
+* Creates an ir of a block.
+* @param btins_list The bins of the block. The ir copies what it needs, so
+*                   the list may be deleted after.
+* @return The ir of btins_list.
+*/
+struct ir * ir_create (struct list * btins_list);
+
+/**
+* Deletes an ir, and its arena with everything in it. Don't call this, call
+* ODEL().
+* @param ir The ir to delete.
+*/
+void ir_delete (struct ir * ir);
+
+/**
+* Copies an ir. Don't call this, call OCOPY().
+* @param ir The ir to copy.
+* @return A copy of ir, with an arena of its own.
+*/
+struct ir * ir_copy (const struct ir * ir);
+
+/**
+* Gets the index of an operand in ir->opers.
+* @param ir The ir the operand is in.
+* @param boper An operand of one of ir's bins.
+* @return The index of boper in ir->opers, or IR_NONE if boper is not one of
+*         ir's operands.
+*/
+unsigned int ir_index (const struct ir * ir, const struct boper * boper);
+
+#endif
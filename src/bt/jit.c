@@ -3,6 +3,7 @@
 #include "btlog.h"
 #include "bt/bins.h"
 #include "container/byte_buf.h"
+#include "container/uint64.h"
 #include "hooks.h"
 
 #include <stdio.h>
@@ -19,28 +20,55 @@ const struct object_vtable jit_block_vtable = {
 
 
 struct jit_block * jit_block_create (uint64_t vaddr,
+                                     unsigned int region,
                                      size_t mm_offset,
                                      size_t size) {
     struct jit_block * jit_block = malloc(sizeof(struct jit_block));
 
     object_init(&(jit_block->oh), &jit_block_vtable);
     jit_block->vaddr = vaddr;
+    jit_block->region = region;
     jit_block->mm_offset = mm_offset;
     jit_block->size = size;
+    memset(jit_block->chain_vaddr, 0, sizeof(jit_block->chain_vaddr));
+    jit_block->chain_used = 0;
+    jit_block->incoming = list_create();
+    jit_block->tier0 = NULL;
+    jit_block->count = 0;
+    jit_block->guest_size = 0;
+    jit_block->deps_vaddr = vaddr;
+    jit_block->deps_size = 0;
 
     return jit_block;
 }
 
 
 void jit_block_delete (struct jit_block * jit_block) {
+    ODEL(jit_block->incoming);
+    if (jit_block->tier0 != NULL)
+        ODEL(jit_block->tier0);
     free(jit_block);
 }
 
 
 struct jit_block * jit_block_copy (const struct jit_block * jit_block) {
-    return jit_block_create(jit_block->vaddr,
-                            jit_block->mm_offset,
-                            jit_block->size);
+    struct jit_block * copy = jit_block_create(jit_block->vaddr,
+                                               jit_block->region,
+                                               jit_block->mm_offset,
+                                               jit_block->size);
+    memcpy(copy->chain_vaddr,
+           jit_block->chain_vaddr,
+           sizeof(jit_block->chain_vaddr));
+    copy->chain_used = jit_block->chain_used;
+    ODEL(copy->incoming);
+    copy->incoming = OCOPY(jit_block->incoming);
+    if (jit_block->tier0 != NULL)
+        copy->tier0 = OCOPY(jit_block->tier0);
+    copy->count = jit_block->count;
+    copy->guest_size = jit_block->guest_size;
+    copy->deps_vaddr = jit_block->deps_vaddr;
+    copy->deps_size = jit_block->deps_size;
+    return copy;
 }
 
 
@@ -53,6 +81,83 @@ int jit_block_cmp (const struct jit_block * lhs, const struct jit_block * rhs) {
 }
 
 
+const struct object_vtable jit_flags_vtable = {
+    (void (*) (void *))                    jit_flags_delete,
+    (void * (*) (const void *))            jit_flags_copy,
+    (int (*) (const void *, const void *)) jit_flags_cmp
+};
+
+
+/* Takes ownership of written */
+struct jit_flags * jit_flags_create (uint64_t vaddr,
+                                     const void * bytes,
+                                     size_t size,
+                                     struct list * written) {
+    struct jit_flags * jit_flags = malloc(sizeof(struct jit_flags));
+
+    object_init(&(jit_flags->oh), &jit_flags_vtable);
+    jit_flags->vaddr = vaddr;
+    jit_flags->bytes = malloc(size);
+    memcpy(jit_flags->bytes, bytes, size);
+    jit_flags->size = size;
+    jit_flags->written = written;
+
+    return jit_flags;
+}
+
+
+void jit_flags_delete (struct jit_flags * jit_flags) {
+    ODEL(jit_flags->written);
+    free(jit_flags->bytes);
+    free(jit_flags);
+}
+
+
+struct jit_flags * jit_flags_copy (const struct jit_flags * jit_flags) {
+    return jit_flags_create(jit_flags->vaddr,
+                            jit_flags->bytes,
+                            jit_flags->size,
+                            OCOPY(jit_flags->written));
+}
+
+
+int jit_flags_cmp (const struct jit_flags * lhs, const struct jit_flags * rhs) {
+    if (lhs->vaddr < rhs->vaddr)
+        return -1;
+    else if (lhs->vaddr > rhs->vaddr)
+        return 1;
+    return 0;
+}
+
+
+const struct object_vtable jit_link_vtable = {
+    (void (*) (void *))          jit_link_delete,
+    (void * (*) (const void *))  jit_link_copy,
+    NULL
+};
+
+
+struct jit_link * jit_link_create (uint64_t vaddr, unsigned int slot) {
+    struct jit_link * jit_link = malloc(sizeof(struct jit_link));
+
+    object_init(&(jit_link->oh), &jit_link_vtable);
+    jit_link->vaddr = vaddr;
+    jit_link->slot = slot;
+
+    return jit_link;
+}
+
+
+void jit_link_delete (struct jit_link * jit_link) {
+    free(jit_link);
+}
+
+
+struct jit_link * jit_link_copy (const struct jit_link * jit_link) {
+    return jit_link_create(jit_link->vaddr, jit_link->slot);
+}
+
+
 const struct object_vtable jit_vtable = {
     (void (*) (void *))          jit_delete,
     (void * (*) (const void *))  jit_copy,
@@ -66,14 +171,36 @@ struct jit * jit_create (const struct arch_source * arch_source,
     struct jit * jit = malloc(sizeof(struct jit));
 
     object_init(&(jit->oh), &jit_vtable);
+    pthread_mutex_init(&(jit->lock), NULL);
+    pthread_cond_init(&(jit->cond), NULL);
+    jit->active = 0;
+    jit->stopping = 0;
     jit->blocks = tree_create();
-    jit->mmap_mem = mmap(NULL,
-                         INITIAL_MMAP_SIZE,
-                         PROT_EXEC | PROT_READ | PROT_WRITE,
-                         MAP_PRIVATE | MAP_ANONYMOUS,
-                         -1, 0);
-    jit->mmap_size = INITIAL_MMAP_SIZE;
-    jit->mmap_next = 0;
+    jit->lookup = calloc(JIT_LOOKUP_SIZE, sizeof(struct jit_lookup));
+    jit->regions = NULL;
+    jit->regions_size = 0;
+    jit->dispatcher = NULL;
+    jit->dispatcher_size = 0;
+    jit->pool = NULL;
+    jit->tier_target = NULL;
+    jit->tier_threshold = 0;
+    jit->cache = NULL;
+    jit->fuel_unit = JIT_FUEL_BLOCKS;
+    jit->opt_passes = OPT_ALL;
+    jit->deps_reach = 0;
+    jit->guest_reach = 0;
+    jit->flags = tree_create();
+    jit->perf = NULL;
+    jit->retired = list_create();
+    jit->layout = list_create();
+    jit->layout_size = 0;
+    jit->code_granules = tree_create();
+    jit->code_log = NULL;
+    jit->code_log_size = 0;
+    jit->code_log_end = 0;
+    jit->region = 0;
+    jit->code_cap = JIT_DEFAULT_CODE_CAP;
+    memset(&(jit->stats), 0, sizeof(jit->stats));
 
     jit->arch_source = arch_source;
     jit->arch_target = arch_target;
@@ -84,157 +211,1679 @@ struct jit * jit_create (const struct arch_source * arch_source,
 
 
 void jit_delete (struct jit * jit) {
-    munmap(jit->mmap_mem, jit->mmap_size);
+    unsigned int i;
+    for (i = 0; i < jit->regions_size; i++)
+        munmap(jit->regions[i].mem, jit->regions[i].size);
+    free(jit->regions);
+    if (jit->dispatcher != NULL)
+        munmap(jit->dispatcher, jit->dispatcher_size);
+    if (jit->pool != NULL)
+        ODEL(jit->pool);
+    if (jit->cache != NULL)
+        ODEL(jit->cache);
+    if (jit->perf != NULL)
+        ODEL(jit->perf);
     ODEL(jit->blocks);
+    ODEL(jit->flags);
+    ODEL(jit->retired);
+    ODEL(jit->layout);
+    ODEL(jit->code_granules);
+    free(jit->code_log);
+    free(jit->lookup);
+    pthread_mutex_destroy(&(jit->lock));
+    pthread_cond_destroy(&(jit->cond));
     free(jit);
 }
 
 
 struct jit * jit_copy (const struct jit * jit) {
     struct jit * copy = malloc(sizeof(struct jit));
+    pthread_mutex_lock((pthread_mutex_t *) &(jit->lock));
 
     object_init(&(copy->oh), &jit_vtable);
+    pthread_mutex_init(&(copy->lock), NULL);
+    pthread_cond_init(&(copy->cond), NULL);
+    copy->active = 0;
+    copy->stopping = 0;
     copy->blocks = OCOPY(jit->blocks);
-    copy->mmap_mem = mmap(NULL,
-                          jit->mmap_size,
-                          PROT_EXEC | PROT_READ | PROT_WRITE,
-                          MAP_PRIVATE | MAP_ANONYMOUS,
-                          -1, 0);
-    memcpy(copy->mmap_mem, jit->mmap_mem, jit->mmap_size);
-    copy->mmap_size = jit->mmap_size;
-    copy->mmap_size = jit->mmap_next;
+    copy->lookup = calloc(JIT_LOOKUP_SIZE, sizeof(struct jit_lookup));
+    copy->regions = malloc(sizeof(struct jit_region) * jit->regions_size);
+    copy->regions_size = jit->regions_size;
+    unsigned int i;
+    for (i = 0; i < jit->regions_size; i++) {
+        struct jit_region * region = &(copy->regions[i]);
+        region->mem = mmap(NULL,
+                           jit->regions[i].size,
+                           PROT_EXEC | PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+        memcpy(region->mem, jit->regions[i].mem, jit->regions[i].next);
+        region->size = jit->regions[i].size;
+        region->next = jit->regions[i].next;
+    }
+    copy->region = jit->region;
+    copy->dispatcher = NULL;
+    copy->dispatcher_size = 0;
+    copy->pool = NULL;
+    if (jit->pool != NULL)
+        copy->pool = OCOPY(jit->pool);
+    if (jit->dispatcher != NULL) {
+        copy->dispatcher = mmap(NULL,
+                                jit->dispatcher_size,
+                                PROT_EXEC | PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS,
+                                -1, 0);
+        memcpy(copy->dispatcher, jit->dispatcher, jit->dispatcher_size);
+        copy->dispatcher_size = jit->dispatcher_size;
+    }
+    copy->tier_target = jit->tier_target;
+    copy->tier_threshold = jit->tier_threshold;
+    copy->cache = NULL;
+    if (jit->cache != NULL)
+        copy->cache = OCOPY(jit->cache);
+    copy->fuel_unit = jit->fuel_unit;
+    copy->opt_passes = jit->opt_passes;
+    copy->deps_reach = jit->deps_reach;
+    copy->guest_reach = jit->guest_reach;
+    copy->flags = OCOPY(jit->flags);
+    copy->perf = NULL;
+    copy->retired = list_create();
+    copy->layout = OCOPY(jit->layout);
+    copy->layout_size = jit->layout_size;
+    copy->code_granules = OCOPY(jit->code_granules);
+    copy->code_log = malloc(sizeof(uint64_t) * jit->code_log_size);
+    memcpy(copy->code_log,
+           jit->code_log,
+           sizeof(uint64_t) * jit->code_log_size);
+    copy->code_log_size = jit->code_log_size;
+    copy->code_log_end = jit->code_log_end;
+    copy->code_cap = jit->code_cap;
+    copy->stats = jit->stats;
+
+    /* Chain slots in the copied code still jump into the original regions,
+       so start the copy with every block unchained. */
+    struct tree_it * tit;
+    for (tit = tree_it(copy->blocks); tit != NULL; tit = tree_it_next(tit)) {
+        struct jit_block * jit_block = tree_it_data(tit);
+        uint8_t * code = &(copy->regions[jit_block->region]
+                                .mem[jit_block->mm_offset]);
+        for (i = 0; i < CHAIN_SLOTS; i++) {
+            if ((jit_block->chain_used & (1 << i)) == 0)
+                continue;
+            jit->arch_target->unchain(
+                jit->arch_target->chain_slot(code, jit_block->size, i));
+        }
+        jit_block->chain_used = 0;
+        ODEL(jit_block->incoming);
+        jit_block->incoming = list_create();
+    }
 
     copy->arch_source = jit->arch_source;
     copy->arch_target = jit->arch_target;
     copy->platform = jit->platform;
 
+    pthread_mutex_unlock((pthread_mutex_t *) &(jit->lock));
     return copy;
 }
 
 
+static uint8_t * jit_block_code (const struct jit * jit,
+                                 const struct jit_block * jit_block) {
+    return &(jit->regions[jit_block->region].mem[jit_block->mm_offset]);
+}
+
+
+/* Takes the jit's lock, once no thread is waiting to stop the others */
+static void jit_lock (struct jit * jit) {
+    pthread_mutex_lock(&(jit->lock));
+    while (__atomic_load_n(&(jit->stopping), __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&(jit->cond), &(jit->lock));
+}
+
+
+static void jit_unlock (struct jit * jit) {
+    pthread_mutex_unlock(&(jit->lock));
+}
+
+
+/* Returns the vaddr in the header before code */
+static uint64_t jit_code_vaddr (const void * code) {
+    uint64_t vaddr;
+    memcpy(&vaddr,
+           (const uint8_t *) code - JIT_BLOCK_HEADER_SIZE,
+           sizeof(vaddr));
+    return vaddr;
+}
+
+
+/* Returns code for vaddr from the lookup table, or NULL. Takes no locks. */
+static const void * jit_lookup (struct jit * jit, uint64_t vaddr) {
+    struct jit_lookup * jl = &(jit->lookup[JIT_LOOKUP_HASH(vaddr)]);
+    const void * code = __atomic_load_n(&(jl->code), __ATOMIC_ACQUIRE);
+    if ((code != NULL) && (jit_code_vaddr(code) == vaddr))
+        return code;
+    return NULL;
+}
+
+
+static void jit_lookup_set (struct jit * jit,
+                            uint64_t vaddr,
+                            const void * code) {
+    struct jit_lookup * jl = &(jit->lookup[JIT_LOOKUP_HASH(vaddr)]);
+    __atomic_store_n(&(jl->code), code, __ATOMIC_RELEASE);
+}
+
+
+static void jit_lookup_clear (struct jit * jit) {
+    unsigned int i;
+    for (i = 0; i < JIT_LOOKUP_SIZE; i++)
+        __atomic_store_n(&(jit->lookup[i].code), NULL, __ATOMIC_RELEASE);
+}
+
+
+/* Restores chain slot n of jit_block, without touching any incoming list */
+static void jit_unchain_slot (struct jit * jit,
+                              struct jit_block * jit_block,
+                              unsigned int n) {
+    jit->arch_target->unchain(
+        jit->arch_target->chain_slot(jit_block_code(jit, jit_block),
+                                     jit_block->size,
+                                     n));
+    jit_block->chain_used &= ~(1 << n);
+}
+
+
+/* Unlinks every chain in the jit */
+static void jit_unchain_all (struct jit * jit) {
+    struct tree_it * tit;
+    for (tit = tree_it(jit->blocks); tit != NULL; tit = tree_it_next(tit)) {
+        struct jit_block * jit_block = tree_it_data(tit);
+        unsigned int i;
+        for (i = 0; i < CHAIN_SLOTS; i++) {
+            if (jit_block->chain_used & (1 << i))
+                jit_unchain_slot(jit, jit_block, i);
+        }
+        if (list_front(jit_block->incoming) != NULL) {
+            ODEL(jit_block->incoming);
+            jit_block->incoming = list_create();
+        }
+    }
+}
+
+
+/*
+* Waits, holding the lock, until no other thread is running code from the jit.
+* Threads running code return to jit_execute at their next block boundary once
+* every chain is unlinked and the lookup table is empty, and wait there until
+* jit_resume.
+*/
+static void jit_stop (struct jit * jit) {
+    __atomic_store_n(&(jit->stopping), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(jit->active), __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    jit_unchain_all(jit);
+    jit_lookup_clear(jit);
+    while (__atomic_load_n(&(jit->active), __ATOMIC_SEQ_CST) != 0)
+        pthread_cond_wait(&(jit->cond), &(jit->lock));
+}
+
+
+static void jit_resume (struct jit * jit) {
+    __atomic_store_n(&(jit->stopping), 0, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&(jit->cond));
+}
+
+
+/* Returns the variable holding how much of the layout varstore agrees with */
+static uint64_t * jit_layout_synced (struct varstore * varstore,
+                                     size_t layout_offset) {
+    uint8_t * data_buf = varstore_data_buf(varstore);
+    return (uint64_t *) &(data_buf[layout_offset]);
+}
+
+
+static void jit_leave (struct jit * jit) {
+    if (__atomic_sub_fetch(&(jit->active), 1, __ATOMIC_SEQ_CST) != 0)
+        return;
+    if (__atomic_load_n(&(jit->stopping), __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&(jit->lock));
+        pthread_cond_broadcast(&(jit->cond));
+        pthread_mutex_unlock(&(jit->lock));
+    }
+}
+
+
+/*
+* Marks this thread as running code from the jit, without taking the lock.
+* @param marked How much of the code log this thread's memmap has marked, see
+*               jit_code_replay.
+* @return 0 on success, non-zero if another thread is stopping the jit, the
+*         layout has changed since varstore was last synced with it, or code
+*         granules were logged since marked.
+*/
+static int jit_enter (struct jit * jit,
+                      struct varstore * varstore,
+                      size_t layout_offset,
+                      uint64_t marked) {
+    __atomic_add_fetch(&(jit->active), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(jit->stopping), __ATOMIC_SEQ_CST) == 0) {
+        size_t layout_size = __atomic_load_n(&(jit->layout_size),
+                                             __ATOMIC_ACQUIRE);
+        if (    (*jit_layout_synced(varstore, layout_offset) == layout_size)
+             && (varstore->next_offset == layout_size)
+             && (marked == __atomic_load_n(&(jit->code_log_end),
+                                           __ATOMIC_ACQUIRE)))
+            return 0;
+    }
+    jit_leave(jit);
+    return -1;
+}
+
+
+/* Adds the variables of varstore past the end of the layout to the layout */
+static void jit_layout_extend (struct jit * jit, struct varstore * varstore) {
+    struct tree_it * tit;
+    for (tit = tree_it(varstore->tree); tit != NULL; tit = tree_it_next(tit)) {
+        struct varstore_node * vn = tree_it_data(tit);
+        if (vn->offset < jit->layout_size)
+            continue;
+        /* keep the new variables ordered by offset */
+        struct list_it * it;
+        for (it = list_it(jit->layout); it != NULL; it = list_it_next(it)) {
+            struct varstore_node * next = list_it_data(it);
+            if (next->offset > vn->offset)
+                break;
+        }
+        if (it == NULL)
+            list_append(jit->layout, vn);
+        else
+            list_it_prepend(jit->layout, it, vn);
+    }
+
+    __atomic_store_n(&(jit->layout_size),
+                     varstore->next_offset,
+                     __ATOMIC_RELEASE);
+}
+
+
+/*
+* Makes varstore agree with the layout, creating every variable it is missing
+* at the offset the layout holds it at, and then adds the variables only
+* varstore has to the layout. Expects the lock to be held, by a thread which is
+* not running code.
+* @return 0 on success, non-zero if varstore holds a different variable where
+*         the layout holds one.
+*/
+static int jit_layout_sync (struct jit * jit,
+                            struct varstore * varstore,
+                            size_t layout_offset) {
+    /* varstore agreed with everything before synced last time */
+    uint64_t synced = *jit_layout_synced(varstore, layout_offset);
+
+    struct list_it * it;
+    for (it = list_it(jit->layout); it != NULL; it = list_it_next(it)) {
+        struct varstore_node * vn = list_it_data(it);
+        if (vn->offset < synced)
+            continue;
+        size_t offset;
+        if (varstore_offset_id(varstore, vn->id, vn->bits, &offset) == 0) {
+            if (offset != vn->offset)
+                return -1;
+        }
+        else if (varstore->next_offset == vn->offset)
+            varstore_insert_id(varstore, vn->id, vn->bits);
+        else
+            return -1;
+    }
+
+    /* Once a block using them is published, any thread may run into it
+       through a chain or the dispatcher, so wait for them all first. */
+    if (varstore->next_offset > jit->layout_size) {
+        jit_stop(jit);
+        jit_layout_extend(jit, varstore);
+        jit_resume(jit);
+    }
+    *jit_layout_synced(varstore, layout_offset) = jit->layout_size;
+    return 0;
+}
+
+
+/* Frees retired tier0 code, if no thread can be running it. Expects the lock
+   to be held. */
+static void jit_free_retired (struct jit * jit) {
+    if (list_front(jit->retired) == NULL)
+        return;
+    if (__atomic_load_n(&(jit->active), __ATOMIC_SEQ_CST) != 0)
+        return;
+    ODEL(jit->retired);
+    jit->retired = list_create();
+}
+
+
+void jit_set_code_cap (struct jit * jit, size_t code_cap) {
+    jit->code_cap = code_cap;
+}
+
+
+int jit_set_workers (struct jit * jit, unsigned int threads) {
+    if (jit->pool != NULL) {
+        ODEL(jit->pool);
+        jit->pool = NULL;
+    }
+    if (threads == 0)
+        return 0;
+
+    jit->pool = jit_pool_create(jit->arch_source, threads);
+    if (jit->pool == NULL)
+        return -1;
+    return 0;
+}
+
+
+void jit_set_opt (struct jit * jit, unsigned int passes) {
+    jit->opt_passes = passes;
+}
+
+
+void jit_set_fuel_unit (struct jit * jit, unsigned int fuel_unit) {
+    jit->fuel_unit = fuel_unit;
+}
+
+
+void jit_set_cache (struct jit * jit, const char * path) {
+    /* everything which decides what code a block assembles to */
+    uint64_t key = JIT_CACHE_HASH_INIT;
+    key = jit_cache_hash_symbol(key, jit->arch_source);
+    key = jit_cache_hash_symbol(key, jit->arch_target);
+    key = jit_cache_hash(key, &(jit->fuel_unit), sizeof(jit->fuel_unit));
+    key = jit_cache_hash(key, &(jit->opt_passes), sizeof(jit->opt_passes));
+    if (global_hooks != NULL) {
+        struct list_it * it;
+        for (it = list_it(global_hooks->hooks); it != NULL; it = list_it_next(it)) {
+            struct hook * hook = list_it_data(it);
+            key = jit_cache_hash_symbol(key, hook->hooks_api);
+        }
+    }
+
+    if (jit->cache != NULL)
+        ODEL(jit->cache);
+    jit->cache = jit_cache_create(path, key);
+}
+
+
+int jit_save_cache (struct jit * jit, const struct varstore * varstore) {
+    if (jit->cache == NULL)
+        return -1;
+    jit_lock(jit);
+    int error = jit_cache_save(jit->cache, varstore);
+    jit_unlock(jit);
+    return error;
+}
+
+
+int jit_set_perf (struct jit * jit, const char * prefix, unsigned int flags) {
+    jit_lock(jit);
+    if (jit->perf != NULL) {
+        ODEL(jit->perf);
+        jit->perf = NULL;
+    }
+    if (flags != 0) {
+        jit->perf = jit_perf_create(prefix, flags);
+        if (jit->perf == NULL) {
+            jit_unlock(jit);
+            return -1;
+        }
+        if (jit->dispatcher != NULL)
+            jit_perf_add(jit->perf,
+                         "jit_dispatcher",
+                         jit->dispatcher,
+                         jit->dispatcher_size);
+    }
+    jit_unlock(jit);
+    return 0;
+}
+
+
+void jit_set_tiering (struct jit * jit,
+                      const struct arch_target * tier_target,
+                      unsigned int threshold) {
+    jit->tier_target = tier_target;
+    jit->tier_threshold = threshold;
+}
+
+
+/*
+* Maps a new, empty region of at least size bytes. The last region under
+* code_cap gets whatever is left, so caps below JIT_REGION_SIZE still work.
+*/
+static int jit_region_map (struct jit * jit, size_t size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t region_size = JIT_REGION_SIZE;
+    if (size > region_size)
+        region_size = (size + page_size - 1) & ~(page_size - 1);
+
+    if (jit->stats.mapped + region_size > jit->code_cap) {
+        if (jit->stats.mapped >= jit->code_cap)
+            return -1;
+        region_size = (jit->code_cap - jit->stats.mapped) & ~(page_size - 1);
+        if ((region_size == 0) || (region_size < size))
+            return -1;
+    }
+
+    uint8_t * mem = mmap(NULL,
+                         region_size,
+                         PROT_EXEC | PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    if (mem == MAP_FAILED)
+        return -1;
+
+    jit->regions = realloc(jit->regions,
+                           sizeof(struct jit_region) * (jit->regions_size + 1));
+    jit->regions[jit->regions_size].mem = mem;
+    jit->regions[jit->regions_size].size = region_size;
+    jit->regions[jit->regions_size].next = 0;
+    jit->regions_size++;
+
+    jit->stats.regions = jit->regions_size;
+    jit->stats.mapped += region_size;
+
+    return 0;
+}
+
+
+static void jit_flush_locked (struct jit * jit) {
+    /* we are about to reuse the memory other threads are running */
+    jit_stop(jit);
+
+    /* Every chain is between two blocks we are about to drop, so restoring
+       the slots is only for the benefit of anything still holding code. */
+    jit_unchain_all(jit);
+
+    ODEL(jit->blocks);
+    jit->blocks = tree_create();
+    jit_lookup_clear(jit);
+
+    ODEL(jit->flags);
+    jit->flags = tree_create();
+
+    /* every run replays the log from its start */
+    ODEL(jit->code_granules);
+    jit->code_granules = tree_create();
+    jit->code_log_size = 0;
+    __atomic_store_n(&(jit->code_log_end),
+                     jit->code_log_end + 1,
+                     __ATOMIC_RELEASE);
+
+    unsigned int i;
+    for (i = 0; i < jit->regions_size; i++)
+        jit->regions[i].next = 0;
+    jit->region = 0;
+
+    jit_free_retired(jit);
+
+    jit->stats.used = 0;
+    jit->stats.wasted = 0;
+    jit->stats.flushes++;
+
+    BTLOG(BTLOG_JIT, BTLOG_INFO,
+          "[jit_flush] flush %u, %u regions, %zu bytes",
+          jit->stats.flushes, jit->stats.regions, jit->stats.mapped);
+
+    jit_resume(jit);
+}
+
+
+/*
+* Finds the region we should place size bytes in, moving on to the next region
+* or flushing the code cache as needed.
+* @return The index of the region, or -1 if size bytes will not fit.
+*/
+static int jit_region_reserve (struct jit * jit, size_t size) {
+    int flushed = 0;
+
+    while (1) {
+        if (jit->region < jit->regions_size) {
+            struct jit_region * region = &(jit->regions[jit->region]);
+            if (region->size - region->next >= size)
+                return jit->region;
+            /* we never come back to the rest of this region */
+            jit->stats.wasted += region->size - region->next;
+            jit->region++;
+            continue;
+        }
+
+        if (jit_region_map(jit, size) == 0)
+            continue;
+
+        if (flushed)
+            return -1;
+        jit_flush_locked(jit);
+        flushed = 1;
+    }
+}
+
+
+static int jit_set_code_locked (struct jit * jit,
+                                uint64_t vaddr,
+                                const void * code,
+                                size_t code_size) {
+    size_t size = JIT_BLOCK_HEADER_SIZE + code_size;
+    size_t aligned_size = (size + JIT_CODE_ALIGN - 1) & ~(JIT_CODE_ALIGN - 1);
+
+    int r = jit_region_reserve(jit, aligned_size);
+    if (r < 0)
+        return -1;
+    struct jit_region * region = &(jit->regions[r]);
+
+    memcpy(&(region->mem[region->next]), &vaddr, sizeof(vaddr));
+    size_t mm_offset = region->next + JIT_BLOCK_HEADER_SIZE;
+    memcpy(&(region->mem[mm_offset]), code, code_size);
+    region->next += aligned_size;
+
+    jit->stats.used += size;
+    jit->stats.wasted += aligned_size - size;
+
+    struct jit_block * jb = jit_block_create(vaddr, r, mm_offset, code_size);
+    tree_insert_(jit->blocks, jb);
+
+    if (jit->perf != NULL)
+        jit_perf_add_block(jit->perf,
+                           vaddr,
+                           &(region->mem[mm_offset]),
+                           code_size);
+
+    /* the code is in place before any thread can find it */
+    jit_lookup_set(jit, vaddr, &(region->mem[mm_offset]));
+
+    return 0;
+}
+
+
 int jit_set_code (struct jit * jit,
                   uint64_t vaddr,
                   const void * code,
                   size_t code_size) {
-    memcpy(&(jit->mmap_mem[jit->mmap_next]), code, code_size);
+    jit_lock(jit);
+    int error = jit_set_code_locked(jit, vaddr, code, code_size);
+    jit_unlock(jit);
+    return error;
+}
+
 
-    struct jit_block * jb = jit_block_create(vaddr, jit->mmap_next, code_size);
+static void jit_set_tier0_locked (struct jit * jit,
+                                  uint64_t vaddr,
+                                  const struct byte_buf * code) {
+    struct jit_block * jb = jit_block_create(vaddr, 0, 0, 0);
+    jb->tier0 = OCOPY(code);
+    jb->count = 1;
     tree_insert_(jit->blocks, jb);
+}
 
-    jit->mmap_next += (code_size + 0x100) & (~0xff);
 
-    return 0;
+void jit_set_tier0 (struct jit * jit,
+                    uint64_t vaddr,
+                    const struct byte_buf * code) {
+    jit_lock(jit);
+    jit_set_tier0_locked(jit, vaddr, code);
+    jit_unlock(jit);
 }
 
 
 const void * jit_get_code (struct jit * jit, uint64_t vaddr) {
+    const void * code = jit_lookup(jit, vaddr);
+    if (code != NULL)
+        return code;
+
+    jit_lock(jit);
+    struct jit_block * jit_block = jit_get_block(jit, vaddr);
+    if ((jit_block != NULL) && (jit_block->tier0 == NULL)) {
+        code = jit_block_code(jit, jit_block);
+        jit_lookup_set(jit, vaddr, code);
+    }
+    jit_unlock(jit);
+    return code;
+}
+
+
+struct jit_block * jit_get_block (struct jit * jit, uint64_t vaddr) {
     struct jit_block jb;
     object_init(&(jb.oh), &jit_block_vtable);
     jb.vaddr = vaddr;
-    struct jit_block * jit_block = tree_fetch(jit->blocks, &jb);
+    return tree_fetch(jit->blocks, &jb);
+}
+
+
+static int jit_chain_locked (struct jit * jit,
+                             uint64_t from_vaddr,
+                             uint64_t vaddr) {
+    if (jit->arch_target->chain == NULL)
+        return -1;
+
+    struct jit_block * from = jit_get_block(jit, from_vaddr);
+    struct jit_block * to = jit_get_block(jit, vaddr);
+    if ((from == NULL) || (to == NULL))
+        return -1;
+    if ((from->tier0 != NULL) || (to->tier0 != NULL))
+        return -1;
+
+    unsigned int i;
+    for (i = 0; i < CHAIN_SLOTS; i++) {
+        if (    (from->chain_used & (1 << i))
+             && (from->chain_vaddr[i] == vaddr))
+            return 0;
+    }
+
+    for (i = 0; i < CHAIN_SLOTS; i++) {
+        if ((from->chain_used & (1 << i)) == 0)
+            break;
+    }
+    if (i == CHAIN_SLOTS)
+        return -1;
+
+    void * slot = jit->arch_target->chain_slot(jit_block_code(jit, from),
+                                               from->size,
+                                               i);
+    if (slot == NULL)
+        return -1;
+    if (jit->arch_target->chain(slot, vaddr, jit_block_code(jit, to)))
+        return -1;
+
+    from->chain_vaddr[i] = vaddr;
+    from->chain_used |= 1 << i;
+    list_append_(to->incoming, jit_link_create(from_vaddr, i));
+
+    return 0;
+}
+
+
+int jit_chain (struct jit * jit, uint64_t from_vaddr, uint64_t vaddr) {
+    jit_lock(jit);
+    int error = jit_chain_locked(jit, from_vaddr, vaddr);
+    jit_unlock(jit);
+    return error;
+}
+
+
+static int jit_invalidate_locked (struct jit * jit, uint64_t vaddr) {
+    struct jit_block * jit_block = jit_get_block(jit, vaddr);
     if (jit_block == NULL)
+        return -1;
+
+    /* unlink every slot which jumps to this block */
+    struct list_it * it;
+    for (it = list_it(jit_block->incoming); it != NULL; it = list_it_next(it)) {
+        struct jit_link * jit_link = list_it_data(it);
+        struct jit_block * from = jit_get_block(jit, jit_link->vaddr);
+        if (from != NULL)
+            jit_unchain_slot(jit, from, jit_link->slot);
+    }
+
+    /* unlink this block's slots, and remove them from their targets */
+    unsigned int i;
+    for (i = 0; i < CHAIN_SLOTS; i++) {
+        if ((jit_block->chain_used & (1 << i)) == 0)
+            continue;
+        jit_unchain_slot(jit, jit_block, i);
+
+        struct jit_block * to = jit_get_block(jit, jit_block->chain_vaddr[i]);
+        if (to == NULL)
+            continue;
+        it = list_it(to->incoming);
+        while (it != NULL) {
+            struct jit_link * jit_link = list_it_data(it);
+            if ((jit_link->vaddr == vaddr) && (jit_link->slot == i))
+                it = list_it_remove(to->incoming, it);
+            else
+                it = list_it_next(it);
+        }
+    }
+
+    if (jit_block->tier0 == NULL) {
+        /* the entry may already hold another block which hashes alike */
+        struct jit_lookup * jl = &(jit->lookup[JIT_LOOKUP_HASH(vaddr)]);
+        if (jl->code == jit_block_code(jit, jit_block))
+            __atomic_store_n(&(jl->code), NULL, __ATOMIC_RELEASE);
+
+        size_t size = JIT_BLOCK_HEADER_SIZE + jit_block->size;
+        jit->stats.used -= size;
+        jit->stats.wasted += size;
+    }
+    else {
+        /* another thread may be running it */
+        list_append_(jit->retired, jit_block->tier0);
+        jit_block->tier0 = NULL;
+    }
+
+    struct jit_block needle;
+    object_init(&(needle.oh), &jit_block_vtable);
+    needle.vaddr = vaddr;
+    return tree_remove(jit->blocks, &needle);
+}
+
+
+int jit_invalidate (struct jit * jit, uint64_t vaddr) {
+    jit_lock(jit);
+    int error = jit_invalidate_locked(jit, vaddr);
+    jit_unlock(jit);
+    return error;
+}
+
+
+void jit_flush (struct jit * jit) {
+    jit_lock(jit);
+    jit_flush_locked(jit);
+    jit_unlock(jit);
+}
+
+
+unsigned int jit_invalidate_range (struct jit * jit,
+                                   uint64_t address,
+                                   size_t size) {
+    /* This is called from code which is running, so it must not wait for
+       a thread stopping the others. */
+    pthread_mutex_lock(&(jit->lock));
+
+    /* only blocks from guest_reach below address can reach it */
+    struct jit_block needle;
+    object_init(&(needle.oh), &jit_block_vtable);
+    needle.vaddr = 0;
+    if (address > jit->guest_reach)
+        needle.vaddr = address - jit->guest_reach;
+
+    /* blocks can't be removed from the tree while we walk it */
+    struct list * stale = list_create();
+    struct tree_it * tit;
+    for (tit = tree_it_at(jit->blocks, &needle);
+         tit != NULL;
+         tit = tree_it_next(tit)) {
+        struct jit_block * jit_block = tree_it_data(tit);
+        if (jit_block->vaddr >= address + size + jit->deps_reach)
+            break;
+        if (    (    (jit_block->vaddr >= address + size)
+                  || (jit_block->vaddr + jit_block->guest_size <= address))
+             && (    (jit_block->deps_vaddr >= address + size)
+                  || (jit_block->deps_vaddr + jit_block->deps_size <= address)))
+            continue;
+        list_append_(stale, uint64_create(jit_block->vaddr));
+    }
+    if (tit != NULL)
+        tree_it_delete(tit);
+
+    unsigned int invalidated = 0;
+    struct list_it * it;
+    for (it = list_it(stale); it != NULL; it = list_it_next(it)) {
+        struct uint64 * vaddr = list_it_data(it);
+        if (jit_invalidate_locked(jit, vaddr->value) == 0)
+            invalidated++;
+    }
+    ODEL(stale);
+
+    /* The write cleared the guest's marks on these pages, so blocks
+       translated from them again must be logged anew. */
+    struct uint64 * first;
+    first = uint64_create(address & ~((uint64_t) JIT_CODE_GRANULE - 1));
+    stale = list_create();
+    for (tit = tree_it_at(jit->code_granules, first);
+         tit != NULL;
+         tit = tree_it_next(tit)) {
+        struct uint64 * granule = tree_it_data(tit);
+        if (granule->value >= address + size)
+            break;
+        list_append_(stale, uint64_create(granule->value));
+    }
+    if (tit != NULL)
+        tree_it_delete(tit);
+    ODEL(first);
+    for (it = list_it(stale); it != NULL; it = list_it_next(it))
+        tree_remove(jit->code_granules, list_it_data(it));
+    ODEL(stale);
+
+    jit->stats.smc_invalidations += invalidated;
+
+    pthread_mutex_unlock(&(jit->lock));
+    return invalidated;
+}
+
+
+/* Called by the memmap when the guest writes to a page we translated from */
+static void jit_code_written (void * arg, uint64_t address, size_t size) {
+    struct jit * jit = arg;
+    unsigned int invalidated = jit_invalidate_range(jit, address, size);
+    BTLOG(BTLOG_JIT, BTLOG_DEBUG,
+          "[jit_code_written] %04llx, %u blocks invalidated",
+          (unsigned long long) address, invalidated);
+}
+
+
+void jit_get_stats (const struct jit * jit, struct jit_stats * stats) {
+    pthread_mutex_lock((pthread_mutex_t *) &(jit->lock));
+    *stats = jit->stats;
+    pthread_mutex_unlock((pthread_mutex_t *) &(jit->lock));
+}
+
+
+/*
+* Submits the static successors of the block at vaddr, which we do not have
+* code for yet, to the translation pool.
+*/
+static void jit_speculate (struct jit * jit,
+                           struct memmap * memmap,
+                           uint64_t vaddr,
+                           const void * bytes,
+                           size_t size) {
+    if (jit->arch_source->block_successors == NULL)
+        return;
+
+    uint64_t successors[CHAIN_SLOTS];
+    unsigned int n = jit->arch_source->block_successors(bytes,
+                                                        size,
+                                                        vaddr,
+                                                        successors,
+                                                        CHAIN_SLOTS);
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        if (jit_get_block(jit, successors[i]) != NULL)
+            continue;
+        struct buf * buf = memmap_get_buf(memmap,
+                                          successors[i],
+                                          JIT_POOL_BUF_SIZE);
+        if (buf_length(buf) > 0)
+            jit_pool_submit(jit->pool,
+                            successors[i],
+                            buf_get(buf, 0, buf_length(buf)),
+                            buf_length(buf));
+        ODEL(buf);
+    }
+}
+
+
+/*
+* Returns the number of guest bytes the block at vaddr is translated from,
+* given the size bytes of guest memory we translate it from.
+*/
+static size_t jit_guest_size (const struct jit * jit,
+                              const void * bytes,
+                              size_t size,
+                              uint64_t vaddr) {
+    size_t guest_size = 0;
+    if (jit->arch_source->block_size != NULL)
+        guest_size = jit->arch_source->block_size(bytes, size, vaddr);
+    if (guest_size == 0)
+        return size;
+    return guest_size;
+}
+
+
+/*
+* Returns the fuel the block at vaddr costs to enter, given the size bytes of
+* guest memory we translate it from.
+*/
+static unsigned int jit_fuel_cost (const struct jit * jit,
+                                   const void * bytes,
+                                   size_t size,
+                                   uint64_t vaddr) {
+    unsigned int cost = 0;
+    if (    (jit->fuel_unit == JIT_FUEL_INSTRUCTIONS)
+         && (jit->arch_source->block_instructions != NULL))
+        cost = jit->arch_source->block_instructions(bytes, size, vaddr);
+    if (cost == 0)
+        return 1;
+    return cost;
+}
+
+
+/* Returns 1 if a global hook may add to the blocks we translate */
+static int jit_translate_hooked () {
+    if (global_hooks == NULL)
+        return 0;
+
+    struct list_it * it;
+    for (it = list_it(global_hooks->hooks); it != NULL; it = list_it_next(it)) {
+        struct hook * hook = list_it_data(it);
+        if (hook->hooks_api->jit_translate != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+* Returns the flags the block at vaddr writes before it reads them, translating
+* it only if jit->flags holds nothing for its current guest bytes. Sets
+* guest_size to the number of guest bytes it is translated from.
+* @return A list of variable bopers the caller owns, or NULL if the block
+*         can't be translated.
+*/
+static struct list * jit_flags_written (struct jit * jit,
+                                        struct memmap * memmap,
+                                        uint64_t vaddr,
+                                        size_t * guest_size) {
+    struct buf * buf = memmap_get_buf(memmap, vaddr, JIT_POOL_BUF_SIZE);
+    if (buf_length(buf) == 0) {
+        ODEL(buf);
+        return NULL;
+    }
+    const void * bytes = buf_get(buf, 0, buf_length(buf));
+    size_t size = jit_guest_size(jit, bytes, buf_length(buf), vaddr);
+    *guest_size = size;
+
+    struct jit_flags needle;
+    object_init(&(needle.oh), &jit_flags_vtable);
+    needle.vaddr = vaddr;
+
+    /* we are translating without the lock held */
+    struct list * written = NULL;
+    pthread_mutex_lock(&(jit->lock));
+    struct jit_flags * jit_flags = tree_fetch(jit->flags, &needle);
+    if (    (jit_flags != NULL)
+         && (jit_flags->size == size)
+         && (memcmp(jit_flags->bytes, bytes, size) == 0))
+        written = OCOPY(jit_flags->written);
+    pthread_mutex_unlock(&(jit->lock));
+    if (written != NULL) {
+        ODEL(buf);
+        return written;
+    }
+
+    struct list * binslist;
+    binslist = jit->arch_source->translate_block(bytes, buf_length(buf), vaddr);
+    if ((binslist != NULL) && bins_lower_ce(binslist)) {
+        ODEL(binslist);
+        binslist = NULL;
+    }
+    if (binslist == NULL) {
+        ODEL(buf);
         return NULL;
-    return &(jit->mmap_mem[jit_block->mm_offset]);
+    }
+    written = opt_flags_written(binslist, jit->arch_source->is_flag);
+    ODEL(binslist);
+
+    pthread_mutex_lock(&(jit->lock));
+    tree_remove(jit->flags, &needle);
+    tree_insert_(jit->flags,
+                 jit_flags_create(vaddr, bytes, size, OCOPY(written)));
+    pthread_mutex_unlock(&(jit->lock));
+
+    ODEL(buf);
+    return written;
 }
 
 
-int jit_execute (struct jit * jit,
-                 struct varstore * varstore,
-                 struct memmap * memmap) {
-    /* we will keep executing until there is a reason to stop */
-    do {
-        // get the instruction pointer
-        size_t offset;
-        int error = varstore_offset(varstore,
-                                    jit->arch_source->ip_variable_identifier(),
-                                    jit->arch_source->ip_variable_bits(),
-                                    &offset);
-        if (error)
-            return -1;
-        uint8_t * data_buf = (uint8_t *) varstore_data_buf(varstore);
-        uint64_t ip;
-        switch (jit->arch_source->ip_variable_bits()) {
-        case 8 : ip = *((uint8_t *) &(data_buf[offset])); break;
-        case 16 : ip = *((uint16_t *) &(data_buf[offset])); break;
-        case 32 : ip = *((uint32_t *) &(data_buf[offset])); break;
-        case 64 : ip = *((uint64_t *) &(data_buf[offset])); break;
-        default: return -2;
+/*
+* Returns the flags every successor of the block at vaddr writes before it
+* reads them, given the size bytes of guest memory we translate the block
+* from. Sets deps_vaddr and deps_size to the guest memory the successors were
+* translated from, if there are any such flags.
+*/
+static struct list * jit_dead_flags (struct jit * jit,
+                                     struct memmap * memmap,
+                                     uint64_t vaddr,
+                                     const void * bytes,
+                                     size_t size,
+                                     uint64_t * deps_vaddr,
+                                     size_t * deps_size) {
+    *deps_vaddr = vaddr;
+    *deps_size = 0;
+    if (    ((jit->opt_passes & OPT_DEAD_FLAGS) == 0)
+         || (jit->arch_source->is_flag == NULL)
+         || (jit->arch_source->block_successors == NULL)
+         || jit_translate_hooked())
+        return NULL;
+
+    /* one more than we take, so we know when there are too many */
+    uint64_t successors[CHAIN_SLOTS + 1];
+    unsigned int n = jit->arch_source->block_successors(bytes,
+                                                        size,
+                                                        vaddr,
+                                                        successors,
+                                                        CHAIN_SLOTS + 1);
+    if ((n == 0) || (n > CHAIN_SLOTS))
+        return NULL;
+
+    struct list * dead_flags = NULL;
+    uint64_t lo = UINT64_MAX;
+    uint64_t hi = 0;
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        size_t successor_size = 0;
+        struct list * written = jit_flags_written(jit,
+                                                  memmap,
+                                                  successors[i],
+                                                  &successor_size);
+
+        /* we can't tell what this successor reads */
+        if (written == NULL) {
+            if (dead_flags != NULL)
+                ODEL(dead_flags);
+            return NULL;
         }
 
-        // make sure memmap variable is set
-        offset = varstore_offset_create(varstore, "__MEMMAP__", 64);
-        *((uint64_t *) &(data_buf[offset])) = (uint64_t) memmap;
+        if (dead_flags == NULL)
+            dead_flags = written;
+        else {
+            opt_flags_intersect(dead_flags, written);
+            ODEL(written);
+        }
 
-        // do we already have this block in the jit store?
-        const void * codeptr = jit_get_code(jit, ip);
-        btlog("[jit_execute.rip] %04x", ip);
-        // we don't have this yet, jit it
-        if (codeptr == NULL) {
-            // get memory pointed to by instruction pointer
-            struct buf * buf = memmap_get_buf(memmap, ip, 256);
+        if (successors[i] < lo)
+            lo = successors[i];
+        if (successors[i] + successor_size > hi)
+            hi = successors[i] + successor_size;
+    }
 
-            struct list * binslist;
-            binslist = jit->arch_source->translate_block(buf_get(buf,
-                                                                 0,
-                                                                 buf_length(buf)),
-                                                         buf_length(buf),
-                                                         ip);
+    if (list_length(dead_flags) == 0) {
+        ODEL(dead_flags);
+        return NULL;
+    }
+
+    *deps_vaddr = lo;
+    *deps_size = hi - lo;
+    return dead_flags;
+}
 
-            ODEL(buf);
 
-            if (binslist == NULL)
-                return -3;
+/*
+* Adds the granules holding the size bytes at vaddr to code_granules, and logs
+* the ones which are new. Expects the lock to be held.
+* @return The number of granules logged.
+*/
+static unsigned int jit_code_add (struct jit * jit,
+                                  uint64_t vaddr,
+                                  size_t size) {
+    if (size == 0)
+        return 0;
 
-            /* call our global hooks for jit translate */
-            global_hooks_call(HOOK_JIT_TRANSLATE, jit, varstore, memmap, binslist);
+    unsigned int logged = 0;
+    uint64_t granule = vaddr & ~((uint64_t) JIT_CODE_GRANULE - 1);
+    uint64_t last = (vaddr + size - 1) & ~((uint64_t) JIT_CODE_GRANULE - 1);
+    while (1) {
+        struct uint64 * needle = uint64_create(granule);
+        if (tree_fetch(jit->code_granules, needle) == NULL) {
+            tree_insert_(jit->code_granules, needle);
+            jit->code_log = realloc(jit->code_log,
+                                    sizeof(uint64_t)
+                                    * (jit->code_log_size + 1));
+            jit->code_log[jit->code_log_size++] = granule;
+            __atomic_store_n(&(jit->code_log_end),
+                             jit->code_log_end + 1,
+                             __ATOMIC_RELEASE);
+            logged++;
+        }
+        else
+            ODEL(needle);
+        if (granule == last)
+            break;
+        granule += JIT_CODE_GRANULE;
+    }
+    return logged;
+}
 
-            struct list_it * it;
-            for (it = list_it(binslist); it != NULL; it = list_it_next(it)) {
-                struct bins * bins = (struct bins *) list_it_data(it);
 
-                char * str = bins_string(bins);
-                btlog("[jit_execute.bins] %s", str);
-                free(str);
-            }
+/*
+* Logs the guest memory of a block before it is placed where other threads
+* can run into it. Threads running code only mark what is logged once they
+* return to jit_execute, so if anything new was logged we wait for them to.
+* Expects the lock to be held.
+*/
+static void jit_code_publish (struct jit * jit,
+                              uint64_t vaddr,
+                              size_t size,
+                              uint64_t deps_vaddr,
+                              size_t deps_size) {
+    unsigned int logged =   jit_code_add(jit, vaddr, size)
+                          + jit_code_add(jit, deps_vaddr, deps_size);
+    if (logged > 0) {
+        jit_stop(jit);
+        jit_resume(jit);
+    }
+}
 
-            // assemble instructions
-            struct byte_buf * assembled_buf;
-            assembled_buf = jit->arch_target->assemble(binslist, varstore);
 
+/*
+* Marks the granules logged since marked in memmap, so we hear about writes to
+* code other guests translated, and moves marked to the end of the log.
+* Expects the lock to be held.
+*/
+static void jit_code_replay (struct jit * jit,
+                             struct memmap * memmap,
+                             uint64_t * marked) {
+    uint64_t start = jit->code_log_end - jit->code_log_size;
+    size_t i = 0;
+    if (*marked > start)
+        i = *marked - start;
+    for (; i < jit->code_log_size; i++)
+        memmap_mark_code(memmap, jit->code_log[i], JIT_CODE_GRANULE);
+    *marked = jit->code_log_end;
+}
+
+
+/*
+* Records the guest bytes the block at vaddr was translated from, and the
+* guest bytes its code depends on, and marks their pages so we hear about
+* writes to them. A flush while placing the block forgets what
+* jit_code_publish logged, so it is logged again here.
+*/
+static void jit_track (struct jit * jit,
+                       struct memmap * memmap,
+                       uint64_t vaddr,
+                       size_t guest_size,
+                       uint64_t deps_vaddr,
+                       size_t deps_size) {
+    struct jit_block * jit_block = jit_get_block(jit, vaddr);
+    jit_block->guest_size = guest_size;
+    jit_block->deps_vaddr = deps_vaddr;
+    jit_block->deps_size = deps_size;
+    memmap_mark_code(memmap, vaddr, guest_size);
+    memmap_mark_code(memmap, deps_vaddr, deps_size);
+    jit_code_add(jit, vaddr, guest_size);
+    jit_code_add(jit, deps_vaddr, deps_size);
+    if (    (deps_size > 0)
+         && (deps_vaddr < vaddr)
+         && (vaddr - deps_vaddr > jit->deps_reach))
+        jit->deps_reach = vaddr - deps_vaddr;
+
+    uint64_t reach = guest_size;
+    if ((deps_size > 0) && (deps_vaddr + deps_size > vaddr + reach))
+        reach = deps_vaddr + deps_size - vaddr;
+    if (reach > jit->guest_reach)
+        jit->guest_reach = reach;
+}
+
+
+/*
+* Places code a previous run assembled for the block at vaddr in the code
+* cache, if the guest bytes it was translated from have not changed.
+* @return 0 if the block was placed, 1 if there is no usable cached block, or
+*         -1 if the code does not fit in the code cache.
+*/
+static int jit_cache_fetch (struct jit * jit,
+                            struct memmap * memmap,
+                            uint64_t vaddr) {
+    struct buf * buf = memmap_get_buf(memmap, vaddr, JIT_POOL_BUF_SIZE);
+    uint64_t hash = jit_cache_hash(JIT_CACHE_HASH_INIT,
+                                   buf_get(buf, 0, buf_length(buf)),
+                                   buf_length(buf));
+    struct byte_buf * code = jit_cache_get(jit->cache,
+                                           vaddr,
+                                           hash,
+                                           buf_length(buf));
+    size_t guest_size = jit_guest_size(jit,
+                                       buf_get(buf, 0, buf_length(buf)),
+                                       buf_length(buf),
+                                       vaddr);
+    ODEL(buf);
+    if (code == NULL)
+        return 1;
+
+    jit_code_publish(jit, vaddr, guest_size, vaddr, 0);
+    int error = jit_set_code_locked(jit,
+                                    vaddr,
+                                    byte_buf_bytes(code),
+                                    byte_buf_length(code));
+    ODEL(code);
+    if (error)
+        return -1;
+    jit_track(jit, memmap, vaddr, guest_size, vaddr, 0);
+
+    BTLOG(BTLOG_JIT, BTLOG_DEBUG,
+          "[jit_cache_fetch] %04llx", (unsigned long long) vaddr);
+    return 0;
+}
+
+
+/* Assembles the dispatcher, and places it in its own r/w/x memory */
+static int jit_dispatcher_create (struct jit * jit,
+                                  struct varstore * varstore) {
+    struct boper * ip_boper;
+    ip_boper = boper_variable(jit->arch_source->ip_variable_bits(),
+                              jit->arch_source->ip_variable_identifier());
+    struct byte_buf * bb = jit->arch_target->dispatcher(varstore, ip_boper);
+    ODEL(ip_boper);
+    if (bb == NULL)
+        return -1;
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t size = (byte_buf_length(bb) + page_size - 1) & ~(page_size - 1);
+    uint8_t * mem = mmap(NULL,
+                         size,
+                         PROT_EXEC | PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    if (mem == MAP_FAILED) {
+        ODEL(bb);
+        return -1;
+    }
+    memcpy(mem, byte_buf_bytes(bb), byte_buf_length(bb));
+    ODEL(bb);
+
+    jit->dispatcher = mem;
+    jit->dispatcher_size = size;
+
+    if (jit->perf != NULL)
+        jit_perf_add(jit->perf, "jit_dispatcher", mem, size);
+    return 0;
+}
+
+
+/*
+* Returns the vaddr of the jit block whose code was last left through its
+* chain exit, or -1 if there is no such block.
+*/
+static int jit_exit_vaddr (struct jit * jit,
+                           struct varstore * varstore,
+                           uint64_t * vaddr) {
+    size_t offset;
+    if (varstore_offset(varstore, "__JIT_EXIT__", 64, &offset))
+        return -1;
+
+    uint8_t * data_buf = (uint8_t *) varstore_data_buf(varstore);
+    const uint8_t * code = *((const uint8_t **) &(data_buf[offset]));
+    if (code == NULL)
+        return -1;
+    *((uint64_t *) &(data_buf[offset])) = 0;
+
+    memcpy(vaddr, code - JIT_BLOCK_HEADER_SIZE, sizeof(uint64_t));
+    return 0;
+}
+
+
+static void jit_log_bins (struct list * binslist) {
+    struct list_it * it;
+    for (it = list_it(binslist); it != NULL; it = list_it_next(it)) {
+        char * str = bins_string(list_it_data(it));
+        BTLOG(BTLOG_JIT, BTLOG_TRACE, "[jit_execute.bins] %s", str);
+        free(str);
+    }
+}
+
+
+/* Logs the assembled code, 16 bytes to a line */
+static void jit_log_code (const struct byte_buf * code) {
+    char sprintfbuf[33];
+    sprintfbuf[32] = '\0';
+    unsigned int i;
+    const uint8_t * b = byte_buf_bytes(code);
+    for (i = 0; i < byte_buf_length(code); i++) {
+        if ((i != 0) && ((i % 16) == 0)) {
+            BTLOG(BTLOG_JIT, BTLOG_TRACE, "%s", sprintfbuf);
+        }
+        sprintf(&(sprintfbuf[(i % 16) * 2]), "%02x", b[i]);
+    }
+    if (i & 0xf) {
+        sprintfbuf[(i & 0xf) * 2] = '\0';
+        BTLOG(BTLOG_JIT, BTLOG_TRACE, "%s", sprintfbuf);
+    }
+}
+
+
+/*
+* Finds, fetches or translates the block at ip. Expects the lock to be held,
+* by a thread which is not running code, and drops it while translating.
+* @return 0 with either codeptr or tier0 set, or one of jit_execute's errors.
+*/
+static int jit_prepare (struct jit * jit,
+                        struct varstore * varstore,
+                        struct memmap * memmap,
+                        size_t layout_offset,
+                        uint64_t ip,
+                        const void ** codeptr,
+                        const struct byte_buf ** tier0) {
+    jit_free_retired(jit);
+    if (jit_layout_sync(jit, varstore, layout_offset))
+        return -7;
+
+    // do we already have this block in the jit store?
+    struct jit_block * jit_block = jit_get_block(jit, ip);
+    if ((jit_block != NULL) && (jit_block->tier0 == NULL)) {
+        *codeptr = jit_block_code(jit, jit_block);
+        jit_lookup_set(jit, ip, *codeptr);
+        return 0;
+    }
+
+    // or did an earlier run assemble it?
+    if ((jit_block == NULL) && (jit->cache != NULL)) {
+        int error = jit_cache_fetch(jit, memmap, ip);
+        if (error < 0)
+            return -6;
+        else if (error == 0) {
+            /* nobody will take a translation of it now */
+            if (jit->pool != NULL)
+                jit_pool_discard(jit->pool, ip);
+            *codeptr = jit_block_code(jit, jit_get_block(jit, ip));
+            return 0;
+        }
+    }
+
+    /* set when this block should be assembled with tier_target */
+    int cold = 0;
+    /* set when this block's tier0 code should be replaced */
+    int hot = 0;
+    if (jit->tier_target != NULL) {
+        if (jit_block == NULL)
+            cold = jit->tier_threshold > 1;
+        else if (++jit_block->count < jit->tier_threshold) {
+            *tier0 = jit_block->tier0;
+            return 0;
+        }
+        else
+            hot = 1;
+    }
+
+    // we don't have this yet, jit it
+    BTLOG(BTLOG_JIT, BTLOG_DEBUG,
+          "[jit_execute.rip] %04llx", (unsigned long long) ip);
+
+    /* other threads carry on while we translate */
+    jit_unlock(jit);
+
+    // get memory pointed to by instruction pointer
+    struct buf * buf = memmap_get_buf(memmap, ip, JIT_POOL_BUF_SIZE);
+    const void * bytes = buf_get(buf, 0, buf_length(buf));
+
+    // use a translation from the pool if we have one
+    struct list * binslist = NULL;
+    if (jit->pool != NULL)
+        binslist = jit_pool_take(jit->pool, ip, bytes, buf_length(buf));
+    if (binslist == NULL)
+        binslist = jit->arch_source->translate_block(bytes,
+                                                     buf_length(buf),
+                                                     ip);
+    /* nothing after the translator takes BOP_CE */
+    if ((binslist != NULL) && bins_lower_ce(binslist)) {
+        ODEL(binslist);
+        binslist = NULL;
+    }
+
+    /* identifies the guest bytes in the cache */
+    size_t guest_size = buf_length(buf);
+    uint64_t guest_hash = 0;
+    if (jit->cache != NULL)
+        guest_hash = jit_cache_hash(JIT_CACHE_HASH_INIT, bytes, guest_size);
+    /* the bytes the block was actually translated from */
+    size_t translated_size = jit_guest_size(jit, bytes, guest_size, ip);
+    unsigned int fuel_cost = jit_fuel_cost(jit, bytes, guest_size, ip);
+
+    /* the guest memory this block's code depends on beyond its own */
+    uint64_t deps_vaddr = ip;
+    size_t deps_size = 0;
+    struct list * dead_flags = NULL;
+    /* tier0 blocks aren't optimized, so they have no use for it */
+    if ((binslist != NULL) && (! cold))
+        dead_flags = jit_dead_flags(jit,
+                                    memmap,
+                                    ip,
+                                    bytes,
+                                    guest_size,
+                                    &deps_vaddr,
+                                    &deps_size);
+
+    jit_lock(jit);
+
+    if ((binslist != NULL) && (jit->pool != NULL))
+        jit_speculate(jit, memmap, ip, bytes, buf_length(buf));
+    ODEL(buf);
+
+    if (binslist == NULL)
+        return -3;
+
+    if (jit_layout_sync(jit, varstore, layout_offset)) {
+        ODEL(binslist);
+        if (dead_flags != NULL)
+            ODEL(dead_flags);
+        return -7;
+    }
+
+    jit_block = jit_get_block(jit, ip);
+    if (jit_block != NULL) {
+        if ((! hot) || (jit_block->tier0 == NULL)) {
+            /* another thread placed the block while we translated */
             ODEL(binslist);
+            if (dead_flags != NULL)
+                ODEL(dead_flags);
+            return jit_prepare(jit,
+                               varstore,
+                               memmap,
+                               layout_offset,
+                               ip,
+                               codeptr,
+                               tier0);
+        }
+        /* hot, replace it with native code */
+        BTLOG(BTLOG_JIT, BTLOG_DEBUG,
+              "[jit_execute] promoting %04llx after %u entries",
+              (unsigned long long) ip, jit_block->count);
+        jit_invalidate_locked(jit, ip);
+        jit->stats.promotions++;
+    }
 
-            if (assembled_buf == NULL)
-                return -4;
-
-            /* log the assembled instructions */
-            char sprintfbuf[33];
-            sprintfbuf[32] = '\0';
-            unsigned int i;
-            const uint8_t * b = byte_buf_bytes(assembled_buf);
-            for (i = 0; i < byte_buf_length(assembled_buf); i++) {
-                if ((i != 0) && ((i % 16) == 0)) {
-                    btlog("%s", &sprintfbuf);
-                }
-                sprintf(&(sprintfbuf[(i % 16) * 2]), "%02x", b[i]);
-            }
-            if (i & 0xf) {
-                sprintfbuf[(i & 0xf) * 2] = '\0';
-                btlog("%s", sprintfbuf);
+    /* call our global hooks for jit translate */
+    global_hooks_call(HOOK_JIT_TRANSLATE, jit, varstore, memmap, binslist);
+
+    /* tier0 blocks may only run a few times, so they are not worth it */
+    if (! cold) {
+        struct opt_vars vars;
+        vars.is_flag = jit->arch_source->is_flag;
+        vars.dead_flags = dead_flags;
+        opt_run(binslist, jit->opt_passes, &vars, &(jit->stats.opt));
+    }
+    if (dead_flags != NULL)
+        ODEL(dead_flags);
+
+    /* pay for the block before running any of it */
+    list_prepend_(binslist, bins_fuel(fuel_cost));
+
+    /* hooks are pointers into this process, don't cache them. The cache
+       only checks the guest bytes of the block itself. */
+    int cacheable = (jit->cache != NULL) && (! cold) && (deps_size == 0);
+
+    struct list_it * it;
+    for (it = list_it(binslist); it != NULL; it = list_it_next(it)) {
+        struct bins * bins = (struct bins *) list_it_data(it);
+        if (bins->op == BOP_HOOK)
+            cacheable = 0;
+    }
+
+    if (BTLOG_ENABLED(BTLOG_JIT, BTLOG_TRACE))
+        jit_log_bins(binslist);
+
+    // assemble instructions
+    struct byte_buf * assembled_buf;
+    if (cold)
+        assembled_buf = jit->tier_target->assemble(binslist, varstore);
+    else if (jit->arch_target->assemble_block != NULL) {
+        struct boper * ip_boper;
+        ip_boper = boper_variable(jit->arch_source->ip_variable_bits(),
+                                  jit->arch_source->ip_variable_identifier());
+        assembled_buf = jit->arch_target->assemble_block(binslist,
+                                                         varstore,
+                                                         ip_boper);
+        ODEL(ip_boper);
+    }
+    else
+        assembled_buf = jit->arch_target->assemble(binslist, varstore);
+
+    ODEL(binslist);
+
+    if (assembled_buf == NULL)
+        return -4;
+
+    if (BTLOG_ENABLED(BTLOG_JIT, BTLOG_TRACE))
+        jit_log_code(assembled_buf);
+
+    /* every varstore needs the variables assembly created before any thread
+       can find the block */
+    if (jit_layout_sync(jit, varstore, layout_offset)) {
+        ODEL(assembled_buf);
+        return -7;
+    }
+
+    if (cold) {
+        jit_set_tier0_locked(jit, ip, assembled_buf);
+        ODEL(assembled_buf);
+        jit_track(jit, memmap, ip, translated_size, deps_vaddr, deps_size);
+        *tier0 = jit_get_block(jit, ip)->tier0;
+    }
+    else {
+        jit_code_publish(jit, ip, translated_size, deps_vaddr, deps_size);
+        // set our rwx jit code
+        int error = jit_set_code_locked(jit,
+                                        ip,
+                                        byte_buf_bytes(assembled_buf),
+                                        byte_buf_length(assembled_buf));
+
+        if ((error == 0) && cacheable)
+            jit_cache_put(jit->cache,
+                          ip,
+                          guest_hash,
+                          guest_size,
+                          byte_buf_bytes(assembled_buf),
+                          byte_buf_length(assembled_buf));
+
+        ODEL(assembled_buf);
+
+        if (error)
+            return -6;
+        jit_track(jit, memmap, ip, translated_size, deps_vaddr, deps_size);
+        *codeptr = jit_block_code(jit, jit_get_block(jit, ip));
+    }
+
+    jit->stats.translations++;
+    return 0;
+}
+
+
+static int jit_run (struct jit * jit,
+                    struct varstore * varstore,
+                    struct memmap * memmap) {
+    /* set when the last block we executed left through its chain exit */
+    int exited = 0;
+    uint64_t exit_vaddr = 0;
+    /* how much of the code log memmap has marked, see jit_code_replay */
+    uint64_t marked = 0;
+
+    // find the instruction pointer
+    size_t ip_offset;
+    unsigned int ip_bits = jit->arch_source->ip_variable_bits();
+    int error = varstore_offset(varstore,
+                                jit->arch_source->ip_variable_identifier(),
+                                ip_bits,
+                                &ip_offset);
+    if (error)
+        return -1;
+    if ((ip_bits != 8) && (ip_bits != 16) && (ip_bits != 32) && (ip_bits != 64))
+        return -2;
+
+    // make sure memmap variable is set
+    size_t offset = varstore_offset_create(varstore, "__MEMMAP__", 64);
+    uint8_t * data_buf = (uint8_t *) varstore_data_buf(varstore);
+    *((uint64_t *) &(data_buf[offset])) = (uint64_t) memmap;
+
+    // and the lookup table for generated code
+    offset = varstore_offset_create(varstore, "__JIT_LOOKUP__", 64);
+    data_buf = (uint8_t *) varstore_data_buf(varstore);
+    *((uint64_t *) &(data_buf[offset])) = (uint64_t) jit->lookup;
+
+    // and the varstore itself, for hooks in code other guests share
+    offset = varstore_offset_create(varstore, "__VARSTORE__", 64);
+    data_buf = (uint8_t *) varstore_data_buf(varstore);
+    *((uint64_t *) &(data_buf[offset])) = (uint64_t) varstore;
+
+    // check the whole varstore against the layout the first time through
+    size_t layout_offset = varstore_offset_create(varstore,
+                                                  "__JIT_LAYOUT__",
+                                                  64);
+    *jit_layout_synced(varstore, layout_offset) = 0;
+
+    jit_lock(jit);
+
+    // cached code expects the variables it uses where they were last time
+    if (jit->cache != NULL)
+        jit_cache_layout(jit->cache, varstore);
+
+    if ((jit->arch_target->dispatcher != NULL) && (jit->dispatcher == NULL)) {
+        /* the dispatcher is shared too, so it goes by the layout */
+        if (jit_layout_sync(jit, varstore, layout_offset)) {
+            jit_unlock(jit);
+            return -7;
+        }
+        if (jit_dispatcher_create(jit, varstore)) {
+            jit_unlock(jit);
+            return -4;
+        }
+    }
+
+    jit_unlock(jit);
+
+    /* we will keep executing until there is a reason to stop */
+    do {
+        // get the instruction pointer
+        data_buf = (uint8_t *) varstore_data_buf(varstore);
+        uint64_t ip;
+        switch (ip_bits) {
+        case 8 : ip = *((uint8_t *) &(data_buf[ip_offset])); break;
+        case 16 : ip = *((uint16_t *) &(data_buf[ip_offset])); break;
+        case 32 : ip = *((uint32_t *) &(data_buf[ip_offset])); break;
+        default : ip = *((uint64_t *) &(data_buf[ip_offset])); break;
+        }
+
+        const void * codeptr = NULL;
+        /* tier0 code we run with tier_target instead of codeptr */
+        const struct byte_buf * tier0 = NULL;
+
+        // most blocks are found in the lookup table, without the lock
+        if (    (! exited)
+             && (jit_enter(jit, varstore, layout_offset, marked) == 0)) {
+            codeptr = jit_lookup(jit, ip);
+            if (codeptr == NULL)
+                jit_leave(jit);
+        }
+
+        if (codeptr == NULL) {
+            jit_lock(jit);
+            error = jit_prepare(jit,
+                                varstore,
+                                memmap,
+                                layout_offset,
+                                ip,
+                                &codeptr,
+                                &tier0);
+            if (error) {
+                jit_unlock(jit);
+                return error;
             }
 
+            /* this or any other block we may run into from here */
+            jit_code_replay(jit, memmap, &marked);
+
+            // next time, the block we just left jumps straight here
+            if (exited && (tier0 == NULL))
+                jit_chain_locked(jit, exit_vaddr, ip);
 
-            // set our rwx jit code
-            jit_set_code(jit,
-                         ip,
-                         byte_buf_bytes(assembled_buf),
-                         byte_buf_length(assembled_buf));
+            /* nothing can stop the jit until we unlock */
+            __atomic_add_fetch(&(jit->active), 1, __ATOMIC_SEQ_CST);
+            jit_unlock(jit);
+        }
 
-            ODEL(assembled_buf);
-            codeptr = jit_get_code(jit, ip);
+        unsigned int ret_code;
+        if (tier0 != NULL) {
+            ret_code = jit->tier_target->execute(byte_buf_bytes(tier0),
+                                                 varstore);
+            exited = 0;
+        }
+        else {
+            // execute this jit block, or the dispatcher which will find it
+            if (jit->dispatcher != NULL)
+                codeptr = jit->dispatcher;
+            ret_code = jit->arch_target->execute(codeptr, varstore);
+            /* the block's header may be reused once we leave */
+            exited =    (ret_code == 0)
+                     && (jit->arch_target->assemble_block != NULL)
+                     && (jit_exit_vaddr(jit, varstore, &exit_vaddr) == 0);
         }
 
-        // execute this jit block
-        unsigned int ret_code = jit->arch_target->execute(codeptr, varstore);
+        jit_leave(jit);
 
         /*
         * Return Codes
@@ -242,10 +1891,11 @@ int jit_execute (struct jit * jit,
         * 1 = Error reading from MMU
         * 2 = Error writing to MMU
         * 3 = Encountered HLT instruction
+        * 4 = Ran out of fuel
         */
         if (ret_code == 0)
             continue;
-        else if ((ret_code == 1) || (ret_code == 2))
+        else if ((ret_code == 1) || (ret_code == 2) || (ret_code == 4))
             return ret_code;
         else if (ret_code == 3) {
             int hlt_result = jit->platform->jit_hlt(jit, varstore);
@@ -258,3 +1908,32 @@ int jit_execute (struct jit * jit,
 
     return -10;
 }
+
+
+/* Returns the varstore's fuel, which moves if variables are created */
+static uint64_t * jit_fuel (struct varstore * varstore) {
+    size_t offset = varstore_offset_create(varstore, "__JIT_FUEL__", 64);
+    uint8_t * data_buf = (uint8_t *) varstore_data_buf(varstore);
+    return (uint64_t *) &(data_buf[offset]);
+}
+
+
+int jit_execute (struct jit * jit,
+                 struct varstore * varstore,
+                 struct memmap * memmap) {
+    uint64_t fuel = UINT64_MAX;
+    return jit_execute_fuel(jit, varstore, memmap, &fuel);
+}
+
+
+int jit_execute_fuel (struct jit * jit,
+                      struct varstore * varstore,
+                      struct memmap * memmap,
+                      uint64_t * fuel) {
+    *jit_fuel(varstore) = *fuel;
+    memmap_set_code_written(memmap, jit_code_written, jit);
+    int result = jit_run(jit, varstore, memmap);
+    memmap_set_code_written(memmap, NULL, NULL);
+    *fuel = *jit_fuel(varstore);
+    return result;
+}
@@ -1,38 +1,195 @@
 #ifndef jit_HEADER
 #define jit_HEADER
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 #include "arch/arch.h"
+#include "bt/jit_cache.h"
+#include "bt/jit_perf.h"
+#include "bt/jit_pool.h"
+#include "bt/opt.h"
+#include "container/byte_buf.h"
 #include "container/memmap.h"
 #include "container/tree.h"
 #include "container/varstore.h"
 #include "object.h"
 #include "platform/platform.h"
 
-#define INITIAL_MMAP_SIZE (1024 * 1024 * 32)
 #define INITIAL_VAR_MEM_SIZE (8 * 128)
 
+/* jit code is stored in r/w/x regions of at least this size */
+#define JIT_REGION_SIZE (1024 * 1024 * 4)
+/* default limit on the total size of all regions */
+#define JIT_DEFAULT_CODE_CAP (1024 * 1024 * 64)
+/* a reasonable number of entries before a tier0 block is compiled */
+#define JIT_DEFAULT_TIER_THRESHOLD 16
+/* guest memory blocks are translated from is tracked in granules this size */
+#define JIT_CODE_GRANULE 0x100
+
+/* what one unit of fuel pays for, see jit_set_fuel_unit */
+enum {
+    JIT_FUEL_BLOCKS = 0,
+    JIT_FUEL_INSTRUCTIONS
+};
+
 struct jit_block {
     struct object_header oh;
     uint64_t vaddr;
+    /* index of the region holding this block's code */
+    unsigned int region;
+    /* offset to this block's code in its region */
     size_t mm_offset;
     size_t size;
+    /* vaddr each of this block's chain slots jumps to */
+    uint64_t chain_vaddr[CHAIN_SLOTS];
+    /* bit n is set when chain slot n is in use */
+    unsigned int chain_used;
+    /* jit_link for every chain slot which jumps to this block */
+    struct list * incoming;
+    /* code assembled by the jit's tier_target, or NULL if this block's code
+       is native code in the code cache */
+    struct byte_buf * tier0;
+    /* number of times a tier0 block has been entered */
+    unsigned int count;
+    /* bytes of guest memory at vaddr this block was translated from */
+    size_t guest_size;
+    /* guest memory this block's successors were translated from, when the
+       block's code depends on them. deps_size is 0 when it doesn't. */
+    uint64_t deps_vaddr;
+    size_t deps_size;
+};
+
+
+/*
+* The flags the block at vaddr writes before it reads them, kept so the
+* successors of many blocks are only translated once to find them.
+*/
+struct jit_flags {
+    struct object_header oh;
+    uint64_t vaddr;
+    /* the guest bytes the block was translated from */
+    uint8_t * bytes;
+    size_t size;
+    /* variable bopers, see opt_flags_written */
+    struct list * written;
+};
+
+
+/* A chain slot, identified by the vaddr of the block it belongs to */
+struct jit_link {
+    struct object_header oh;
+    uint64_t vaddr;
+    unsigned int slot;
+};
+
+
+struct jit_region {
+    /* r/w/x memory used to store jit code */
+    uint8_t * mem;
+    /* size of mem */
+    size_t size;
+    /* offset to next available space in mem */
+    size_t next;
 };
 
 
+struct jit_stats {
+    /* number of regions, and their total size in bytes */
+    unsigned int regions;
+    size_t mapped;
+    /* bytes of code and block headers for blocks in the jit */
+    size_t used;
+    /* bytes lost to alignment, the unused ends of full regions, and
+       invalidated blocks */
+    size_t wasted;
+    /* number of times the code cache was flushed */
+    unsigned int flushes;
+    /* number of tier0 blocks recompiled as native code */
+    unsigned int promotions;
+    /* number of blocks invalidated because the guest wrote to their code */
+    unsigned int smc_invalidations;
+    /* number of blocks translated and assembled */
+    unsigned int translations;
+    /* what the optimizer did to those blocks */
+    struct opt_stats opt;
+};
+
+
+/*
+* Any number of threads may run jit_execute on one jit at the same time, and
+* share its code. Everything but the lookup table and chain slots, which code
+* reads while it runs, is changed with lock held.
+*/
 struct jit {
     struct object_header oh;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* number of threads running code from this jit */
+    unsigned int active;
+    /* Set while a thread waits for active to reach 0, so it can reuse code
+       memory, add variables to the layout or log code granules. No thread
+       starts running code until it is cleared. */
+    int stopping;
     /* A tree of jit_block structs we use to find jit code for blocks by
        virtual address. */
     struct tree * blocks;
-    /* r/w/x memory used to store jit code */
-    uint8_t * mmap_mem;
-    /* size of mmap_mem */
-    size_t mmap_size;
-    /* offset to next available space in mmap_mem */
-    size_t mmap_next;
+    /* A direct-mapped cache over blocks. See JIT_LOOKUP_HASH */
+    struct jit_lookup * lookup;
+    /* regions holding jit code. New code is placed in the last region, and
+       when we can't map another region without going over code_cap, the
+       entire code cache is flushed. */
+    struct jit_region * regions;
+    unsigned int regions_size;
+    /* index of the region new code is placed in */
+    unsigned int region;
+    size_t code_cap;
+    struct jit_stats stats;
+    /* r/w/x memory holding the dispatcher, created by the first call to
+       jit_execute, or NULL */
+    uint8_t * dispatcher;
+    size_t dispatcher_size;
+    /* translates blocks we expect to need in the background, or NULL */
+    struct jit_pool * pool;
+    /* when not NULL, new blocks are assembled with tier_target, and only
+       compiled with arch_target once entered tier_threshold times */
+    const struct arch_target * tier_target;
+    unsigned int tier_threshold;
+    /* assembled blocks kept across runs, or NULL */
+    struct jit_cache * cache;
+    /* JIT_FUEL_BLOCKS or JIT_FUEL_INSTRUCTIONS */
+    unsigned int fuel_unit;
+    /* the optimization passes run on every block, see opt_run */
+    unsigned int opt_passes;
+    /* the furthest any block's deps_vaddr is below its vaddr */
+    uint64_t deps_reach;
+    /* the furthest the guest bytes of any block, or those its code depends
+       on, end above its vaddr */
+    uint64_t guest_reach;
+    /* jit_flags of successors jit_dead_flags has looked at since the last
+       flush */
+    struct tree * flags;
+    /* tells host profilers about placed code, or NULL */
+    struct jit_perf * perf;
+    /* tier0 code of invalidated blocks, which another thread may still be
+       running. Freed once no thread is running code. */
+    struct list * retired;
+    /* varstore_node for every variable code in this jit may use, ordered by
+       offset, and the size of the varstore they make up. Every varstore
+       running code from this jit agrees with the layout. */
+    struct list * layout;
+    size_t layout_size;
+    /* uint64 address of every JIT_CODE_GRANULE of guest memory a block in
+       this jit was translated from, since the guest last wrote to it */
+    struct tree * code_granules;
+    /* code_granules in the order they were added since the last flush. Each
+       run marks the granules logged since it last looked in its memmap, so
+       every guest hears about writes to code any guest translated. */
+    uint64_t * code_log;
+    size_t code_log_size;
+    /* number of granules ever logged, plus one for every flush */
+    uint64_t code_log_end;
 
     const struct arch_source * arch_source;
     const struct arch_target * arch_target;
@@ -41,6 +198,7 @@ struct jit {
 
 
 struct jit_block * jit_block_create (uint64_t vaddr,
+                                     unsigned int region,
                                      size_t mm_offset,
                                      size_t size);
 void               jit_block_delete (struct jit_block * jit_block);
@@ -49,6 +207,21 @@ int                jit_block_cmp (const struct jit_block * lhs,
                                   const struct jit_block * rhs);
 
 
+struct jit_flags * jit_flags_create (uint64_t vaddr,
+                                     const void * bytes,
+                                     size_t size,
+                                     struct list * written);
+void               jit_flags_delete (struct jit_flags * jit_flags);
+struct jit_flags * jit_flags_copy   (const struct jit_flags * jit_flags);
+int                jit_flags_cmp    (const struct jit_flags * lhs,
+                                     const struct jit_flags * rhs);
+
+
+struct jit_link * jit_link_create (uint64_t vaddr, unsigned int slot);
+void              jit_link_delete (struct jit_link * jit_link);
+struct jit_link * jit_link_copy   (const struct jit_link * jit_link);
+
+
 struct jit_var * jit_var_create (const char * identifier,
                                  size_t offset,
                                  size_t size);
@@ -63,16 +236,159 @@ struct jit * jit_create (const struct arch_source * arch_source,
 void         jit_delete (struct jit * jit);
 struct jit * jit_copy   (const struct jit * jit);
 
+/*
+* Sets the limit on the total size of the regions holding jit code. If the
+* jit already holds more than this, it will be flushed the next time it needs
+* more space.
+*/
+void jit_set_code_cap (struct jit * jit, size_t code_cap);
+
+/*
+* Starts a pool of threads translating the successors of each new block
+* ahead of time, replacing any pool we already had. Passing 0 threads turns
+* the pool off, which is the default.
+* @return 0 on success, non-zero if the threads could not be started.
+*/
+int jit_set_workers (struct jit * jit, unsigned int threads);
+
+/*
+* Turns on tiered execution. New blocks are assembled with tier_target, which
+* is cheap to assemble for but slow to run, such as arch_target_interp. Once a
+* block has been entered threshold times, it is compiled with the jit's
+* arch_target. Passing a NULL tier_target turns tiering off, which is the
+* default.
+*/
+void jit_set_tiering (struct jit * jit,
+                      const struct arch_target * tier_target,
+                      unsigned int threshold);
+
+/*
+* Copies code for the block at vaddr into the code cache, flushing the cache
+* if needed.
+* @return 0 on success, non-zero if code_size will not fit under the cap.
+*/
 int jit_set_code (struct jit * jit,
                   uint64_t vaddr,
                   const void * code,
                   size_t code_size);
 
+/*
+* Sets the optimization passes run on each block before it is assembled, any
+* of the OPT_ flags. All of them are on by default, and 0 turns them off.
+* Call this before jit_set_cache and the first jit_execute.
+*
+* With OPT_DEAD_FLAGS, blocks don't write flags which every one of their
+* successors writes before reading, so flags in the varstore may be stale
+* whenever jit_execute returns between blocks. Blocks are invalidated when
+* their successors are written to, and are not kept in the jit_set_cache
+* cache. Successors are only looked at when no global hook translates
+* blocks, as we can't tell what a hook will add to them.
+*/
+void jit_set_opt (struct jit * jit, unsigned int passes);
+
+/*
+* Sets what jit_execute_fuel charges for. With JIT_FUEL_BLOCKS, the default,
+* each block entered costs 1. With JIT_FUEL_INSTRUCTIONS, a block costs the
+* number of guest instructions in it, where the arch_source can count them.
+* Call this before jit_set_cache and the first jit_execute.
+*/
+void jit_set_fuel_unit (struct jit * jit, unsigned int fuel_unit);
+
+/*
+* Keeps assembled blocks in the file at path, and uses blocks a previous run
+* left there instead of translating them again. The file is only used if it
+* was written for the same arch_source, arch_target and global hooks, and
+* blocks containing BOP_HOOK are never kept. Call this before the first
+* jit_execute.
+*/
+void jit_set_cache (struct jit * jit, const char * path);
+
+/*
+* Writes the jit's cache file, see jit_set_cache.
+* @return 0 on success, non-zero if there is no cache or it could not be
+*         written.
+*/
+int jit_save_cache (struct jit * jit, const struct varstore * varstore);
+
+/*
+* Tells host profilers where the code of every block placed from now on is.
+* Blocks are named prefix_0x<vaddr>. See jit_perf. A copy of the jit does not
+* inherit this.
+* @param flags JIT_PERF_MAP, JIT_PERF_DUMP, or both. 0 turns this off.
+* @return 0 on success, non-zero if the files could not be created.
+*/
+int jit_set_perf (struct jit * jit, const char * prefix, unsigned int flags);
+
+/*
+* Stores a copy of code, assembled by the jit's tier_target, as the block at
+* vaddr. Tier0 blocks are never placed in the lookup table or chained.
+*/
+void jit_set_tier0 (struct jit * jit,
+                    uint64_t vaddr,
+                    const struct byte_buf * code);
+
+/* Returns native code for the block at vaddr, or NULL */
 const void * jit_get_code (struct jit * jit, uint64_t vaddr);
 
+/*
+* Returns the block at vaddr, or NULL. The block may be removed by any other
+* thread running jit_execute on this jit.
+*/
+struct jit_block * jit_get_block (struct jit * jit, uint64_t vaddr);
+
+/*
+* Patches a free chain slot of the block at from_vaddr to jump directly to the
+* block at vaddr.
+* @return 0 if the blocks are chained, non-zero if the target does not support
+*         chaining, either block does not exist, or from_vaddr has no free
+*         chain slots.
+*/
+int jit_chain (struct jit * jit, uint64_t from_vaddr, uint64_t vaddr);
+
+/*
+* Removes the block at vaddr from the jit, unlinking every chain slot which
+* jumps to it and every chain slot it owns. The block's code is not reclaimed.
+* @return 0 on success, non-zero if there is no block at vaddr.
+*/
+int jit_invalidate (struct jit * jit, uint64_t vaddr);
+
+/*
+* Removes every block from the jit and unlinks all chains. The memory holding
+* jit code is kept, and reused for blocks translated afterwards. This waits
+* for every other thread running code from the jit to return to jit_execute,
+* so it must not be called from a hook.
+*/
+void jit_flush (struct jit * jit);
+
+/*
+* Invalidates every block translated from guest memory overlapping the size
+* bytes at address, as jit_invalidate does. jit_execute calls this when the
+* guest writes to a page blocks were translated from, so guests which modify
+* their own code keep running correct code.
+* @return The number of blocks invalidated.
+*/
+unsigned int jit_invalidate_range (struct jit * jit,
+                                   uint64_t address,
+                                   size_t size);
+
+void jit_get_stats (const struct jit * jit, struct jit_stats * stats);
+
 /*
 * Executes the code based upon varstore and memmap until the program
 * successfully terminates or an error condition is reached.
+*
+* While it runs, a write to a page of memmap which blocks were translated from
+* invalidates those blocks. The write takes effect from the next block the
+* guest enters, the rest of the block doing the write runs as translated.
+*
+* Several threads may run jit_execute on the same jit at once, each with its
+* own varstore and memmap, and each block is translated once for all of them.
+* Blocks are shared by vaddr, so every guest must be running the same code,
+* and hooks must be safe to call from several threads. The varstores must
+* agree on the offset of every variable they share, which they do when they
+* are set up the same way. A write to code is noticed in the memmap of each
+* guest which translated the block or looked it up under the jit's lock.
+*
 * @param jit A pointer to the jit we will execute this program in.
 * @param varstore A pointer to the varstore we are jitting over.
 * @param memmap A pointer to the memmap we are jitting over.
@@ -81,12 +397,30 @@ const void * jit_get_code (struct jit * jit, uint64_t vaddr);
           -3 if we failed to translate instructions from memmap to bins
           -4 if we failed to assemble the bins to the target asm
           -5 if there was a platform error
+          -6 if the assembled block does not fit in the code cache
+          -7 if varstore disagrees with the variables of other varstores
+             running code from this jit
           1 if there was an error reading from the MMU
           2 if there was an error writing to the MMU
+          4 if jit_execute_fuel ran out of fuel
           0 if execution stopped normally.
 */
 int jit_execute (struct jit * jit,
                  struct varstore * varstore,
                  struct memmap * memmap);
 
+/*
+* As jit_execute, but stops once the guest has used up *fuel. Every block
+* checks and charges the fuel when it is entered, before it does anything
+* else, and one which can't pay returns 4 with the instruction pointer on
+* itself. The guest can be resumed from there with jit_execute or another
+* call to jit_execute_fuel. See jit_set_fuel_unit.
+* @param fuel The budget, which is set to whatever is left when this returns.
+* @return As jit_execute.
+*/
+int jit_execute_fuel (struct jit * jit,
+                      struct varstore * varstore,
+                      struct memmap * memmap,
+                      uint64_t * fuel);
+
 #endif
@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+#include "jit_cache.h"
+
+#include "btlog.h"
+#include "container/memmap.h"
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Functions generated code may hold absolute pointers to */
+static const void * const jit_cache_symbols[] = {
+    (const void *) memmap_get_u8,
+    (const void *) memmap_set_u8,
+    (const void *) memmap_get_u16_le,
+    (const void *) memmap_get_u16_be,
+    (const void *) memmap_get_u32_le,
+    (const void *) memmap_get_u32_be,
+    (const void *) memmap_get_u64_le,
+    (const void *) memmap_get_u64_be,
+    (const void *) memmap_set_u16_le,
+    (const void *) memmap_set_u16_be,
+    (const void *) memmap_set_u32_le,
+    (const void *) memmap_set_u32_be,
+    (const void *) memmap_set_u64_le,
+    (const void *) memmap_set_u64_be
+};
+#define JIT_CACHE_SYMBOLS \
+    (sizeof(jit_cache_symbols) / sizeof(jit_cache_symbols[0]))
+
+#define JIT_CACHE_PAD(x) (((x) + 7) & ~((size_t) 7))
+
+
+const struct object_vtable jit_cache_block_vtable = {
+    (void (*) (void *))                    jit_cache_block_delete,
+    (void * (*) (const void *))            jit_cache_block_copy,
+    (int (*) (const void *, const void *)) jit_cache_block_cmp
+};
+
+
+/* Size of a record, including its relocations and code */
+static size_t jit_cache_record_size (const struct jit_cache_record * record) {
+    return sizeof(struct jit_cache_record)
+         + sizeof(struct jit_cache_reloc) * record->relocs
+         + JIT_CACHE_PAD(record->code_size);
+}
+
+
+struct jit_cache_block * jit_cache_block_create (
+    const struct jit_cache_record * record,
+    uint8_t * owned
+) {
+    struct jit_cache_block * jcb = malloc(sizeof(struct jit_cache_block));
+
+    object_init(&(jcb->oh), &jit_cache_block_vtable);
+    jcb->record = record;
+    jcb->owned = owned;
+
+    return jcb;
+}
+
+
+void jit_cache_block_delete (struct jit_cache_block * jcb) {
+    free(jcb->owned);
+    free(jcb);
+}
+
+
+struct jit_cache_block * jit_cache_block_copy (
+    const struct jit_cache_block * jcb
+) {
+    if (jcb->owned == NULL)
+        return jit_cache_block_create(jcb->record, NULL);
+
+    size_t size = jit_cache_record_size(jcb->record);
+    uint8_t * owned = malloc(size);
+    memcpy(owned, jcb->owned, size);
+    return jit_cache_block_create((const struct jit_cache_record *) owned,
+                                  owned);
+}
+
+
+int jit_cache_block_cmp (const struct jit_cache_block * lhs,
+                         const struct jit_cache_block * rhs) {
+    if (lhs->record->vaddr < rhs->record->vaddr)
+        return -1;
+    else if (lhs->record->vaddr > rhs->record->vaddr)
+        return 1;
+    return 0;
+}
+
+
+const struct object_vtable jit_cache_vtable = {
+    (void (*) (void *))          jit_cache_delete,
+    (void * (*) (const void *))  jit_cache_copy,
+    NULL
+};
+
+
+/*
+* Reads the vars and blocks out of the mapped file.
+* @return 0 on success, non-zero if the file is not a valid cache for key.
+*/
+static int jit_cache_parse (struct jit_cache * jit_cache) {
+    const uint8_t * mem = jit_cache->mem;
+    size_t size = jit_cache->mem_size;
+
+    if (size < sizeof(struct jit_cache_header))
+        return -1;
+    const struct jit_cache_header * header = (const void *) mem;
+    if (memcmp(header->magic, JIT_CACHE_MAGIC, sizeof(header->magic)))
+        return -1;
+    if (header->key != jit_cache->key)
+        return -1;
+
+    size_t offset = sizeof(struct jit_cache_header);
+    unsigned int i;
+    for (i = 0; i < header->vars; i++) {
+        if (offset + sizeof(struct jit_cache_var) > size)
+            return -1;
+        const struct jit_cache_var * var = (const void *) &(mem[offset]);
+        offset += sizeof(struct jit_cache_var);
+        if (offset + JIT_CACHE_PAD(var->identifier_size) > size)
+            return -1;
+
+        char * identifier = malloc(var->identifier_size + 1);
+        memcpy(identifier, &(mem[offset]), var->identifier_size);
+        identifier[var->identifier_size] = '\0';
+        list_append_(jit_cache->vars,
+                     varstore_node_create(identifier, var->bits, var->offset));
+        free(identifier);
+        offset += JIT_CACHE_PAD(var->identifier_size);
+    }
+
+    for (i = 0; i < header->blocks; i++) {
+        if (offset + sizeof(struct jit_cache_record) > size)
+            return -1;
+        const struct jit_cache_record * record = (const void *) &(mem[offset]);
+        size_t record_size = jit_cache_record_size(record);
+        if (offset + record_size > size)
+            return -1;
+
+        const struct jit_cache_reloc * relocs = (const void *) &(record[1]);
+        unsigned int j;
+        for (j = 0; j < record->relocs; j++) {
+            if (    (relocs[j].symbol >= JIT_CACHE_SYMBOLS)
+                 || (relocs[j].offset + 8 > record->code_size))
+                return -1;
+        }
+
+        tree_insert_(jit_cache->blocks, jit_cache_block_create(record, NULL));
+        offset += record_size;
+    }
+
+    return 0;
+}
+
+
+/* Maps and parses the file at jit_cache->path, if there is a valid one */
+static void jit_cache_load (struct jit_cache * jit_cache) {
+    int fd = open(jit_cache->path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+        void * mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem != MAP_FAILED) {
+            jit_cache->mem = mem;
+            jit_cache->mem_size = st.st_size;
+        }
+    }
+    close(fd);
+
+    if (jit_cache->mem == NULL)
+        return;
+
+    if (jit_cache_parse(jit_cache)) {
+        BTLOG(BTLOG_JIT, BTLOG_INFO,
+              "[jit_cache_load] ignoring %s", jit_cache->path);
+        ODEL(jit_cache->vars);
+        jit_cache->vars = list_create();
+        ODEL(jit_cache->blocks);
+        jit_cache->blocks = tree_create();
+    }
+    else
+        BTLOG(BTLOG_JIT, BTLOG_INFO, "[jit_cache_load] %s", jit_cache->path);
+}
+
+
+struct jit_cache * jit_cache_create (const char * path, uint64_t key) {
+    struct jit_cache * jit_cache = malloc(sizeof(struct jit_cache));
+
+    object_init(&(jit_cache->oh), &jit_cache_vtable);
+    jit_cache->path = strdup(path);
+    jit_cache->key = key;
+    jit_cache->mem = NULL;
+    jit_cache->mem_size = 0;
+    jit_cache->vars = list_create();
+    jit_cache->blocks = tree_create();
+    jit_cache->layout_done = 0;
+
+    jit_cache_load(jit_cache);
+
+    return jit_cache;
+}
+
+
+void jit_cache_delete (struct jit_cache * jit_cache) {
+    /* blocks may point into mem */
+    ODEL(jit_cache->blocks);
+    ODEL(jit_cache->vars);
+    if (jit_cache->mem != NULL)
+        munmap(jit_cache->mem, jit_cache->mem_size);
+    free(jit_cache->path);
+    free(jit_cache);
+}
+
+
+struct jit_cache * jit_cache_copy (const struct jit_cache * jit_cache) {
+    struct jit_cache * copy = malloc(sizeof(struct jit_cache));
+
+    object_init(&(copy->oh), &jit_cache_vtable);
+    copy->path = strdup(jit_cache->path);
+    copy->key = jit_cache->key;
+    copy->mem = NULL;
+    copy->mem_size = 0;
+    copy->vars = OCOPY(jit_cache->vars);
+    copy->layout_done = jit_cache->layout_done;
+
+    /* the file may change under us, so the copy owns all of its blocks */
+    copy->blocks = tree_create();
+    struct tree_it * it;
+    for (it = tree_it(jit_cache->blocks); it != NULL; it = tree_it_next(it)) {
+        struct jit_cache_block * jcb = tree_it_data(it);
+        size_t size = jit_cache_record_size(jcb->record);
+        uint8_t * owned = malloc(size);
+        memcpy(owned, jcb->record, size);
+        tree_insert_(copy->blocks,
+                     jit_cache_block_create((const void *) owned, owned));
+    }
+
+    return copy;
+}
+
+
+uint64_t jit_cache_hash (uint64_t hash, const void * buf, size_t size) {
+    const uint8_t * bytes = buf;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+uint64_t jit_cache_hash_symbol (uint64_t hash, const void * symbol) {
+    Dl_info info;
+    if ((dladdr(symbol, &info) == 0) || (info.dli_fname == NULL))
+        return jit_cache_hash(hash, &symbol, sizeof(symbol));
+
+    uint64_t offset = (const uint8_t *) symbol - (const uint8_t *) info.dli_fbase;
+    hash = jit_cache_hash(hash, info.dli_fname, strlen(info.dli_fname));
+    hash = jit_cache_hash(hash, &offset, sizeof(offset));
+
+    /* a rebuilt module invalidates code assembled by the old one */
+    struct stat st;
+    if (stat(info.dli_fname, &st) == 0) {
+        uint64_t mtime = st.st_mtime;
+        hash = jit_cache_hash(hash, &mtime, sizeof(mtime));
+    }
+    return hash;
+}
+
+
+int jit_cache_layout (struct jit_cache * jit_cache, struct varstore * varstore) {
+    if (jit_cache->layout_done)
+        return 0;
+    jit_cache->layout_done = 1;
+
+    struct list_it * it;
+    for (it = list_it(jit_cache->vars); it != NULL; it = list_it_next(it)) {
+        struct varstore_node * vn = list_it_data(it);
+        size_t offset;
+        if (varstore_offset_id(varstore, vn->id, vn->bits, &offset) == 0) {
+            if (offset != vn->offset)
+                break;
+        }
+        else if (varstore->next_offset == vn->offset)
+            varstore_insert_id(varstore, vn->id, vn->bits);
+        else
+            break;
+    }
+
+    if (it == NULL)
+        return 0;
+
+    BTLOG(BTLOG_JIT, BTLOG_WARN,
+          "[jit_cache_layout] varstore layout changed, "
+          "dropping cached blocks");
+    ODEL(jit_cache->blocks);
+    jit_cache->blocks = tree_create();
+    return -1;
+}
+
+
+struct byte_buf * jit_cache_get (struct jit_cache * jit_cache,
+                                 uint64_t vaddr,
+                                 uint64_t hash,
+                                 size_t guest_size) {
+    struct jit_cache_record needle_record;
+    needle_record.vaddr = vaddr;
+    struct jit_cache_block needle;
+    object_init(&(needle.oh), &jit_cache_block_vtable);
+    needle.record = &needle_record;
+
+    struct jit_cache_block * jcb = tree_fetch(jit_cache->blocks, &needle);
+    if (jcb == NULL)
+        return NULL;
+    const struct jit_cache_record * record = jcb->record;
+    if ((record->hash != hash) || (record->guest_size != guest_size))
+        return NULL;
+
+    const struct jit_cache_reloc * relocs = (const void *) &(record[1]);
+    const uint8_t * code = (const uint8_t *) &(relocs[record->relocs]);
+
+    uint8_t * buf = malloc(record->code_size);
+    memcpy(buf, code, record->code_size);
+    unsigned int i;
+    for (i = 0; i < record->relocs; i++) {
+        uint64_t pointer = (uint64_t) jit_cache_symbols[relocs[i].symbol];
+        memcpy(&(buf[relocs[i].offset]), &pointer, sizeof(pointer));
+    }
+
+    struct byte_buf * bb = byte_buf_create();
+    byte_buf_append_bytes(bb, buf, record->code_size);
+    free(buf);
+    return bb;
+}
+
+
+int jit_cache_put (struct jit_cache * jit_cache,
+                   uint64_t vaddr,
+                   uint64_t hash,
+                   size_t guest_size,
+                   const void * code,
+                   size_t code_size) {
+    const uint8_t * bytes = code;
+
+    /* find every pointer to a symbol we know how to relocate */
+    struct jit_cache_reloc relocs[64];
+    unsigned int relocs_size = 0;
+    size_t i;
+    for (i = 0; i + 8 <= code_size; i++) {
+        uint64_t pointer;
+        memcpy(&pointer, &(bytes[i]), sizeof(pointer));
+        unsigned int j;
+        for (j = 0; j < JIT_CACHE_SYMBOLS; j++) {
+            if (pointer == (uint64_t) jit_cache_symbols[j])
+                break;
+        }
+        if (j == JIT_CACHE_SYMBOLS)
+            continue;
+        if (relocs_size == sizeof(relocs) / sizeof(relocs[0]))
+            return -1;
+        relocs[relocs_size].offset = i;
+        relocs[relocs_size].symbol = j;
+        relocs_size++;
+        i += 7;
+    }
+
+    struct jit_cache_record record;
+    record.vaddr = vaddr;
+    record.hash = hash;
+    record.guest_size = guest_size;
+    record.code_size = code_size;
+    record.relocs = relocs_size;
+    record.reserved = 0;
+
+    uint8_t * owned = calloc(1, jit_cache_record_size(&record));
+    memcpy(owned, &record, sizeof(record));
+    memcpy(&(owned[sizeof(record)]),
+           relocs,
+           sizeof(struct jit_cache_reloc) * relocs_size);
+    memcpy(&(owned[sizeof(record) + sizeof(struct jit_cache_reloc) * relocs_size]),
+           code,
+           code_size);
+
+    struct jit_cache_block * jcb;
+    jcb = jit_cache_block_create((const struct jit_cache_record *) owned,
+                                 owned);
+    tree_remove(jit_cache->blocks, jcb);
+    tree_insert_(jit_cache->blocks, jcb);
+
+    return 0;
+}
+
+
+/* Writes size bytes of buf, then pads the file to 8 bytes */
+static int jit_cache_write (FILE * fh, const void * buf, size_t size) {
+    static const uint8_t zero[8] = {0};
+    if (fwrite(buf, 1, size, fh) != size)
+        return -1;
+    size_t pad = JIT_CACHE_PAD(size) - size;
+    if (fwrite(zero, 1, pad, fh) != pad)
+        return -1;
+    return 0;
+}
+
+
+int jit_cache_save (struct jit_cache * jit_cache,
+                    const struct varstore * varstore) {
+    if (! jit_cache->layout_done)
+        return -1;
+
+    /* order the variables by offset, so they are recreated in order */
+    struct list * vars = list_create();
+    struct tree_it * tit;
+    for (tit = tree_it(varstore->tree); tit != NULL; tit = tree_it_next(tit)) {
+        struct varstore_node * vn = tree_it_data(tit);
+        struct list_it * it;
+        for (it = list_it(vars); it != NULL; it = list_it_next(it)) {
+            struct varstore_node * next = list_it_data(it);
+            if (next->offset > vn->offset)
+                break;
+        }
+        if (it == NULL)
+            list_append(vars, vn);
+        else
+            list_it_prepend(vars, it, vn);
+    }
+
+    struct jit_cache_header header;
+    memcpy(header.magic, JIT_CACHE_MAGIC, sizeof(header.magic));
+    header.key = jit_cache->key;
+    header.vars = 0;
+    header.blocks = 0;
+    struct list_it * it;
+    for (it = list_it(vars); it != NULL; it = list_it_next(it))
+        header.vars++;
+    for (tit = tree_it(jit_cache->blocks); tit != NULL; tit = tree_it_next(tit))
+        header.blocks++;
+
+    /* write somewhere else first, our blocks may point into the old file */
+    char * tmp_path = malloc(strlen(jit_cache->path) + 5);
+    sprintf(tmp_path, "%s.tmp", jit_cache->path);
+    FILE * fh = fopen(tmp_path, "wb");
+    if (fh == NULL) {
+        free(tmp_path);
+        ODEL(vars);
+        return -1;
+    }
+
+    int error = jit_cache_write(fh, &header, sizeof(header));
+
+    for (it = list_it(vars); it != NULL; it = list_it_next(it)) {
+        struct varstore_node * vn = list_it_data(it);
+        struct jit_cache_var var;
+        var.offset = vn->offset;
+        var.bits = vn->bits;
+        var.identifier_size = strlen(vn->identifier);
+        error |= jit_cache_write(fh, &var, sizeof(var));
+        error |= jit_cache_write(fh, vn->identifier, var.identifier_size);
+    }
+
+    for (tit = tree_it(jit_cache->blocks); tit != NULL; tit = tree_it_next(tit)) {
+        struct jit_cache_block * jcb = tree_it_data(tit);
+        error |= jit_cache_write(fh,
+                                 jcb->record,
+                                 jit_cache_record_size(jcb->record));
+    }
+
+    if (fclose(fh))
+        error = -1;
+    if ((error == 0) && rename(tmp_path, jit_cache->path))
+        error = -1;
+    if (error)
+        unlink(tmp_path);
+
+    free(tmp_path);
+    ODEL(vars);
+    return error;
+}
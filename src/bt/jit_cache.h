@@ -0,0 +1,162 @@
+#ifndef jit_cache_HEADER
+#define jit_cache_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "container/byte_buf.h"
+#include "container/list.h"
+#include "container/tree.h"
+#include "container/varstore.h"
+#include "object.h"
+
+/*
+* A jit_cache keeps assembled blocks in a file, so later runs of the same guest
+* can skip translation and assembly. The file is mapped with mmap when the
+* cache is created, and blocks are copied out of it as the jit needs them.
+*
+* A cached block is used only if the guest bytes it was translated from hash
+* to the same value. The whole file is keyed by a hash of everything else the
+* code depends on, such as the arch_source, arch_target and hooks, and is
+* ignored if that key does not match.
+*
+* Assembled code addresses variables by their offset in the varstore, so the
+* file also holds the varstore layout. See jit_cache_layout.
+*
+* Absolute pointers to the functions in jit_cache_symbols are stored as
+* relocations, and patched when a block is loaded. Code holding any other
+* absolute pointer, such as a BOP_HOOK, must not be cached.
+*/
+
+#define JIT_CACHE_MAGIC "btjitc01"
+#define JIT_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+struct jit_cache_header {
+    char magic[8];
+    uint64_t key;
+    uint32_t vars;
+    uint32_t blocks;
+};
+
+/* A varstore variable. Followed by identifier_size bytes, padded to 8 */
+struct jit_cache_var {
+    uint64_t offset;
+    uint32_t bits;
+    uint32_t identifier_size;
+};
+
+/*
+* An assembled block. Followed by relocs jit_cache_reloc, and then code_size
+* bytes of code padded to 8.
+*/
+struct jit_cache_record {
+    uint64_t vaddr;
+    /* jit_cache_hash of the guest bytes the block was translated from */
+    uint64_t hash;
+    uint32_t guest_size;
+    uint32_t code_size;
+    uint32_t relocs;
+    uint32_t reserved;
+};
+
+struct jit_cache_reloc {
+    /* offset into the code of a 64-bit pointer */
+    uint32_t offset;
+    /* index into jit_cache_symbols */
+    uint32_t symbol;
+};
+
+
+struct jit_cache_block {
+    struct object_header oh;
+    /* the record, either in the mapped file or in owned */
+    const struct jit_cache_record * record;
+    /* memory holding record for blocks added in this run, or NULL */
+    uint8_t * owned;
+};
+
+
+struct jit_cache {
+    struct object_header oh;
+    char * path;
+    uint64_t key;
+    /* the mapped cache file, or NULL */
+    uint8_t * mem;
+    size_t mem_size;
+    /* varstore_node for every variable the cached code uses, by offset */
+    struct list * vars;
+    /* jit_cache_block by vaddr */
+    struct tree * blocks;
+    /* set once jit_cache_layout has been called */
+    int layout_done;
+};
+
+
+struct jit_cache_block * jit_cache_block_create (
+    const struct jit_cache_record * record,
+    uint8_t * owned
+);
+void                     jit_cache_block_delete (struct jit_cache_block * jcb);
+struct jit_cache_block * jit_cache_block_copy   (
+    const struct jit_cache_block * jcb
+);
+int                      jit_cache_block_cmp    (
+    const struct jit_cache_block * lhs,
+    const struct jit_cache_block * rhs
+);
+
+/*
+* Opens the cache at path. If the file exists and was written with the same
+* key, its blocks are available through jit_cache_get. Otherwise the cache
+* starts out empty.
+*/
+struct jit_cache * jit_cache_create (const char * path, uint64_t key);
+void               jit_cache_delete (struct jit_cache * jit_cache);
+struct jit_cache * jit_cache_copy   (const struct jit_cache * jit_cache);
+
+/* FNV-1a hash of size bytes of buf, continuing from hash */
+uint64_t jit_cache_hash (uint64_t hash, const void * buf, size_t size);
+
+/*
+* Continues hash with something which identifies symbol across runs of the
+* same build, the module it lives in and its offset in that module, but not
+* its address.
+*/
+uint64_t jit_cache_hash_symbol (uint64_t hash, const void * symbol);
+
+/*
+* Creates the variables cached code expects, at the offsets it expects them,
+* in varstore. This must be called before any block is fetched, and before the
+* jit creates variables the previous run did not. If varstore already
+* disagrees with the cached layout, every cached block is dropped.
+* @return 0 if the cached blocks can be used, non-zero if they were dropped.
+*/
+int jit_cache_layout (struct jit_cache * jit_cache, struct varstore * varstore);
+
+/*
+* Fetches cached code for the block at vaddr, with its relocations applied.
+* @param hash jit_cache_hash of the guest bytes the block would be translated
+*             from.
+* @return The code, or NULL if there is no matching block.
+*/
+struct byte_buf * jit_cache_get (struct jit_cache * jit_cache,
+                                 uint64_t vaddr,
+                                 uint64_t hash,
+                                 size_t guest_size);
+
+/* Adds, or replaces, the code for the block at vaddr */
+int jit_cache_put (struct jit_cache * jit_cache,
+                   uint64_t vaddr,
+                   uint64_t hash,
+                   size_t guest_size,
+                   const void * code,
+                   size_t code_size);
+
+/*
+* Writes every block, and the layout of varstore, to the cache's path.
+* @return 0 on success, non-zero if the file could not be written.
+*/
+int jit_cache_save (struct jit_cache * jit_cache,
+                    const struct varstore * varstore);
+
+#endif
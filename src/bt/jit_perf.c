@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include "jit_perf.h"
+
+#include "btlog.h"
+
+#include <elf.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+const struct object_vtable jit_perf_vtable = {
+    (void (*) (void *))          jit_perf_delete,
+    NULL,
+    NULL
+};
+
+
+/* perf record -k mono orders jitdump records by this clock */
+static uint64_t jit_perf_timestamp () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+
+static int jit_perf_dump_open (struct jit_perf * jit_perf) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int) getpid());
+    jit_perf->dump = fopen(path, "w+");
+    if (jit_perf->dump == NULL)
+        return -1;
+
+    struct jit_perf_dump_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JIT_PERF_DUMP_MAGIC;
+    header.version = JIT_PERF_DUMP_VERSION;
+    header.total_size = sizeof(header);
+    header.elf_mach = EM_X86_64;
+    header.pid = getpid();
+    header.timestamp = jit_perf_timestamp();
+    if (fwrite(&header, sizeof(header), 1, jit_perf->dump) != 1)
+        return -1;
+    fflush(jit_perf->dump);
+
+    /* perf only looks at jitdump files the process maps executable */
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    void * marker = mmap(NULL,
+                         page_size,
+                         PROT_READ | PROT_EXEC,
+                         MAP_PRIVATE,
+                         fileno(jit_perf->dump),
+                         0);
+    if (marker == MAP_FAILED)
+        return -1;
+    jit_perf->dump_marker = marker;
+    jit_perf->dump_marker_size = page_size;
+    return 0;
+}
+
+
+struct jit_perf * jit_perf_create (const char * prefix, unsigned int flags) {
+    struct jit_perf * jit_perf = malloc(sizeof(struct jit_perf));
+
+    object_init(&(jit_perf->oh), &jit_perf_vtable);
+    jit_perf->flags = flags;
+    jit_perf->prefix = strdup(prefix);
+    jit_perf->map = NULL;
+    jit_perf->dump = NULL;
+    jit_perf->dump_marker = NULL;
+    jit_perf->dump_marker_size = 0;
+    jit_perf->code_index = 0;
+
+    if (flags & JIT_PERF_MAP) {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) getpid());
+        jit_perf->map = fopen(path, "w");
+        if (jit_perf->map == NULL) {
+            BTLOG(BTLOG_JIT, BTLOG_WARN,
+                  "[jit_perf_create] can't open %s", path);
+            jit_perf_delete(jit_perf);
+            return NULL;
+        }
+    }
+
+    if ((flags & JIT_PERF_DUMP) && jit_perf_dump_open(jit_perf)) {
+        BTLOG(BTLOG_JIT, BTLOG_WARN,
+              "[jit_perf_create] can't create jitdump");
+        jit_perf_delete(jit_perf);
+        return NULL;
+    }
+
+    return jit_perf;
+}
+
+
+void jit_perf_delete (struct jit_perf * jit_perf) {
+    if (jit_perf->map != NULL)
+        fclose(jit_perf->map);
+    if (jit_perf->dump != NULL) {
+        struct jit_perf_dump_record record;
+        record.id = JIT_PERF_CODE_CLOSE;
+        record.total_size = sizeof(record);
+        record.timestamp = jit_perf_timestamp();
+        fwrite(&record, sizeof(record), 1, jit_perf->dump);
+        fclose(jit_perf->dump);
+    }
+    if (jit_perf->dump_marker != NULL)
+        munmap(jit_perf->dump_marker, jit_perf->dump_marker_size);
+    free(jit_perf->prefix);
+    free(jit_perf);
+}
+
+
+void jit_perf_add (struct jit_perf * jit_perf,
+                   const char * name,
+                   const void * code,
+                   size_t size) {
+    if (jit_perf->map != NULL) {
+        fprintf(jit_perf->map, "%llx %zx %s\n",
+                (unsigned long long) (uintptr_t) code, size, name);
+        fflush(jit_perf->map);
+    }
+
+    if (jit_perf->dump != NULL) {
+        size_t name_size = strlen(name) + 1;
+        struct jit_perf_dump_load load;
+        load.record.id = JIT_PERF_CODE_LOAD;
+        load.record.total_size = sizeof(load) + name_size + size;
+        load.record.timestamp = jit_perf_timestamp();
+        load.pid = getpid();
+        load.tid = syscall(SYS_gettid);
+        load.vma = (uintptr_t) code;
+        load.code_addr = (uintptr_t) code;
+        load.code_size = size;
+        load.code_index = jit_perf->code_index++;
+        fwrite(&load, sizeof(load), 1, jit_perf->dump);
+        fwrite(name, name_size, 1, jit_perf->dump);
+        fwrite(code, size, 1, jit_perf->dump);
+        fflush(jit_perf->dump);
+    }
+}
+
+
+void jit_perf_add_block (struct jit_perf * jit_perf,
+                         uint64_t vaddr,
+                         const void * code,
+                         size_t size) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_0x%04llx",
+             jit_perf->prefix, (unsigned long long) vaddr);
+    jit_perf_add(jit_perf, name, code, size);
+}
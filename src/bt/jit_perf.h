@@ -0,0 +1,95 @@
+#ifndef jit_perf_HEADER
+#define jit_perf_HEADER
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "object.h"
+
+/*
+* A jit_perf tells host profilers, such as perf, where the code of each jit
+* block is, so time spent in the code cache is attributed to guest blocks.
+*
+* JIT_PERF_MAP writes /tmp/perf-<pid>.map, which perf report reads directly.
+* JIT_PERF_DUMP writes /tmp/jit-<pid>.dump in the jitdump format, which also
+* holds the code, for perf record -k mono followed by perf inject --jit.
+*
+* A jit_perf owns the files for this process, so it can't be copied.
+*/
+
+#define JIT_PERF_MAP  1
+#define JIT_PERF_DUMP 2
+
+#define JIT_PERF_DUMP_MAGIC   0x4A695444
+#define JIT_PERF_DUMP_VERSION 1
+#define JIT_PERF_CODE_LOAD    0
+#define JIT_PERF_CODE_CLOSE   3
+
+struct jit_perf_dump_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct jit_perf_dump_record {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+/* A JIT_PERF_CODE_LOAD record. Followed by the name, its terminating null,
+   and then the code. */
+struct jit_perf_dump_load {
+    struct jit_perf_dump_record record;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+
+struct jit_perf {
+    struct object_header oh;
+    unsigned int flags;
+    /* blocks are named prefix_0x<vaddr> */
+    char * prefix;
+    FILE * map;
+    FILE * dump;
+    /* perf record finds the jitdump file through this mapping of it */
+    void * dump_marker;
+    size_t dump_marker_size;
+    /* incremented for every JIT_PERF_CODE_LOAD record */
+    uint64_t code_index;
+};
+
+
+/*
+* Creates the files flags asks for.
+* @param prefix Blocks are named prefix_0x<vaddr>, such as hsvm_0x01a4.
+* @param flags JIT_PERF_MAP, JIT_PERF_DUMP, or both.
+* @return A new jit_perf, or NULL if a file could not be created.
+*/
+struct jit_perf * jit_perf_create (const char * prefix, unsigned int flags);
+void              jit_perf_delete (struct jit_perf * jit_perf);
+
+/* Records size bytes of code at code as the symbol name */
+void jit_perf_add (struct jit_perf * jit_perf,
+                   const char * name,
+                   const void * code,
+                   size_t size);
+
+/* Records the code of the block at vaddr, named after vaddr */
+void jit_perf_add_block (struct jit_perf * jit_perf,
+                         uint64_t vaddr,
+                         const void * code,
+                         size_t size);
+
+#endif
@@ -0,0 +1,282 @@
+#include "jit_pool.h"
+
+#include "btlog.h"
+#include "container/uint64.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+const struct object_vtable jit_pool_job_vtable = {
+    (void (*) (void *))                    jit_pool_job_delete,
+    (void * (*) (const void *))            jit_pool_job_copy,
+    (int (*) (const void *, const void *)) jit_pool_job_cmp
+};
+
+
+struct jit_pool_job * jit_pool_job_create (uint64_t vaddr,
+                                           const void * buf,
+                                           size_t size) {
+    struct jit_pool_job * job = malloc(sizeof(struct jit_pool_job));
+
+    object_init(&(job->oh), &jit_pool_job_vtable);
+    job->vaddr = vaddr;
+    if (size > JIT_POOL_BUF_SIZE)
+        size = JIT_POOL_BUF_SIZE;
+    memcpy(job->buf, buf, size);
+    job->size = size;
+    job->state = JIT_POOL_QUEUED;
+    job->abandoned = 0;
+    job->binslist = NULL;
+
+    return job;
+}
+
+
+void jit_pool_job_delete (struct jit_pool_job * job) {
+    if (job->binslist != NULL)
+        ODEL(job->binslist);
+    free(job);
+}
+
+
+struct jit_pool_job * jit_pool_job_copy (const struct jit_pool_job * job) {
+    struct jit_pool_job * copy = jit_pool_job_create(job->vaddr,
+                                                     job->buf,
+                                                     job->size);
+    copy->state = job->state;
+    copy->abandoned = job->abandoned;
+    if (job->binslist != NULL)
+        copy->binslist = OCOPY(job->binslist);
+    return copy;
+}
+
+
+int jit_pool_job_cmp (const struct jit_pool_job * lhs,
+                      const struct jit_pool_job * rhs) {
+    if (lhs->vaddr < rhs->vaddr)
+        return -1;
+    else if (lhs->vaddr > rhs->vaddr)
+        return 1;
+    return 0;
+}
+
+
+const struct object_vtable jit_pool_vtable = {
+    (void (*) (void *))          jit_pool_delete,
+    (void * (*) (const void *))  jit_pool_copy,
+    NULL
+};
+
+
+/* Must be called with the pool locked */
+static struct jit_pool_job * jit_pool_fetch (struct jit_pool * jit_pool,
+                                             uint64_t vaddr) {
+    struct jit_pool_job needle;
+    object_init(&(needle.oh), &jit_pool_job_vtable);
+    needle.vaddr = vaddr;
+    return tree_fetch(jit_pool->jobs, &needle);
+}
+
+
+/* Must be called with the pool locked */
+static void jit_pool_remove (struct jit_pool * jit_pool, uint64_t vaddr) {
+    struct jit_pool_job needle;
+    object_init(&(needle.oh), &jit_pool_job_vtable);
+    needle.vaddr = vaddr;
+    tree_remove(jit_pool->jobs, &needle);
+}
+
+
+/*
+* Removes job, or leaves it to its worker if it is running. Must be called
+* with the pool locked.
+*/
+static void jit_pool_drop (struct jit_pool * jit_pool,
+                           struct jit_pool_job * job) {
+    if (job->state == JIT_POOL_RUNNING) {
+        job->abandoned = 1;
+        return;
+    }
+    if (job->state == JIT_POOL_QUEUED)
+        jit_pool->queue_size--;
+    jit_pool_remove(jit_pool, job->vaddr);
+}
+
+
+/*
+* Marks job done, and drops the oldest finished jobs nobody took if there are
+* too many. Must be called with the pool locked.
+*/
+static void jit_pool_done (struct jit_pool * jit_pool,
+                           struct jit_pool_job * job) {
+    job->state = JIT_POOL_DONE;
+    list_append_(jit_pool->done, uint64_create(job->vaddr));
+    jit_pool->done_size++;
+
+    while (jit_pool->done_size > JIT_POOL_MAX_JOBS) {
+        struct uint64 * vaddr = list_front(jit_pool->done);
+        struct jit_pool_job * oldest = jit_pool_fetch(jit_pool, vaddr->value);
+        /* the vaddr may have been taken, and submitted again since */
+        if ((oldest != NULL) && (oldest->state == JIT_POOL_DONE))
+            jit_pool_remove(jit_pool, vaddr->value);
+        list_pop_front(jit_pool->done);
+        jit_pool->done_size--;
+    }
+}
+
+
+static void * jit_pool_worker (void * arg) {
+    struct jit_pool * jit_pool = arg;
+
+    pthread_mutex_lock(&(jit_pool->lock));
+    while (1) {
+        while ((! jit_pool->shutdown) && (list_front(jit_pool->queue) == NULL))
+            pthread_cond_wait(&(jit_pool->cond), &(jit_pool->lock));
+        if (jit_pool->shutdown)
+            break;
+
+        struct uint64 * vaddr = list_front(jit_pool->queue);
+        struct jit_pool_job * job = jit_pool_fetch(jit_pool, vaddr->value);
+        list_pop_front(jit_pool->queue);
+
+        /* the job may have been taken before we got to it */
+        if ((job == NULL) || (job->state != JIT_POOL_QUEUED))
+            continue;
+        job->state = JIT_POOL_RUNNING;
+        jit_pool->queue_size--;
+
+        /* while running, nobody else removes or modifies the job */
+        pthread_mutex_unlock(&(jit_pool->lock));
+        struct list * binslist;
+        binslist = jit_pool->arch_source->translate_block(job->buf,
+                                                          job->size,
+                                                          job->vaddr);
+        pthread_mutex_lock(&(jit_pool->lock));
+
+        job->binslist = binslist;
+        if (job->abandoned)
+            jit_pool_remove(jit_pool, job->vaddr);
+        else
+            jit_pool_done(jit_pool, job);
+    }
+    pthread_mutex_unlock(&(jit_pool->lock));
+
+    return NULL;
+}
+
+
+struct jit_pool * jit_pool_create (const struct arch_source * arch_source,
+                                   unsigned int threads) {
+    struct jit_pool * jit_pool = malloc(sizeof(struct jit_pool));
+
+    object_init(&(jit_pool->oh), &jit_pool_vtable);
+    jit_pool->arch_source = arch_source;
+    pthread_mutex_init(&(jit_pool->lock), NULL);
+    pthread_cond_init(&(jit_pool->cond), NULL);
+    jit_pool->jobs = tree_create();
+    jit_pool->queue = list_create();
+    jit_pool->queue_size = 0;
+    jit_pool->done = list_create();
+    jit_pool->done_size = 0;
+    jit_pool->shutdown = 0;
+    jit_pool->threads = malloc(sizeof(pthread_t) * threads);
+    jit_pool->threads_size = 0;
+
+    unsigned int i;
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&(jit_pool->threads[i]),
+                           NULL,
+                           jit_pool_worker,
+                           jit_pool)) {
+            BTLOG(BTLOG_JIT, BTLOG_WARN,
+                  "[jit_pool_create] could not start worker %u", i);
+            ODEL(jit_pool);
+            return NULL;
+        }
+        jit_pool->threads_size++;
+    }
+
+    return jit_pool;
+}
+
+
+void jit_pool_delete (struct jit_pool * jit_pool) {
+    pthread_mutex_lock(&(jit_pool->lock));
+    jit_pool->shutdown = 1;
+    pthread_cond_broadcast(&(jit_pool->cond));
+    pthread_mutex_unlock(&(jit_pool->lock));
+
+    unsigned int i;
+    for (i = 0; i < jit_pool->threads_size; i++)
+        pthread_join(jit_pool->threads[i], NULL);
+
+    free(jit_pool->threads);
+    ODEL(jit_pool->queue);
+    ODEL(jit_pool->done);
+    ODEL(jit_pool->jobs);
+    pthread_cond_destroy(&(jit_pool->cond));
+    pthread_mutex_destroy(&(jit_pool->lock));
+    free(jit_pool);
+}
+
+
+struct jit_pool * jit_pool_copy (const struct jit_pool * jit_pool) {
+    return jit_pool_create(jit_pool->arch_source, jit_pool->threads_size);
+}
+
+
+int jit_pool_submit (struct jit_pool * jit_pool,
+                     uint64_t vaddr,
+                     const void * buf,
+                     size_t size) {
+    int result = -1;
+
+    pthread_mutex_lock(&(jit_pool->lock));
+    if (    (jit_pool->queue_size < JIT_POOL_MAX_JOBS)
+         && (jit_pool_fetch(jit_pool, vaddr) == NULL)) {
+        tree_insert_(jit_pool->jobs, jit_pool_job_create(vaddr, buf, size));
+        list_append_(jit_pool->queue, uint64_create(vaddr));
+        jit_pool->queue_size++;
+        pthread_cond_signal(&(jit_pool->cond));
+        result = 0;
+    }
+    pthread_mutex_unlock(&(jit_pool->lock));
+
+    return result;
+}
+
+
+struct list * jit_pool_take (struct jit_pool * jit_pool,
+                             uint64_t vaddr,
+                             const void * buf,
+                             size_t size) {
+    struct list * binslist = NULL;
+
+    pthread_mutex_lock(&(jit_pool->lock));
+    struct jit_pool_job * job = jit_pool_fetch(jit_pool, vaddr);
+    if (job != NULL) {
+        if (size > JIT_POOL_BUF_SIZE)
+            size = JIT_POOL_BUF_SIZE;
+        if (    (job->state == JIT_POOL_DONE)
+             && (job->size == size)
+             && (memcmp(job->buf, buf, size) == 0)) {
+            binslist = job->binslist;
+            job->binslist = NULL;
+        }
+        /* queued, running, stale or taken, we are done with this job either
+           way. A running job belongs to its worker until it is done. */
+        jit_pool_drop(jit_pool, job);
+    }
+    pthread_mutex_unlock(&(jit_pool->lock));
+
+    return binslist;
+}
+
+
+void jit_pool_discard (struct jit_pool * jit_pool, uint64_t vaddr) {
+    pthread_mutex_lock(&(jit_pool->lock));
+    struct jit_pool_job * job = jit_pool_fetch(jit_pool, vaddr);
+    if (job != NULL)
+        jit_pool_drop(jit_pool, job);
+    pthread_mutex_unlock(&(jit_pool->lock));
+}
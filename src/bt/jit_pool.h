@@ -0,0 +1,120 @@
+#ifndef jit_pool_HEADER
+#define jit_pool_HEADER
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arch/arch.h"
+#include "container/list.h"
+#include "container/tree.h"
+#include "object.h"
+
+/*
+* A jit_pool translates blocks ahead of time in worker threads. The executing
+* thread submits the guest bytes of blocks it expects to run soon, and later
+* takes the translated bins when it actually needs them.
+*
+* Workers only call arch_source->translate_block. Translate hooks and
+* assembly touch the varstore and global hooks, so they stay on the executing
+* thread.
+*/
+
+/* Number of bytes of guest memory handed to translate_block */
+#define JIT_POOL_BUF_SIZE 256
+/* Submissions are dropped once this many jobs are queued, and the oldest
+   finished jobs are dropped once more than this many are waiting */
+#define JIT_POOL_MAX_JOBS 1024
+
+enum {
+    JIT_POOL_QUEUED,
+    JIT_POOL_RUNNING,
+    JIT_POOL_DONE
+};
+
+struct jit_pool_job {
+    struct object_header oh;
+    uint64_t vaddr;
+    uint8_t buf[JIT_POOL_BUF_SIZE];
+    size_t size;
+    int state;
+    /* set when the job was taken or discarded while running. Its worker
+       removes it once it is done. */
+    int abandoned;
+    /* translated bins, or NULL if translation failed */
+    struct list * binslist;
+};
+
+
+struct jit_pool {
+    struct object_header oh;
+    const struct arch_source * arch_source;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* jit_pool_job by vaddr, in any state */
+    struct tree * jobs;
+    /* uint64 vaddrs of queued jobs, oldest first */
+    struct list * queue;
+    /* number of jobs queued. The queue may also hold vaddrs of jobs taken
+       before a worker got to them. */
+    unsigned int queue_size;
+    /* uint64 vaddrs of finished jobs, oldest first. Jobs taken since are
+       left in here until they reach the front. */
+    struct list * done;
+    unsigned int done_size;
+    int shutdown;
+    pthread_t * threads;
+    unsigned int threads_size;
+};
+
+
+struct jit_pool_job * jit_pool_job_create (uint64_t vaddr,
+                                           const void * buf,
+                                           size_t size);
+void                  jit_pool_job_delete (struct jit_pool_job * job);
+struct jit_pool_job * jit_pool_job_copy   (const struct jit_pool_job * job);
+int                   jit_pool_job_cmp    (const struct jit_pool_job * lhs,
+                                           const struct jit_pool_job * rhs);
+
+/*
+* Creates a jit_pool and starts its worker threads.
+* @param arch_source The arch_source used to translate blocks.
+* @param threads The number of worker threads to start.
+* @return A new jit_pool, or NULL if the threads could not be started.
+*/
+struct jit_pool * jit_pool_create (const struct arch_source * arch_source,
+                                   unsigned int threads);
+/* Stops and joins all worker threads. Don't call this, call ODEL(). */
+void              jit_pool_delete (struct jit_pool * jit_pool);
+/* Creates a new pool with the same number of threads and no jobs. */
+struct jit_pool * jit_pool_copy   (const struct jit_pool * jit_pool);
+
+/*
+* Queues translation of the block at vaddr from a copy of buf.
+* @return 0 if the block was queued, or non-zero if it was already submitted
+*         or JIT_POOL_MAX_JOBS jobs are queued.
+*/
+int jit_pool_submit (struct jit_pool * jit_pool,
+                     uint64_t vaddr,
+                     const void * buf,
+                     size_t size);
+
+/*
+* Takes the translated bins for the block at vaddr. The job is only used if it
+* was translated from the same bytes as buf, which guards against guest code
+* changing after it was submitted.
+* @return The translated bins, which the caller now owns, or NULL if there is
+*         no finished translation for vaddr.
+*/
+struct list * jit_pool_take (struct jit_pool * jit_pool,
+                             uint64_t vaddr,
+                             const void * buf,
+                             size_t size);
+
+/*
+* Drops the job for vaddr, if there is one. The jit calls this when it gets a
+* block without translating it, so the job is never taken.
+*/
+void jit_pool_discard (struct jit_pool * jit_pool, uint64_t vaddr);
+
+#endif
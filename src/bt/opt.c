@@ -0,0 +1,642 @@
+#include "opt.h"
+
+#include "bt/bins.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+* A variable known to hold value, which is either a constant or another
+* variable.
+*/
+struct opt_fact {
+    struct boper * variable;
+    struct boper * value;
+};
+
+struct opt_facts {
+    struct opt_fact * facts;
+    unsigned int size;
+};
+
+/*
+* The labels of the branches walked past whose BOP_LABEL is still ahead.
+* Instructions between a branch and its label may be skipped.
+*/
+struct opt_branches {
+    uint32_t * labels;
+    unsigned int size;
+};
+
+
+/* A pass, run when any of the bits in passes are enabled */
+struct opt_pass {
+    const char * name;
+    unsigned int passes;
+    void (* run) (struct list * binslist,
+                  unsigned int passes,
+                  const struct opt_vars * vars,
+                  struct opt_stats * stats);
+};
+
+
+static uint64_t opt_mask (unsigned int bits) {
+    if (bits >= 64)
+        return 0xffffffffffffffffULL;
+    return (1ULL << bits) - 1;
+}
+
+
+/* Returns 1 if lhs and rhs are the same variable or temporary */
+static int opt_same (const struct boper * lhs, const struct boper * rhs) {
+    return    (boper_type(lhs) != BOPER_CONSTANT)
+           && (boper_type(lhs) == boper_type(rhs))
+           && (boper_bits(lhs) == boper_bits(rhs))
+           && (boper_id(lhs) == boper_id(rhs));
+}
+
+
+static int opt_is_zero (const struct boper * boper) {
+    return    (boper_type(boper) == BOPER_CONSTANT)
+           && (boper_value(boper) == 0);
+}
+
+
+/*
+* Sets reads to a mask of the operands bins reads, and writes to 1 if it
+* writes oper[0].
+* @return 0 on success, non-zero if bins may read or write any variable.
+*/
+static int opt_operands (const struct bins * bins,
+                         unsigned int * reads,
+                         int * writes) {
+    *reads = 0;
+    *writes = 0;
+    switch (bins->op) {
+    case BOP_ADD :
+    case BOP_SUB :
+    case BOP_UMUL :
+    case BOP_UDIV :
+    case BOP_UMOD :
+    case BOP_AND :
+    case BOP_OR :
+    case BOP_XOR :
+    case BOP_SHL :
+    case BOP_SHR :
+    case BOP_CMPEQ :
+    case BOP_CMPLTU :
+    case BOP_CMPLTS :
+    case BOP_CMPLEU :
+    case BOP_CMPLES :
+        *reads = 6;
+        *writes = 1;
+        return 0;
+    case BOP_SEXT :
+    case BOP_ZEXT :
+    case BOP_TRUN :
+    case BOP_LOAD :
+    case BOP_LOADBE :
+        *reads = 2;
+        *writes = 1;
+        return 0;
+    case BOP_STORE :
+    case BOP_STOREBE :
+        *reads = 3;
+        return 0;
+    case BOP_BRZ :
+        *reads = 1;
+        return 0;
+    case BOP_HLT :
+    case BOP_FUEL :
+    case BOP_COMMENT :
+    case BOP_LABEL :
+    case BOP_BR :
+        return 0;
+    }
+    return -1;
+}
+
+
+static void opt_branches_init (struct opt_branches * branches,
+                               struct list * binslist) {
+    branches->labels = malloc(sizeof(uint32_t)
+                              * (list_length(binslist) + 1));
+    branches->size = 0;
+}
+
+
+/*
+* Walks forward past bins, returns 1 if bins may be skipped by a branch
+* before it.
+*/
+static int opt_branches_walk (struct opt_branches * branches,
+                              const struct bins * bins) {
+    if (bins->op == BOP_LABEL) {
+        unsigned int i = 0;
+        while (i < branches->size) {
+            if (branches->labels[i] == bins_target(bins))
+                branches->labels[i] = branches->labels[--branches->size];
+            else
+                i++;
+        }
+    }
+    int skipped = branches->size > 0;
+    if (bins_is_branch(bins))
+        branches->labels[branches->size++] = bins_target(bins);
+    return skipped;
+}
+
+
+/*
+* Returns the operand a move copies into oper[0], or NULL if bins is not a
+* move. Moves are written as or dst, src, 0, or the same with add, sub or
+* xor.
+*/
+static const struct boper * opt_moved (const struct bins * bins) {
+    switch (bins->op) {
+    case BOP_ADD :
+    case BOP_OR :
+    case BOP_XOR :
+        if (opt_is_zero(bins->oper[1]))
+            return bins->oper[2];
+        /* fall through */
+    case BOP_SUB :
+        if (opt_is_zero(bins->oper[2]))
+            return bins->oper[1];
+    }
+    return NULL;
+}
+
+
+static const struct boper * opt_fact_get (const struct opt_facts * facts,
+                                          const struct boper * variable) {
+    unsigned int i;
+    for (i = 0; i < facts->size; i++) {
+        if (opt_same(facts->facts[i].variable, variable))
+            return facts->facts[i].value;
+    }
+    return NULL;
+}
+
+
+/* Forgets everything known about variable, and every copy of it */
+static void opt_fact_kill (struct opt_facts * facts,
+                           const struct boper * variable) {
+    unsigned int i = 0;
+    while (i < facts->size) {
+        struct opt_fact * fact = &(facts->facts[i]);
+        if (    opt_same(fact->variable, variable)
+             || opt_same(fact->value, variable)) {
+            ODEL(fact->variable);
+            ODEL(fact->value);
+            *fact = facts->facts[--facts->size];
+        }
+        else
+            i++;
+    }
+}
+
+
+static void opt_fact_set (struct opt_facts * facts,
+                          const struct boper * variable,
+                          const struct boper * value) {
+    facts->facts = realloc(facts->facts,
+                           sizeof(struct opt_fact) * (facts->size + 1));
+    facts->facts[facts->size].variable = OCOPY(variable);
+    facts->facts[facts->size].value = OCOPY(value);
+    facts->size++;
+}
+
+
+static void opt_facts_clear (struct opt_facts * facts) {
+    while (facts->size > 0) {
+        facts->size--;
+        ODEL(facts->facts[facts->size].variable);
+        ODEL(facts->facts[facts->size].value);
+    }
+}
+
+
+/* sign-extends the low bits of value to 64 bits */
+static uint64_t opt_signed (uint64_t value, unsigned int bits) {
+    if (bits >= 64)
+        return value;
+    uint64_t sign = 1ULL << (bits - 1);
+    return ((value & opt_mask(bits)) ^ sign) - sign;
+}
+
+
+/*
+* Computes what bins writes to oper[0], if its operands are constants.
+* @return 0 on success, non-zero if the result is not known or targets may
+*         disagree on it.
+*/
+static int opt_eval (const struct bins * bins, uint64_t * result) {
+    unsigned int bits = boper_bits(bins->oper[1]);
+    uint64_t lhs = boper_value(bins->oper[1]) & opt_mask(bits);
+    uint64_t rhs = 0;
+    if (bins->oper[2] != NULL)
+        rhs = boper_value(bins->oper[2]) & opt_mask(boper_bits(bins->oper[2]));
+
+    switch (bins->op) {
+    case BOP_ADD : *result = lhs + rhs; break;
+    case BOP_SUB : *result = lhs - rhs; break;
+    case BOP_UMUL : *result = lhs * rhs; break;
+    case BOP_UDIV :
+        if (rhs == 0)
+            return -1;
+        *result = lhs / rhs;
+        break;
+    case BOP_UMOD :
+        if (rhs == 0)
+            return -1;
+        *result = lhs % rhs;
+        break;
+    case BOP_AND : *result = lhs & rhs; break;
+    case BOP_OR : *result = lhs | rhs; break;
+    case BOP_XOR : *result = lhs ^ rhs; break;
+    case BOP_SHL :
+        if (rhs >= 64)
+            return -1;
+        *result = lhs << rhs;
+        break;
+    case BOP_SHR :
+        if (rhs >= 64)
+            return -1;
+        *result = lhs >> rhs;
+        break;
+    case BOP_CMPEQ : *result = lhs == rhs; break;
+    case BOP_CMPLTU : *result = lhs < rhs; break;
+    case BOP_CMPLEU : *result = lhs <= rhs; break;
+    case BOP_CMPLTS :
+        *result = (int64_t) opt_signed(lhs, bits) < (int64_t) opt_signed(rhs, bits);
+        break;
+    case BOP_CMPLES :
+        *result = (int64_t) opt_signed(lhs, bits) <= (int64_t) opt_signed(rhs, bits);
+        break;
+    case BOP_SEXT : *result = opt_signed(lhs, bits); break;
+    case BOP_ZEXT :
+    case BOP_TRUN : *result = lhs; break;
+    default :
+        return -1;
+    }
+
+    *result &= opt_mask(boper_bits(bins->oper[0]));
+    return 0;
+}
+
+
+/*
+* Replaces bins with a move of its result, if its operands are constants.
+* @return 1 if bins was folded, 0 otherwise.
+*/
+static int opt_fold (struct bins * bins) {
+    if (    (bins->op == BOP_LOAD)
+         || (bins->op == BOP_LOADBE)
+         || (boper_type(bins->oper[0]) == BOPER_CONSTANT)
+         || (boper_type(bins->oper[1]) != BOPER_CONSTANT)
+         || (    (bins->oper[2] != NULL)
+              && (boper_type(bins->oper[2]) != BOPER_CONSTANT)))
+        return 0;
+    /* already a move */
+    if ((bins->op == BOP_OR) && opt_is_zero(bins->oper[2]))
+        return 0;
+
+    uint64_t result;
+    if (opt_eval(bins, &result))
+        return 0;
+
+    unsigned int bits = boper_bits(bins->oper[0]);
+    ODEL(bins->oper[1]);
+    if (bins->oper[2] != NULL)
+        ODEL(bins->oper[2]);
+    bins->op = BOP_OR;
+    bins->oper[1] = boper_constant(bits, result);
+    bins->oper[2] = boper_constant(bits, 0);
+    return 1;
+}
+
+
+/* Constant folding, and constant and copy propagation, in one forward walk */
+static void opt_propagate (struct list * binslist,
+                           unsigned int passes,
+                           const struct opt_vars * vars,
+                           struct opt_stats * stats) {
+    struct opt_facts facts;
+    facts.facts = NULL;
+    facts.size = 0;
+    struct opt_branches branches;
+    opt_branches_init(&branches, binslist);
+
+    struct list_it * it;
+    for (it = list_it(binslist); it != NULL; it = list_it_next(it)) {
+        struct bins * bins = list_it_data(it);
+        int conditional = opt_branches_walk(&branches, bins);
+
+        unsigned int reads;
+        int writes;
+        if (opt_operands(bins, &reads, &writes)) {
+            opt_facts_clear(&facts);
+            continue;
+        }
+
+        unsigned int i;
+        for (i = 0; i < 3; i++) {
+            if (    ((reads & (1 << i)) == 0)
+                 || (boper_type(bins->oper[i]) == BOPER_CONSTANT))
+                continue;
+            const struct boper * value = opt_fact_get(&facts, bins->oper[i]);
+            if (value == NULL)
+                continue;
+            if (boper_type(value) == BOPER_CONSTANT) {
+                if ((passes & OPT_CONST_PROP) == 0)
+                    continue;
+                stats->constants++;
+            }
+            else {
+                /* amd64 moves lhs into dst before reading rhs */
+                if (    ((passes & OPT_COPY_PROP) == 0)
+                     || (    writes
+                          && (boper_type(bins->oper[0]) != BOPER_CONSTANT)
+                          && (boper_id(bins->oper[0]) == boper_id(value))))
+                    continue;
+                stats->copies++;
+            }
+            ODEL(bins->oper[i]);
+            bins->oper[i] = OCOPY(value);
+        }
+
+        if ((! writes) || (boper_type(bins->oper[0]) == BOPER_CONSTANT))
+            continue;
+
+        if ((passes & OPT_FOLD) && opt_fold(bins))
+            stats->folded++;
+
+        opt_fact_kill(&facts, bins->oper[0]);
+        /* what a conditional instruction writes is unknown after it */
+        if (conditional)
+            continue;
+
+        const struct boper * moved = opt_moved(bins);
+        if (    (moved == NULL)
+             || (boper_bits(moved) != boper_bits(bins->oper[0]))
+             || opt_same(moved, bins->oper[0]))
+            continue;
+        if (    (boper_type(moved) == BOPER_CONSTANT)
+             && (passes & OPT_CONST_PROP))
+            opt_fact_set(&facts, bins->oper[0], moved);
+        else if (    (boper_type(moved) != BOPER_CONSTANT)
+                  && (passes & OPT_COPY_PROP))
+            opt_fact_set(&facts, bins->oper[0], moved);
+    }
+
+    opt_facts_clear(&facts);
+    free(facts.facts);
+    free(branches.labels);
+}
+
+
+static int opt_live (const struct boper ** live,
+                     unsigned int live_size,
+                     const struct boper * variable) {
+    unsigned int i;
+    for (i = 0; i < live_size; i++) {
+        if (opt_same(live[i], variable))
+            return 1;
+    }
+    return 0;
+}
+
+
+/* Removes variable from the size variables in set */
+static void opt_live_remove (const struct boper ** set,
+                             unsigned int * size,
+                             const struct boper * variable) {
+    unsigned int i = 0;
+    while (i < *size) {
+        if (opt_same(set[i], variable))
+            set[i] = set[--(*size)];
+        else
+            i++;
+    }
+}
+
+
+static int opt_is (int (* is) (const char * identifier),
+                   const struct boper * boper) {
+    return    (is != NULL)
+           && (boper_type(boper) == BOPER_VARIABLE)
+           && is(boper_identifier(boper));
+}
+
+
+/*
+* Dead code elimination, in one backward walk. Temporaries are dead at the end
+* of a block and hooks never read them, and the flags in vars->dead_flags are
+* dead at the end of the block too.
+*/
+static void opt_dce (struct list * binslist,
+                     unsigned int passes,
+                     const struct opt_vars * vars,
+                     struct opt_stats * stats) {
+    unsigned int size = list_length(binslist);
+    if (size == 0)
+        return;
+
+    int (* is_flag) (const char *) = NULL;
+    if (passes & OPT_DEAD_FLAGS)
+        is_flag = vars->is_flag;
+
+    unsigned int dead_flags_size = 0;
+    if ((is_flag != NULL) && (vars->dead_flags != NULL))
+        dead_flags_size = list_length(vars->dead_flags);
+
+    struct bins ** binses = malloc(sizeof(struct bins *) * size);
+    /* set for instructions a branch may skip */
+    uint8_t * conditional = calloc(size, 1);
+    uint8_t * dead = calloc(size, 1);
+    /* temporaries read after the instruction we're at */
+    const struct boper ** live = malloc(sizeof(struct boper *) * size * 3);
+    unsigned int live_size = 0;
+    /* flags written after the instruction we're at, before anything reads
+       them */
+    const struct boper ** overwritten;
+    overwritten = malloc(sizeof(struct boper *) * (size + dead_flags_size));
+    unsigned int overwritten_size = 0;
+
+    if (dead_flags_size > 0) {
+        struct list_it * it;
+        for (it = list_it(vars->dead_flags); it != NULL; it = list_it_next(it))
+            overwritten[overwritten_size++] = list_it_data(it);
+    }
+
+    struct opt_branches branches;
+    opt_branches_init(&branches, binslist);
+    unsigned int i = 0;
+    struct list_it * it;
+    for (it = list_it(binslist); it != NULL; it = list_it_next(it)) {
+        struct bins * bins = list_it_data(it);
+        binses[i] = bins;
+        conditional[i] = opt_branches_walk(&branches, bins);
+        i++;
+    }
+    free(branches.labels);
+
+    for (i = size; i-- > 0; ) {
+        struct bins * bins = binses[i];
+
+        unsigned int reads;
+        int writes;
+        /* hooks may read every flag, but no temporary */
+        if (opt_operands(bins, &reads, &writes)) {
+            overwritten_size = 0;
+            continue;
+        }
+        if (bins->op == BOP_HLT)
+            overwritten_size = 0;
+
+        if (writes && (! conditional[i])) {
+            const struct boper * dst = bins->oper[0];
+            const struct boper * moved = opt_moved(bins);
+            int temporary =    (passes & OPT_DCE)
+                            && (boper_type(dst) == BOPER_TEMPORARY);
+            int flag = opt_is(is_flag, dst);
+
+            /* loads stay, they may fault */
+            if (    (bins->op != BOP_LOAD)
+                 && (bins->op != BOP_LOADBE)
+                 && (    (    (passes & OPT_DCE)
+                           && (    (boper_type(dst) == BOPER_CONSTANT)
+                                || ((moved != NULL) && opt_same(moved, dst))))
+                      || (    temporary
+                           && (! opt_live(live, live_size, dst)))
+                      || (    flag
+                           && opt_live(overwritten, overwritten_size, dst)))) {
+                dead[i] = 1;
+                if (flag)
+                    stats->flags++;
+                continue;
+            }
+
+            if (temporary)
+                opt_live_remove(live, &live_size, dst);
+            if (flag && (! opt_live(overwritten, overwritten_size, dst)))
+                overwritten[overwritten_size++] = dst;
+        }
+
+        unsigned int j;
+        for (j = 0; j < 3; j++) {
+            const struct boper * boper = bins->oper[j];
+            if ((reads & (1 << j)) == 0)
+                continue;
+            if (    (boper_type(boper) == BOPER_TEMPORARY)
+                 && (! opt_live(live, live_size, boper)))
+                live[live_size++] = boper;
+            if (opt_is(is_flag, boper))
+                opt_live_remove(overwritten, &overwritten_size, boper);
+        }
+    }
+
+    i = 0;
+    it = list_it(binslist);
+    while (it != NULL) {
+        if (dead[i]) {
+            it = list_it_remove(binslist, it);
+            stats->eliminated++;
+        }
+        else
+            it = list_it_next(it);
+        i++;
+    }
+
+    free(binses);
+    free(conditional);
+    free(dead);
+    free(live);
+    free(overwritten);
+}
+
+
+static const struct opt_pass opt_passes[] = {
+    {"propagate", OPT_FOLD | OPT_CONST_PROP | OPT_COPY_PROP, opt_propagate},
+    {"dce", OPT_DCE | OPT_DEAD_FLAGS, opt_dce},
+    {NULL, 0, NULL}
+};
+
+
+void opt_run (struct list * binslist,
+              unsigned int passes,
+              const struct opt_vars * vars,
+              struct opt_stats * stats) {
+    stats->blocks++;
+    stats->bins_in += list_length(binslist);
+
+    unsigned int i;
+    for (i = 0; opt_passes[i].name != NULL; i++) {
+        if (passes & opt_passes[i].passes)
+            opt_passes[i].run(binslist, passes, vars, stats);
+    }
+
+    stats->bins_out += list_length(binslist);
+}
+
+
+static int opt_flags_contain (struct list * flags, const struct boper * flag) {
+    struct list_it * it;
+    for (it = list_it(flags); it != NULL; it = list_it_next(it)) {
+        if (opt_same(list_it_data(it), flag))
+            return 1;
+    }
+    return 0;
+}
+
+
+struct list * opt_flags_written (struct list * binslist,
+                                 int (* is_flag) (const char * identifier)) {
+    struct list * written = list_create();
+    struct list * read = list_create();
+    struct opt_branches branches;
+    opt_branches_init(&branches, binslist);
+
+    struct list_it * it;
+    for (it = list_it(binslist); it != NULL; it = list_it_next(it)) {
+        struct bins * bins = list_it_data(it);
+        int conditional = opt_branches_walk(&branches, bins);
+
+        unsigned int reads;
+        int writes;
+        if (opt_operands(bins, &reads, &writes) || (bins->op == BOP_HLT))
+            break;
+
+        unsigned int i;
+        for (i = 0; i < 3; i++) {
+            if (    (reads & (1 << i))
+                 && opt_is(is_flag, bins->oper[i])
+                 && (! opt_flags_contain(read, bins->oper[i])))
+                list_append(read, bins->oper[i]);
+        }
+
+        if (    writes
+             && (! conditional)
+             && opt_is(is_flag, bins->oper[0])
+             && (! opt_flags_contain(read, bins->oper[0]))
+             && (! opt_flags_contain(written, bins->oper[0])))
+            list_append(written, bins->oper[0]);
+    }
+
+    free(branches.labels);
+    ODEL(read);
+    return written;
+}
+
+
+void opt_flags_intersect (struct list * flags, struct list * other) {
+    struct list_it * it = list_it(flags);
+    while (it != NULL) {
+        if (opt_flags_contain(other, list_it_data(it)))
+            it = list_it_next(it);
+        else
+            it = list_it_remove(flags, it);
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef opt_HEADER
+#define opt_HEADER
+
+/*
+* Optimization passes over the bins list of a block, run between the
+* HOOK_JIT_TRANSLATE hooks and assembly.
+*
+* OPT_FOLD replaces instructions whose operands are all constants with a
+* move of the result, written as or dst, result, 0.
+* OPT_CONST_PROP and OPT_COPY_PROP replace reads of a variable with the
+* constant or variable last moved into it.
+* OPT_DCE removes instructions which write a temporary nothing reads, and
+* instructions with no effect.
+* OPT_DEAD_FLAGS removes writes to guest flags which are written again before
+* anything reads them, later in the block or, for the flags in
+* opt_vars.dead_flags, in every successor of the block. The temporaries
+* computing them then go with OPT_DCE.
+*
+* Hooks may read and write any variable, so nothing is known across a
+* BOP_HOOK, and every variable but the temporaries is read by it. The platform may read any flag
+* at a BOP_HLT. Instructions between a branch and its label are never removed,
+* and what they write is unknown after them. Blocks reach opt with their
+* BOP_CE lowered, see bins_lower_ce.
+*/
+
+#include "container/list.h"
+
+#include <stdint.h>
+
+#define OPT_FOLD       1
+#define OPT_CONST_PROP 2
+#define OPT_COPY_PROP  4
+#define OPT_DCE        8
+#define OPT_DEAD_FLAGS 16
+#define OPT_ALL (OPT_FOLD | OPT_CONST_PROP | OPT_COPY_PROP | OPT_DCE \
+                 | OPT_DEAD_FLAGS)
+
+/* What the passes may assume about the variables of a block */
+struct opt_vars {
+    /* Returns 1 if the variable identifier is a guest flag. May be NULL, in
+       which case no variable is. */
+    int (* is_flag) (const char * identifier);
+    /* flags, as variable bopers, which every successor of the block writes
+       before reading, or NULL if there are none */
+    struct list * dead_flags;
+};
+
+struct opt_stats {
+    /* number of blocks optimized */
+    unsigned int blocks;
+    /* number of bins before and after optimizing */
+    unsigned int bins_in;
+    unsigned int bins_out;
+    /* number of instructions replaced with a move of a constant */
+    unsigned int folded;
+    /* number of operands replaced with a constant, and with another
+       variable */
+    unsigned int constants;
+    unsigned int copies;
+    /* number of instructions removed */
+    unsigned int eliminated;
+    /* number of those which wrote a flag */
+    unsigned int flags;
+};
+
+/*
+* Runs the passes set in passes over binslist, in place, and adds what they
+* did to stats.
+*/
+void opt_run (struct list * binslist,
+              unsigned int passes,
+              const struct opt_vars * vars,
+              struct opt_stats * stats);
+
+/*
+* Returns the flags binslist always writes before it reads them, as a list of
+* variable bopers. Stops at the first instruction which may read every flag.
+*/
+struct list * opt_flags_written (struct list * binslist,
+                                 int (* is_flag) (const char * identifier));
+
+/* Removes the flags which are not also in other from flags */
+void opt_flags_intersect (struct list * flags, struct list * other);
+
+#endif
@@ -1,53 +1,40 @@
 #include "btlog.h"
 
-#include "container/list.h"
-
-#include "object.h"
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 
-struct btlog_object * btlog_object_create (const char * line);
-void                  btlog_object_delete (struct btlog_object * btlog_object);
-struct btlog_object * btlog_object_copy   (const struct btlog_object * btlog_object);
-
-
-
-struct list * btlog_list = NULL;
-FILE * btlog_fh = NULL;
-
-
-
-const struct object_vtable btlog_object_object = {
-    (void (*) (void *)) btlog_object_delete,
-    (void * (*) (const void *)) btlog_object_copy,
-    NULL
-};
-
-struct btlog_object {
-    struct object_header oh;
-    char * line;
+unsigned char btlog_levels[BTLOG_SUBSYSTEMS] = {
+    BTLOG_DEFAULT_LEVEL,
+    BTLOG_DEFAULT_LEVEL,
+    BTLOG_DEFAULT_LEVEL,
+    BTLOG_DEFAULT_LEVEL,
+    BTLOG_DEFAULT_LEVEL,
+    BTLOG_DEFAULT_LEVEL,
+    BTLOG_DEFAULT_LEVEL
 };
 
-
-struct btlog_object * btlog_object_create (const char * line) {
-    struct btlog_object * btlog_object = malloc(sizeof(struct btlog_object));
-    object_init(&(btlog_object->oh), &btlog_object_object);
-    btlog_object->line = strdup(line);
-    return btlog_object;
-}
-
-
-void btlog_object_delete (struct btlog_object * btlog_object) {
-    free(btlog_object->line);
-    free(btlog_object);
-}
-
-
-struct btlog_object * btlog_object_copy (const struct btlog_object * btlog_object) {
-    return btlog_object_create(btlog_object->line);
+FILE * btlog_fh = NULL;
+/* the last BTLOG_RING_SIZE messages, btlog_ring_next is the oldest once the
+   ring is full */
+static char btlog_ring[BTLOG_RING_SIZE][BTLOG_LINE_SIZE];
+static unsigned int btlog_ring_next = 0;
+static unsigned int btlog_ring_size = 0;
+/* btlog is called from every thread running a shared jit */
+static pthread_mutex_t btlog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void btlog_set_level (unsigned int subsystem, unsigned int level) {
+    if (subsystem == BTLOG_ALL) {
+        unsigned int i;
+        for (i = 0; i < BTLOG_SUBSYSTEMS; i++)
+            btlog_levels[i] = level;
+    }
+    else if (subsystem < BTLOG_SUBSYSTEMS)
+        btlog_levels[subsystem] = level;
 }
 
 
@@ -56,72 +43,61 @@ void btlog_continuous (const char * filename) {
 }
 
 
-void btlog (const char * format, ...) {
-    va_list args;
-    va_start(args, format);
-    // vasprintf support is a pain
-    size_t str_size = 256;
-    char * str = malloc(str_size);
-    do {
-        size_t sprintf_chars = vsnprintf(str, str_size, format, args);
-        if (sprintf_chars >= str_size - 1) {
-            free(str);
-            str_size *= 2;
-            str = malloc(str_size);
-        }
-        else
-            break;
-    } while(1);
-    va_end(args);
+static void btlog_vwrite (const char * format, va_list args) {
+    char line[BTLOG_LINE_SIZE];
+    vsnprintf(line, BTLOG_LINE_SIZE, format, args);
 
+    pthread_mutex_lock(&btlog_lock);
     if (btlog_fh != NULL) {
-        fprintf(btlog_fh, "%s\n", str);
+        fprintf(btlog_fh, "%s\n", line);
         fflush(btlog_fh);
     }
     else {
-        if (btlog_list == NULL)
-            btlog_list = list_create();
-
-        list_append_(btlog_list, btlog_object_create(str));
+        memcpy(btlog_ring[btlog_ring_next], line, BTLOG_LINE_SIZE);
+        btlog_ring_next = (btlog_ring_next + 1) % BTLOG_RING_SIZE;
+        if (btlog_ring_size < BTLOG_RING_SIZE)
+            btlog_ring_size++;
     }
+    pthread_mutex_unlock(&btlog_lock);
+}
+
 
-    free(str);
+void btlog_write (unsigned int subsystem,
+                  unsigned int level,
+                  const char * format,
+                  ...) {
+    va_list args;
+    va_start(args, format);
+    btlog_vwrite(format, args);
+    va_end(args);
 }
 
 
-void btlog_error (const char * format, ...) {
+void btlog (const char * format, ...) {
+    if (! BTLOG_ENABLED(BTLOG_CORE, BTLOG_DEBUG))
+        return;
+
     va_list args;
     va_start(args, format);
-    // vasprintf support is a pain
-    size_t str_size = 256;
-    char * str = malloc(str_size);
-    do {
-        size_t sprintf_chars = vsnprintf(str, str_size, format, args);
-        if (sprintf_chars >= str_size - 1) {
-            free(str);
-            str_size *= 2;
-            str = malloc(str_size);
-        }
-        else
-            break;
-    } while(1);
+    btlog_vwrite(format, args);
     va_end(args);
+}
 
-    if (btlog_fh != NULL) {
-        fprintf(btlog_fh, "%s\n", str);
-        fflush(btlog_fh);
-    }
-    else {
-        if (btlog_list == NULL)
-            btlog_list = list_create();
 
-        list_append_(btlog_list, btlog_object_create(str));
+void btlog_error (const char * format, ...) {
+    va_list args;
+    if (BTLOG_ENABLED(BTLOG_CORE, BTLOG_ERROR)) {
+        va_start(args, format);
+        btlog_vwrite(format, args);
+        va_end(args);
     }
 
-    printf("\e[31m%s\e[39m\n", str);
+    printf("\e[31m");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\e[39m\n");
     fflush(stdout);
-
-    free(str);
 }
 
 
@@ -131,12 +107,14 @@ void write_btlog (const char * filename) {
     if (fh == NULL)
         return;
 
-    struct list_it * it;
-
-    for (it = list_it(btlog_list); it != NULL; it = list_it_next(it)) {
-        struct btlog_object * btlog_object = list_it_data(it);
-        fprintf(fh, "%s\n", btlog_object->line);
-    }
+    pthread_mutex_lock(&btlog_lock);
+    unsigned int first = 0;
+    if (btlog_ring_size == BTLOG_RING_SIZE)
+        first = btlog_ring_next;
+    unsigned int i;
+    for (i = 0; i < btlog_ring_size; i++)
+        fprintf(fh, "%s\n", btlog_ring[(first + i) % BTLOG_RING_SIZE]);
+    pthread_mutex_unlock(&btlog_lock);
 
     fclose(fh);
 }
@@ -1,12 +1,86 @@
 #ifndef btlog_HEADER
 #define btlog_HEADER
 
+/*
+* Leveled logging, with a separate level for each subsystem.
+*
+* BTLOG checks the level before its arguments are evaluated or anything is
+* formatted, so a disabled message costs one branch. Messages above
+* BTLOG_MAX_LEVEL are removed at compile time. Build with
+* -DBTLOG_MAX_LEVEL=BTLOG_TRACE to keep per-block and per-access messages.
+*
+* Messages go to the file given to btlog_continuous. Without one, the last
+* BTLOG_RING_SIZE messages are kept for write_btlog.
+*/
+
+enum {
+    BTLOG_OFF = 0,
+    BTLOG_ERROR,
+    BTLOG_WARN,
+    BTLOG_INFO,
+    BTLOG_DEBUG,
+    /* once per block executed or guest memory access */
+    BTLOG_TRACE
+};
+
+enum {
+    BTLOG_CORE = 0,
+    BTLOG_JIT,
+    BTLOG_SOURCE,
+    BTLOG_TARGET,
+    BTLOG_MEMMAP,
+    BTLOG_PLATFORM,
+    BTLOG_PLUGIN,
+    BTLOG_SUBSYSTEMS
+};
+
+/* pass to btlog_set_level for every subsystem */
+#define BTLOG_ALL BTLOG_SUBSYSTEMS
+
+#ifndef BTLOG_MAX_LEVEL
+#define BTLOG_MAX_LEVEL BTLOG_DEBUG
+#endif
+
+#define BTLOG_DEFAULT_LEVEL BTLOG_WARN
+
+/* number of messages kept when there is no btlog_continuous file */
+#define BTLOG_RING_SIZE 1024
+/* longer messages are truncated */
+#define BTLOG_LINE_SIZE 256
+
+/* runtime level of each subsystem, see btlog_set_level */
+extern unsigned char btlog_levels[BTLOG_SUBSYSTEMS];
+
+#define BTLOG_ENABLED(subsystem, level) \
+    (((level) <= BTLOG_MAX_LEVEL) && ((level) <= btlog_levels[subsystem]))
+
+#define BTLOG(subsystem, level, ...) \
+    do { \
+        if (BTLOG_ENABLED(subsystem, level)) \
+            btlog_write(subsystem, level, __VA_ARGS__); \
+    } while (0)
+
+/*
+* Logs messages of subsystem up to and including level. Set levels before
+* starting threads which log.
+*/
+void btlog_set_level (unsigned int subsystem, unsigned int level);
+
 void btlog_continuous (const char * filename);
 
+/* Formats and logs a message. Call this through BTLOG. */
+void btlog_write (unsigned int subsystem,
+                  unsigned int level,
+                  const char * format,
+                  ...);
+
+/* Logs a BTLOG_CORE message at BTLOG_DEBUG */
 void btlog (const char * format, ...);
 
+/* Logs a BTLOG_CORE message at BTLOG_ERROR, and prints it to stdout */
 void btlog_error (const char * format, ...);
 
+/* Writes the kept messages to filename, oldest first */
 void write_btlog (const char * filename);
 
-#endif
\ No newline at end of file
+#endif
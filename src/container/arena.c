@@ -0,0 +1,69 @@
+#include "arena.h"
+
+#include <stdint.h>
+
+const struct object_vtable arena_vtable = {
+    (void (*) (void *)) arena_delete,
+    NULL,
+    NULL
+};
+
+
+struct arena * arena_create () {
+    struct arena * arena = malloc(sizeof(struct arena));
+    object_init(&(arena->oh), &arena_vtable);
+    arena->chunks = NULL;
+    arena->chunks_size = 0;
+    return arena;
+}
+
+
+void arena_delete (struct arena * arena) {
+    while (arena->chunks != NULL) {
+        struct arena_chunk * next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    free(arena);
+}
+
+
+/* Adds a chunk with room for at least size bytes */
+static struct arena_chunk * arena_chunk_create (struct arena * arena,
+                                                size_t size) {
+    if (size < ARENA_CHUNK_SIZE)
+        size = ARENA_CHUNK_SIZE;
+
+    /* the chunk's header and data are one allocation */
+    struct arena_chunk * chunk = malloc(sizeof(struct arena_chunk)
+                                        + size
+                                        + ARENA_ALIGN);
+    if (chunk == NULL)
+        return NULL;
+
+    uintptr_t data = (uintptr_t) &(chunk[1]);
+    data = (data + ARENA_ALIGN - 1) & ~((uintptr_t) ARENA_ALIGN - 1);
+    chunk->data = (unsigned char *) data;
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->chunks_size++;
+    return chunk;
+}
+
+
+void * arena_alloc (struct arena * arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+    struct arena_chunk * chunk = arena->chunks;
+    if ((chunk == NULL) || (chunk->size - chunk->used < size)) {
+        chunk = arena_chunk_create(arena, size);
+        if (chunk == NULL)
+            return NULL;
+    }
+
+    void * memory = &(chunk->data[chunk->used]);
+    chunk->used += size;
+    return memory;
+}
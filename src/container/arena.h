@@ -0,0 +1,60 @@
+#ifndef arena_HEADER
+#define arena_HEADER
+
+/**
+* An arena hands out memory from a few large chunks, and frees all of it at
+* once when it is deleted. Use it for many small allocations which all live
+* as long as each other, like the instructions of a block we are assembling.
+*
+* Arenas can't be copied, as everything allocated from one would still point
+* into the original.
+*/
+
+#include "object.h"
+
+#include <stdlib.h>
+
+/* allocations are aligned to this many bytes */
+#define ARENA_ALIGN 16
+/* the size of a chunk, unless one allocation needs more */
+#define ARENA_CHUNK_SIZE 4096
+
+struct arena_chunk {
+    struct arena_chunk * next;
+    size_t size;
+    size_t used;
+    unsigned char * data;
+};
+
+struct arena {
+    struct object_header oh;
+    /* the chunk we are allocating from, chunks before it follow next */
+    struct arena_chunk * chunks;
+    /* the number of chunks malloc'd so far */
+    unsigned int chunks_size;
+};
+
+
+/**
+* Creates an empty arena.
+* @return A new arena, which has no chunks until we allocate from it.
+*/
+struct arena * arena_create ();
+
+/**
+* Deletes an arena, and everything allocated from it. Don't call this, call
+* ODEL().
+* @param arena The arena to delete.
+*/
+void arena_delete (struct arena * arena);
+
+/**
+* Allocates memory from an arena. The memory lives until the arena is
+* deleted, and is not initialized.
+* @param arena The arena to allocate from.
+* @param size The number of bytes to allocate.
+* @return ARENA_ALIGN aligned memory of size bytes, or NULL on error.
+*/
+void * arena_alloc (struct arena * arena, size_t size);
+
+#endif
@@ -132,6 +132,21 @@ int byte_buf_append_byte_buf (struct byte_buf * byte_buf,
 }
 
 
+int byte_buf_set_le32 (struct byte_buf * byte_buf,
+                       size_t offset,
+                       uint32_t uint32) {
+    if ((offset > byte_buf->length) || (byte_buf->length - offset < 4))
+        return -1;
+
+    byte_buf->buf[offset] = uint32 & 0xff;
+    byte_buf->buf[offset + 1] = (uint32 >> 8) & 0xff;
+    byte_buf->buf[offset + 2] = (uint32 >> 16) & 0xff;
+    byte_buf->buf[offset + 3] = (uint32 >> 24) & 0xff;
+
+    return 0;
+}
+
+
 size_t byte_buf_length (const struct byte_buf * byte_buf) {
     return byte_buf->length;
 }
@@ -93,6 +93,17 @@ int byte_buf_append_bytes (struct byte_buf * byte_buf,
 int byte_buf_append_byte_buf (struct byte_buf * byte_buf,
                               const struct byte_buf * src);
 
+/**
+* Overwrites 4 bytes of a byte_buf with a little-endian 32-bit value.
+* @param byte_buf The byte_buf to change.
+* @param offset The offset of the first byte to overwrite.
+* @param uint32 The value to write.
+* @return 0 on success, non-zero if the bytes are past the end of byte_buf.
+*/
+int byte_buf_set_le32 (struct byte_buf * byte_buf,
+                       size_t offset,
+                       uint32_t uint32);
+
 /**
 * Gets the length of the contents of a byte_buf.
 * @param byte_buf The byte_buf we want the length of.
@@ -90,7 +90,10 @@ void list_prepend_ (struct list * list, void * obj) {
     it->obj = obj;
     it->prev = NULL;
     it->next = list->front;
-    list->front->prev = it;
+    if (list->front == NULL)
+        list->back = it;
+    else
+        list->front->prev = it;
     list->front = it;
 }
 
@@ -117,6 +120,8 @@ void list_pop_front (struct list * list) {
     list->front = tmp->next;
     if (list->front != NULL)
         list->front->prev = NULL;
+    else
+        list->back = NULL;
 
     ODEL(tmp->obj);
     free(tmp);
@@ -132,6 +137,8 @@ void list_pop_back (struct list * list) {
 
     if (list->back != NULL)
         list->back->next = NULL;
+    else
+        list->front = NULL;
 
     ODEL(tmp->obj);
     free(tmp);
@@ -163,7 +170,7 @@ struct list * list_slice (
         last = list_it_next(last);
     }
     while (it != last) {
-        list_append(new, it);
+        list_append(new, list_it_data(it));
         it = list_it_next(it);
     }
     return new;
@@ -2,8 +2,24 @@
 
 #include "btlog.h"
 
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* the number of direct memmaps which may exist at once */
+#define MEMMAP_DIRECT_MAX 64
+
+/* every direct memmap, for memmap_direct_fault */
+static struct memmap * memmap_directs[MEMMAP_DIRECT_MAX];
+static pthread_mutex_t memmap_directs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the SIGSEGV handler of direct memmaps, and the one it replaced */
+static pthread_once_t memmap_segv_once = PTHREAD_ONCE_INIT;
+static struct sigaction memmap_segv_previous;
+static int (* memmap_direct_resume) (void * context) = NULL;
 
 const struct object_vtable memmap_page_vtable = {
     (void (*) (void *))                    memmap_page_delete,
@@ -21,6 +37,9 @@ struct memmap_page * memmap_page_create (uint64_t address,
     memmap_page->data    = malloc(size);
     memmap_page->size    = size;
     memmap_page->permissions = permissions;
+    memmap_page->code = 0;
+    memmap_page->index = 0;
+    memmap_page->direct = 0;
     memset(memmap_page->data, 0, memmap_page->size);
 
     return memmap_page;
@@ -28,7 +47,16 @@ struct memmap_page * memmap_page_create (uint64_t address,
 
 
 void memmap_page_delete (struct memmap_page * memmap_page) {
-    free(memmap_page->data);
+    /* zero direct pages and make them inaccessible, leaving them reserved */
+    if (memmap_page->direct)
+        mmap(memmap_page->data,
+             memmap_page->size,
+             PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+             -1,
+             0);
+    else
+        free(memmap_page->data);
     free(memmap_page);
 }
 
@@ -38,6 +66,7 @@ struct memmap_page * memmap_page_copy (const struct memmap_page * memmap_page) {
                                                    memmap_page->size,
                                                    memmap_page->permissions);
     memcpy(copy->data, memmap_page->data, memmap_page->size);
+    copy->code = memmap_page->code;
     return copy;
 }
 
@@ -52,6 +81,24 @@ int memmap_page_cmp (const struct memmap_page * lhs,
 }
 
 
+/* Empties every entry of memmap's tlb */
+static void memmap_tlb_flush (struct memmap * memmap) {
+    unsigned int i;
+    for (i = 0; i < MEMMAP_TLB_SIZE; i++) {
+        memmap->tlb[i].read = MEMMAP_TLB_EMPTY;
+        memmap->tlb[i].write = MEMMAP_TLB_EMPTY;
+    }
+}
+
+
+/* Stops writes through memmap's tlb, for when pages stop being dirty */
+static void memmap_tlb_flush_write (struct memmap * memmap) {
+    unsigned int i;
+    for (i = 0; i < MEMMAP_TLB_SIZE; i++)
+        memmap->tlb[i].write = MEMMAP_TLB_EMPTY;
+}
+
+
 const struct object_vtable memmap_vtable = {
     (void (*) (void *)) memmap_delete,
     (void * (*) (const void *)) memmap_copy,
@@ -66,6 +113,104 @@ struct memmap * memmap_create (unsigned int page_size) {
     memmap->tree = tree_create();
     memmap->page_size = page_size;
     memmap->flags = 0;
+    memmap->code_written = NULL;
+    memmap->code_written_arg = NULL;
+    memmap->pages = NULL;
+    memmap->pages_size = 0;
+    memmap->dirty = NULL;
+    memmap->generation = 0;
+    memmap_tlb_flush(memmap);
+    memmap->direct = NULL;
+    memmap->direct_size = 0;
+    memmap->direct_limit = 0;
+
+    return memmap;
+}
+
+
+/*
+* Handles faults in the mappings of direct memmaps, see memmap_direct_fault.
+* A fault where no page is goes to memmap_direct_resume. Anything we don't
+* handle goes on to whoever handled SIGSEGV before us.
+*/
+static void memmap_segv (int signum, siginfo_t * info, void * context) {
+    int (* resume) (void *);
+    resume = __atomic_load_n(&memmap_direct_resume, __ATOMIC_ACQUIRE);
+
+    switch (memmap_direct_fault((uintptr_t) info->si_addr)) {
+    case 0 :
+        return;
+    case 1 :
+        if ((resume != NULL) && (resume(context) == 0))
+            return;
+        break;
+    }
+
+    if (memmap_segv_previous.sa_flags & SA_SIGINFO)
+        memmap_segv_previous.sa_sigaction(signum, info, context);
+    else if (    (memmap_segv_previous.sa_handler != SIG_DFL)
+              && (memmap_segv_previous.sa_handler != SIG_IGN))
+        memmap_segv_previous.sa_handler(signum);
+    else {
+        /* the access faults again once we return, and dies as it would
+           have without us */
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+
+static void memmap_segv_install (void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = memmap_segv;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&(action.sa_mask));
+    sigaction(SIGSEGV, &action, &memmap_segv_previous);
+}
+
+
+struct memmap * memmap_create_direct (unsigned int page_size, uint64_t size) {
+    long host_page_size = sysconf(_SC_PAGESIZE);
+    if (    (host_page_size <= 0)
+         || (page_size == 0)
+         || (page_size % host_page_size)
+         || (size < page_size)
+         || (size % page_size))
+        return NULL;
+
+    void * direct = mmap(NULL,
+                         size,
+                         PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                         -1,
+                         0);
+    if (direct == MAP_FAILED)
+        return NULL;
+
+    pthread_once(&memmap_segv_once, memmap_segv_install);
+
+    struct memmap * memmap = memmap_create(page_size);
+    memmap->direct = direct;
+    memmap->direct_size = size;
+    memmap->direct_limit = size - 7;
+
+    pthread_mutex_lock(&memmap_directs_lock);
+    unsigned int i;
+    for (i = 0; i < MEMMAP_DIRECT_MAX; i++) {
+        if (memmap_directs[i] == NULL) {
+            __atomic_store_n(&(memmap_directs[i]), memmap, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&memmap_directs_lock);
+
+    if (i == MEMMAP_DIRECT_MAX) {
+        BTLOG(BTLOG_MEMMAP, BTLOG_WARN,
+              "[memmap_create_direct] more than %u direct memmaps",
+              MEMMAP_DIRECT_MAX);
+        ODEL(memmap);
+        return NULL;
+    }
 
     return memmap;
 }
@@ -73,24 +218,274 @@ struct memmap * memmap_create (unsigned int page_size) {
 
 void memmap_delete (struct memmap * memmap) {
     ODEL(memmap->tree);
+    if (memmap->direct != NULL) {
+        pthread_mutex_lock(&memmap_directs_lock);
+        unsigned int i;
+        for (i = 0; i < MEMMAP_DIRECT_MAX; i++) {
+            if (memmap_directs[i] == memmap)
+                __atomic_store_n(&(memmap_directs[i]), NULL, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&memmap_directs_lock);
+        munmap(memmap->direct, memmap->direct_size);
+    }
+    free(memmap->pages);
+    free(memmap->dirty);
     free(memmap);
 }
 
 
+static inline int memmap_is_dirty (const struct memmap * memmap,
+                                   const struct memmap_page * page) {
+    return (memmap->dirty[page->index / 64] >> (page->index % 64)) & 1;
+}
+
+
+/*
+* Makes a direct page writable only while it is dirty and holds no code, so
+* writes which must be seen fault. See memmap_create_direct.
+*/
+static void memmap_protect (const struct memmap * memmap,
+                            const struct memmap_page * page) {
+    if (! page->direct)
+        return;
+    int prot = PROT_READ;
+    if (memmap_is_dirty(memmap, page) && (page->code == 0))
+        prot |= PROT_WRITE;
+    mprotect(page->data, page->size, prot);
+}
+
+
+/* Marks page as changed since the last snapshot */
+static inline void memmap_dirty (struct memmap * memmap,
+                                 const struct memmap_page * page) {
+    uint64_t bit = 1ULL << (page->index % 64);
+    if (memmap->dirty[page->index / 64] & bit)
+        return;
+    memmap->dirty[page->index / 64] |= bit;
+    memmap_protect(memmap, page);
+}
+
+
+/* Creates the page at address, in memmap's direct mapping if it lies there */
+static struct memmap_page * memmap_page_new (struct memmap * memmap,
+                                             uint64_t address,
+                                             unsigned int permissions) {
+    if ((memmap->direct == NULL) || (address >= memmap->direct_size))
+        return memmap_page_create(address, memmap->page_size, permissions);
+
+    struct memmap_page * page = malloc(sizeof(struct memmap_page));
+    object_init(&(page->oh), &memmap_page_vtable);
+    page->address = address;
+    page->data = &(memmap->direct[address]);
+    page->size = memmap->page_size;
+    page->permissions = permissions;
+    page->code = 0;
+    page->index = 0;
+    page->direct = 1;
+    return page;
+}
+
+
+/*
+* Points the tlb entry for address at page. Writes may use it once page is
+* dirty and holds no code, as they then have nothing more to do than store
+* the byte.
+*/
+static void memmap_tlb_fill (struct memmap * memmap,
+                             struct memmap_page * page,
+                             uint64_t address) {
+    if (memmap->page_size < MEMMAP_TLB_GRANULE)
+        return;
+
+    uint64_t granule = address & ~((uint64_t) MEMMAP_TLB_GRANULE - 1);
+    struct memmap_tlb * tlb = &(memmap->tlb[MEMMAP_TLB_INDEX(address)]);
+    tlb->read = granule;
+    if ((page->code == 0) && memmap_is_dirty(memmap, page))
+        tlb->write = granule;
+    else
+        tlb->write = MEMMAP_TLB_EMPTY;
+    tlb->addend = (uint64_t) (uintptr_t) &(page->data[granule - page->address])
+                - granule;
+}
+
+
+/* Adds page to the tree and to pages, and marks it dirty */
+static void memmap_page_insert (struct memmap * memmap,
+                                struct memmap_page * page) {
+    if ((memmap->pages_size % 64) == 0) {
+        unsigned int words = memmap->pages_size / 64 + 1;
+        memmap->pages = realloc(memmap->pages,
+                                sizeof(struct memmap_page *) * words * 64);
+        memmap->dirty = realloc(memmap->dirty, sizeof(uint64_t) * words);
+        memmap->dirty[words - 1] = 0;
+    }
+    page->index = memmap->pages_size;
+    memmap->pages[memmap->pages_size++] = page;
+    tree_insert_(memmap->tree, page);
+    memmap_dirty(memmap, page);
+}
+
+
 struct memmap * memmap_copy (const struct memmap * memmap) {
     struct memmap * copy = memmap_create(memmap->page_size);
-    ODEL(copy->tree);
-    copy->tree = OCOPY(memmap->tree);
+    struct tree_it * it;
+    for (it = tree_it(memmap->tree); it != NULL; it = tree_it_next(it))
+        memmap_page_insert(copy, OCOPY(tree_it_data(it)));
     copy->flags = memmap->flags;
     return copy;
 }
 
 
+const struct object_vtable memmap_snapshot_vtable = {
+    (void (*) (void *)) memmap_snapshot_delete,
+    NULL,
+    NULL
+};
+
+
+void memmap_snapshot_delete (struct memmap_snapshot * snapshot) {
+    free(snapshot->data);
+    free(snapshot->permissions);
+    free(snapshot);
+}
+
+
+struct memmap_snapshot * memmap_snapshot (struct memmap * memmap) {
+    struct memmap_snapshot * snapshot;
+    snapshot = malloc(sizeof(struct memmap_snapshot));
+    object_init(&(snapshot->oh), &memmap_snapshot_vtable);
+
+    snapshot->memmap = memmap;
+    snapshot->generation = ++memmap->generation;
+    snapshot->pages_size = memmap->pages_size;
+    snapshot->data = malloc((size_t) memmap->pages_size * memmap->page_size);
+    snapshot->permissions = malloc(sizeof(unsigned int) * memmap->pages_size);
+
+    unsigned int i;
+    for (i = 0; i < memmap->pages_size; i++) {
+        memcpy(&(snapshot->data[(size_t) i * memmap->page_size]),
+               memmap->pages[i]->data,
+               memmap->page_size);
+        snapshot->permissions[i] = memmap->pages[i]->permissions;
+    }
+    for (i = 0; i < (memmap->pages_size + 63) / 64; i++)
+        memmap->dirty[i] = 0;
+    memmap_tlb_flush_write(memmap);
+    if (memmap->direct != NULL) {
+        for (i = 0; i < memmap->pages_size; i++)
+            memmap_protect(memmap, memmap->pages[i]);
+    }
+
+    return snapshot;
+}
+
+
 void memmap_set_flags (struct memmap * memmap, unsigned int flags) {
     memmap->flags = flags;
 }
 
 
+void memmap_set_code_written (struct memmap * memmap,
+                              void (* code_written) (void * arg,
+                                                     uint64_t address,
+                                                     size_t size),
+                              void * arg) {
+    memmap->code_written = code_written;
+    memmap->code_written_arg = arg;
+}
+
+
+void memmap_mark_code (struct memmap * memmap, uint64_t address, size_t size) {
+    if (size == 0)
+        return;
+
+    struct memmap_page needle;
+    object_init(&(needle.oh), &memmap_page_vtable);
+
+    uint64_t page_address = address & (~(memmap->page_size - 1));
+    uint64_t last = (address + size - 1) & (~(memmap->page_size - 1));
+    while (1) {
+        needle.address = page_address;
+        struct memmap_page * page = tree_fetch(memmap->tree, &needle);
+        if ((page != NULL) && (page->code == 0)) {
+            page->code = 1;
+            memmap_protect(memmap, page);
+            /* writes to the page must come through memmap_byte_set now */
+            uint64_t granule;
+            for (granule = page_address;
+                 granule < page_address + memmap->page_size;
+                 granule += MEMMAP_TLB_GRANULE) {
+                struct memmap_tlb * tlb;
+                tlb = &(memmap->tlb[MEMMAP_TLB_INDEX(granule)]);
+                if (tlb->write == granule)
+                    tlb->write = MEMMAP_TLB_EMPTY;
+            }
+        }
+        if (page_address == last)
+            break;
+        page_address += memmap->page_size;
+    }
+}
+
+
+/* Clears page's code mark, and tells whoever is watching it was written */
+static void memmap_code_written (struct memmap * memmap,
+                                 struct memmap_page * page) {
+    page->code = 0;
+    memmap_protect(memmap, page);
+    if (memmap->code_written != NULL)
+        memmap->code_written(memmap->code_written_arg,
+                             page->address,
+                             page->size);
+}
+
+
+int memmap_restore (struct memmap * memmap,
+                    const struct memmap_snapshot * snapshot) {
+    if (    (snapshot->memmap != memmap)
+         || (snapshot->generation != memmap->generation))
+        return -1;
+
+    /* pages created since the snapshot are all dirty, and go away */
+    while (memmap->pages_size > snapshot->pages_size) {
+        unsigned int index = --memmap->pages_size;
+        struct memmap_page * page = memmap->pages[index];
+        if (page->code)
+            memmap_code_written(memmap, page);
+        tree_remove(memmap->tree, page);
+        memmap->dirty[index / 64] &= ~(1ULL << (index % 64));
+    }
+
+    unsigned int words = (memmap->pages_size + 63) / 64;
+    unsigned int i;
+    for (i = 0; i < words; i++) {
+        uint64_t dirty = memmap->dirty[i];
+        while (dirty != 0) {
+            unsigned int index = i * 64 + __builtin_ctzll(dirty);
+            dirty &= dirty - 1;
+
+            struct memmap_page * page = memmap->pages[index];
+            /* a page holding code is not writable yet */
+            if (page->direct)
+                mprotect(page->data, page->size, PROT_READ | PROT_WRITE);
+            memcpy(page->data,
+                   &(snapshot->data[(size_t) index * memmap->page_size]),
+                   memmap->page_size);
+            page->permissions = snapshot->permissions[index];
+            if (page->code)
+                memmap_code_written(memmap, page);
+            /* and clean once the dirty bits are cleared below */
+            if (page->direct)
+                mprotect(page->data, page->size, PROT_READ);
+        }
+        memmap->dirty[i] = 0;
+    }
+    memmap_tlb_flush(memmap);
+
+    return 0;
+}
+
+
 int memmap_map (struct memmap * memmap,
                 uint64_t address,
                 size_t size,
@@ -114,11 +509,14 @@ int memmap_map (struct memmap * memmap,
     struct memmap_page * page = tree_fetch(memmap->tree, needle);
     // first page doesn't exist, create it
     if (page == NULL) {
-        page = memmap_page_create(page_address, memmap->page_size, permissions);
-        tree_insert_(memmap->tree, page);
+        page = memmap_page_new(memmap, page_address, permissions);
+        memmap_page_insert(memmap, page);
     }
     // set permissions
     page->permissions = permissions;
+    memmap_dirty(memmap, page);
+    if (page->code && (buf_size > 0))
+        memmap_code_written(memmap, page);
 
     // set mapped bytes for first page
     mapped_bytes = memmap->page_size - page_offset;
@@ -143,13 +541,16 @@ int memmap_map (struct memmap * memmap,
         needle->address = page_address;
         page = tree_fetch(memmap->tree, needle);
         if (page == NULL) {
-            page = memmap_page_create(page_address, memmap->page_size, permissions);
-            tree_insert_(memmap->tree, page);
+            page = memmap_page_new(memmap, page_address, permissions);
+            memmap_page_insert(memmap, page);
         }
         page->permissions = permissions;
+        memmap_dirty(memmap, page);
 
         // copy over any data that requires copying
         if (copied_bytes < buf_size) {
+            if (page->code)
+                memmap_code_written(memmap, page);
             uint64_t copy_size = buf_size - copied_bytes;
             if (copy_size > memmap->page_size)
                 copy_size = memmap->page_size;
@@ -167,6 +568,10 @@ int memmap_map (struct memmap * memmap,
 uint8_t __attribute__ ((noinline)) memmap_byte_get (const struct memmap * memmap,
                          uint64_t address,
                          int * error) {
+    const struct memmap_tlb * tlb = &(memmap->tlb[MEMMAP_TLB_INDEX(address)]);
+    if (tlb->read == (address & ~((uint64_t) MEMMAP_TLB_GRANULE - 1)))
+        return *((uint8_t *) (uintptr_t) (tlb->addend + address));
+
     struct memmap_page page;
 
     uint64_t page_address = address & (~(memmap->page_size - 1));
@@ -177,21 +582,28 @@ uint8_t __attribute__ ((noinline)) memmap_byte_get (const struct memmap * memmap
 
     struct memmap_page * tree_page = tree_fetch(memmap->tree, &page);
     if ((tree_page == NULL) && (memmap->flags & MEMMAP_NOFAIL)) {
-        tree_page = memmap_page_create(page_address,
-                                       memmap->page_size,
-                                       MEMMAP_R | MEMMAP_W | MEMMAP_X);
-        tree_insert_(memmap->tree, tree_page);
+        tree_page = memmap_page_new((struct memmap *) memmap,
+                                    page_address,
+                                    MEMMAP_R | MEMMAP_W | MEMMAP_X);
+        memmap_page_insert((struct memmap *) memmap, tree_page);
     }
     else if (tree_page == NULL) {
         *error = 1;
         return 0;
     }
 
+    memmap_tlb_fill((struct memmap *) memmap, tree_page, address);
     return tree_page->data[page_offset];
 }
 
 
 int __attribute__ ((noinline)) memmap_byte_set (struct memmap * memmap, uint64_t address, uint8_t byte) {
+    const struct memmap_tlb * tlb = &(memmap->tlb[MEMMAP_TLB_INDEX(address)]);
+    if (tlb->write == (address & ~((uint64_t) MEMMAP_TLB_GRANULE - 1))) {
+        *((uint8_t *) (uintptr_t) (tlb->addend + address)) = byte;
+        return 0;
+    }
+
     struct memmap_page page;
 
     uint64_t page_address = address & (~(memmap->page_size - 1));
@@ -202,20 +614,65 @@ int __attribute__ ((noinline)) memmap_byte_set (struct memmap * memmap, uint64_t
 
     struct memmap_page * tree_page = tree_fetch(memmap->tree, &page);
     if ((tree_page == NULL) && (memmap->flags & MEMMAP_NOFAIL)) {
-        tree_page = memmap_page_create(page_address,
-                                       memmap->page_size,
-                                       MEMMAP_R | MEMMAP_W | MEMMAP_X);
-        tree_insert_(memmap->tree, tree_page);
+        tree_page = memmap_page_new(memmap,
+                                    page_address,
+                                    MEMMAP_R | MEMMAP_W | MEMMAP_X);
+        memmap_page_insert(memmap, tree_page);
     }
     else if (tree_page == NULL) {
         return 1;
     }
 
+    /* a direct page is writable once it is dirty and holds no code */
+    memmap_dirty(memmap, tree_page);
+    if (tree_page->code)
+        memmap_code_written(memmap, tree_page);
     tree_page->data[page_offset] = byte;
+    memmap_tlb_fill(memmap, tree_page, address);
     return 0;
 }
 
 
+int memmap_direct_fault (uintptr_t address) {
+    unsigned int i;
+    for (i = 0; i < MEMMAP_DIRECT_MAX; i++) {
+        struct memmap * memmap = __atomic_load_n(&(memmap_directs[i]),
+                                                 __ATOMIC_ACQUIRE);
+        if (memmap == NULL)
+            continue;
+        uintptr_t direct = (uintptr_t) memmap->direct;
+        if ((address < direct) || (address - direct >= memmap->direct_size))
+            continue;
+
+        struct memmap_page needle;
+        object_init(&(needle.oh), &memmap_page_vtable);
+        needle.address = (address - direct) & ~((uint64_t) memmap->page_size - 1);
+        struct memmap_page * page = tree_fetch(memmap->tree, &needle);
+        if ((page == NULL) && (memmap->flags & MEMMAP_NOFAIL)) {
+            page = memmap_page_new(memmap,
+                                   needle.address,
+                                   MEMMAP_R | MEMMAP_W | MEMMAP_X);
+            memmap_page_insert(memmap, page);
+            return 0;
+        }
+        else if (page == NULL)
+            return 1;
+
+        /* mapped pages are always readable, so this was a write */
+        memmap_dirty(memmap, page);
+        if (page->code)
+            memmap_code_written(memmap, page);
+        return 0;
+    }
+    return -1;
+}
+
+
+void memmap_set_direct_resume (int (* resume) (void * context)) {
+    __atomic_store_n(&memmap_direct_resume, resume, __ATOMIC_RELEASE);
+}
+
+
 struct buf * memmap_get_buf (const struct memmap * memmap,
                              uint64_t address,
                              size_t size) {
@@ -244,7 +701,9 @@ int memmap_get_u8 (const struct memmap * memmap,
     int error = 0;
     *value = memmap_byte_get(memmap, address, &error);
     unsigned int v = *value;
-    btlog("[memmap_get_u8] address=%08llx, %02x", address, v, 0, 0);
+    BTLOG(BTLOG_MEMMAP, BTLOG_TRACE,
+          "[memmap_get_u8] address=%08llx, %02x",
+          (unsigned long long) address, v);
     return error;
 }
 
@@ -255,7 +714,7 @@ int memmap_get_u16_be (const struct memmap * memmap,
     int error = 0;
     *value = memmap_byte_get(memmap, address, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 1, &error);
+    *value |= memmap_byte_get(memmap, address + 1, &error);
     return error;
 }
 
@@ -266,7 +725,7 @@ int memmap_get_u16_le (const struct memmap * memmap,
     int error = 0;
     *value = memmap_byte_get(memmap, address + 1, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address, &error);
+    *value |= memmap_byte_get(memmap, address, &error);
     return error;
 }
 
@@ -277,11 +736,11 @@ int memmap_get_u32_be (const struct memmap * memmap,
     int error = 0;
     *value = memmap_byte_get(memmap, address, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 1, &error);
+    *value |= memmap_byte_get(memmap, address + 1, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 2, &error);
+    *value |= memmap_byte_get(memmap, address + 2, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 3, &error);
+    *value |= memmap_byte_get(memmap, address + 3, &error);
     return error;
 }
 
@@ -292,11 +751,11 @@ int memmap_get_u32_le (const struct memmap * memmap,
     int error = 0;
     *value = memmap_byte_get(memmap, address + 3, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 2, &error);
+    *value |= memmap_byte_get(memmap, address + 2, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 1, &error);
+    *value |= memmap_byte_get(memmap, address + 1, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address, &error);
+    *value |= memmap_byte_get(memmap, address, &error);
     return error;
 }
 
@@ -307,19 +766,19 @@ int memmap_get_u64_be (const struct memmap * memmap,
     int error = 0;
     *value = memmap_byte_get(memmap, address, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 1, &error);
+    *value |= memmap_byte_get(memmap, address + 1, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 2, &error);
+    *value |= memmap_byte_get(memmap, address + 2, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 3, &error);
+    *value |= memmap_byte_get(memmap, address + 3, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 4, &error);
+    *value |= memmap_byte_get(memmap, address + 4, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 5, &error);
+    *value |= memmap_byte_get(memmap, address + 5, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 6, &error);
+    *value |= memmap_byte_get(memmap, address + 6, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 7, &error);
+    *value |= memmap_byte_get(memmap, address + 7, &error);
     return error;
 }
 
@@ -330,26 +789,28 @@ int memmap_get_u64_le (const struct memmap * memmap,
     int error = 0;
     *value = memmap_byte_get(memmap, address + 7, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 6, &error);
+    *value |= memmap_byte_get(memmap, address + 6, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 5, &error);
+    *value |= memmap_byte_get(memmap, address + 5, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 4, &error);
+    *value |= memmap_byte_get(memmap, address + 4, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 3, &error);
+    *value |= memmap_byte_get(memmap, address + 3, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 2, &error);
+    *value |= memmap_byte_get(memmap, address + 2, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address + 1, &error);
+    *value |= memmap_byte_get(memmap, address + 1, &error);
     *value <<= 8;
-    *value = memmap_byte_get(memmap, address, &error);
+    *value |= memmap_byte_get(memmap, address, &error);
     return error;
 }
 
 
 int memmap_set_u8 (struct memmap * memmap, uint64_t address, uint8_t value) {
     int error = 0;
-    btlog("[memmap_set_u8] address=%08llx, %02x", address, value, 0, 0);
+    BTLOG(BTLOG_MEMMAP, BTLOG_TRACE,
+          "[memmap_set_u8] address=%08llx, %02x",
+          (unsigned long long) address, value);
     error |= memmap_byte_set(memmap, address, value);
     return error;
 }
@@ -14,12 +14,50 @@
 
 #define MEMMAP_NOFAIL 1
 
+/*
+* Each memmap keeps a small direct-mapped TLB in front of its tree, so reads
+* and writes which hit it skip the tree lookup. An entry covers one
+* MEMMAP_TLB_GRANULE bytes of a page, so the TLB is only used when page_size
+* is at least that. The jit probes it inline, see amd64_assemble_bins, and
+* calls the memmap_get and memmap_set functions only on a miss, which refill
+* the entry.
+*/
+#define MEMMAP_TLB_SHIFT   8
+#define MEMMAP_TLB_GRANULE (1 << MEMMAP_TLB_SHIFT)
+#define MEMMAP_TLB_SIZE    1024
+/* never the address of a granule, so never matches */
+#define MEMMAP_TLB_EMPTY   1
+
+#define MEMMAP_TLB_INDEX(address) \
+    (((address) >> MEMMAP_TLB_SHIFT) & (MEMMAP_TLB_SIZE - 1))
+
+struct memmap_tlb {
+    /* the address of the granule this entry covers for reads, or
+       MEMMAP_TLB_EMPTY */
+    uint64_t read;
+    /* the same for writes. Writes may only skip the tree when the page is
+       already dirty and holds no code, so this is MEMMAP_TLB_EMPTY otherwise */
+    uint64_t write;
+    /* add to an address in the granule for the host address of its byte */
+    uint64_t addend;
+    /* keeps entries a power of two in size for the jit */
+    uint64_t unused;
+};
+
 struct memmap_page {
     struct object_header oh;
     uint64_t address;
     uint8_t * data;
     size_t size;
     unsigned int permissions;
+    /* set while code translated from this page may be in use, see
+       memmap_mark_code */
+    int code;
+    /* this page's index in its memmap's pages */
+    unsigned int index;
+    /* set when data lies in its memmap's direct mapping, rather than being
+       allocated for the page */
+    int direct;
 };
 
 
@@ -37,6 +75,42 @@ struct memmap {
     struct tree * tree;
     unsigned int page_size;
     unsigned int flags;
+    /* called when a page marked with memmap_mark_code is written, or NULL */
+    void (* code_written) (void * arg, uint64_t address, size_t size);
+    void * code_written_arg;
+    /* every page in tree, in the order they were created */
+    struct memmap_page ** pages;
+    unsigned int pages_size;
+    /* bit n is set when pages[n] was created, written or remapped since the
+       last memmap_snapshot or memmap_restore */
+    uint64_t * dirty;
+    /* counts snapshots, so memmap_restore can tell the dirty bits are for
+       the snapshot it was given */
+    unsigned int generation;
+    struct memmap_tlb tlb[MEMMAP_TLB_SIZE];
+    /* the host mapping of memmap_create_direct, or NULL */
+    uint8_t * direct;
+    uint64_t direct_size;
+    /* accesses of up to 8 bytes starting below this lie in direct, 0 when
+       there is no direct mapping */
+    uint64_t direct_limit;
+};
+
+
+/*
+* The contents of a memmap, which memmap_restore puts it back to. See
+* memmap_snapshot.
+*/
+struct memmap_snapshot {
+    struct object_header oh;
+    /* the memmap this was taken of, and its generation at the time */
+    const struct memmap * memmap;
+    unsigned int generation;
+    /* the number of pages the memmap had */
+    unsigned int pages_size;
+    /* a copy of the data of each page, page_size bytes each */
+    uint8_t * data;
+    unsigned int * permissions;
 };
 
 
@@ -44,8 +118,91 @@ struct memmap * memmap_create (unsigned int page_size);
 void            memmap_delete (struct memmap * memmap);
 struct memmap * memmap_copy   (const struct memmap * memmap);
 
+/*
+* Creates a memmap which reserves size bytes of host memory up front, and
+* keeps pages below size there, so the host address of a mapped byte is
+* memmap->direct plus its address. Pages above size work as in any memmap.
+*
+* Host protections follow the memmap rather than the page permissions, which
+* no memmap enforces. Bytes no page holds are inaccessible. Pages are only
+* writable while they are dirty and hold no code, so the first write after
+* memmap_snapshot or memmap_mark_code faults, and memmap_direct_fault does
+* what memmap_set would have. Copies of a direct memmap are not direct.
+*
+* The first direct memmap installs a SIGSEGV handler for these faults, which
+* passes any fault it does not handle on to the handler installed before it.
+* @param page_size a multiple of the host page size
+* @param size a multiple of page_size
+* @return NULL if page_size or size do not fit, or the mapping could not be
+*         reserved.
+*/
+struct memmap * memmap_create_direct (unsigned int page_size, uint64_t size);
+
+/*
+* Handles a fault at a host address, from a SIGSEGV handler. A write to a
+* page of a direct memmap is marked as memmap_set would, and the page made
+* writable. An unmapped page of a MEMMAP_NOFAIL memmap is created.
+*
+* This is not async-signal-safe. It walks the memmap's tree, creating a page
+* mallocs, and code_written may take the jit's lock. It is only safe for
+* faults of code which does not hold those, or the memmap, at the time, such
+* as jit code, and not for faults of memmap or malloc themselves.
+* @return 0 if the access may be retried, 1 if address is in a direct
+*         mapping but no page holds it, -1 if it is in none.
+*/
+int memmap_direct_fault (uintptr_t address);
+
+/*
+* Sets the function the SIGSEGV handler of direct memmaps calls for a fault
+* memmap_direct_fault returns 1 for. A target which accesses direct memmaps
+* sets it before running any code.
+* @param resume Gets the ucontext_t of the fault, and returns 0 if it changed
+*               it to carry on past the access, or -1 if the fault is not
+*               one of its accesses, which passes it on.
+*/
+void memmap_set_direct_resume (int (* resume) (void * context));
+
+void memmap_snapshot_delete (struct memmap_snapshot * snapshot);
+
 void memmap_set_flags (struct memmap * memmap, unsigned int flags);
 
+/*
+* Sets the function called when a byte is written to a page marked with
+* memmap_mark_code. It is passed arg, and the address and size of the page.
+* The page's mark is cleared before code_written is called, so it is called
+* once per page until the page is marked again. Pass NULL to stop watching.
+*/
+void memmap_set_code_written (struct memmap * memmap,
+                              void (* code_written) (void * arg,
+                                                     uint64_t address,
+                                                     size_t size),
+                              void * arg);
+
+/*
+* Marks every page holding size bytes at address as holding bytes which code
+* was translated from. Pages which are not mapped are ignored.
+*/
+void memmap_mark_code (struct memmap * memmap, uint64_t address, size_t size);
+
+/*
+* Copies every page of memmap, and starts tracking which pages are written
+* from here on. Writes through memmap_map and the memmap_set functions, by
+* the jit or anyone else, mark the page they hit.
+*/
+struct memmap_snapshot * memmap_snapshot (struct memmap * memmap);
+
+/*
+* Puts memmap back to how it was when snapshot was taken. Only pages written
+* since then are copied back, and pages created since then are removed, so
+* this costs what the guest touched rather than what is mapped. A restored
+* page which code was translated from is reported to code_written, as any
+* other write would be.
+* @return 0 on success, non-zero if snapshot is not the last snapshot taken
+*         of memmap.
+*/
+int memmap_restore (struct memmap * memmap,
+                    const struct memmap_snapshot * snapshot);
+
 /**
 * Inserts the buf into the memmap at the given address with given permissions. If
 * the pages do not exist they will be created. If buf_size is less than size,
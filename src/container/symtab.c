@@ -0,0 +1,123 @@
+#include "symtab.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the interned strings, by id */
+static const char ** symtab_chunks[SYMTAB_CHUNKS];
+static unsigned int symtab_next_id = 0;
+
+/* an open addressed hash table of ids, by the hash of their identifier,
+   kept at most half full */
+static unsigned int * symtab_slots = NULL;
+static unsigned int symtab_slots_size = 0;
+
+static pthread_mutex_t symtab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* FNV-1a */
+static uint64_t symtab_hash (const char * identifier) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*identifier != '\0') {
+        hash ^= (unsigned char) *(identifier++);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+/* Returns the slot holding identifier, or the empty slot it would go in */
+static unsigned int symtab_slot (const char * identifier) {
+    unsigned int mask = symtab_slots_size - 1;
+    unsigned int slot = symtab_hash(identifier) & mask;
+    while (symtab_slots[slot] != SYMTAB_NONE) {
+        if (strcmp(symtab_name(symtab_slots[slot]), identifier) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+
+/* Doubles the hash table, or creates it */
+static int symtab_grow () {
+    unsigned int size = symtab_slots_size * 2;
+    if (size == 0)
+        size = 256;
+    unsigned int * slots = malloc(sizeof(unsigned int) * size);
+    if (slots == NULL)
+        return -1;
+    memset(slots, 0xff, sizeof(unsigned int) * size);
+
+    free(symtab_slots);
+    symtab_slots = slots;
+    symtab_slots_size = size;
+
+    unsigned int id;
+    for (id = 0; id < symtab_next_id; id++)
+        symtab_slots[symtab_slot(symtab_name(id))] = id;
+    return 0;
+}
+
+
+/* symtab_id, with symtab_lock held */
+static unsigned int symtab_intern (const char * identifier) {
+    if ((symtab_next_id * 2 >= symtab_slots_size) && symtab_grow())
+        return SYMTAB_NONE;
+
+    unsigned int slot = symtab_slot(identifier);
+    if (symtab_slots[slot] != SYMTAB_NONE)
+        return symtab_slots[slot];
+
+    if (symtab_next_id == SYMTAB_CHUNK_SIZE * SYMTAB_CHUNKS)
+        return SYMTAB_NONE;
+    unsigned int chunk = symtab_next_id / SYMTAB_CHUNK_SIZE;
+    if (symtab_chunks[chunk] == NULL) {
+        symtab_chunks[chunk] = malloc(sizeof(const char *)
+                                      * SYMTAB_CHUNK_SIZE);
+        if (symtab_chunks[chunk] == NULL)
+            return SYMTAB_NONE;
+    }
+    char * name = strdup(identifier);
+    if (name == NULL)
+        return SYMTAB_NONE;
+
+    unsigned int id = symtab_next_id;
+    symtab_chunks[chunk][id % SYMTAB_CHUNK_SIZE] = name;
+    symtab_slots[slot] = id;
+    /* symtab_name reads the name once it sees the id */
+    __atomic_store_n(&symtab_next_id, id + 1, __ATOMIC_RELEASE);
+    return id;
+}
+
+
+unsigned int symtab_id (const char * identifier) {
+    pthread_mutex_lock(&symtab_lock);
+    unsigned int id = symtab_intern(identifier);
+    pthread_mutex_unlock(&symtab_lock);
+    return id;
+}
+
+
+unsigned int symtab_find (const char * identifier) {
+    pthread_mutex_lock(&symtab_lock);
+    unsigned int id = SYMTAB_NONE;
+    if (symtab_slots_size > 0)
+        id = symtab_slots[symtab_slot(identifier)];
+    pthread_mutex_unlock(&symtab_lock);
+    return id;
+}
+
+
+const char * symtab_name (unsigned int id) {
+    if (id >= __atomic_load_n(&symtab_next_id, __ATOMIC_ACQUIRE))
+        return NULL;
+    return symtab_chunks[id / SYMTAB_CHUNK_SIZE][id % SYMTAB_CHUNK_SIZE];
+}
+
+
+unsigned int symtab_size () {
+    return __atomic_load_n(&symtab_next_id, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,49 @@
+#ifndef symtab_HEADER
+#define symtab_HEADER
+
+/**
+* The symbol table interns the identifiers of variables into dense integer
+* ids, so variables can be compared, and looked up, without comparing
+* strings. An identifier keeps its id, and its interned string, for as long
+* as the process runs, and ids start from 0 in the order identifiers were
+* first seen.
+*
+* The symbol table is global, and may be used from any thread.
+*/
+
+/* the id of no identifier */
+#define SYMTAB_NONE ((unsigned int) -1)
+
+/* ids are kept in chunks which never move, so symtab_name needn't lock */
+#define SYMTAB_CHUNK_SIZE 1024
+#define SYMTAB_CHUNKS     1024
+
+
+/**
+* Gets the id of an identifier, interning it if it has none yet.
+* @param identifier The identifier to intern.
+* @return The id of identifier, or SYMTAB_NONE if the table is full.
+*/
+unsigned int symtab_id (const char * identifier);
+
+/**
+* Gets the id of an identifier, without interning it.
+* @param identifier The identifier to look for.
+* @return The id of identifier, or SYMTAB_NONE if it was never interned.
+*/
+unsigned int symtab_find (const char * identifier);
+
+/**
+* Gets the interned string of an id.
+* @param id An id returned by symtab_id.
+* @return The identifier with this id, or NULL if there is no such id.
+*/
+const char * symtab_name (unsigned int id);
+
+/**
+* @return The number of identifiers interned so far. Every id is less than
+*         this.
+*/
+unsigned int symtab_size ();
+
+#endif
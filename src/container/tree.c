@@ -191,17 +191,24 @@ struct tree_node * tree_node_delete (struct tree_node * node,
             free(node);
             return NULL;
         }
+        /*
+        * Swap objects with our successor/predecessor and delete the needle from
+        * that subtree. Swapping, instead of copying, keeps pointers to objects
+        * still held by the tree valid.
+        */
         else if (node->left == NULL) {
             struct tree_node * tmp = tree_node_successor(node);
-            ODEL(node->obj);
-            node->obj = OCOPY(tmp->obj);
-            node->right = tree_node_delete(node->right, tmp->obj, error);
+            void * obj = node->obj;
+            node->obj = tmp->obj;
+            tmp->obj = obj;
+            node->right = tree_node_delete(node->right, needle, error);
         }
-        else if (node->right == NULL) {
+        else {
             struct tree_node * tmp = tree_node_predecessor(node);
-            ODEL(node->obj);
-            node->obj = OCOPY(tmp->obj);
-            node->left = tree_node_delete(node->left, tmp->obj, error);
+            void * obj = node->obj;
+            node->obj = tmp->obj;
+            tmp->obj = obj;
+            node->left = tree_node_delete(node->left, needle, error);
         }
     }
 
@@ -298,6 +305,29 @@ struct tree_it * tree_it (struct tree * tree) {
 }
 
 
+struct tree_it * tree_it_at (struct tree * tree, const void * needle) {
+    struct tree_it * it = malloc(sizeof(struct tree_it));
+    it->list = list_create();
+
+    /* like tree_it_walk_left, only nodes less than needle are passed by */
+    struct tree_node * node = tree->nodes;
+    while (node != NULL) {
+        if (OCMP(node->obj, needle) < 0)
+            node = node->right;
+        else {
+            list_append_(it->list, tree_it_obj_create(node));
+            node = node->left;
+        }
+    }
+
+    if (list_front(it->list) == NULL) {
+        tree_it_delete(it);
+        return NULL;
+    }
+    return it;
+}
+
+
 void tree_it_delete (struct tree_it * it) {
     ODEL(it->list);
     free(it);
@@ -306,7 +336,7 @@ void tree_it_delete (struct tree_it * it) {
 
 void * tree_it_data (struct tree_it * it) {
     struct tree_it_obj * tio = list_back(it->list);
-    return tio->node;
+    return tio->node->obj;
 }
 
 
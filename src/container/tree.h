@@ -77,6 +77,9 @@ struct tree_it {
 
 
 struct tree_it * tree_it        (struct tree * tree);
+/* An iterator starting at the first object not less than needle, or NULL if
+   there is none */
+struct tree_it * tree_it_at     (struct tree * tree, const void * needle);
 void             tree_it_delete (struct tree_it * it);
 void *           tree_it_data   (struct tree_it * it);
 struct tree_it * tree_it_next   (struct tree_it * it);
@@ -10,26 +10,37 @@ const struct object_vtable varstore_node_vtable = {
 };
 
 
-struct varstore_node * varstore_node_create (const char * identifier,
-                                             size_t bits,
-                                             size_t offset) {
+static struct varstore_node * varstore_node_create_id (unsigned int id,
+                                                       size_t bits,
+                                                       size_t offset) {
     struct varstore_node * vn = malloc(sizeof(struct varstore_node));
     object_init(&(vn->oh), &varstore_node_vtable);
-    vn->identifier = strdup(identifier);
+    vn->identifier = symtab_name(id);
+    vn->id = id;
     vn->bits = bits;
     vn->offset = offset;
+    vn->next = NULL;
     return vn;
 }
 
 
+struct varstore_node * varstore_node_create (const char * identifier,
+                                             size_t bits,
+                                             size_t offset) {
+    unsigned int id = symtab_id(identifier);
+    if (id == SYMTAB_NONE)
+        return NULL;
+    return varstore_node_create_id(id, bits, offset);
+}
+
+
 void varstore_node_delete (struct varstore_node * vn) {
-    free(vn->identifier);
     free(vn);
 }
 
 
 struct varstore_node * varstore_node_copy (const struct varstore_node * vn) {
-    return varstore_node_create(vn->identifier, vn->bits, vn->offset);
+    return varstore_node_create_id(vn->id, vn->bits, vn->offset);
 }
 
 
@@ -37,12 +48,13 @@ int varstore_node_cmp (
     const struct varstore_node * lhs,
     const struct varstore_node * rhs
 ) {
-    int strcmp_r = strcmp(lhs->identifier, rhs->identifier);
-    if (strcmp_r)
-        return strcmp_r;
+    if (lhs->id < rhs->id)
+        return -1;
+    else if (lhs->id > rhs->id)
+        return 1;
     else if (lhs->bits < rhs->bits)
         return -1;
-    else if (rhs->bits > lhs->bits)
+    else if (lhs->bits > rhs->bits)
         return 1;
     else
         return 0;
@@ -60,6 +72,8 @@ struct varstore * varstore_create () {
     struct varstore * varstore = malloc(sizeof(struct varstore));
     object_init(&(varstore->oh), &varstore_vtable);
     varstore->tree = tree_create();
+    varstore->ids = NULL;
+    varstore->ids_size = 0;
     varstore->data_buf = malloc(256);
 
     // don't remove this memset. not having this causes valgrind to freak out.
@@ -73,15 +87,45 @@ struct varstore * varstore_create () {
 
 void varstore_delete (struct varstore * varstore) {
     ODEL(varstore->tree);
+    free(varstore->ids);
     free(varstore->data_buf);
     free(varstore);
 }
 
 
+/* Adds vn, which is in varstore's tree, to varstore's ids */
+static int varstore_index (struct varstore * varstore,
+                           struct varstore_node * vn) {
+    if (vn->id >= varstore->ids_size) {
+        unsigned int size = varstore->ids_size * 2;
+        if (size <= vn->id)
+            size = vn->id + 64;
+        struct varstore_node ** ids = realloc(varstore->ids,
+                                              sizeof(struct varstore_node *)
+                                              * size);
+        if (ids == NULL)
+            return -1;
+        memset(&(ids[varstore->ids_size]),
+               0,
+               sizeof(struct varstore_node *) * (size - varstore->ids_size));
+        varstore->ids = ids;
+        varstore->ids_size = size;
+    }
+    vn->next = varstore->ids[vn->id];
+    varstore->ids[vn->id] = vn;
+    return 0;
+}
+
+
 struct varstore * varstore_copy (const struct varstore * varstore) {
     struct varstore * new = malloc(sizeof(struct varstore));
     object_init(&(new->oh), &varstore_vtable);
     new->tree = OCOPY(varstore->tree);
+    new->ids = NULL;
+    new->ids_size = 0;
+    struct tree_it * tit;
+    for (tit = tree_it(new->tree); tit != NULL; tit = tree_it_next(tit))
+        varstore_index(new, tree_it_data(tit));
     new->data_buf = malloc(varstore->data_buf_size);
     memcpy(new->data_buf, varstore->data_buf, varstore->data_buf_size);
     new->data_buf_size = varstore->data_buf_size;
@@ -90,9 +134,31 @@ struct varstore * varstore_copy (const struct varstore * varstore) {
 }
 
 
+/* Returns the variable id:bits of varstore, or NULL if there is none */
+static struct varstore_node * varstore_fetch (const struct varstore * varstore,
+                                              unsigned int id,
+                                              size_t bits) {
+    if (id >= varstore->ids_size)
+        return NULL;
+    struct varstore_node * vn;
+    for (vn = varstore->ids[id]; vn != NULL; vn = vn->next) {
+        if (vn->bits == bits)
+            return vn;
+    }
+    return NULL;
+}
+
+
 size_t varstore_insert (struct varstore * varstore,
                         const char * identifier,
                         size_t bits) {
+    return varstore_insert_id(varstore, symtab_id(identifier), bits);
+}
+
+
+size_t varstore_insert_id (struct varstore * varstore,
+                           unsigned int id,
+                           size_t bits) {
 
     // figure out how much space to allocate
     size_t bytes = bits / 8;
@@ -108,15 +174,19 @@ size_t varstore_insert (struct varstore * varstore,
         varstore->data_buf = realloc(varstore->data_buf,
                                      varstore->data_buf_size * 2);
         // don't remove this memset. not having this causes valgrind to freak out.
-        memset(&(varstore->data_buf), 0, varstore->data_buf_size);
+        memset(&(varstore->data_buf[varstore->data_buf_size]),
+               0,
+               varstore->data_buf_size);
         varstore->data_buf_size *= 2;
 
     }
 
-    // drop this node into tree
-    tree_insert_(varstore->tree, varstore_node_create(identifier,
-                                                      bits,
-                                                      varstore->next_offset));
+    // drop this node into tree, and index it by id
+    struct varstore_node * vn = varstore_node_create_id(id,
+                                                        bits,
+                                                        varstore->next_offset);
+    if (tree_insert_(varstore->tree, vn) == 0)
+        varstore_index(varstore, vn);
 
     // return the offset to this variable
     size_t result = varstore->next_offset;
@@ -129,11 +199,15 @@ int varstore_offset (const struct varstore * varstore,
                      const char * identifier,
                      size_t bits,
                      size_t * offset) {
-    struct varstore_node varstore_node;
-    object_init(&(varstore_node.oh), &varstore_node_vtable);
-    varstore_node.identifier = (char *) identifier;
-    varstore_node.bits = bits;
-    struct varstore_node * vn = tree_fetch(varstore->tree, &varstore_node);
+    return varstore_offset_id(varstore, symtab_find(identifier), bits, offset);
+}
+
+
+int varstore_offset_id (const struct varstore * varstore,
+                        unsigned int id,
+                        size_t bits,
+                        size_t * offset) {
+    struct varstore_node * vn = varstore_fetch(varstore, id, bits);
     if (vn == NULL) {
         return -1;
     }
@@ -148,11 +222,15 @@ int varstore_value (const struct varstore * varstore,
                     const char * identifier,
                     size_t bits,
                     uint64_t * value) {
-    struct varstore_node varstore_node;
-    object_init(&(varstore_node.oh), &varstore_node_vtable);
-    varstore_node.identifier = (char *) identifier;
-    varstore_node.bits = bits;
-    struct varstore_node * vn = tree_fetch(varstore->tree, &varstore_node);
+    return varstore_value_id(varstore, symtab_find(identifier), bits, value);
+}
+
+
+int varstore_value_id (const struct varstore * varstore,
+                       unsigned int id,
+                       size_t bits,
+                       uint64_t * value) {
+    struct varstore_node * vn = varstore_fetch(varstore, id, bits);
     if (vn == NULL)
         return -1;
     switch (bits) {
@@ -186,8 +264,34 @@ void * varstore_data_buf (struct varstore * varstore) {
 size_t varstore_offset_create (struct varstore * varstore,
                                const char * identifier,
                                size_t bits) {
+    return varstore_offset_create_id(varstore, symtab_id(identifier), bits);
+}
+
+
+size_t varstore_offset_create_id (struct varstore * varstore,
+                                  unsigned int id,
+                                  size_t bits) {
     size_t offset = 0;
-    if (varstore_offset(varstore, identifier, bits, &offset) == 0)
+    if (varstore_offset_id(varstore, id, bits, &offset) == 0)
         return offset;
-    return varstore_insert(varstore, identifier, bits);
+    return varstore_insert_id(varstore, id, bits);
+}
+
+
+struct byte_buf * varstore_snapshot (const struct varstore * varstore) {
+    struct byte_buf * snapshot = byte_buf_create();
+    byte_buf_append_bytes(snapshot, varstore->data_buf, varstore->next_offset);
+    return snapshot;
+}
+
+
+int varstore_restore (struct varstore * varstore,
+                      const struct byte_buf * snapshot) {
+    size_t size = byte_buf_length(snapshot);
+    if (size > varstore->next_offset)
+        return -1;
+
+    memcpy(varstore->data_buf, byte_buf_bytes(snapshot), size);
+    memset(&(varstore->data_buf[size]), 0, varstore->next_offset - size);
+    return 0;
 }
@@ -1,17 +1,30 @@
 #ifndef varstore_HEADER
 #define varstore_HEADER
 
+#include "container/byte_buf.h"
+#include "container/symtab.h"
 #include "container/tree.h"
 #include "object.h"
 
 #include <stdint.h>
 #include <stdlib.h>
 
+/*
+* Variables are named by an identifier and a size in bits. The identifier is
+* interned in the symtab, and the varstore finds variables by the symtab id of
+* their identifier in constant time. Functions taking an identifier look up
+* its id first.
+*/
+
 struct varstore_node {
     struct object_header oh;
-    char * identifier;
+    /* the interned identifier, and its symtab id */
+    const char * identifier;
+    unsigned int id;
     size_t bits;
     size_t offset;
+    /* the next variable of the varstore with the same id, and other bits */
+    struct varstore_node * next;
 };
 
 
@@ -27,6 +40,9 @@ int varstore_node_cmp (const struct varstore_node * lhs,
 struct varstore {
     struct object_header oh;
     struct tree * tree;
+    /* the first variable of each id in tree, or NULL */
+    struct varstore_node ** ids;
+    unsigned int ids_size;
     uint8_t * data_buf;
     size_t next_offset;
     size_t data_buf_size;
@@ -40,10 +56,17 @@ struct varstore * varstore_copy   (const struct varstore * varstore);
 size_t varstore_insert (struct varstore * varstore,
                         const char * identifier,
                         size_t bits);
+size_t varstore_insert_id (struct varstore * varstore,
+                           unsigned int id,
+                           size_t bits);
 int varstore_offset (const struct varstore * varstore,
                      const char * identifier,
                      size_t bits,
                      size_t * offset);
+int varstore_offset_id (const struct varstore * varstore,
+                        unsigned int id,
+                        size_t bits,
+                        size_t * offset);
 
 /**
 * Retrieves a variable from the varstore, up to 64-bits in size, and places
@@ -59,6 +82,10 @@ int varstore_value (const struct varstore * varstore,
                     const char * identifier,
                     size_t bits,
                     uint64_t * value);
+int varstore_value_id (const struct varstore * varstore,
+                       unsigned int id,
+                       size_t bits,
+                       uint64_t * value);
 
 void * varstore_data_buf (struct varstore * varstore);
 
@@ -66,5 +93,20 @@ void * varstore_data_buf (struct varstore * varstore);
 size_t varstore_offset_create (struct varstore * varstore,
                                const char * identifier,
                                size_t bits);
+size_t varstore_offset_create_id (struct varstore * varstore,
+                                  unsigned int id,
+                                  size_t bits);
+
+/* Returns a copy of the value of every variable, for varstore_restore */
+struct byte_buf * varstore_snapshot (const struct varstore * varstore);
+
+/*
+* Sets every variable back to its value when snapshot was taken. Variables
+* created since then are kept, and set to 0.
+* @return 0 on success, non-zero if snapshot holds more variables than
+*         varstore.
+*/
+int varstore_restore (struct varstore * varstore,
+                      const struct byte_buf * snapshot);
 
 #endif
@@ -64,6 +64,9 @@ int hooks_append (struct hooks * hooks, const struct hooks_api * hooks_api);
 int hooks_call (struct hooks * hooks, int hook_type, ...);
 int hooks_vcall (struct hooks * hooks, int hook_type, va_list args);
 
+/* The hooks the global_hooks_ functions operate on */
+extern struct hooks * global_hooks;
+
 void global_hooks_init ();
 int  global_hooks_append (const struct hooks_api * hooks_api);
 int  global_hooks_call (int hook_type, ...);
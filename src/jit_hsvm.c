@@ -1,5 +1,6 @@
 #include "arch/source/hsvm.h"
 #include "arch/target/amd64.h"
+#include "arch/target/interp.h"
 #include "btlog.h"
 #include "bt/bins.h"
 #include "bt/jit.h"
@@ -14,6 +15,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "plugins/tainttrace.c"
@@ -36,6 +38,7 @@ uint16_t get_rip (struct varstore * varstore) {
 int main (int argc, char * argv[]) {
     /* turn on debugging */
     btlog_continuous("jit_hsvm.debug");
+    btlog_set_level(BTLOG_ALL, BTLOG_DEBUG);
 
     /* initialize global hooks */
     global_hooks_init();
@@ -68,12 +71,18 @@ int main (int argc, char * argv[]) {
 
     fclose(fh);
 
-    btlog("[jit_hsvm] read %s %u bytes", argv[1], (unsigned int) filesize);
+    BTLOG(BTLOG_CORE, BTLOG_INFO,
+          "[jit_hsvm] read %s %u bytes", argv[1], (unsigned int) filesize);
 
-    /* Create the memmap */
-    struct memmap * memmap = memmap_create(4096);
+    /* Create the memmap. The whole address space fits in a direct memmap,
+       BT_DIRECT=0 keeps guest memory in separately allocated pages */
+    struct memmap * memmap = NULL;
+    if ((getenv("BT_DIRECT") == NULL) || strtoul(getenv("BT_DIRECT"), NULL, 0))
+        memmap = memmap_create_direct(4096, 0x10000);
+    if (memmap == NULL)
+        memmap = memmap_create(4096);
 
-    btlog("[jit_hsvm] created memmap");
+    BTLOG(BTLOG_CORE, BTLOG_INFO, "[jit_hsvm] created memmap");
     fflush(stdout);
 
     /* insert our code into memmap */
@@ -86,32 +95,51 @@ int main (int argc, char * argv[]) {
 
     free(buf);
 
-    btlog("[jit_hsvm] initialized memmap");
+    BTLOG(BTLOG_CORE, BTLOG_INFO, "[jit_hsvm] initialized memmap");
     fflush(stdout);
 
     /* create our jit */
     struct jit * jit = jit_create(&arch_source_hsvm,
                                   &arch_target_amd64,
                                   &platform_hsvm);
-    btlog("[jit_hsvm] created jit");
+    /* most blocks only run a handful of times, don't compile those */
+    jit_set_tiering(jit, &arch_target_interp, JIT_DEFAULT_TIER_THRESHOLD);
+    /* optionally keep assembled blocks across runs */
+    if (argc > 2)
+        jit_set_cache(jit, argv[2]);
+    /* name blocks for perf, BT_PERF=map for a perf map only */
+    if (getenv("BT_PERF") != NULL) {
+        unsigned int flags = JIT_PERF_MAP | JIT_PERF_DUMP;
+        if (strcmp(getenv("BT_PERF"), "map") == 0)
+            flags = JIT_PERF_MAP;
+        if (jit_set_perf(jit, "hsvm", flags))
+            fprintf(stderr, "could not create perf files\n");
+    }
+    /* BT_OPT=<flags> picks the optimization passes, 0 turns them off */
+    if (getenv("BT_OPT") != NULL)
+        jit_set_opt(jit, strtoul(getenv("BT_OPT"), NULL, 0));
+    /* BT_PEEPHOLE=0 turns off the amd64 peephole optimizations */
+    if (getenv("BT_PEEPHOLE") != NULL)
+        amd64_set_peephole(strtoul(getenv("BT_PEEPHOLE"), NULL, 0));
+    BTLOG(BTLOG_CORE, BTLOG_INFO, "[jit_hsvm] created jit");
     fflush(stdout);
 
     /* create our varstore */
     struct varstore * varstore = varstore_create();
-    btlog("[jit_hsvm] created varstore");
+    BTLOG(BTLOG_CORE, BTLOG_INFO, "[jit_hsvm] created varstore");
     fflush(stdout);
 
     /* init and set rip */
     size_t offset = varstore_insert(varstore, "rip", 16);
     uint8_t * data_buf = (uint8_t *) varstore_data_buf(varstore);
     *((uint16_t *) &(data_buf[offset])) = 0;
-    btlog("[jit_hsvm] rip set and init");
+    BTLOG(BTLOG_CORE, BTLOG_INFO, "[jit_hsvm] rip set and init");
 
     /* init and set rsp */
     offset = varstore_insert(varstore, "rsp", 16);
     data_buf = (uint8_t *) varstore_data_buf(varstore);
     *((uint16_t *) &(data_buf[offset])) = 0xfff8;
-    btlog("[jit_hsvm] rsp set and init");
+    BTLOG(BTLOG_CORE, BTLOG_INFO, "[jit_hsvm] rsp set and init");
 
     /* call our global hooks for jit startup */
     global_hooks_call(HOOK_JIT_STARTUP, jit, varstore, memmap);
@@ -119,6 +147,28 @@ int main (int argc, char * argv[]) {
     int result = jit_execute(jit, varstore, memmap);
     fprintf(stderr, "jit result %d\n", result);
 
+    struct jit_stats stats;
+    jit_get_stats(jit, &stats);
+    BTLOG(BTLOG_JIT, BTLOG_INFO,
+          "[jit_hsvm] optimized %u blocks from %u to %u bins: %u folded, "
+          "%u constants, %u copies, %u eliminated (%u flags)",
+          stats.opt.blocks, stats.opt.bins_in, stats.opt.bins_out,
+          stats.opt.folded, stats.opt.constants, stats.opt.copies,
+          stats.opt.eliminated, stats.opt.flags);
+
+    struct amd64_peephole_stats peephole;
+    amd64_get_peephole_stats(&peephole);
+    BTLOG(BTLOG_JIT, BTLOG_INFO,
+          "[jit_hsvm] assembled %u blocks into %zu bytes: removed %u reloads, "
+          "%u push/pop pairs, %u immediate moves and %u identities; "
+          "%u short forms, %u constant operations and %u leas",
+          peephole.blocks, peephole.bytes, peephole.reloads, peephole.pushes,
+          peephole.immediates, peephole.identities, peephole.short_forms,
+          peephole.constants, peephole.leas);
+
+    if ((argc > 2) && jit_save_cache(jit, varstore))
+        fprintf(stderr, "failed to save jit cache %s\n", argv[2]);
+
     /* call our global hooks for jit cleanup */
     global_hooks_call(HOOK_JIT_CLEANUP, jit, varstore, memmap);
 
@@ -127,7 +177,7 @@ int main (int argc, char * argv[]) {
     ODEL(jit);
     ODEL(memmap);
     global_hooks_cleanup();
-    btlog("[jit_hsvm] calling plugins_delete");
+    BTLOG(BTLOG_CORE, BTLOG_INFO, "[jit_hsvm] calling plugins_delete");
     plugins_delete(plugins);
     plugin_cleanup();
 
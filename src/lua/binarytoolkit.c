@@ -130,8 +130,14 @@ struct lbt_constant lbt_constants [] = {
     {"BOP_TRUN", BOP_TRUN},
     {"BOP_STORE", BOP_STORE},
     {"BOP_LOAD", BOP_LOAD},
+    {"BOP_STOREBE", BOP_STOREBE},
+    {"BOP_LOADBE", BOP_LOADBE},
     {"BOP_CE", BOP_CE},
+    {"BOP_LABEL", BOP_LABEL},
+    {"BOP_BRZ", BOP_BRZ},
+    {"BOP_BR", BOP_BR},
     {"BOP_HLT", BOP_HLT},
+    {"BOP_FUEL", BOP_FUEL},
     {"BOP_COMMENT", BOP_COMMENT},
     {"BOP_HOOK", BOP_HOOK},
     {NULL, .value=-1}
@@ -410,6 +416,8 @@ int lbt_boper_type (lua_State * L) {
         lua_pushstring(L, "variable");
     else if (boper_type(boper) == BOPER_CONSTANT)
         lua_pushstring(L, "contant");
+    else if (boper_type(boper) == BOPER_TEMPORARY)
+        lua_pushstring(L, "temporary");
     else
         luaL_error(L, "error on lua_boper_type, invalid return result");
 
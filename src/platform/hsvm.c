@@ -17,11 +17,12 @@ const struct platform platform_hsvm = {
 
 
 int platform_hsvm_jit_hlt (struct jit * jit, struct varstore * varstore) {
-    btlog("[platform_hsvm.jit_hlt]");
+    BTLOG(BTLOG_PLATFORM, BTLOG_DEBUG, "[platform_hsvm.jit_hlt]");
     size_t offset;
     int error = varstore_offset(varstore, "halt_code", 8, &offset);
     if (error) {
-        btlog("[%s] error finding halt_code");
+        BTLOG(BTLOG_PLATFORM, BTLOG_ERROR,
+              "[%s] error finding halt_code", __func__);
         return PLATFORM_ERROR;
     }
 
@@ -38,11 +39,13 @@ int platform_hsvm_jit_hlt (struct jit * jit, struct varstore * varstore) {
         offset = varstore_offset_create(varstore, hsvm_reg_string(reg_code), 16);
         uint8_t r;
         if (read(0, &r, 1) != 1) {
-            btlog("[%s] error reading to in reg", __func__);
+            BTLOG(BTLOG_PLATFORM, BTLOG_ERROR,
+                  "[%s] error reading to in reg", __func__);
             return PLATFORM_ERROR;
         }
         *((uint16_t *) &(data_buf[offset])) = r;
-        btlog("[platform_hsvm.jit_hlt] IN %s = 0x%02x",
+        BTLOG(BTLOG_PLATFORM, BTLOG_DEBUG,
+              "[platform_hsvm.jit_hlt] IN %s = 0x%02x",
               hsvm_reg_string(reg_code), r);
         return PLATFORM_HANDLED;
     }
@@ -54,16 +57,18 @@ int platform_hsvm_jit_hlt (struct jit * jit, struct varstore * varstore) {
         varstore_offset(varstore, hsvm_reg_string(reg_code), 16, &offset);
         uint8_t r = *((uint16_t *) &(data_buf[offset]));
         if (write(1, &r, 1) != 1) {
-            btlog("[%s] error writing reg out", __func__);
+            BTLOG(BTLOG_PLATFORM, BTLOG_ERROR,
+                  "[%s] error writing reg out", __func__);
             return PLATFORM_ERROR;
         }
-        btlog("[platform_hsvm.jit_hlt] OUT %s = 0x%02x",
+        BTLOG(BTLOG_PLATFORM, BTLOG_DEBUG,
+              "[platform_hsvm.jit_hlt] OUT %s = 0x%02x",
               hsvm_reg_string(reg_code), r);
         return PLATFORM_HANDLED;
     }
 
     /* unhandled halt code */
-    btlog("[%s] unhandled halt code", __func__);
+    BTLOG(BTLOG_PLATFORM, BTLOG_ERROR, "[%s] unhandled halt code", __func__);
     return PLATFORM_ERROR;
 }
 
@@ -72,7 +77,8 @@ struct list * platform_hsvm_hlt_tainted_bopers (struct varstore * varstore) {
     size_t offset;
     int error = varstore_offset(varstore, "halt_code", 8, &offset);
     if (error) {
-        btlog("[%s] error finding halt_code");
+        BTLOG(BTLOG_PLATFORM, BTLOG_ERROR,
+              "[%s] error finding halt_code", __func__);
         return NULL;
     }
 
@@ -17,21 +17,22 @@ const struct object_vtable plugin_vtable = {
 struct plugin * plugin_create (const char * filename) {
     void * handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
     if (handle == NULL) {
-        btlog("[plugins.create] dlopen for %s failed", filename);
+        BTLOG(BTLOG_PLUGIN, BTLOG_ERROR,
+              "[plugins.create] dlopen for %s failed", filename);
         return NULL;
     }
 
     struct plugin * plugin = malloc(sizeof(struct plugin));
     object_init(plugin, &plugin_vtable);
     plugin->filename = strdup(filename);
-    btlog("plugin->filename = %p", plugin->filename);
+    BTLOG(BTLOG_PLUGIN, BTLOG_DEBUG, "plugin->filename = %p", plugin->filename);
     plugin->handle = handle;
     return plugin;
 }
 
 
 void plugin_delete (struct plugin * plugin) {
-    btlog("[plugin_delete]");
+    BTLOG(BTLOG_PLUGIN, BTLOG_DEBUG, "[plugin_delete]");
     dlclose(plugin->handle);
     free((void *) plugin->filename);
     free(plugin);
@@ -40,7 +41,7 @@ void plugin_delete (struct plugin * plugin) {
 
 struct plugin * plugin_copy (const struct plugin * plugin) {
     /* TODO Oh boy, this can return NULL, which is bad. */
-    btlog("[plugin_copy]");
+    BTLOG(BTLOG_PLUGIN, BTLOG_DEBUG, "[plugin_copy]");
     return plugin_create(plugin->filename);
 }
 
@@ -71,12 +72,14 @@ void plugins_delete (struct plugins * plugins) {
         struct plugin * plugin = list_it_data(it);
         typeof(plugin_cleanup) * pc = plugin_dlsym(plugin, "plugin_cleanup");
         if (pc != NULL) {
-            btlog("[plugins_delete] calling plugin_cleanup for %p %p",
+            BTLOG(BTLOG_PLUGIN, BTLOG_DEBUG,
+                  "[plugins_delete] calling plugin_cleanup for %p %p",
                   plugin->filename, pc);
             pc();
         }
         else
-            btlog("[plugins.delete] %s has no plugin_cleanup",
+            BTLOG(BTLOG_PLUGIN, BTLOG_WARN,
+                  "[plugins.delete] %s has no plugin_cleanup",
                   plugin->filename);
     }
     ODEL(plugins->plugins);
@@ -102,7 +105,8 @@ int plugins_load (struct plugins * plugins, const char * filename) {
 
     list_append_(plugins->plugins, plugin);
 
-    btlog("[plugins_load] %s loaded", plugin->filename);
+    BTLOG(BTLOG_PLUGIN, BTLOG_DEBUG,
+          "[plugins_load] %s loaded", plugin->filename);
 
     return 0;
 }
@@ -17,6 +17,7 @@
 #include "bt/jit.h"
 #include "container/list.h"
 #include "container/memmap.h"
+#include "container/symtab.h"
 #include "container/tags.h"
 #include "container/tree.h"
 #include "container/uint64.h"
@@ -34,10 +35,11 @@
 
 struct tt_var {
     struct object_header oh;
-    const char * identifier;
+    /* the symtab id of the variable's identifier */
+    unsigned int id;
 };
 
-struct tt_var * tt_var_create (const char * identifier);
+struct tt_var * tt_var_create (unsigned int id);
 void            tt_var_delete (struct tt_var * ttv);
 struct tt_var * tt_var_copy   (const struct tt_var * ttv);
 int             tt_var_cmp    (const struct tt_var * lhs,
@@ -50,27 +52,30 @@ const struct object_vtable tt_var_vtable = {
 };
 
 
-struct tt_var * tt_var_create (const char * identifier) {
+struct tt_var * tt_var_create (unsigned int id) {
     struct tt_var * ttv = malloc(sizeof(struct tt_var));
     object_init(ttv, &tt_var_vtable);
-    ttv->identifier = strdup(identifier);
+    ttv->id = id;
     return ttv;
 }
 
 
 void tt_var_delete (struct tt_var * ttv) {
-    free((void *) ttv->identifier);
     free(ttv);
 }
 
 
 struct tt_var * tt_var_copy (const struct tt_var * ttv) {
-    return tt_var_create(ttv->identifier);
+    return tt_var_create(ttv->id);
 }
 
 
 int tt_var_cmp (const struct tt_var * lhs, const struct tt_var * rhs) {
-    return strcmp(lhs->identifier, rhs->identifier);
+    if (lhs->id < rhs->id)
+        return -1;
+    else if (lhs->id > rhs->id)
+        return 1;
+    return 0;
 }
 
 
@@ -204,6 +209,10 @@ struct tt {
     */
     uint64_t tt_bins_identifier;
 
+    /* The symtab ids of the variables our hooks read */
+    unsigned int tt_bins_identifier_id;
+    unsigned int jit_id;
+
     /*
     * A list of traced bins instructions. Some instructions/operands will be
     * tagged with additional information.
@@ -224,6 +233,8 @@ int plugin_initialize () {
     tt->addresses = tree_create();
     tt->bins = tree_create();
     tt->tt_bins_identifier = 0;
+    tt->tt_bins_identifier_id = symtab_id("tt_bins_identifier");
+    tt->jit_id = symtab_id("__JIT__");
     tt->trace = list_create();
     return 0;
 }
@@ -232,7 +243,7 @@ int plugin_initialize () {
 int plugin_cleanup () {
     printf("[plugin_cleanup]\n");
     struct list_it * it;
-    btlog("[tainttrace.plugin_cleanup]");
+    BTLOG(BTLOG_PLUGIN, BTLOG_DEBUG, "[tainttrace.plugin_cleanup]");
     for (it = list_it(tt->trace); it != NULL; it = list_it_next(it)) {
         struct bins * bins = list_it_data(it);
         char * bins_str = bins_string(bins);
@@ -284,7 +295,7 @@ int tt_boper_tainted (const struct boper * boper) {
         return 0;
 
     int tainted = 0;
-    struct tt_var * ttv = tt_var_create(boper->identifier);
+    struct tt_var * ttv = tt_var_create(boper_id(boper));
     if (tree_fetch(tt->variables, ttv))
         tainted = 1;
     ODEL(ttv);
@@ -293,15 +304,32 @@ int tt_boper_tainted (const struct boper * boper) {
 }
 
 
+/*
+* Our hooks read the values of operands from the varstore, where temporaries
+* never are, so we turn the temporaries of bins into variables.
+*/
+void tt_bins_variables (struct bins * bins) {
+    unsigned int i;
+    for (i = 0; i < 3; i++) {
+        struct boper * boper = bins->oper[i];
+        if ((boper == NULL) || (boper_type(boper) != BOPER_TEMPORARY))
+            continue;
+        bins->oper[i] = boper_variable(boper_bits(boper),
+                                       boper_identifier(boper));
+        ODEL(boper);
+    }
+}
+
+
 int tt_boper_taint (const struct boper * boper) {
-    struct tt_var * ttv = tt_var_create(boper_identifier(boper));
+    struct tt_var * ttv = tt_var_create(boper_id(boper));
     tree_insert_(tt->variables, ttv);
     return 0;
 }
 
 
 int tt_boper_untaint (const struct boper * boper) {
-    struct tt_var * ttv = tt_var_create(boper_identifier(boper));
+    struct tt_var * ttv = tt_var_create(boper_id(boper));
     tree_remove(tt->variables, ttv);
     ODEL(ttv);
     return 0;
@@ -338,22 +366,22 @@ int tt_boper_value (struct varstore * varstore,
                     uint64_t * address) {
     switch (boper_bits(boper)) {
     case 8 : {
-        if (varstore_value(varstore, boper_identifier(boper), 8, address))
+        if (varstore_value_id(varstore, boper_id(boper), 8, address))
             return -1;
         return 0;
     }
     case 16 : {
-        if (varstore_value(varstore, boper_identifier(boper), 16, address))
+        if (varstore_value_id(varstore, boper_id(boper), 16, address))
             return -1;
         return 0;
     }
     case 32 : {
-        if (varstore_value(varstore, boper_identifier(boper), 32, address))
+        if (varstore_value_id(varstore, boper_id(boper), 32, address))
             return -1;
         return 0;
     }
     case 64 : {
-        if (varstore_value(varstore, boper_identifier(boper), 64, address))
+        if (varstore_value_id(varstore, boper_id(boper), 64, address))
             return -1;
         return 0;
     }
@@ -365,12 +393,13 @@ int tt_boper_value (struct varstore * varstore,
 struct tt_bins * tt_hook_get_tt_bins (struct varstore * varstore) {
     /* Get the instruction associated with this hook. */
     uint64_t tt_bins_identifier;
-    int error = varstore_value(varstore,
-                               "tt_bins_identifier",
-                               64,
-                               &tt_bins_identifier);
+    int error = varstore_value_id(varstore,
+                                  tt->tt_bins_identifier_id,
+                                  64,
+                                  &tt_bins_identifier);
     if (error) {
-        btlog("[-] Could not find tt_bins_identifier");
+        BTLOG(BTLOG_PLUGIN, BTLOG_WARN,
+              "[-] Could not find tt_bins_identifier");
         return NULL;
     }
 
@@ -380,7 +409,8 @@ struct tt_bins * tt_hook_get_tt_bins (struct varstore * varstore) {
     tt_bins_needle.identifier = tt_bins_identifier;
     struct tt_bins * tt_bins = tree_fetch(tt->bins, &tt_bins_needle);
     if (tt_bins == NULL) {
-        btlog("[-] Could not find tt_bins for 0x%llx",
+        BTLOG(BTLOG_PLUGIN, BTLOG_WARN,
+              "[-] Could not find tt_bins for 0x%llx",
               (unsigned long long) tt_bins_identifier);
         return NULL;
     }
@@ -462,7 +492,8 @@ void tt_arithmetic_hook (struct varstore * varstore) {
             uint64_t value;
             int error = tt_boper_value(varstore, bins->oper[1], &value);
             if (error) {
-                btlog("[-] Could not get boper_1_value for %s",
+                BTLOG(BTLOG_PLUGIN, BTLOG_WARN,
+                      "[-] Could not get boper_1_value for %s",
                       boper_identifier(bins->oper[1]));
             }
             else
@@ -473,7 +504,8 @@ void tt_arithmetic_hook (struct varstore * varstore) {
             uint64_t value;
             int error = tt_boper_value(varstore, bins->oper[2], &value);
             if (error) {
-                btlog("[-] Could not get boper_2_value for %s",
+                BTLOG(BTLOG_PLUGIN, BTLOG_WARN,
+                      "[-] Could not get boper_2_value for %s",
                       boper_identifier(bins->oper[2]));
             }
             else
@@ -542,19 +574,26 @@ void tt_store_hook (struct varstore * varstore) {
     if (boper_type(bins->oper[0]) == BOPER_CONSTANT)
         address = boper_value(bins->oper[0]);
     else if (tt_boper_value(varstore, bins->oper[0], &address)) {
-        btlog("[-] error fetching address for store for %s",
+        BTLOG(BTLOG_PLUGIN, BTLOG_WARN,
+              "[-] error fetching address for store for %s",
               boper_identifier(bins->oper[0]));
         return;
     }
 
     /*
-    * If the value being written to memory is tainted, then we taint that
-    * memory address. Otherwise, we ensure address is untainted.
+    * If the value being written to memory is tainted, then we taint every
+    * memory address it is written to. Otherwise, we ensure they are
+    * untainted.
     */
-    if (tt_boper_tainted(bins->oper[1]))
-        tt_address_taint(address);
-    else
-        tt_address_untaint(address);
+    int tainted = tt_boper_tainted(bins->oper[1]);
+    unsigned int bytes = (boper_bits(bins->oper[1]) + 7) / 8;
+    unsigned int i;
+    for (i = 0; i < bytes; i++) {
+        if (tainted)
+            tt_address_taint(address + i);
+        else
+            tt_address_untaint(address + i);
+    }
 }
 
 
@@ -572,28 +611,36 @@ void tt_load_hook (struct varstore * varstore) {
     if (boper_type(bins->oper[1]) == BOPER_CONSTANT)
         address = boper_value(bins->oper[1]);
     else if (tt_boper_value(varstore, bins->oper[1], &address)) {
-        btlog("[-] error fetching address for store for %s",
+        BTLOG(BTLOG_PLUGIN, BTLOG_WARN,
+              "[-] error fetching address for store for %s",
               boper_identifier(bins->oper[1]));
         return;
     }
 
     /*
-    * If this address is tainted, we propogate this taint to the variable of
-    * the load instruction.
+    * If any address we load from is tainted, we propogate this taint to the
+    * variable of the load instruction.
     */
-    if (tt_address_tainted(address))
+    int tainted = 0;
+    unsigned int bytes = (boper_bits(bins->oper[0]) + 7) / 8;
+    unsigned int i;
+    for (i = 0; i < bytes; i++) {
+        if (tt_address_tainted(address + i))
+            tainted = 1;
+    }
+    if (tainted)
         tt_boper_taint(bins->oper[0]);
     else
-        tt_boper_untaint(bins->oper[1]);
+        tt_boper_untaint(bins->oper[0]);
 }
 
 
 void tt_hlt_hook (struct varstore * varstore) {
     /* Fetch the jit pointer we saved in taint_trace_jit_startup */
     uint64_t jit_u64;
-    int error = varstore_value(varstore, "__JIT__", 64, &jit_u64);
+    int error = varstore_value_id(varstore, tt->jit_id, 64, &jit_u64);
     if (error) {
-        btlog("[-] error fetching address for jit");
+        BTLOG(BTLOG_PLUGIN, BTLOG_WARN, "[-] error fetching address for jit");
         return;
     }
     struct jit * jit = (struct jit *) jit_u64;
@@ -648,6 +695,7 @@ int taint_trace_jit_translate (struct jit * jit,
     struct list_it * it = NULL;
     for (it = list_it(binslist); it != NULL; it = list_it_next(it)) {
         struct bins * bins = list_it_data(it);
+        tt_bins_variables(bins);
         void (* function_ptr) (void *) = NULL;
         switch (bins->op) {
         /* We hook almost, but not all, bins instruction types. */
@@ -675,9 +723,11 @@ int taint_trace_jit_translate (struct jit * jit,
             if (function_ptr == NULL)
                 function_ptr = (void (*) (void *)) tt_extension_hook;
         case BOP_STORE :
+        case BOP_STOREBE :
             if (function_ptr == NULL)
                 function_ptr = (void (*) (void *)) tt_store_hook;
         case BOP_LOAD :
+        case BOP_LOADBE :
             if (function_ptr == NULL)
                 function_ptr = (void (*) (void *)) tt_load_hook;
         case BOP_HLT : {
@@ -97,6 +97,33 @@ struct list * arithmetic_operands_set (struct arithmetic_operands * ao) {
 }
 
 
+/* Jumps too far for a rel8 use the rel32 encodings */
+int test_jmp () {
+    struct byte_buf * bb = byte_buf_create();
+    int32_t rel32;
+
+    jmp(bb, 0x1234);
+    const uint8_t * bytes = byte_buf_bytes(bb);
+    memcpy(&rel32, &(bytes[1]), sizeof(rel32));
+    if ((byte_buf_length(bb) != 5) || (bytes[0] != 0xe9) || (rel32 != 0x1234))
+        return -1;
+    ODEL(bb);
+
+    bb = byte_buf_create();
+    jcc(bb, 0, -0x200);
+    bytes = byte_buf_bytes(bb);
+    memcpy(&rel32, &(bytes[2]), sizeof(rel32));
+    if (    (byte_buf_length(bb) != 6)
+         || (bytes[0] != 0x0f)
+         || ((bytes[1] & 0xf0) != 0x80)
+         || (rel32 != -0x200))
+        return -1;
+    ODEL(bb);
+
+    return 0;
+}
+
+
 /*
 * Test functions for arithmetic instructions
 */
@@ -942,10 +969,400 @@ int test_cmples () {
 }
 
 
+/* Points __VARSTORE__ at varstore, as jit_run does, for blocks with hooks */
+void test_set_varstore (struct varstore * varstore) {
+    size_t offset = varstore_offset_create(varstore, "__VARSTORE__", 64);
+    uint8_t * data_buf = varstore_data_buf(varstore);
+    *((uint64_t *) &(data_buf[offset])) = (uint64_t) varstore;
+}
+
+
+/* doubles v5, seeing the values the block computed before the hook */
+void test_alloc_hook (void * arg) {
+    struct varstore * varstore = arg;
+    size_t offset;
+    assert(varstore_offset(varstore, "v5", 32, &offset) == 0);
+    uint32_t * v5 = varstore_data_buf(varstore) + offset;
+    *v5 *= 2;
+}
+
+
+/*
+* More variables than there are registers to hold them, read and written
+* around a hook and under a branch.
+*/
+int test_alloc (uint32_t skip) {
+    struct list * list = list_create();
+    char identifier[8];
+
+    unsigned int i;
+    for (i = 0; i < 12; i++) {
+        snprintf(identifier, sizeof(identifier), "v%u", i);
+        list_append_(list, bins_or_(boper_variable(32, identifier),
+                                    boper_constant(32, i),
+                                    boper_constant(32, 0)));
+    }
+    list_append_(list, bins_add_(boper_variable(32, "v5"),
+                                 boper_variable(32, "v5"),
+                                 boper_variable(32, "v1")));
+    list_append_(list, bins_hook(test_alloc_hook));
+    list_append_(list, bins_cmpeq_(boper_variable(1, "flag"),
+                                   boper_variable(32, "v0"),
+                                   boper_constant(32, skip)));
+    /* v0 is 0, so this range is skipped for any other skip */
+    list_append_(list, bins_brz_(boper_variable(1, "flag"), 1));
+    list_append_(list, bins_add_(boper_variable(32, "v2"),
+                                 boper_variable(32, "v2"),
+                                 boper_variable(32, "v3")));
+    list_append_(list, bins_add_(boper_variable(32, "v3"),
+                                 boper_variable(32, "v3"),
+                                 boper_variable(32, "v2")));
+    list_append_(list, bins_label(1));
+    list_append_(list, bins_or_(boper_variable(32, "sum"),
+                                boper_constant(32, 0),
+                                boper_constant(32, 0)));
+    for (i = 0; i < 12; i++) {
+        snprintf(identifier, sizeof(identifier), "v%u", i);
+        list_append_(list, bins_add_(boper_variable(32, "sum"),
+                                     boper_variable(32, "sum"),
+                                     boper_variable(32, identifier)));
+    }
+
+    struct varstore * varstore = varstore_create();
+    struct byte_buf * assembled = amd64_assemble(list, varstore);
+    memcpy(mmap_mem, byte_buf_bytes(assembled), byte_buf_length(assembled));
+    mmap_length = byte_buf_length(assembled);
+    test_set_varstore(varstore);
+    assert(amd64_execute(mmap_mem, varstore) == 0);
+
+    /* 0 + ... + 11, with v5 = (5 + 1) * 2, and v2 = 5, v3 = 8 unless the
+       branch skipped them */
+    uint64_t expected = 66 - 5 + 12;
+    if (skip == 0)
+        expected += 8;
+
+    uint64_t v5, v3, sum;
+    assert(varstore_value(varstore, "v5", 32, &v5) == 0);
+    assert(varstore_value(varstore, "v3", 32, &v3) == 0);
+    assert(varstore_value(varstore, "sum", 32, &sum) == 0);
+
+    ODEL(list);
+    ODEL(varstore);
+    ODEL(assembled);
+
+    if ((v5 != 12) || (v3 != ((skip == 0) ? 8 : 3)) || (sum != expected)) {
+        printf("alloc (v5 = %u, v3 = %u, sum = %u)\n",
+               (unsigned int) v5, (unsigned int) v3, (unsigned int) sum);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* A temporary lives through a hook without ever reaching the varstore */
+int test_temporary () {
+    struct list * list = list_create();
+    list_append_(list, bins_or_(boper_temporary(32, "t32"),
+                                boper_constant(32, 5),
+                                boper_constant(32, 0)));
+    list_append_(list, bins_hook(test_alloc_hook));
+    list_append_(list, bins_add_(boper_variable(32, "result"),
+                                 boper_temporary(32, "t32"),
+                                 boper_constant(32, 1)));
+
+    struct varstore * varstore = varstore_create();
+    varstore_insert(varstore, "v5", 32);
+    struct byte_buf * assembled = amd64_assemble(list, varstore);
+    memcpy(mmap_mem, byte_buf_bytes(assembled), byte_buf_length(assembled));
+    mmap_length = byte_buf_length(assembled);
+    test_set_varstore(varstore);
+    assert(amd64_execute(mmap_mem, varstore) == 0);
+
+    uint64_t result;
+    assert(varstore_value(varstore, "result", 32, &result) == 0);
+    int error =    (result != 6)
+                || (varstore_value(varstore, "t32", 32, &result) == 0);
+
+    ODEL(list);
+    ODEL(varstore);
+    ODEL(assembled);
+
+    return error;
+}
+
+/* Runs a block with immediates, identities and 1-bit operations, with the
+   peephole optimizations on and off */
+int test_peephole_run (int enabled, uint64_t * results, size_t * length) {
+    struct list * list = list_create();
+    list_append_(list, bins_or_(boper_variable(64, "a64"),
+                                boper_constant(64, 0x1122334455667788),
+                                boper_constant(64, 0)));
+    list_append_(list, bins_add_(boper_variable(64, "a64"),
+                                 boper_variable(64, "a64"),
+                                 boper_constant(64, 0xfffffffffffffff0)));
+    list_append_(list, bins_xor_(boper_variable(64, "a64"),
+                                 boper_variable(64, "a64"),
+                                 boper_constant(64, 0x8000000000000000)));
+    list_append_(list, bins_or_(boper_variable(8, "a8"),
+                                boper_constant(8, 0x81),
+                                boper_constant(8, 0)));
+    list_append_(list, bins_sub_(boper_variable(8, "a8"),
+                                 boper_variable(8, "a8"),
+                                 boper_constant(8, 0)));
+    list_append_(list, bins_and_(boper_variable(8, "a8"),
+                                 boper_variable(8, "a8"),
+                                 boper_constant(8, 0xf0)));
+    list_append_(list, bins_or_(boper_variable(1, "f"),
+                                boper_constant(1, 1),
+                                boper_constant(1, 0)));
+    list_append_(list, bins_add_(boper_variable(1, "f"),
+                                 boper_variable(1, "f"),
+                                 boper_constant(1, 1)));
+    list_append_(list, bins_cmpeq_(boper_variable(1, "g"),
+                                   boper_variable(8, "a8"),
+                                   boper_constant(8, 0x80)));
+    list_append_(list, bins_xor_(boper_variable(1, "g"),
+                                 boper_variable(1, "g"),
+                                 boper_variable(1, "f")));
+
+    amd64_set_peephole(enabled);
+    struct varstore * varstore = varstore_create();
+    struct byte_buf * assembled = amd64_assemble(list, varstore);
+    amd64_set_peephole(1);
+    memcpy(mmap_mem, byte_buf_bytes(assembled), byte_buf_length(assembled));
+    mmap_length = byte_buf_length(assembled);
+    *length = mmap_length;
+    assert(amd64_execute(mmap_mem, varstore) == 0);
+
+    assert(varstore_value(varstore, "a64", 64, &results[0]) == 0);
+    assert(varstore_value(varstore, "a8", 8, &results[1]) == 0);
+    assert(varstore_value(varstore, "f", 1, &results[2]) == 0);
+    assert(varstore_value(varstore, "g", 1, &results[3]) == 0);
+
+    ODEL(list);
+    ODEL(varstore);
+    ODEL(assembled);
+
+    return 0;
+}
+
+
+int test_peephole () {
+    uint64_t on[4];
+    uint64_t off[4];
+    size_t on_length;
+    size_t off_length;
+    struct amd64_peephole_stats before;
+    struct amd64_peephole_stats after;
+
+    amd64_get_peephole_stats(&before);
+    test_peephole_run(1, on, &on_length);
+    amd64_get_peephole_stats(&after);
+    test_peephole_run(0, off, &off_length);
+
+    if (memcmp(on, off, sizeof(on)) != 0)
+        return -1;
+    else if (   (on[0] != (0x1122334455667778ULL ^ 0x8000000000000000ULL))
+             || (on[1] != 0x80)
+             || (on[2] != 0)
+             || (on[3] != 1))
+        return -1;
+    else if (on_length >= off_length)
+        return -1;
+    else if (   (after.identities == before.identities)
+             || (after.immediates == before.immediates))
+        return -1;
+
+    return 0;
+}
+
+
+/* The constant operations of test_constant_run, each at every width */
+struct test_constant {
+    struct bins * (* op_) (struct boper *, struct boper *, struct boper *);
+    uint64_t constant;
+};
+
+struct test_constant test_constants [] = {
+    {bins_shl_, 1},
+    {bins_shl_, 3},
+    {bins_shl_, 7},
+    {bins_shl_, 64},
+    {bins_shr_, 1},
+    {bins_shr_, 5},
+    {bins_shr_, 64},
+    {bins_umul_, 2},
+    {bins_umul_, 8},
+    {bins_umul_, 5},
+    {bins_umul_, 0x7f},
+    {bins_umul_, 0},
+    {bins_udiv_, 1},
+    {bins_udiv_, 16},
+    {bins_udiv_, 3},
+    {bins_umod_, 8},
+    {bins_umod_, 10},
+    {bins_add_, 0x10},
+    {bins_add_, 0x12345678}
+};
+
+#define TEST_CONSTANTS (sizeof(test_constants) / sizeof(struct test_constant))
+
+uint64_t test_constant_expected (unsigned int i, uint64_t lhs, unsigned int bits) {
+    uint64_t mask = (bits == 64) ? 0xffffffffffffffffULL : (1ULL << bits) - 1;
+    uint64_t c = test_constants[i].constant & mask;
+    if (test_constants[i].op_ == bins_shl_)
+        return (c >= bits) ? 0 : (lhs << c) & mask;
+    else if (test_constants[i].op_ == bins_shr_)
+        return (c >= bits) ? 0 : lhs >> c;
+    else if (test_constants[i].op_ == bins_umul_)
+        return (lhs * c) & mask;
+    else if (test_constants[i].op_ == bins_udiv_)
+        return lhs / c;
+    else if (test_constants[i].op_ == bins_umod_)
+        return lhs % c;
+    return (lhs + c) & mask;
+}
+
+
+/*
+* Runs every test_constants operation on lhs at every width, along with an
+* add of two variables and a shift in place, with the peephole optimizations
+* on or off. There are more results than registers, so some are in the
+* varstore.
+*/
+int test_constant_run (int enabled,
+                       uint64_t lhs,
+                       uint64_t * results,
+                       size_t * length) {
+    static const unsigned int widths [] = {8, 16, 32, 64};
+    struct list * list = list_create();
+    char identifier[16];
+    char identifier2[16];
+
+    unsigned int w;
+    unsigned int i;
+    for (w = 0; w < 4; w++) {
+        unsigned int bits = widths[w];
+        snprintf(identifier, sizeof(identifier), "l%u", bits);
+        list_append_(list, bins_or_(boper_variable(bits, identifier),
+                                    boper_constant(bits, lhs),
+                                    boper_constant(bits, 0)));
+        for (i = 0; i < TEST_CONSTANTS; i++) {
+            snprintf(identifier2, sizeof(identifier2), "r%u_%u", bits, i);
+            struct boper * constant;
+            constant = boper_constant(bits, test_constants[i].constant);
+            list_append_(list, test_constants[i].op_(
+                                   boper_variable(bits, identifier2),
+                                   boper_variable(bits, identifier),
+                                   constant));
+        }
+        snprintf(identifier2, sizeof(identifier2), "s%u", bits);
+        list_append_(list, bins_add_(boper_variable(bits, identifier2),
+                                     boper_variable(bits, identifier),
+                                     boper_variable(bits, identifier)));
+        list_append_(list, bins_shr_(boper_variable(bits, identifier2),
+                                     boper_variable(bits, identifier2),
+                                     boper_constant(bits, 2)));
+    }
+
+    amd64_set_peephole(enabled);
+    struct varstore * varstore = varstore_create();
+    struct byte_buf * assembled = amd64_assemble(list, varstore);
+    amd64_set_peephole(1);
+    memcpy(mmap_mem, byte_buf_bytes(assembled), byte_buf_length(assembled));
+    mmap_length = byte_buf_length(assembled);
+    *length = mmap_length;
+    assert(amd64_execute(mmap_mem, varstore) == 0);
+
+    for (w = 0; w < 4; w++) {
+        unsigned int bits = widths[w];
+        for (i = 0; i < TEST_CONSTANTS; i++) {
+            snprintf(identifier2, sizeof(identifier2), "r%u_%u", bits, i);
+            assert(varstore_value(varstore,
+                                  identifier2,
+                                  bits,
+                                  &results[w * (TEST_CONSTANTS + 1) + i])
+                   == 0);
+        }
+        snprintf(identifier2, sizeof(identifier2), "s%u", bits);
+        assert(varstore_value(varstore,
+                              identifier2,
+                              bits,
+                              &results[w * (TEST_CONSTANTS + 1) + i]) == 0);
+    }
+
+    ODEL(list);
+    ODEL(varstore);
+    ODEL(assembled);
+
+    return 0;
+}
+
+
+int test_constant () {
+    static const unsigned int widths [] = {8, 16, 32, 64};
+    uint64_t on[4 * (TEST_CONSTANTS + 1)];
+    uint64_t off[4 * (TEST_CONSTANTS + 1)];
+    size_t on_length;
+    size_t off_length;
+    struct amd64_peephole_stats before;
+    struct amd64_peephole_stats after;
+    uint64_t lhs = 0x8123456789abcdefULL;
+
+    amd64_get_peephole_stats(&before);
+    test_constant_run(1, lhs, on, &on_length);
+    amd64_get_peephole_stats(&after);
+    test_constant_run(0, lhs, off, &off_length);
+
+    unsigned int w;
+    unsigned int i;
+    for (w = 0; w < 4; w++) {
+        unsigned int bits = widths[w];
+        uint64_t mask = (bits == 64) ? 0xffffffffffffffffULL : (1ULL << bits) - 1;
+        for (i = 0; i < TEST_CONSTANTS; i++) {
+            uint64_t expected = test_constant_expected(i, lhs & mask, bits);
+            unsigned int r = w * (TEST_CONSTANTS + 1) + i;
+            if ((on[r] != expected) || (off[r] != expected)) {
+                printf("constant %u %u (0x%llx, 0x%llx != 0x%llx)\n",
+                       bits, i,
+                       (unsigned long long) on[r],
+                       (unsigned long long) off[r],
+                       (unsigned long long) expected);
+                return -1;
+            }
+        }
+        uint64_t expected = ((lhs + lhs) & mask) >> 2;
+        unsigned int r = w * (TEST_CONSTANTS + 1) + i;
+        if ((on[r] != expected) || (off[r] != expected)) {
+            printf("constant %u lea (0x%llx, 0x%llx != 0x%llx)\n",
+                   bits,
+                   (unsigned long long) on[r],
+                   (unsigned long long) off[r],
+                   (unsigned long long) expected);
+            return -1;
+        }
+    }
+
+    if (on_length >= off_length)
+        return -1;
+    else if (   (after.constants == before.constants)
+             || (after.leas == before.leas)
+             || (after.short_forms == before.short_forms))
+        return -1;
+
+    return 0;
+}
+
+
 int main (int argc, char * argv[]) {
     mmap_mem = mmap(0, 4096 * 16, PROT_READ | PROT_WRITE | PROT_EXEC,
                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    if (test_add()) {
+    if (test_jmp()) {
+        printf("error in test_jmp()\n");
+        return -1;
+    }
+    else if (test_add()) {
         printf("error in test_add()\n");
         dump_mmap_mem();
         return -1;
@@ -1020,6 +1437,26 @@ int main (int argc, char * argv[]) {
         dump_mmap_mem();
         return -1;
     }
+    else if (test_alloc(0) || test_alloc(1)) {
+        printf("error in test_alloc()\n");
+        dump_mmap_mem();
+        return -1;
+    }
+    else if (test_temporary()) {
+        printf("error in test_temporary()\n");
+        dump_mmap_mem();
+        return -1;
+    }
+    else if (test_peephole()) {
+        printf("error in test_peephole()\n");
+        dump_mmap_mem();
+        return -1;
+    }
+    else if (test_constant()) {
+        printf("error in test_constant()\n");
+        dump_mmap_mem();
+        return -1;
+    }
     munmap(mmap_mem, 4096 * 16);
     return 0;
 }
@@ -0,0 +1,34 @@
+#include "container/arena.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+int main () {
+    struct arena * arena = arena_create();
+    assert(arena->chunks_size == 0);
+
+    /* small allocations share a chunk, and are aligned */
+    unsigned int i;
+    uint8_t * last = NULL;
+    for (i = 0; i < 64; i++) {
+        uint8_t * memory = arena_alloc(arena, 24);
+        assert(memory != NULL);
+        assert(((uintptr_t) memory & (ARENA_ALIGN - 1)) == 0);
+        memset(memory, i, 24);
+        if (last != NULL)
+            assert(last[23] == i - 1);
+        last = memory;
+    }
+    assert(arena->chunks_size == 1);
+
+    /* an allocation larger than a chunk gets its own */
+    uint8_t * large = arena_alloc(arena, ARENA_CHUNK_SIZE * 2);
+    assert(large != NULL);
+    memset(large, 0xff, ARENA_CHUNK_SIZE * 2);
+    assert(arena->chunks_size == 2);
+
+    ODEL(arena);
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include "btlog.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_PATH "/tmp/test_btlog.log"
+
+
+int evaluated = 0;
+
+
+int evaluate () {
+    evaluated++;
+    return 0;
+}
+
+
+int main () {
+    /* disabled messages don't evaluate their arguments */
+    btlog_set_level(BTLOG_ALL, BTLOG_WARN);
+    BTLOG(BTLOG_JIT, BTLOG_DEBUG, "%d", evaluate());
+    assert(evaluated == 0);
+    BTLOG(BTLOG_JIT, BTLOG_WARN, "%d", evaluate());
+    assert(evaluated == 1);
+
+    /* levels are per subsystem */
+    btlog_set_level(BTLOG_MEMMAP, BTLOG_OFF);
+    assert(! BTLOG_ENABLED(BTLOG_MEMMAP, BTLOG_ERROR));
+    assert(BTLOG_ENABLED(BTLOG_JIT, BTLOG_ERROR));
+
+    /* only the newest messages are kept */
+    unsigned int i;
+    for (i = 0; i < BTLOG_RING_SIZE * 2; i++)
+        BTLOG(BTLOG_JIT, BTLOG_WARN, "message %u", i);
+    write_btlog(TEST_PATH);
+
+    FILE * fh = fopen(TEST_PATH, "r");
+    assert(fh != NULL);
+    char line[BTLOG_LINE_SIZE];
+    unsigned int lines = 0;
+    while (fgets(line, sizeof(line), fh) != NULL) {
+        char expected[BTLOG_LINE_SIZE];
+        snprintf(expected, sizeof(expected),
+                 "message %u\n", BTLOG_RING_SIZE + lines);
+        assert(strcmp(line, expected) == 0);
+        lines++;
+    }
+    fclose(fh);
+    assert(lines == BTLOG_RING_SIZE);
+
+    remove(TEST_PATH);
+    return 0;
+}
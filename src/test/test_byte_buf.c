@@ -35,6 +35,13 @@ int main () {
         assert(byte_buf_bytes(bb)[i] == compare_bytes[i % 15]);
     }
 
+    assert(byte_buf_set_le32(bb, 26, 0x44332211) == 0);
+    assert(byte_buf_bytes(bb)[25] == 0x0b);
+    assert(byte_buf_bytes(bb)[26] == 0x11);
+    assert(byte_buf_bytes(bb)[29] == 0x44);
+    assert(byte_buf_set_le32(bb, 27, 0) != 0);
+    assert(byte_buf_length(bb) == 30);
+
     ODEL(bb);
     ODEL(copy);
 
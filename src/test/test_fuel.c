@@ -0,0 +1,127 @@
+#include "arch/source/hsvm.h"
+#include "arch/target/amd64.h"
+#include "arch/target/interp.h"
+#include "bt/jit.h"
+#include "container/memmap.h"
+#include "container/varstore.h"
+#include "hooks.h"
+#include "platform/platform.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+
+/*
+* Sums 1..10, entering the block at 0x00 once, the block at 0x08 9 times and
+* the block at 0x18 once. That is 11 blocks, and 6 + 9 * 4 + 1 = 43
+* instructions.
+* 0x00 mov r0, 0
+* 0x04 load r1, [0x100]
+* 0x08 add r0, r0, r1
+* 0x0c sub r1, 1
+* 0x10 cmp r1, 0
+* 0x14 jg 0x08
+* 0x18 hlt
+*/
+const uint8_t program[] = {
+    0x52, 0x00, 0x00, 0x00,
+    0x30, 0x01, 0x01, 0x00,
+    0x10, 0x00, 0x00, 0x01,
+    0x13, 0x01, 0x00, 0x01,
+    0x54, 0x01, 0x00, 0x00,
+    0x25, 0x00, 0xff, 0xf0,
+    0x60, 0x00, 0x00, 0x00
+};
+
+
+int test_hlt (struct jit * jit, struct varstore * varstore) {
+    return PLATFORM_STOP;
+}
+
+
+const struct platform test_platform = {test_hlt, NULL, NULL};
+
+
+struct memmap * test_memmap () {
+    struct memmap * memmap = memmap_create(0x100);
+    memmap_map(memmap,
+               0,
+               0x200,
+               program,
+               sizeof(program),
+               MEMMAP_R | MEMMAP_W | MEMMAP_X);
+    memmap_set_u8(memmap, 0x101, 10);
+    return memmap;
+}
+
+
+uint64_t test_value (struct varstore * varstore, const char * identifier) {
+    uint64_t value;
+    assert(varstore_value(varstore, identifier, 16, &value) == 0);
+    return value;
+}
+
+
+int test_fuel (unsigned int fuel_unit,
+               const struct arch_target * tier_target,
+               uint64_t budget,
+               uint64_t needed) {
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+    jit_set_fuel_unit(jit, fuel_unit);
+    if (tier_target != NULL)
+        jit_set_tiering(jit, tier_target, 4);
+
+    struct memmap * memmap = test_memmap();
+    struct varstore * varstore = varstore_create();
+    varstore_insert(varstore, "rip", 16);
+
+    /* too little fuel stops the guest on a block boundary */
+    uint64_t fuel = budget;
+    assert(jit_execute_fuel(jit, varstore, memmap, &fuel) == 4);
+    uint64_t rip = test_value(varstore, "rip");
+    assert((rip == 0x08) || (rip == 0x18));
+
+    /* and it finishes where it left off */
+    uint64_t spent = budget - fuel;
+    fuel = needed;
+    assert(jit_execute_fuel(jit, varstore, memmap, &fuel) == 0);
+    assert(fuel == spent);
+    assert(test_value(varstore, "r0") == 55);
+
+    /* exactly enough fuel runs it to the end */
+    ODEL(varstore);
+    varstore = varstore_create();
+    varstore_insert(varstore, "rip", 16);
+    fuel = needed;
+    assert(jit_execute_fuel(jit, varstore, memmap, &fuel) == 0);
+    assert(fuel == 0);
+    assert(test_value(varstore, "r0") == 55);
+
+    /* and there is no limit without a budget */
+    ODEL(varstore);
+    varstore = varstore_create();
+    varstore_insert(varstore, "rip", 16);
+    assert(jit_execute(jit, varstore, memmap) == 0);
+    assert(test_value(varstore, "r0") == 55);
+
+    ODEL(varstore);
+    ODEL(memmap);
+    ODEL(jit);
+    return 0;
+}
+
+
+int main () {
+    global_hooks_init();
+
+    assert(test_fuel(JIT_FUEL_BLOCKS, NULL, 5, 11) == 0);
+    assert(test_fuel(JIT_FUEL_BLOCKS, &arch_target_interp, 7, 11) == 0);
+    assert(test_fuel(JIT_FUEL_INSTRUCTIONS, NULL, 42, 43) == 0);
+    assert(test_fuel(JIT_FUEL_INSTRUCTIONS, &arch_target_interp, 20, 43) == 0);
+
+    global_hooks_cleanup();
+    return 0;
+}
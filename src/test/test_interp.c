@@ -0,0 +1,351 @@
+#include "arch/target/amd64.h"
+#include "arch/target/interp.h"
+#include "bt/bins.h"
+#include "container/byte_buf.h"
+#include "container/list.h"
+#include "container/memmap.h"
+#include "container/varstore.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define TEST_ITERATIONS 16
+
+
+/* Executable memory for running amd64 code we compare the interpreter to. */
+void * mmap_mem;
+
+
+uint64_t random_u64 () {
+    uint64_t r;
+    FILE * fh = fopen("/dev/urandom", "rb");
+    fread(&r, 1, sizeof(r), fh);
+    fclose(fh);
+    return r;
+}
+
+
+/*
+* Runs list with both amd64 and interp, and checks variable "result" of the
+* given bits came out the same.
+*/
+int compare_targets (struct list * list, unsigned int bits) {
+    struct varstore * native = varstore_create();
+    struct varstore * interp = varstore_create();
+
+    struct byte_buf * assembled = amd64_assemble(list, native);
+    memcpy(mmap_mem, byte_buf_bytes(assembled), byte_buf_length(assembled));
+    ODEL(assembled);
+    assert(amd64_execute(mmap_mem, native) == 0);
+
+    assembled = interp_assemble(list, interp);
+    assert(assembled != NULL);
+    assert(interp_execute(byte_buf_bytes(assembled), interp) == 0);
+    ODEL(assembled);
+
+    uint64_t native_result;
+    uint64_t interp_result;
+    assert(varstore_value(native, "result", bits, &native_result) == 0);
+    assert(varstore_value(interp, "result", bits, &interp_result) == 0);
+
+    ODEL(native);
+    ODEL(interp);
+
+    if (native_result != interp_result) {
+        printf("amd64 0x%llx interp 0x%llx\n",
+               (unsigned long long) native_result,
+               (unsigned long long) interp_result);
+        return -1;
+    }
+    return 0;
+}
+
+
+int test_3op (struct bins * (* op_) (struct boper *,
+                                     struct boper *,
+                                     struct boper *),
+              unsigned int result_bits) {
+    unsigned int bits;
+    for (bits = 8; bits <= 64; bits *= 2) {
+        unsigned int i;
+        for (i = 0; i < TEST_ITERATIONS; i++) {
+            uint64_t lhs = random_u64();
+            uint64_t rhs = random_u64();
+            /* shift counts below bits, of 64, and anything else, in turn */
+            if ((op_ == bins_shl_) || (op_ == bins_shr_)) {
+                if (i % 3 == 0)
+                    rhs &= bits - 1;
+                else if (i % 3 == 1)
+                    rhs = 64;
+            }
+            if ((rhs & (0xffffffffffffffffULL >> (64 - bits))) == 0)
+                rhs = 1;
+
+            struct list * list = list_create();
+            list_append_(list, bins_or_(boper_variable(bits, "lhs"),
+                                        boper_constant(bits, 0),
+                                        boper_constant(bits, lhs)));
+            list_append_(list, op_(boper_variable(result_bits ? result_bits
+                                                              : bits,
+                                                  "result"),
+                                   boper_variable(bits, "lhs"),
+                                   boper_constant(bits, rhs)));
+            int error = compare_targets(list, result_bits ? result_bits : bits);
+            ODEL(list);
+            if (error) {
+                printf("bits %u lhs 0x%llx rhs 0x%llx\n",
+                       bits,
+                       (unsigned long long) lhs,
+                       (unsigned long long) rhs);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+int test_ext () {
+    unsigned int i;
+    for (i = 0; i < TEST_ITERATIONS; i++) {
+        uint8_t value = random_u64();
+
+        struct list * list = list_create();
+        list_append_(list, bins_sext_(boper_variable(32, "result"),
+                                      boper_constant(8, value)));
+        assert(compare_targets(list, 32) == 0);
+        ODEL(list);
+
+        list = list_create();
+        list_append_(list, bins_zext_(boper_variable(64, "result"),
+                                      boper_constant(16, value << 8)));
+        assert(compare_targets(list, 64) == 0);
+        ODEL(list);
+    }
+    return 0;
+}
+
+
+struct bins * add_result (uint64_t value) {
+    return bins_add_(boper_variable(8, "result"),
+                     boper_variable(8, "result"),
+                     boper_constant(8, value));
+}
+
+
+/* Nested ces, lowered to branches, and an if-else of branches */
+int test_branch () {
+    unsigned int flags;
+    for (flags = 0; flags < 4; flags++) {
+        unsigned int a = flags & 1;
+        unsigned int b = flags >> 1;
+        struct list * list = list_create();
+        list_append_(list, bins_or_(boper_variable(8, "result"),
+                                    boper_constant(8, 0),
+                                    boper_constant(8, 1)));
+        list_append_(list, bins_or_(boper_variable(1, "b"),
+                                    boper_constant(1, b),
+                                    boper_constant(1, 0)));
+        list_append_(list, bins_ce_(boper_constant(8, a),
+                                    boper_constant(8, 3)));
+        list_append_(list, add_result(2));
+        list_append_(list, bins_ce_(boper_variable(1, "b"),
+                                    boper_constant(8, 1)));
+        list_append_(list, add_result(4));
+        list_append_(list, add_result(8));
+        list_append_(list, bins_brz_(boper_variable(1, "b"), 0));
+        list_append_(list, add_result(16));
+        list_append_(list, bins_br(1));
+        list_append_(list, bins_label(0));
+        list_append_(list, add_result(32));
+        list_append_(list, bins_label(1));
+        assert(bins_lower_ce(list) == 0);
+        assert(list_length(list) == 15);
+
+        struct varstore * varstore = varstore_create();
+        struct byte_buf * assembled = interp_assemble(list, varstore);
+        assert(interp_execute(byte_buf_bytes(assembled), varstore) == 0);
+
+        uint64_t result;
+        uint64_t expected = 1 + 8 + (b ? 16 : 32);
+        if (a)
+            expected += 2 + (b ? 4 : 0);
+        assert(varstore_value(varstore, "result", 8, &result) == 0);
+        assert(result == expected);
+        assert(compare_targets(list, 8) == 0);
+
+        ODEL(assembled);
+        ODEL(varstore);
+        ODEL(list);
+    }
+
+    /* a ce past the end of the block, or a branch with no label after it,
+       is an error */
+    struct list * list = list_create();
+    list_append_(list, bins_ce_(boper_constant(8, 1), boper_constant(8, 2)));
+    list_append_(list, add_result(2));
+    assert(bins_lower_ce(list) != 0);
+    ODEL(list);
+
+    list = list_create();
+    list_append_(list, bins_label(0));
+    list_append_(list, bins_br(0));
+    struct varstore * varstore = varstore_create();
+    assert(interp_assemble(list, varstore) == NULL);
+    ODEL(varstore);
+    ODEL(list);
+
+    return 0;
+}
+
+
+int test_memory () {
+    uint8_t bytes[16];
+    memset(bytes, 0x41, sizeof(bytes));
+    struct memmap * memmap = memmap_create(4096);
+    memmap_map(memmap, 0, 4096, bytes, sizeof(bytes), MEMMAP_R | MEMMAP_W);
+
+    struct list * list = list_create();
+    list_append_(list, bins_store_(boper_constant(16, 4),
+                                   boper_constant(8, 0x99)));
+    list_append_(list, bins_load_(boper_variable(8, "result"),
+                                  boper_constant(16, 4)));
+
+    struct varstore * varstore = varstore_create();
+    size_t offset = varstore_offset_create(varstore, "__MEMMAP__", 64);
+    uint8_t * data_buf = varstore_data_buf(varstore);
+    *((uint64_t *) &(data_buf[offset])) = (uint64_t) memmap;
+
+    struct byte_buf * assembled = interp_assemble(list, varstore);
+    assert(interp_execute(byte_buf_bytes(assembled), varstore) == 0);
+    uint64_t result;
+    assert(varstore_value(varstore, "result", 8, &result) == 0);
+    assert(result == 0x99);
+    ODEL(assembled);
+
+    /* unmapped memory is an MMU read error, like amd64_execute */
+    ODEL(list);
+    list = list_create();
+    list_append_(list, bins_load_(boper_variable(8, "result"),
+                                  boper_constant(16, 0x8000)));
+    assembled = interp_assemble(list, varstore);
+    assert(interp_execute(byte_buf_bytes(assembled), varstore) == 1);
+    ODEL(assembled);
+
+    ODEL(varstore);
+    ODEL(list);
+    ODEL(memmap);
+    return 0;
+}
+
+
+/* Runs list against a fresh memmap with amd64 or interp, and returns the
+   variables result and half it loaded */
+int run_wide (struct list * list,
+              int native,
+              uint64_t * result,
+              uint64_t * half) {
+    uint8_t bytes[16];
+    memset(bytes, 0x41, sizeof(bytes));
+    struct memmap * memmap = memmap_create(4096);
+    memmap_map(memmap, 0, 4096, bytes, sizeof(bytes), MEMMAP_R | MEMMAP_W);
+
+    struct varstore * varstore = varstore_create();
+    size_t offset = varstore_offset_create(varstore, "__MEMMAP__", 64);
+    uint8_t * data_buf = varstore_data_buf(varstore);
+    *((uint64_t *) &(data_buf[offset])) = (uint64_t) memmap;
+
+    int error;
+    struct byte_buf * assembled;
+    if (native) {
+        assembled = amd64_assemble(list, varstore);
+        memcpy(mmap_mem, byte_buf_bytes(assembled), byte_buf_length(assembled));
+        error = amd64_execute(mmap_mem, varstore);
+    }
+    else {
+        assembled = interp_assemble(list, varstore);
+        error = interp_execute(byte_buf_bytes(assembled), varstore);
+    }
+    ODEL(assembled);
+
+    if (error == 0) {
+        assert(varstore_value(varstore, "result", 64, result) == 0);
+        assert(varstore_value(varstore, "half", 16, half) == 0);
+    }
+
+    ODEL(varstore);
+    ODEL(memmap);
+    return error;
+}
+
+
+int test_memory_wide () {
+    struct list * list = list_create();
+    list_append_(list, bins_storebe_(boper_constant(16, 0),
+                                     boper_constant(32, 0x11223344)));
+    list_append_(list, bins_store_(boper_constant(16, 4),
+                                   boper_constant(16, 0xaabb)));
+    list_append_(list, bins_load_(boper_variable(64, "result"),
+                                  boper_constant(16, 0)));
+    list_append_(list, bins_loadbe_(boper_variable(16, "half"),
+                                    boper_constant(16, 2)));
+
+    int native;
+    for (native = 0; native < 2; native++) {
+        uint64_t result;
+        uint64_t half;
+        assert(run_wide(list, native, &result, &half) == 0);
+        if ((result != 0x4141aabb44332211ULL) || (half != 0x3344)) {
+            printf("%s result 0x%llx half 0x%llx\n",
+                   native ? "amd64" : "interp",
+                   (unsigned long long) result,
+                   (unsigned long long) half);
+            return -1;
+        }
+    }
+    ODEL(list);
+
+    /* any byte of the access being unmapped fails it */
+    list = list_create();
+    list_append_(list, bins_load_(boper_variable(32, "result"),
+                                  boper_constant(16, 4094)));
+    for (native = 0; native < 2; native++) {
+        uint64_t result;
+        uint64_t half;
+        assert(run_wide(list, native, &result, &half) == 1);
+    }
+    ODEL(list);
+
+    return 0;
+}
+
+
+int main (int argc, char * argv[]) {
+    mmap_mem = mmap(0, 4096 * 16, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    assert(test_3op(bins_add_, 0) == 0);
+    assert(test_3op(bins_sub_, 0) == 0);
+    assert(test_3op(bins_umul_, 0) == 0);
+    assert(test_3op(bins_udiv_, 0) == 0);
+    assert(test_3op(bins_umod_, 0) == 0);
+    assert(test_3op(bins_and_, 0) == 0);
+    assert(test_3op(bins_or_, 0) == 0);
+    assert(test_3op(bins_xor_, 0) == 0);
+    assert(test_3op(bins_shl_, 0) == 0);
+    assert(test_3op(bins_shr_, 0) == 0);
+    assert(test_3op(bins_cmpeq_, 8) == 0);
+    assert(test_3op(bins_cmpltu_, 8) == 0);
+    assert(test_3op(bins_cmplts_, 8) == 0);
+    assert(test_3op(bins_cmpleu_, 8) == 0);
+    assert(test_3op(bins_cmples_, 8) == 0);
+    assert(test_ext() == 0);
+    assert(test_branch() == 0);
+    assert(test_memory() == 0);
+    assert(test_memory_wide() == 0);
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "bt/bins.h"
+#include "bt/ir.h"
+#include "container/list.h"
+
+#include <assert.h>
+#include <string.h>
+
+int main () {
+    struct list * l = list_create();
+    list_append_(l, bins_add_(boper_variable(32, "a"),
+                              boper_variable(32, "a"),
+                              boper_constant(32, 1)));
+    list_append_(l, bins_or_(boper_temporary(32, "a"),
+                             boper_variable(16, "a"),
+                             boper_constant(32, 1)));
+    list_append_(l, bins_hlt());
+
+    struct ir * ir = ir_create(l);
+    ODEL(l);
+
+    assert(ir->size == 3);
+    assert(ir->bins[0].op == BOP_ADD);
+    assert(ir->bins[2].op == BOP_HLT);
+    assert(ir->bins[2].oper[0] == NULL);
+
+    /* equal operands are interned, others are not */
+    assert(ir->bins[0].oper[0] == ir->bins[0].oper[1]);
+    assert(ir->bins[0].oper[2] == ir->bins[1].oper[2]);
+    assert(ir->bins[0].oper[0] != ir->bins[1].oper[0]);
+    assert(ir->bins[0].oper[0] != ir->bins[1].oper[1]);
+    assert(ir->opers_size == 4);
+    assert(ir_index(ir, ir->bins[1].oper[1]) == 3);
+
+    /* but their identifiers are kept once */
+    assert(    boper_identifier(ir->bins[0].oper[0])
+            == boper_identifier(ir->bins[1].oper[0]));
+    assert(strcmp(boper_identifier(ir->bins[1].oper[1]), "a") == 0);
+
+    struct ir * copy = OCOPY(ir);
+    ODEL(ir);
+    assert(copy->size == 3);
+    assert(copy->opers_size == 4);
+    assert(boper_value(copy->bins[1].oper[2]) == 1);
+    assert(ir_index(copy, copy->bins[0].oper[0]) == 0);
+    ODEL(copy);
+
+    /* branches find the label after them */
+    l = list_create();
+    list_append_(l, bins_label(1));
+    list_append_(l, bins_brz_(boper_variable(1, "f"), 1));
+    list_append_(l, bins_br(2));
+    list_append_(l, bins_label(2));
+    list_append_(l, bins_label(1));
+    ir = ir_create(l);
+    ODEL(l);
+    assert(ir->targets[0] == IR_NONE);
+    assert(ir->targets[1] == 4);
+    assert(ir->targets[2] == 3);
+    copy = OCOPY(ir);
+    ODEL(ir);
+    assert(copy->targets[1] == 4);
+    ODEL(copy);
+
+    return 0;
+}
@@ -0,0 +1,498 @@
+#include "arch/source/hsvm.h"
+#include "arch/target/amd64.h"
+#include "arch/target/interp.h"
+#include "bt/jit.h"
+#include "container/memmap.h"
+#include "container/varstore.h"
+#include "hooks.h"
+#include "platform/platform.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+
+/* A copied jit has the code of the original, and room for more */
+int test_copy () {
+    struct jit * jit = jit_create(NULL, &arch_target_amd64, NULL);
+
+    uint8_t code[64];
+    memset(code, 0xc3, sizeof(code));
+    assert(jit_set_code(jit, 0x100, code, sizeof(code)) == 0);
+
+    struct jit * copy = OCOPY(jit);
+    ODEL(jit);
+
+    const uint8_t * copied = jit_get_code(copy, 0x100);
+    if ((copied == NULL) || (memcmp(copied, code, sizeof(code)) != 0))
+        return -1;
+
+    memset(code, 0x90, sizeof(code));
+    assert(jit_set_code(copy, 0x200, code, sizeof(code)) == 0);
+    copied = jit_get_code(copy, 0x100);
+    if ((copied == NULL) || (copied[0] != 0xc3))
+        return -1;
+    copied = jit_get_code(copy, 0x200);
+    if ((copied == NULL) || (memcmp(copied, code, sizeof(code)) != 0))
+        return -1;
+
+    ODEL(copy);
+
+    return 0;
+}
+
+
+/*
+* Sums 1..n, where n is the 16-bit value at 0x100
+* 0x00 mov r0, 0
+* 0x04 load r1, [0x100]
+* 0x08 add r0, r0, r1
+* 0x0c sub r1, 1
+* 0x10 cmp r1, 0
+* 0x14 jg 0x08
+* 0x18 hlt
+*/
+const uint8_t program[] = {
+    0x52, 0x00, 0x00, 0x00,
+    0x30, 0x01, 0x01, 0x00,
+    0x10, 0x00, 0x00, 0x01,
+    0x13, 0x01, 0x00, 0x01,
+    0x54, 0x01, 0x00, 0x00,
+    0x25, 0x00, 0xff, 0xf0,
+    0x60, 0x00, 0x00, 0x00
+};
+
+
+int test_hlt (struct jit * jit, struct varstore * varstore) {
+    return PLATFORM_STOP;
+}
+
+
+const struct platform test_platform = {test_hlt, NULL, NULL};
+
+
+/*
+* Runs the program summing 1..n from 0 in varstore, and returns 0 if the sum
+* is right
+*/
+int test_sum_varstore (struct jit * jit,
+                       struct varstore * varstore,
+                       uint16_t n) {
+    struct memmap * memmap = memmap_create(0x100);
+    memmap_map(memmap,
+               0,
+               0x200,
+               program,
+               sizeof(program),
+               MEMMAP_R | MEMMAP_W | MEMMAP_X);
+    memmap_set_u8(memmap, 0x100, n >> 8);
+    memmap_set_u8(memmap, 0x101, n & 0xff);
+
+    size_t offset = varstore_offset_create(varstore, "rip", 16);
+    uint8_t * data_buf = (uint8_t *) varstore_data_buf(varstore);
+    *((uint16_t *) &(data_buf[offset])) = 0;
+
+    int error = jit_execute(jit, varstore, memmap);
+    uint64_t r0;
+    if (    (error == 0)
+         && (    (varstore_value(varstore, "r0", 16, &r0) != 0)
+              || (r0 != (((n * (n + 1)) / 2) & 0xffff))))
+        error = -100;
+
+    ODEL(memmap);
+
+    return error;
+}
+
+
+/* Runs the program summing 1..n in a varstore of its own */
+int test_sum (struct jit * jit, uint16_t n) {
+    struct varstore * varstore = varstore_create();
+    int error = test_sum_varstore(jit, varstore, n);
+    ODEL(varstore);
+    return error;
+}
+
+
+/* Returns non-zero if a chain slot of the block at from_vaddr jumps to vaddr */
+int test_chained (struct jit * jit, uint64_t from_vaddr, uint64_t vaddr) {
+    struct jit_block * jit_block = jit_get_block(jit, from_vaddr);
+    if (jit_block == NULL)
+        return 0;
+
+    unsigned int i;
+    for (i = 0; i < CHAIN_SLOTS; i++) {
+        if (    (jit_block->chain_used & (1 << i))
+             && (jit_block->chain_vaddr[i] == vaddr))
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+* The block at 0x00 leaves through the jg to the loop at 0x08, which must be
+* chained once it exists. Invalidating the loop unchains it, and the guest
+* still sums right afterwards. Blocks keep the layout of the varstore they
+* were assembled with, so both runs share one.
+*/
+int test_chain () {
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+    struct varstore * varstore = varstore_create();
+
+    if (test_sum_varstore(jit, varstore, 10))
+        return -1;
+    if (! test_chained(jit, 0x00, 0x08))
+        return -1;
+
+    if (jit_invalidate(jit, 0x08))
+        return -1;
+    if (jit_get_block(jit, 0x08) != NULL)
+        return -1;
+    if (test_chained(jit, 0x00, 0x08))
+        return -1;
+
+    if (test_sum_varstore(jit, varstore, 100))
+        return -1;
+    if (! test_chained(jit, 0x00, 0x08))
+        return -1;
+
+    ODEL(varstore);
+    ODEL(jit);
+
+    return 0;
+}
+
+
+/*
+* 0x100 and 0x4100 share a lookup table entry. Each replaces the other there,
+* neither is returned for the other, and invalidating a block only clears the
+* entry while it holds that block.
+*/
+int test_lookup () {
+    struct jit * jit = jit_create(NULL, &arch_target_amd64, NULL);
+
+    assert(JIT_LOOKUP_HASH(0x100) == JIT_LOOKUP_HASH(0x4100));
+    struct jit_lookup * jl = &(jit->lookup[JIT_LOOKUP_HASH(0x100)]);
+
+    uint8_t code[16];
+    memset(code, 0xc3, sizeof(code));
+    assert(jit_set_code(jit, 0x100, code, sizeof(code)) == 0);
+    memset(code, 0x90, sizeof(code));
+    assert(jit_set_code(jit, 0x4100, code, sizeof(code)) == 0);
+
+    const uint8_t * first = jit_get_code(jit, 0x100);
+    if ((first == NULL) || (first[0] != 0xc3) || (jl->code != first))
+        return -1;
+    const uint8_t * second = jit_get_code(jit, 0x4100);
+    if ((second == NULL) || (second[0] != 0x90) || (jl->code != second))
+        return -1;
+    if (jit_get_code(jit, 0x100) != first)
+        return -1;
+    if (jl->code != first)
+        return -1;
+
+    if (jit_invalidate(jit, 0x4100))
+        return -1;
+    if (jl->code != first)
+        return -1;
+    if (jit_invalidate(jit, 0x100))
+        return -1;
+    if (jl->code != NULL)
+        return -1;
+    if (jit_get_code(jit, 0x100) != NULL)
+        return -1;
+
+    ODEL(jit);
+
+    return 0;
+}
+
+
+/*
+* The loop at 0x08 was translated before it jumps to itself, so the probe at
+* the end of the block finds it in the lookup table and it never returns to
+* the jit to be chained. 0x00 leaves for 0x08 before 0x08 exists, so that
+* exit does return, and is chained.
+*/
+int test_probe () {
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+
+    if (test_sum(jit, 10))
+        return -1;
+    if (! test_chained(jit, 0x00, 0x08))
+        return -1;
+    if (test_chained(jit, 0x08, 0x08))
+        return -1;
+
+    ODEL(jit);
+
+    return 0;
+}
+
+
+/*
+* A cap below JIT_REGION_SIZE gets a single, smaller region. Invalidated
+* blocks waste their space in it until the jit has to flush.
+*/
+int test_cap () {
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+    jit_set_code_cap(jit, 0x2000);
+
+    unsigned int i;
+    for (i = 0; i < 32; i++) {
+        if (test_sum(jit, 10 + i))
+            return -1;
+        jit_invalidate(jit, 0x00);
+        jit_invalidate(jit, 0x08);
+        jit_invalidate(jit, 0x18);
+    }
+
+    struct jit_stats stats;
+    jit_get_stats(jit, &stats);
+    if ((stats.regions != 1) || (stats.mapped > 0x2000) || (stats.flushes == 0))
+        return -1;
+
+    ODEL(jit);
+
+    return 0;
+}
+
+
+/*
+* Reads then writes 0x8000, which is not mapped, after a jump to another block
+* 0x00 mov r0, 0
+* 0x04 jmp 0x0c
+* 0x08 hlt
+* 0x0c load r1, [0x8000]
+* 0x10 stor [0x8000], r1
+* 0x14 hlt
+*/
+const uint8_t fault_program[] = {
+    0x52, 0x00, 0x00, 0x00,
+    0x20, 0x00, 0x00, 0x04,
+    0x60, 0x00, 0x00, 0x00,
+    0x30, 0x01, 0x80, 0x00,
+    0x34, 0x01, 0x80, 0x00,
+    0x60, 0x00, 0x00, 0x00
+};
+
+
+int test_hlt_error (struct jit * jit, struct varstore * varstore) {
+    return PLATFORM_ERROR;
+}
+
+
+const struct platform test_error_platform = {test_hlt_error, NULL, NULL};
+
+
+/* Runs fault_program with the bytes at 0x0c replaced by ins */
+int test_fault (struct jit * jit, const uint8_t * ins) {
+    uint8_t code[sizeof(fault_program)];
+    memcpy(code, fault_program, sizeof(code));
+    memcpy(&(code[0x0c]), ins, 4);
+
+    struct memmap * memmap = memmap_create(0x100);
+    memmap_map(memmap,
+               0,
+               0x200,
+               code,
+               sizeof(code),
+               MEMMAP_R | MEMMAP_W | MEMMAP_X);
+    struct varstore * varstore = varstore_create();
+    varstore_insert(varstore, "rip", 16);
+
+    int result = jit_execute(jit, varstore, memmap);
+
+    ODEL(varstore);
+    ODEL(memmap);
+
+    return result;
+}
+
+
+unsigned int test_hooked = 0;
+unsigned int test_misaligned = 0;
+
+
+/* With the frame pointer pushed, the frame is 16-byte aligned if the stack
+   was at the call */
+void test_align_hook (void * varstore) {
+    if (((uintptr_t) __builtin_frame_address(0)) & 0xf)
+        test_misaligned++;
+    test_hooked++;
+}
+
+
+int test_align_translate (struct jit * jit,
+                          struct varstore * varstore,
+                          struct memmap * memmap,
+                          struct list * binslist) {
+    list_prepend_(binslist, bins_hook(test_align_hook));
+    return 0;
+}
+
+
+const struct hooks_api test_align_api = {NULL, test_align_translate, NULL};
+
+
+/*
+* Blocks run from the dispatcher halt, fault and call hooks just as they would
+* run on their own. Each guest reuses the vaddrs of the last, so the jit is
+* flushed in between. This leaves test_align_api hooked.
+*/
+int test_dispatcher () {
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+
+    if (test_sum(jit, 10))
+        return -1;
+    if (jit->dispatcher == NULL)
+        return -1;
+
+    const uint8_t load[] = {0x30, 0x01, 0x80, 0x00};
+    jit_flush(jit);
+    if (test_fault(jit, load) != 1)
+        return -1;
+    jit_flush(jit);
+    const uint8_t stor[] = {0x34, 0x01, 0x80, 0x00};
+    if (test_fault(jit, stor) != 2)
+        return -1;
+    jit_flush(jit);
+    const uint8_t hlt[] = {0x60, 0x00, 0x00, 0x00};
+    if (test_fault(jit, hlt) != 0)
+        return -1;
+    ODEL(jit);
+
+    jit = jit_create(&arch_source_hsvm,
+                     &arch_target_amd64,
+                     &test_error_platform);
+    if (test_fault(jit, hlt) != -5)
+        return -1;
+    ODEL(jit);
+
+    global_hooks_append(&test_align_api);
+    jit = jit_create(&arch_source_hsvm,
+                     &arch_target_amd64,
+                     &test_platform);
+    if (test_sum(jit, 10))
+        return -1;
+    if ((test_hooked == 0) || (test_misaligned != 0))
+        return -1;
+    ODEL(jit);
+
+    return 0;
+}
+
+
+unsigned int test_translations = 0;
+
+
+struct list * test_translate_block (const void * buf,
+                                    size_t size,
+                                    uint64_t address) {
+    test_translations++;
+    return hsvm_translate_block(buf, size, address);
+}
+
+
+/*
+* 0x00 and 0x08 both jump to 0x08 or fall through to 0x18. Finding the flags
+* those successors write translates each once, however many blocks ask.
+*/
+int test_dead_flags () {
+    struct arch_source arch_source = arch_source_hsvm;
+    arch_source.translate_block = test_translate_block;
+
+    struct jit * jit = jit_create(&arch_source,
+                                  &arch_target_amd64,
+                                  &test_platform);
+
+    if (test_sum(jit, 10))
+        return -1;
+    /* the three blocks, 0x08 and 0x18 as successors, and 0x1c past the hlt */
+    if (test_translations != 6)
+        return -1;
+
+    ODEL(jit);
+
+    return 0;
+}
+
+
+/* Only blocks promoted from tier0 are optimized */
+int test_tier0_opt () {
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+    jit_set_tiering(jit, &arch_target_interp, 4);
+
+    if (test_sum(jit, 10))
+        return -1;
+
+    struct jit_stats stats;
+    jit_get_stats(jit, &stats);
+    if ((stats.promotions == 0) || (stats.opt.blocks != stats.promotions))
+        return -1;
+
+    ODEL(jit);
+
+    return 0;
+}
+
+
+int main () {
+    global_hooks_init();
+
+    if (test_copy()) {
+        printf("error in test_copy()\n");
+        return -1;
+    }
+
+    if (test_chain()) {
+        printf("error in test_chain()\n");
+        return -1;
+    }
+
+    if (test_lookup()) {
+        printf("error in test_lookup()\n");
+        return -1;
+    }
+
+    if (test_probe()) {
+        printf("error in test_probe()\n");
+        return -1;
+    }
+
+    if (test_cap()) {
+        printf("error in test_cap()\n");
+        return -1;
+    }
+
+    if (test_dead_flags()) {
+        printf("error in test_dead_flags()\n");
+        return -1;
+    }
+
+    if (test_tier0_opt()) {
+        printf("error in test_tier0_opt()\n");
+        return -1;
+    }
+
+    if (test_dispatcher()) {
+        printf("error in test_dispatcher()\n");
+        return -1;
+    }
+
+    global_hooks_cleanup();
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "bt/jit_cache.h"
+#include "container/byte_buf.h"
+#include "container/memmap.h"
+#include "container/varstore.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_PATH "/tmp/test_jit_cache.bin"
+#define TEST_KEY 0x1234
+
+
+int main () {
+    unlink(TEST_PATH);
+
+    /* a block of code holding a pointer to memmap_get_u8 */
+    uint8_t code[32];
+    memset(code, 0x90, sizeof(code));
+    uint64_t pointer = (uint64_t) memmap_get_u8;
+    memcpy(&(code[3]), &pointer, sizeof(pointer));
+
+    struct varstore * varstore = varstore_create();
+    varstore_insert(varstore, "rip", 16);
+    varstore_insert(varstore, "a", 64);
+
+    struct jit_cache * jit_cache = jit_cache_create(TEST_PATH, TEST_KEY);
+    assert(jit_cache_layout(jit_cache, varstore) == 0);
+    assert(jit_cache_get(jit_cache, 0x100, 7, 16) == NULL);
+    assert(jit_cache_put(jit_cache, 0x100, 7, 16, code, sizeof(code)) == 0);
+    assert(jit_cache_save(jit_cache, varstore) == 0);
+    ODEL(jit_cache);
+    ODEL(varstore);
+
+    /* a new run recreates the variables, and gets the same code back */
+    varstore = varstore_create();
+    varstore_insert(varstore, "rip", 16);
+    jit_cache = jit_cache_create(TEST_PATH, TEST_KEY);
+    assert(jit_cache_layout(jit_cache, varstore) == 0);
+    size_t offset;
+    assert(varstore_offset(varstore, "a", 64, &offset) == 0);
+    assert(offset == 4);
+
+    struct byte_buf * bb = jit_cache_get(jit_cache, 0x100, 7, 16);
+    assert(bb != NULL);
+    assert(byte_buf_length(bb) == sizeof(code));
+    assert(memcmp(byte_buf_bytes(bb), code, sizeof(code)) == 0);
+    ODEL(bb);
+
+    /* the guest bytes changed */
+    assert(jit_cache_get(jit_cache, 0x100, 8, 16) == NULL);
+    ODEL(jit_cache);
+    ODEL(varstore);
+
+    /* a different layout drops every block */
+    varstore = varstore_create();
+    varstore_insert(varstore, "b", 32);
+    jit_cache = jit_cache_create(TEST_PATH, TEST_KEY);
+    assert(jit_cache_layout(jit_cache, varstore) != 0);
+    assert(jit_cache_get(jit_cache, 0x100, 7, 16) == NULL);
+    ODEL(jit_cache);
+    ODEL(varstore);
+
+    /* and so does a different key */
+    varstore = varstore_create();
+    jit_cache = jit_cache_create(TEST_PATH, TEST_KEY + 1);
+    assert(jit_cache_layout(jit_cache, varstore) == 0);
+    assert(jit_cache_get(jit_cache, 0x100, 7, 16) == NULL);
+    ODEL(jit_cache);
+    ODEL(varstore);
+
+    unlink(TEST_PATH);
+
+    return 0;
+}
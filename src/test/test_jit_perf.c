@@ -0,0 +1,61 @@
+#include "bt/jit_perf.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+int main () {
+    uint8_t code[24];
+    memset(code, 0x90, sizeof(code));
+
+    struct jit_perf * jit_perf = jit_perf_create("hsvm",
+                                                 JIT_PERF_MAP | JIT_PERF_DUMP);
+    assert(jit_perf != NULL);
+    jit_perf_add_block(jit_perf, 0x1a4, code, sizeof(code));
+    ODEL(jit_perf);
+
+    /* one line per block, address and size in hex */
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) getpid());
+    FILE * fh = fopen(path, "r");
+    assert(fh != NULL);
+    char line[128];
+    assert(fgets(line, sizeof(line), fh) != NULL);
+    char expected[128];
+    snprintf(expected, sizeof(expected), "%llx 18 hsvm_0x01a4\n",
+             (unsigned long long) (uintptr_t) code);
+    assert(strcmp(line, expected) == 0);
+    assert(fgets(line, sizeof(line), fh) == NULL);
+    fclose(fh);
+    unlink(path);
+
+    /* a header, a load record holding the name and code, and a close */
+    snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int) getpid());
+    fh = fopen(path, "rb");
+    assert(fh != NULL);
+    struct jit_perf_dump_header header;
+    assert(fread(&header, sizeof(header), 1, fh) == 1);
+    assert(header.magic == JIT_PERF_DUMP_MAGIC);
+    assert(header.pid == getpid());
+
+    struct jit_perf_dump_load load;
+    assert(fread(&load, sizeof(load), 1, fh) == 1);
+    assert(load.record.id == JIT_PERF_CODE_LOAD);
+    assert(load.code_addr == (uintptr_t) code);
+    assert(load.code_size == sizeof(code));
+    assert(load.record.total_size == sizeof(load) + 12 + sizeof(code));
+    assert(fread(line, 12, 1, fh) == 1);
+    assert(strcmp(line, "hsvm_0x01a4") == 0);
+    assert(fread(line, sizeof(code), 1, fh) == 1);
+    assert(memcmp(line, code, sizeof(code)) == 0);
+
+    struct jit_perf_dump_record record;
+    assert(fread(&record, sizeof(record), 1, fh) == 1);
+    assert(record.id == JIT_PERF_CODE_CLOSE);
+    fclose(fh);
+    unlink(path);
+
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include "arch/source/hsvm.h"
+#include "bt/jit_pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* hlt */
+const uint8_t program[] = {0x60, 0x00, 0x00, 0x00};
+
+
+/* Returns the state of the job for vaddr, or -1 if there is none */
+int test_state (struct jit_pool * jit_pool, uint64_t vaddr) {
+    struct jit_pool_job * needle = jit_pool_job_create(vaddr,
+                                                       program,
+                                                       sizeof(program));
+
+    pthread_mutex_lock(&(jit_pool->lock));
+    struct jit_pool_job * job = tree_fetch(jit_pool->jobs, needle);
+    int state = -1;
+    if (job != NULL)
+        state = job->state;
+    pthread_mutex_unlock(&(jit_pool->lock));
+
+    ODEL(needle);
+    return state;
+}
+
+
+/* Waits up to a few seconds for the job for vaddr to reach state */
+int test_wait (struct jit_pool * jit_pool, uint64_t vaddr, int state) {
+    unsigned int i;
+    for (i = 0; i < 5000; i++) {
+        if (test_state(jit_pool, vaddr) == state)
+            return 0;
+        usleep(1000);
+    }
+    return -1;
+}
+
+
+/* Returns the number of jobs in the pool */
+unsigned int test_jobs (struct jit_pool * jit_pool) {
+    pthread_mutex_lock(&(jit_pool->lock));
+    unsigned int jobs = 0;
+    struct tree_it * tit;
+    for (tit = tree_it(jit_pool->jobs); tit != NULL; tit = tree_it_next(tit))
+        jobs++;
+    pthread_mutex_unlock(&(jit_pool->lock));
+    return jobs;
+}
+
+
+/* A finished job is taken once, and only for the bytes it was submitted */
+int test_take () {
+    struct jit_pool * jit_pool = jit_pool_create(&arch_source_hsvm, 1);
+
+    if (jit_pool_submit(jit_pool, 0x100, program, sizeof(program)))
+        return -1;
+    if (jit_pool_submit(jit_pool, 0x100, program, sizeof(program)) == 0)
+        return -1;
+    if (test_wait(jit_pool, 0x100, JIT_POOL_DONE))
+        return -1;
+
+    struct list * binslist;
+    binslist = jit_pool_take(jit_pool, 0x100, program, sizeof(program));
+    if (binslist == NULL)
+        return -1;
+    ODEL(binslist);
+    if (jit_pool_take(jit_pool, 0x100, program, sizeof(program)) != NULL)
+        return -1;
+
+    /* stale bytes are dropped too */
+    if (jit_pool_submit(jit_pool, 0x100, program, sizeof(program)))
+        return -1;
+    if (test_wait(jit_pool, 0x100, JIT_POOL_DONE))
+        return -1;
+    const uint8_t nop[] = {0x90, 0x00, 0x00, 0x00};
+    if (jit_pool_take(jit_pool, 0x100, nop, sizeof(nop)) != NULL)
+        return -1;
+    if (test_state(jit_pool, 0x100) != -1)
+        return -1;
+
+    /* as are discarded jobs */
+    if (jit_pool_submit(jit_pool, 0x100, program, sizeof(program)))
+        return -1;
+    if (test_wait(jit_pool, 0x100, JIT_POOL_DONE))
+        return -1;
+    jit_pool_discard(jit_pool, 0x100);
+    if (test_state(jit_pool, 0x100) != -1)
+        return -1;
+
+    ODEL(jit_pool);
+
+    return 0;
+}
+
+
+/*
+* Without workers nothing leaves the queue, so it fills up. Taking a queued
+* job makes room for another.
+*/
+int test_queue () {
+    struct jit_pool * jit_pool = jit_pool_create(&arch_source_hsvm, 0);
+
+    unsigned int i;
+    for (i = 0; i < JIT_POOL_MAX_JOBS; i++) {
+        if (jit_pool_submit(jit_pool, i * 4, program, sizeof(program)))
+            return -1;
+    }
+    if (jit_pool_submit(jit_pool, i * 4, program, sizeof(program)) == 0)
+        return -1;
+
+    if (jit_pool_take(jit_pool, 0, program, sizeof(program)) != NULL)
+        return -1;
+    if (jit_pool_submit(jit_pool, i * 4, program, sizeof(program)))
+        return -1;
+
+    ODEL(jit_pool);
+
+    return 0;
+}
+
+
+/*
+* Jobs nobody takes don't stop later submissions, and no more than
+* JIT_POOL_MAX_JOBS of them are kept.
+*/
+int test_untaken () {
+    struct jit_pool * jit_pool = jit_pool_create(&arch_source_hsvm, 2);
+
+    unsigned int i;
+    for (i = 0; i < JIT_POOL_MAX_JOBS * 3; i++) {
+        unsigned int tries = 0;
+        while (jit_pool_submit(jit_pool, i * 4, program, sizeof(program))) {
+            if (++tries == 5000)
+                return -1;
+            usleep(1000);
+        }
+    }
+    if (test_wait(jit_pool, (i - 1) * 4, JIT_POOL_DONE))
+        return -1;
+
+    if (test_jobs(jit_pool) > JIT_POOL_MAX_JOBS + 2)
+        return -1;
+    if (test_state(jit_pool, 0) != -1)
+        return -1;
+
+    ODEL(jit_pool);
+
+    return 0;
+}
+
+
+pthread_mutex_t test_gate = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* translates only once test_gate is unlocked */
+struct list * test_translate_block (const void * buf,
+                                    size_t size,
+                                    uint64_t address) {
+    pthread_mutex_lock(&test_gate);
+    pthread_mutex_unlock(&test_gate);
+    return hsvm_translate_block(buf, size, address);
+}
+
+
+/* A job taken while it runs is removed by its worker once it is done */
+int test_abandon () {
+    struct arch_source arch_source = arch_source_hsvm;
+    arch_source.translate_block = test_translate_block;
+
+    struct jit_pool * jit_pool = jit_pool_create(&arch_source, 1);
+
+    pthread_mutex_lock(&test_gate);
+    if (jit_pool_submit(jit_pool, 0x100, program, sizeof(program)))
+        return -1;
+    if (test_wait(jit_pool, 0x100, JIT_POOL_RUNNING))
+        return -1;
+    if (jit_pool_take(jit_pool, 0x100, program, sizeof(program)) != NULL)
+        return -1;
+    pthread_mutex_unlock(&test_gate);
+
+    if (test_wait(jit_pool, 0x100, -1))
+        return -1;
+    if (jit_pool_submit(jit_pool, 0x100, program, sizeof(program)))
+        return -1;
+
+    ODEL(jit_pool);
+
+    return 0;
+}
+
+
+int main () {
+    if (test_take()) {
+        printf("error in test_take()\n");
+        return -1;
+    }
+
+    if (test_queue()) {
+        printf("error in test_queue()\n");
+        return -1;
+    }
+
+    if (test_untaken()) {
+        printf("error in test_untaken()\n");
+        return -1;
+    }
+
+    if (test_abandon()) {
+        printf("error in test_abandon()\n");
+        return -1;
+    }
+
+    return 0;
+}
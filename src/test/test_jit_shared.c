@@ -0,0 +1,276 @@
+#include "arch/source/hsvm.h"
+#include "arch/target/amd64.h"
+#include "arch/target/interp.h"
+#include "bt/bins.h"
+#include "bt/jit.h"
+#include "container/memmap.h"
+#include "container/varstore.h"
+#include "hooks.h"
+#include "platform/platform.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_THREADS 4
+#define TEST_RUNS 16
+
+
+/*
+* Sums 1..n, where n is the 16-bit value at 0x100
+* 0x00 mov r0, 0
+* 0x04 load r1, [0x100]
+* 0x08 add r0, r0, r1
+* 0x0c sub r1, 1
+* 0x10 cmp r1, 0
+* 0x14 jg 0x08
+* 0x18 hlt
+*/
+const uint8_t program[] = {
+    0x52, 0x00, 0x00, 0x00,
+    0x30, 0x01, 0x01, 0x00,
+    0x10, 0x00, 0x00, 0x01,
+    0x13, 0x01, 0x00, 0x01,
+    0x54, 0x01, 0x00, 0x00,
+    0x25, 0x00, 0xff, 0xf0,
+    0x60, 0x00, 0x00, 0x00
+};
+
+
+int test_hlt (struct jit * jit, struct varstore * varstore) {
+    return PLATFORM_STOP;
+}
+
+
+const struct platform test_platform = {test_hlt, NULL, NULL};
+
+
+struct test_guest {
+    struct jit * jit;
+    uint16_t n;
+    /* jit_execute's result, or -100 if a guest summed wrong */
+    int result;
+};
+
+
+void * test_guest_run (void * arg) {
+    struct test_guest * guest = arg;
+
+    unsigned int i;
+    for (i = 0; i < TEST_RUNS; i++) {
+        uint16_t n = guest->n + i;
+        struct memmap * memmap = memmap_create(0x100);
+        memmap_map(memmap,
+                   0,
+                   0x200,
+                   program,
+                   sizeof(program),
+                   MEMMAP_R | MEMMAP_W | MEMMAP_X);
+        memmap_set_u8(memmap, 0x100, n >> 8);
+        memmap_set_u8(memmap, 0x101, n & 0xff);
+
+        struct varstore * varstore = varstore_create();
+        varstore_insert(varstore, "rip", 16);
+
+        guest->result = jit_execute(guest->jit, varstore, memmap);
+        uint64_t r0;
+        if (    (guest->result == 0)
+             && (    (varstore_value(varstore, "r0", 16, &r0) != 0)
+                  || (r0 != (((n * (n + 1)) / 2) & 0xffff))))
+            guest->result = -100;
+        ODEL(varstore);
+        ODEL(memmap);
+
+        if (guest->result != 0)
+            break;
+    }
+
+    return NULL;
+}
+
+
+int test_shared (const struct arch_target * tier_target) {
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+    if (tier_target != NULL)
+        jit_set_tiering(jit, tier_target, 4);
+
+    struct test_guest guests[TEST_THREADS];
+    pthread_t threads[TEST_THREADS];
+    unsigned int i;
+    for (i = 0; i < TEST_THREADS; i++) {
+        guests[i].jit = jit;
+        guests[i].n = 100 * (i + 1);
+        assert(pthread_create(&(threads[i]),
+                              NULL,
+                              test_guest_run,
+                              &(guests[i])) == 0);
+    }
+
+    for (i = 0; i < TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        if (guests[i].result != 0) {
+            printf("guest %u returned %d\n", i, guests[i].result);
+            return -1;
+        }
+    }
+
+    /* every block was translated for all of the guests at once */
+    struct jit_stats stats;
+    jit_get_stats(jit, &stats);
+    if (tier_target == NULL)
+        assert(stats.translations == 3);
+    else
+        assert(stats.translations <= 6);
+
+    ODEL(jit);
+    return 0;
+}
+
+
+/*
+* 0x000 mov r2, 2
+* 0x004 storb [0x113], r2
+* 0x008 jmp 0x110
+* 0x110 mov r1, 1
+* 0x114 hlt
+* The storb patches the mov at 0x110 to mov r1, 2.
+*/
+const uint8_t patch_program[] = {
+    0x52, 0x02, 0x00, 0x02,
+    0x36, 0x02, 0x01, 0x13,
+    0x20, 0x00, 0x01, 0x04
+};
+const uint8_t patched_program[] = {
+    0x52, 0x01, 0x00, 0x01,
+    0x60, 0x00, 0x00, 0x00
+};
+
+
+/* Runs from rip in a new guest, and returns r1, or -1 on error */
+int test_patch_run (struct jit * jit, uint16_t rip) {
+    uint8_t image[0x110 + sizeof(patched_program)];
+    memset(image, 0, sizeof(image));
+    memcpy(image, patch_program, sizeof(patch_program));
+    memcpy(&(image[0x110]), patched_program, sizeof(patched_program));
+
+    struct memmap * memmap = memmap_create(0x100);
+    memmap_map(memmap,
+               0,
+               0x200,
+               image,
+               sizeof(image),
+               MEMMAP_R | MEMMAP_W | MEMMAP_X);
+
+    struct varstore * varstore = varstore_create();
+    size_t offset = varstore_insert(varstore, "rip", 16);
+    *((uint16_t *) &(((uint8_t *) varstore_data_buf(varstore))[offset])) = rip;
+
+    uint64_t r1 = -1;
+    if (    (jit_execute(jit, varstore, memmap) != 0)
+         || varstore_value(varstore, "r1", 16, &r1))
+        r1 = -1;
+
+    ODEL(varstore);
+    ODEL(memmap);
+    return r1;
+}
+
+
+/*
+* A guest which only ever runs the block at 0x110 from the lookup table still
+* hears about its own writes to it, though another guest translated it.
+*/
+int test_shared_patch () {
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+
+    if (test_patch_run(jit, 0x110) != 1)
+        return -1;
+    if (test_patch_run(jit, 0x000) != 2)
+        return -1;
+
+    ODEL(jit);
+    return 0;
+}
+
+
+/* the varstore test_varstore_hook was last called with */
+struct varstore * test_hooked = NULL;
+
+
+void test_varstore_hook (void * arg) {
+    test_hooked = arg;
+}
+
+
+int test_varstore_translate (struct jit * jit,
+                             struct varstore * varstore,
+                             struct memmap * memmap,
+                             struct list * binslist) {
+    list_prepend_(binslist, bins_hook(test_varstore_hook));
+    return 0;
+}
+
+
+const struct hooks_api test_varstore_api = {NULL, test_varstore_translate, NULL};
+
+
+/*
+* A hook in a block another guest translated gets the varstore of the guest
+* running it. Both varstores live to the end, so the second can't take the
+* place of the first. This leaves test_varstore_api hooked.
+*/
+int test_shared_hook () {
+    global_hooks_append(&test_varstore_api);
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+
+    struct varstore * varstores[2];
+    unsigned int i;
+    for (i = 0; i < 2; i++) {
+        struct memmap * memmap = memmap_create(0x100);
+        memmap_map(memmap,
+                   0,
+                   0x200,
+                   program,
+                   sizeof(program),
+                   MEMMAP_R | MEMMAP_W | MEMMAP_X);
+        memmap_set_u8(memmap, 0x101, 10);
+
+        varstores[i] = varstore_create();
+        varstore_insert(varstores[i], "rip", 16);
+        test_hooked = NULL;
+        assert(jit_execute(jit, varstores[i], memmap) == 0);
+        ODEL(memmap);
+        if (test_hooked != varstores[i])
+            return -1;
+    }
+
+    /* the second guest ran the first guest's blocks */
+    struct jit_stats stats;
+    jit_get_stats(jit, &stats);
+    assert(stats.translations == 3);
+
+    ODEL(varstores[0]);
+    ODEL(varstores[1]);
+    ODEL(jit);
+    return 0;
+}
+
+
+int main () {
+    global_hooks_init();
+
+    assert(test_shared(NULL) == 0);
+    assert(test_shared(&arch_target_interp) == 0);
+    assert(test_shared_patch() == 0);
+    assert(test_shared_hook() == 0);
+
+    global_hooks_cleanup();
+    return 0;
+}
@@ -41,6 +41,32 @@ int main () {
     testobj = (struct testobj *) list_back(list);
     assert(testobj->value == 2);
 
+    // empty the list from the back, then reuse it
+    while (list_back(list) != NULL)
+        list_pop_back(list);
+    assert(list_front(list) == NULL);
+    list_append_(list, testobj_create(4));
+    list_prepend_(list, testobj_create(5));
+    assert(((struct testobj *) list_front(list))->value == 5);
+    assert(((struct testobj *) list_back(list))->value == 4);
+
+    // and from the front
+    while (list_front(list) != NULL)
+        list_pop_front(list);
+    assert(list_back(list) == NULL);
+    list_prepend_(list, testobj_create(6));
+    assert(((struct testobj *) list_back(list))->value == 6);
+
+    // slices copy the objects between two iterators, inclusive
+    list_append_(list, testobj_create(7));
+    list_append_(list, testobj_create(8));
+    struct list_it * first = list_it_next(list_it(list));
+    struct list * slice = list_slice(list, first, list_it_next(first));
+    assert(((struct testobj *) list_front(slice))->value == 7);
+    assert(((struct testobj *) list_back(slice))->value == 8);
+    assert(list_front(slice) != list_it_data(first));
+    ODEL(slice);
+
     ODEL(copy);
     ODEL(list);
 
@@ -0,0 +1,278 @@
+#include "arch/target/amd64.h"
+#include "bt/bins.h"
+#include "container/byte_buf.h"
+#include "container/list.h"
+#include "container/memmap.h"
+#include "container/varstore.h"
+
+#include <assert.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+
+/* Executable memory for running the amd64 code memmaps are accessed from. */
+void * mmap_mem;
+
+
+void tlb_code_written (void * arg, uint64_t address, size_t size) {
+    *((unsigned int *) arg) += 1;
+}
+
+
+/*
+* Runs the same loads and stores through amd64 twice, so the second run hits
+* the tlb entries the first run filled, and checks writes to a page holding
+* code still reach code_written.
+*/
+int test_tlb () {
+    struct memmap * memmap = memmap_create(4096);
+    memmap_map(memmap, 0, 0x2000, NULL, 0, MEMMAP_R | MEMMAP_W);
+    unsigned int written = 0;
+    memmap_set_code_written(memmap, tlb_code_written, &written);
+    memmap_snapshot_delete(memmap_snapshot(memmap));
+
+    struct list * list = list_create();
+    list_append_(list, bins_store_(boper_constant(16, 0x10),
+                                   boper_constant(32, 0x11223344)));
+    list_append_(list, bins_storebe_(boper_constant(16, 0x20),
+                                     boper_constant(16, 0xaabb)));
+    list_append_(list, bins_store_(boper_constant(16, 0x1010),
+                                   boper_constant(8, 0x55)));
+    list_append_(list, bins_load_(boper_variable(64, "result"),
+                                  boper_constant(16, 0x10)));
+    list_append_(list, bins_loadbe_(boper_variable(16, "half"),
+                                    boper_constant(16, 0x20)));
+    /* straddles two entries */
+    list_append_(list, bins_load_(boper_variable(32, "straddle"),
+                                  boper_constant(16, 0xfe)));
+
+    struct varstore * varstore = varstore_create();
+    size_t offset = varstore_offset_create(varstore, "__MEMMAP__", 64);
+    uint8_t * data_buf = varstore_data_buf(varstore);
+    *((uint64_t *) &(data_buf[offset])) = (uint64_t) memmap;
+
+    struct byte_buf * assembled = amd64_assemble(list, varstore);
+    memcpy(mmap_mem, byte_buf_bytes(assembled), byte_buf_length(assembled));
+
+    unsigned int run;
+    for (run = 0; run < 3; run++) {
+        memmap_set_u8(memmap, 0x100, 0x77);
+        assert(amd64_execute(mmap_mem, varstore) == 0);
+        uint64_t result, half, straddle;
+        assert(varstore_value(varstore, "result", 64, &result) == 0);
+        assert(varstore_value(varstore, "half", 16, &half) == 0);
+        assert(varstore_value(varstore, "straddle", 32, &straddle) == 0);
+        if (    (result != 0x11223344ULL)
+             || (half != 0xaabb)
+             || (straddle != 0x770000)) {
+            printf("tlb run %u result 0x%llx half 0x%llx straddle 0x%llx\n",
+                   run,
+                   (unsigned long long) result,
+                   (unsigned long long) half,
+                   (unsigned long long) straddle);
+            return -1;
+        }
+        assert(memmap->tlb[MEMMAP_TLB_INDEX(0x10)].read == 0);
+        assert(memmap->tlb[MEMMAP_TLB_INDEX(0x10)].write == 0);
+        assert(memmap->tlb[MEMMAP_TLB_INDEX(0x1010)].write == 0x1000);
+
+        /* the next run must see the write to code */
+        memmap_mark_code(memmap, 0x1000, 1);
+        assert(memmap->tlb[MEMMAP_TLB_INDEX(0x1010)].write
+               == MEMMAP_TLB_EMPTY);
+        assert(memmap->tlb[MEMMAP_TLB_INDEX(0x10)].write == 0);
+    }
+    assert(written == 2);
+
+    /* a snapshot leaves pages clean, so writes must mark them again */
+    memmap_snapshot_delete(memmap_snapshot(memmap));
+    assert(memmap->tlb[MEMMAP_TLB_INDEX(0x10)].write == MEMMAP_TLB_EMPTY);
+    assert(amd64_execute(mmap_mem, varstore) == 0);
+    assert(memmap->dirty[0] == 3);
+
+    ODEL(assembled);
+    ODEL(varstore);
+    ODEL(list);
+    ODEL(memmap);
+    return 0;
+}
+
+
+/* Assembles list for amd64 and runs it with memmap */
+unsigned int run_direct (struct list * list,
+                         struct memmap * memmap,
+                         struct varstore * varstore) {
+    size_t offset = varstore_offset_create(varstore, "__MEMMAP__", 64);
+    uint8_t * data_buf = varstore_data_buf(varstore);
+    *((uint64_t *) &(data_buf[offset])) = (uint64_t) memmap;
+
+    struct byte_buf * assembled = amd64_assemble(list, varstore);
+    memcpy(mmap_mem, byte_buf_bytes(assembled), byte_buf_length(assembled));
+    ODEL(assembled);
+    return amd64_execute(mmap_mem, varstore);
+}
+
+
+/*
+* Loads and stores in a direct memmap go straight to its mapping, and still
+* mark pages dirty, reach code_written, and fail on unmapped pages.
+*/
+int test_direct () {
+    struct memmap * memmap = memmap_create_direct(4096, 0x10000);
+    assert(memmap != NULL);
+    assert(memmap_create_direct(4096, 0x10001) == NULL);
+    memmap_map(memmap, 0, 0x2000, NULL, 0, MEMMAP_R | MEMMAP_W);
+    /* above the direct mapping, so reached through the tlb */
+    memmap_map(memmap, 0x20000, 0x1000, NULL, 0, MEMMAP_R | MEMMAP_W);
+    memmap_set_u8(memmap, 0x20000, 0x66);
+    unsigned int written = 0;
+    memmap_set_code_written(memmap, tlb_code_written, &written);
+
+    struct list * list = list_create();
+    list_append_(list, bins_store_(boper_constant(16, 0x10),
+                                   boper_constant(32, 0x11223344)));
+    list_append_(list, bins_storebe_(boper_constant(16, 0x20),
+                                     boper_constant(16, 0xaabb)));
+    list_append_(list, bins_store_(boper_constant(16, 0x1010),
+                                   boper_constant(8, 0x55)));
+    list_append_(list, bins_load_(boper_variable(64, "result"),
+                                  boper_constant(16, 0x10)));
+    list_append_(list, bins_loadbe_(boper_variable(16, "half"),
+                                    boper_constant(16, 0x20)));
+    list_append_(list, bins_load_(boper_variable(8, "above"),
+                                  boper_constant(32, 0x20000)));
+
+    struct varstore * varstore = varstore_create();
+    struct memmap_snapshot * snapshot = memmap_snapshot(memmap);
+    unsigned int run;
+    for (run = 0; run < 2; run++) {
+        assert(memmap->dirty[0] == 0);
+        memmap_mark_code(memmap, 0x1000, 1);
+        assert(run_direct(list, memmap, varstore) == 0);
+
+        uint64_t result, half, above;
+        assert(varstore_value(varstore, "result", 64, &result) == 0);
+        assert(varstore_value(varstore, "half", 16, &half) == 0);
+        assert(varstore_value(varstore, "above", 8, &above) == 0);
+        if ((result != 0x11223344ULL) || (half != 0xaabb) || (above != 0x66)) {
+            printf("direct run %u result 0x%llx half 0x%llx above 0x%llx\n",
+                   run,
+                   (unsigned long long) result,
+                   (unsigned long long) half,
+                   (unsigned long long) above);
+            return -1;
+        }
+        assert(memmap->direct[0x21] == 0xbb);
+        /* the first two pages were written, the one above only read */
+        assert(memmap->dirty[0] == 3);
+        assert(written == run + 1);
+
+        assert(memmap_restore(memmap, snapshot) == 0);
+        assert(memmap->direct[0x10] == 0);
+    }
+    ODEL(snapshot);
+    ODEL(list);
+
+    /* unmapped pages fail as memmap_get and memmap_set do, with registers
+       written back */
+    list = list_create();
+    list_append_(list, bins_or_(boper_variable(32, "before"),
+                                boper_constant(32, 5),
+                                boper_constant(32, 0)));
+    list_append_(list, bins_load_(boper_variable(8, "result"),
+                                  boper_constant(16, 0x8000)));
+    assert(run_direct(list, memmap, varstore) == 1);
+    uint64_t before;
+    assert(varstore_value(varstore, "before", 32, &before) == 0);
+    assert(before == 5);
+    ODEL(list);
+
+    list = list_create();
+    list_append_(list, bins_store_(boper_constant(16, 0x8000),
+                                   boper_constant(8, 1)));
+    assert(run_direct(list, memmap, varstore) == 2);
+
+    /* unless the memmap creates them */
+    memmap_set_flags(memmap, MEMMAP_NOFAIL);
+    assert(run_direct(list, memmap, varstore) == 0);
+    assert(memmap->direct[0x8000] == 1);
+    ODEL(list);
+
+    ODEL(varstore);
+    ODEL(memmap);
+    return 0;
+}
+
+
+/* the number of faults which reached test_segv_handler */
+unsigned int segv_count = 0;
+
+
+/* Stands in for a SIGSEGV handler the host had before any direct memmap, and
+   lets the faulting access through */
+void test_segv_handler (int signum, siginfo_t * info, void * context) {
+    uintptr_t page = (uintptr_t) info->si_addr & ~((uintptr_t) 4096 - 1);
+    mprotect((void *) page, 4096, PROT_READ | PROT_WRITE);
+    segv_count++;
+}
+
+
+/*
+* The first direct memmap installs its SIGSEGV handler, and faults it does not
+* handle still reach the handler before it, every time.
+*/
+int test_segv () {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = test_segv_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&(action.sa_mask));
+    sigaction(SIGSEGV, &action, NULL);
+
+    /* running amd64 code leaves SIGSEGV alone */
+    assert(test_tlb() == 0);
+    struct sigaction current;
+    sigaction(SIGSEGV, NULL, &current);
+    assert(current.sa_sigaction == test_segv_handler);
+
+    struct memmap * memmap = memmap_create_direct(4096, 0x10000);
+    sigaction(SIGSEGV, NULL, &current);
+    assert(current.sa_sigaction != test_segv_handler);
+
+    /* faults outside any direct mapping */
+    volatile uint8_t * foreign = mmap(NULL,
+                                      4096,
+                                      PROT_NONE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS,
+                                      -1,
+                                      0);
+    unsigned int i;
+    for (i = 0; i < 2; i++) {
+        foreign[0] = 1;
+        assert(segv_count == i + 1);
+        mprotect((void *) foreign, 4096, PROT_NONE);
+    }
+    munmap((void *) foreign, 4096);
+
+    /* a fault where no page is, but not in jit code */
+    volatile uint8_t * unmapped = &(memmap->direct[0x8000]);
+    assert(unmapped[0] == 0);
+    assert(segv_count == 3);
+
+    ODEL(memmap);
+    return 0;
+}
+
+
+int main (int argc, char * argv[]) {
+    mmap_mem = mmap(0, 4096 * 16, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    assert(test_segv() == 0);
+    assert(test_direct() == 0);
+
+    return 0;
+}
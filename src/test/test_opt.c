@@ -0,0 +1,260 @@
+#include "bt/bins.h"
+#include "bt/opt.h"
+#include "container/list.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+void hook (void * arg) {
+}
+
+
+struct boper * var (const char * identifier) {
+    return boper_variable(16, identifier);
+}
+
+
+struct boper * tmp (const char * identifier) {
+    return boper_temporary(16, identifier);
+}
+
+
+struct boper * con (uint64_t value) {
+    return boper_constant(16, value);
+}
+
+
+/* Returns the string of the nth bins in binslist */
+const char * nth (struct list * binslist, unsigned int n) {
+    static char s[128];
+    struct list_it * it = list_it(binslist);
+    while (n-- > 0)
+        it = list_it_next(it);
+    char * str = bins_string(list_it_data(it));
+    strncpy(s, str, sizeof(s) - 1);
+    free(str);
+    return s;
+}
+
+
+int is_flag (const char * identifier) {
+    return identifier[0] == 'f';
+}
+
+
+struct list * run_dead (struct list * binslist,
+                        unsigned int passes,
+                        struct list * dead_flags) {
+    struct opt_vars vars;
+    vars.is_flag = is_flag;
+    vars.dead_flags = dead_flags;
+    struct opt_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    opt_run(binslist, passes, &vars, &stats);
+    assert(stats.bins_out == list_length(binslist));
+    return binslist;
+}
+
+
+struct list * run (struct list * binslist, unsigned int passes) {
+    return run_dead(binslist, passes, NULL);
+}
+
+
+int main () {
+    struct list * l;
+    char * expected;
+
+    /* constants are folded through temporaries, which then go away */
+    l = list_create();
+    list_append_(l, bins_or_(tmp("t16"), con(0x10), con(0)));
+    list_append_(l, bins_shl_(tmp("t16"), tmp("t16"), con(4)));
+    list_append_(l, bins_add_(var("a"), tmp("t16"), con(1)));
+    run(l, OPT_ALL);
+    assert(list_length(l) == 1);
+    struct bins * bins = bins_or_(var("a"), con(0x101), con(0));
+    expected = bins_string(bins);
+    assert(strcmp(nth(l, 0), expected) == 0);
+    free(expected);
+    ODEL(bins);
+    ODEL(l);
+
+    /* with every pass off, nothing changes */
+    l = list_create();
+    list_append_(l, bins_or_(tmp("t16"), con(0x10), con(0)));
+    list_append_(l, bins_add_(var("a"), tmp("t16"), con(1)));
+    run(l, 0);
+    assert(list_length(l) == 2);
+    ODEL(l);
+
+    /* copies are propagated */
+    l = list_create();
+    list_append_(l, bins_or_(var("b"), var("a"), con(0)));
+    list_append_(l, bins_add_(var("c"), var("b"), con(1)));
+    run(l, OPT_COPY_PROP);
+    assert(strstr(nth(l, 1), "add") != NULL);
+    assert(strstr(nth(l, 1), "b") == NULL);
+    ODEL(l);
+
+    /* but not into the rhs of an instruction writing the copy's source */
+    l = list_create();
+    list_append_(l, bins_or_(var("b"), var("a"), con(0)));
+    list_append_(l, bins_add_(var("a"), var("c"), var("b")));
+    run(l, OPT_ALL);
+    assert(strstr(nth(l, 1), "b") != NULL);
+    ODEL(l);
+
+    /* and not once the source is written */
+    l = list_create();
+    list_append_(l, bins_or_(var("b"), var("a"), con(0)));
+    list_append_(l, bins_or_(var("a"), con(1), con(0)));
+    list_append_(l, bins_add_(var("c"), var("b"), con(1)));
+    run(l, OPT_COPY_PROP);
+    assert(strstr(nth(l, 2), "b") != NULL);
+    ODEL(l);
+
+    /* hooks may read and write anything */
+    l = list_create();
+    list_append_(l, bins_or_(tmp("t16"), con(1), con(0)));
+    list_append_(l, bins_hook(hook));
+    list_append_(l, bins_add_(var("a"), tmp("t16"), con(1)));
+    run(l, OPT_ALL);
+    assert(list_length(l) == 3);
+    assert(strstr(nth(l, 2), "t16") != NULL);
+    ODEL(l);
+
+    /* but they never read temporaries */
+    l = list_create();
+    list_append_(l, bins_or_(tmp("t16"), var("a"), con(0)));
+    list_append_(l, bins_hook(hook));
+    list_append_(l, bins_add_(var("a"), var("b"), con(1)));
+    run(l, OPT_DCE);
+    assert(list_length(l) == 2);
+    ODEL(l);
+
+    /* instructions a branch may skip stay, and are unknown after its
+       label */
+    l = list_create();
+    list_append_(l, bins_brz_(boper_variable(1, "flag"), 0));
+    list_append_(l, bins_or_(tmp("t16"), con(1), con(0)));
+    list_append_(l, bins_label(0));
+    list_append_(l, bins_add_(var("a"), tmp("t16"), con(1)));
+    run(l, OPT_ALL);
+    assert(list_length(l) == 4);
+    assert(strstr(nth(l, 3), "t16") != NULL);
+    ODEL(l);
+
+    /* but what was known before the branch still is */
+    l = list_create();
+    list_append_(l, bins_or_(tmp("t16"), con(2), con(0)));
+    list_append_(l, bins_brz_(boper_variable(1, "flag"), 0));
+    list_append_(l, bins_or_(var("b"), con(1), con(0)));
+    list_append_(l, bins_label(0));
+    list_append_(l, bins_add_(var("a"), tmp("t16"), var("b")));
+    run(l, OPT_ALL);
+    assert(list_length(l) == 4);
+    assert(strstr(nth(l, 3), "t16") == NULL);
+    assert(strstr(nth(l, 3), "b") != NULL);
+    ODEL(l);
+
+    /* writes to temporaries nothing reads are removed, loads stay */
+    l = list_create();
+    list_append_(l, bins_load_(boper_temporary(8, "t8"), var("a")));
+    list_append_(l, bins_add_(tmp("t16"), var("a"), con(1)));
+    list_append_(l, bins_add_(tmp("t16"), var("a"), con(2)));
+    list_append_(l, bins_store_(tmp("t16"), boper_temporary(8, "t8")));
+    list_append_(l, bins_or_(con(0), con(0), con(0)));
+    run(l, OPT_DCE);
+    assert(list_length(l) == 3);
+    assert(strstr(nth(l, 1), "0x2") != NULL);
+    ODEL(l);
+
+    /* signed compares and extensions fold at their operand's width */
+    l = list_create();
+    list_append_(l, bins_cmplts_(boper_variable(1, "c"),
+                                 boper_constant(8, 0xff),
+                                 boper_constant(8, 1)));
+    list_append_(l, bins_sext_(var("d"), boper_constant(8, 0x80)));
+    run(l, OPT_FOLD);
+    assert(strstr(nth(l, 0), "0x1") != NULL);
+    assert(strstr(nth(l, 1), "0xff80") != NULL);
+    ODEL(l);
+
+    /* flags written again before they are read are removed, along with the
+       temporaries computing them */
+    l = list_create();
+    list_append_(l, bins_cmpeq_(boper_temporary(1, "t1"), var("a"), con(0)));
+    list_append_(l, bins_or_(boper_variable(1, "fz"),
+                             boper_temporary(1, "t1"),
+                             boper_constant(1, 0)));
+    list_append_(l, bins_cmpeq_(boper_variable(1, "fz"), var("b"), con(0)));
+    run(l, OPT_ALL);
+    assert(list_length(l) == 1);
+    assert(strstr(nth(l, 0), "b") != NULL);
+    ODEL(l);
+
+    /* but not when something reads them first, or the platform may */
+    l = list_create();
+    list_append_(l, bins_cmpeq_(boper_variable(1, "fz"), var("a"), con(0)));
+    list_append_(l, bins_zext_(var("c"), boper_variable(1, "fz")));
+    list_append_(l, bins_cmpeq_(boper_variable(1, "fz"), var("b"), con(0)));
+    list_append_(l, bins_hlt());
+    list_append_(l, bins_cmpeq_(boper_variable(1, "fz"), var("a"), con(1)));
+    run(l, OPT_ALL);
+    assert(list_length(l) == 5);
+    ODEL(l);
+
+    /* flags are only dead at the end of the block when every successor
+       writes them before reading */
+    struct list * successor = list_create();
+    list_append_(successor, bins_cmpeq_(boper_variable(1, "fc"),
+                                        var("a"),
+                                        con(1)));
+    list_append_(successor, bins_ce_(boper_variable(1, "fc"),
+                                     boper_constant(8, 1)));
+    list_append_(successor, bins_cmpeq_(boper_variable(1, "fn"),
+                                        var("a"),
+                                        con(2)));
+    list_append_(successor, bins_cmpeq_(boper_variable(1, "fz"),
+                                        boper_variable(1, "fv"),
+                                        con(0)));
+    list_append_(successor, bins_cmpeq_(boper_variable(1, "fv"),
+                                        var("a"),
+                                        con(3)));
+    /* the translator's ce becomes a branch over fn */
+    assert(bins_lower_ce(successor) == 0);
+    assert(list_length(successor) == 6);
+    assert(strstr(nth(successor, 1), "brz") != NULL);
+    assert(strstr(nth(successor, 3), "label") != NULL);
+    struct list * dead_flags = opt_flags_written(successor, is_flag);
+    assert(list_length(dead_flags) == 2);
+    ODEL(successor);
+
+    successor = list_create();
+    list_append_(successor, bins_cmpeq_(boper_variable(1, "fz"),
+                                        var("a"),
+                                        con(1)));
+    list_append_(successor, bins_hook(hook));
+    list_append_(successor, bins_cmpeq_(boper_variable(1, "fc"),
+                                        var("a"),
+                                        con(1)));
+    struct list * written = opt_flags_written(successor, is_flag);
+    opt_flags_intersect(dead_flags, written);
+    assert(list_length(dead_flags) == 1);
+    ODEL(written);
+    ODEL(successor);
+
+    l = list_create();
+    list_append_(l, bins_cmpeq_(boper_variable(1, "fz"), var("a"), con(0)));
+    list_append_(l, bins_cmpeq_(boper_variable(1, "fc"), var("a"), con(0)));
+    run_dead(l, OPT_ALL, dead_flags);
+    assert(list_length(l) == 1);
+    assert(strstr(nth(l, 0), "fc") != NULL);
+    ODEL(l);
+    ODEL(dead_flags);
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include "arch/source/hsvm.h"
+#include "arch/target/amd64.h"
+#include "bt/jit.h"
+#include "container/memmap.h"
+#include "container/varstore.h"
+#include "hooks.h"
+#include "platform/platform.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+
+/*
+* 0x00 mov r0, 2
+* 0x04 storb [0x13], r0    patches the value moved at 0x10
+* 0x08 jmp 0x10
+* 0x0c nop
+* 0x10 mov r1, 1
+* 0x14 hlt
+*/
+const uint8_t program[] = {
+    0x52, 0x00, 0x00, 0x02,
+    0x36, 0x00, 0x00, 0x13,
+    0x20, 0x00, 0x00, 0x04,
+    0x90, 0x00, 0x00, 0x00,
+    0x52, 0x01, 0x00, 0x01,
+    0x60, 0x00, 0x00, 0x00
+};
+
+
+int test_hlt (struct jit * jit, struct varstore * varstore) {
+    return PLATFORM_STOP;
+}
+
+
+const struct platform test_platform = {test_hlt, NULL, NULL};
+
+
+int written_calls = 0;
+uint64_t written_address = 0;
+
+
+void written (void * arg, uint64_t address, size_t size) {
+    written_calls++;
+    written_address = address;
+}
+
+
+int test_memmap () {
+    struct memmap * memmap = memmap_create(0x100);
+    memmap_map(memmap, 0, 0x400, NULL, 0, MEMMAP_R | MEMMAP_W | MEMMAP_X);
+    memmap_set_code_written(memmap, written, NULL);
+
+    /* unmarked pages are written quietly */
+    assert(memmap_set_u8(memmap, 0x10, 1) == 0);
+    assert(written_calls == 0);
+
+    /* the mark covers both pages of a block which crosses them */
+    memmap_mark_code(memmap, 0x1f0, 0x20);
+    assert(memmap_set_u8(memmap, 0x210, 1) == 0);
+    assert(written_calls == 1);
+    assert(written_address == 0x200);
+
+    /* and is cleared by the first write */
+    assert(memmap_set_u8(memmap, 0x211, 1) == 0);
+    assert(written_calls == 1);
+    assert(memmap_set_u8(memmap, 0x100, 1) == 0);
+    assert(written_calls == 2);
+    assert(written_address == 0x100);
+
+    ODEL(memmap);
+    return 0;
+}
+
+
+int test_jit () {
+    struct memmap * memmap = memmap_create(0x100);
+    memmap_map(memmap,
+               0,
+               0x100,
+               program,
+               sizeof(program),
+               MEMMAP_R | MEMMAP_W | MEMMAP_X);
+
+    struct varstore * varstore = varstore_create();
+    varstore_insert(varstore, "rip", 16);
+
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+
+    /* translate the block at 0x10 */
+    size_t offset;
+    assert(varstore_offset(varstore, "rip", 16, &offset) == 0);
+    uint8_t * data_buf = (uint8_t *) varstore_data_buf(varstore);
+    *((uint16_t *) &(data_buf[offset])) = 0x10;
+    assert(jit_execute(jit, varstore, memmap) == 0);
+    uint64_t r1;
+    assert(varstore_value(varstore, "r1", 16, &r1) == 0);
+    assert(r1 == 1);
+    assert(jit_get_block(jit, 0x10)->guest_size == 8);
+
+    /* patch it, and run the patched code */
+    assert(varstore_offset(varstore, "rip", 16, &offset) == 0);
+    data_buf = (uint8_t *) varstore_data_buf(varstore);
+    *((uint16_t *) &(data_buf[offset])) = 0;
+    assert(jit_execute(jit, varstore, memmap) == 0);
+    assert(varstore_value(varstore, "r1", 16, &r1) == 0);
+    assert(r1 == 2);
+
+    struct jit_stats stats;
+    jit_get_stats(jit, &stats);
+    assert(stats.smc_invalidations == 2);
+
+    /* blocks elsewhere are left alone */
+    assert(jit_invalidate_range(jit, 0x40, 0x10) == 0);
+    assert(jit_invalidate_range(jit, 0x14, 1) == 1);
+    assert(jit_get_block(jit, 0x10) == NULL);
+
+    ODEL(jit);
+    ODEL(varstore);
+    ODEL(memmap);
+    return 0;
+}
+
+
+int main () {
+    global_hooks_init();
+
+    assert(test_memmap() == 0);
+    assert(test_jit() == 0);
+
+    global_hooks_cleanup();
+    return 0;
+}
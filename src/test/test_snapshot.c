@@ -0,0 +1,193 @@
+#include "arch/source/hsvm.h"
+#include "arch/target/amd64.h"
+#include "bt/jit.h"
+#include "container/memmap.h"
+#include "container/varstore.h"
+#include "hooks.h"
+#include "platform/platform.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+
+/*
+* 0x00 mov r0, 2
+* 0x04 storb [0x13], r0    patches the value moved at 0x10
+* 0x08 jmp 0x10
+* 0x0c nop
+* 0x10 mov r1, 1
+* 0x14 hlt
+*/
+const uint8_t program[] = {
+    0x52, 0x00, 0x00, 0x02,
+    0x36, 0x00, 0x00, 0x13,
+    0x20, 0x00, 0x00, 0x04,
+    0x90, 0x00, 0x00, 0x00,
+    0x52, 0x01, 0x00, 0x01,
+    0x60, 0x00, 0x00, 0x00
+};
+
+
+int test_hlt (struct jit * jit, struct varstore * varstore) {
+    return PLATFORM_STOP;
+}
+
+
+const struct platform test_platform = {test_hlt, NULL, NULL};
+
+
+void written (void * arg, uint64_t address, size_t size) {
+    jit_invalidate_range(arg, address, size);
+}
+
+
+int test_memmap () {
+    struct memmap * memmap = memmap_create(0x100);
+    memmap_map(memmap, 0, 0x400, NULL, 0, MEMMAP_R | MEMMAP_W);
+    memmap_set_u8(memmap, 0x110, 1);
+
+    struct memmap_snapshot * snapshot = memmap_snapshot(memmap);
+    assert(memmap->dirty[0] == 0);
+
+    memmap_set_u8(memmap, 0x110, 2);
+    memmap_set_u8(memmap, 0x300, 3);
+    memmap_map(memmap, 0x800, 0x100, NULL, 0, MEMMAP_R);
+    assert(memmap->dirty[0] == 0x1a);
+
+    uint8_t byte;
+    assert(memmap_restore(memmap, snapshot) == 0);
+    assert(memmap->dirty[0] == 0);
+    assert(memmap_get_u8(memmap, 0x110, &byte) == 0);
+    assert(byte == 1);
+    assert(memmap_get_u8(memmap, 0x300, &byte) == 0);
+    assert(byte == 0);
+    assert(memmap_get_u8(memmap, 0x800, &byte) != 0);
+
+    /* a snapshot may be restored any number of times */
+    memmap_set_u8(memmap, 0x110, 4);
+    assert(memmap_restore(memmap, snapshot) == 0);
+    assert(memmap_get_u8(memmap, 0x110, &byte) == 0);
+    assert(byte == 1);
+
+    /* but only until another snapshot is taken */
+    struct memmap_snapshot * next = memmap_snapshot(memmap);
+    assert(memmap_restore(memmap, snapshot) != 0);
+    assert(memmap_restore(memmap, next) == 0);
+
+    ODEL(next);
+    ODEL(snapshot);
+    ODEL(memmap);
+    return 0;
+}
+
+
+/* Pages mapped after a snapshot are dropped by restoring it, dirty bits too */
+int test_memmap_grown () {
+    struct memmap * memmap = memmap_create(0x100);
+    memmap_map(memmap, 0, 0x400, NULL, 0, MEMMAP_R | MEMMAP_W);
+    struct memmap_snapshot * snapshot = memmap_snapshot(memmap);
+
+    memmap_map(memmap, 0x400, 0x100, NULL, 0, MEMMAP_R | MEMMAP_W);
+    memmap_set_u8(memmap, 0x400, 1);
+    assert(memmap->dirty[0] == 0x10);
+
+    uint8_t byte;
+    assert(memmap_restore(memmap, snapshot) == 0);
+    assert(memmap->pages_size == 4);
+    assert(memmap->dirty[0] == 0);
+    assert(memmap_get_u8(memmap, 0x400, &byte) != 0);
+
+    /* mapped again, the page is new to the snapshot again */
+    memmap_map(memmap, 0x400, 0x100, NULL, 0, MEMMAP_R | MEMMAP_W);
+    assert(memmap->dirty[0] == 0x10);
+    assert(memmap_restore(memmap, snapshot) == 0);
+    assert(memmap_get_u8(memmap, 0x400, &byte) != 0);
+
+    ODEL(snapshot);
+    ODEL(memmap);
+    return 0;
+}
+
+
+int test_varstore () {
+    struct varstore * varstore = varstore_create();
+    varstore_insert(varstore, "a", 16);
+    struct byte_buf * snapshot = varstore_snapshot(varstore);
+
+    size_t offset = varstore_insert(varstore, "b", 32);
+    uint8_t * data_buf = varstore_data_buf(varstore);
+    data_buf[0] = 1;
+    data_buf[offset] = 2;
+
+    uint64_t value;
+    assert(varstore_restore(varstore, snapshot) == 0);
+    assert(varstore_value(varstore, "a", 16, &value) == 0);
+    assert(value == 0);
+    assert(varstore_value(varstore, "b", 32, &value) == 0);
+    assert(value == 0);
+
+    ODEL(snapshot);
+    ODEL(varstore);
+    return 0;
+}
+
+
+int test_jit () {
+    struct memmap * memmap = memmap_create(0x100);
+    memmap_map(memmap,
+               0,
+               0x100,
+               program,
+               sizeof(program),
+               MEMMAP_R | MEMMAP_W | MEMMAP_X);
+
+    struct varstore * varstore = varstore_create();
+    varstore_insert(varstore, "rip", 16);
+
+    struct jit * jit = jit_create(&arch_source_hsvm,
+                                  &arch_target_amd64,
+                                  &test_platform);
+
+    struct memmap_snapshot * memmap_start = memmap_snapshot(memmap);
+    struct byte_buf * varstore_start = varstore_snapshot(varstore);
+
+    unsigned int i;
+    for (i = 0; i < 3; i++) {
+        assert(jit_execute(jit, varstore, memmap) == 0);
+        uint64_t r1;
+        assert(varstore_value(varstore, "r1", 16, &r1) == 0);
+        assert(r1 == 2);
+
+        /* the patch is undone, and so is the code translated from it */
+        memmap_set_code_written(memmap, written, jit);
+        assert(memmap_restore(memmap, memmap_start) == 0);
+        memmap_set_code_written(memmap, NULL, NULL);
+        assert(varstore_restore(varstore, varstore_start) == 0);
+
+        uint8_t byte;
+        assert(memmap_get_u8(memmap, 0x13, &byte) == 0);
+        assert(byte == 1);
+        assert(jit_get_block(jit, 0x10) == NULL);
+    }
+
+    ODEL(varstore_start);
+    ODEL(memmap_start);
+    ODEL(jit);
+    ODEL(varstore);
+    ODEL(memmap);
+    return 0;
+}
+
+
+int main () {
+    global_hooks_init();
+
+    assert(test_memmap() == 0);
+    assert(test_memmap_grown() == 0);
+    assert(test_varstore() == 0);
+    assert(test_jit() == 0);
+
+    global_hooks_cleanup();
+    return 0;
+}
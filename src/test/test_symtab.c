@@ -0,0 +1,36 @@
+#include "container/symtab.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+int main () {
+    unsigned int size = symtab_size();
+
+    unsigned int rip = symtab_id("rip");
+    unsigned int rsp = symtab_id("rsp");
+    assert(rip != SYMTAB_NONE);
+    assert(rsp != rip);
+    assert(symtab_id("rip") == rip);
+    assert(symtab_find("rsp") == rsp);
+    assert(symtab_find("never_seen") == SYMTAB_NONE);
+    assert(strcmp(symtab_name(rip), "rip") == 0);
+    assert(symtab_name(symtab_size()) == NULL);
+
+    /* ids are dense, and stay put as the table grows */
+    char identifier[32];
+    unsigned int i;
+    for (i = 0; i < 5000; i++) {
+        snprintf(identifier, sizeof(identifier), "var%u", i);
+        assert(symtab_id(identifier) == size + 2 + i);
+    }
+    for (i = 0; i < 5000; i++) {
+        snprintf(identifier, sizeof(identifier), "var%u", i);
+        assert(symtab_find(identifier) == size + 2 + i);
+        assert(strcmp(symtab_name(size + 2 + i), identifier) == 0);
+    }
+    assert(symtab_id("rip") == rip);
+    assert(symtab_size() == size + 5002);
+
+    return 0;
+}
@@ -36,6 +36,29 @@ int main () {
 
     ODEL(copy);
 
+    /* iterators visit every object in order */
+    struct tree_it * it;
+    i = 0;
+    for (it = tree_it(tree); it != NULL; it = tree_it_next(it)) {
+        struct testobj * testobj = tree_it_data(it);
+        assert(testobj->value == i);
+        i++;
+    }
+    assert(i == 16);
+
+    /* or from the first object not less than a needle */
+    for (i = 0; i <= 16; i++) {
+        struct testobj * needle = testobj_create(i);
+        unsigned int j = i;
+        for (it = tree_it_at(tree, needle); it != NULL; it = tree_it_next(it)) {
+            struct testobj * testobj = tree_it_data(it);
+            assert(testobj->value == j);
+            j++;
+        }
+        assert(j == 16);
+        ODEL(needle);
+    }
+
     for (i = 0; i < 16; i++) {
         if (i % 2 == 1)
             continue;
@@ -57,6 +80,31 @@ int main () {
         ODEL(testobj);
     }
 
+    /* needles which are not in the tree start at the next object */
+    struct testobj * needle = testobj_create(4);
+    it = tree_it_at(tree, needle);
+    assert(((struct testobj *) tree_it_data(it))->value == 5);
+    tree_it_delete(it);
+    ODEL(needle);
+
+    /* remove the remaining values, including nodes with two children */
+    unsigned int removal_order[] = {7, 3, 11, 1, 15, 5, 13, 9};
+    for (i = 0; i < 8; i++) {
+        struct testobj * testobj = testobj_create(removal_order[i]);
+        assert(tree_remove(tree, testobj) == 0);
+        assert(tree_fetch(tree, testobj) == NULL);
+        ODEL(testobj);
+
+        unsigned int j;
+        for (j = i + 1; j < 8; j++) {
+            testobj = testobj_create(removal_order[j]);
+            assert(tree_fetch(tree, testobj) != NULL);
+            ODEL(testobj);
+        }
+    }
+
+    assert(tree->nodes == NULL);
+
     ODEL(tree);
 
     return 0;
@@ -22,6 +22,48 @@ int main () {
     assert(varstore_offset(varstore, "test16", 16, &offset) == 0);
     assert(offset == 8);
 
+    /* variables are found by the symtab id of their identifier, and the same
+       identifier at other sizes is another variable */
+    unsigned int id = symtab_id("test16");
+    assert(varstore_offset_id(varstore, id, 16, &offset) == 0);
+    assert(offset == 8);
+    assert(varstore_offset_id(varstore, id, 32, &offset) != 0);
+    assert(varstore_offset_create_id(varstore, id, 32) == 32);
+    assert(varstore_offset(varstore, "test16", 32, &offset) == 0);
+    assert(offset == 32);
+    assert(varstore_offset(varstore, "test16", 16, &offset) == 0);
+    assert(offset == 8);
+    assert(varstore_offset(varstore, "never_seen", 16, &offset) != 0);
+
+    struct varstore * copy = OCOPY(varstore);
+    ODEL(varstore);
+    assert(varstore_offset_id(copy, id, 32, &offset) == 0);
+    assert(offset == 32);
+    *((uint16_t *) &(((uint8_t *) varstore_data_buf(copy))[8])) = 0x1234;
+    uint64_t value;
+    assert(varstore_value_id(copy, id, 16, &value) == 0);
+    assert(value == 0x1234);
+
+    ODEL(copy);
+
+    /* growing data_buf keeps values and zeroes the new space */
+    varstore = varstore_create();
+    assert(varstore_insert(varstore, "first", 64) == 0);
+    *((uint64_t *) varstore_data_buf(varstore)) = 0x1122334455667788;
+    char identifier[16];
+    unsigned int i;
+    for (i = 0; i < 100; i++) {
+        snprintf(identifier, sizeof(identifier), "v%u", i);
+        assert(varstore_insert(varstore, identifier, 64) == (i + 1) * 8);
+    }
+    assert(varstore_value(varstore, "first", 64, &value) == 0);
+    assert(value == 0x1122334455667788);
+    for (i = 0; i < 100; i++) {
+        snprintf(identifier, sizeof(identifier), "v%u", i);
+        assert(varstore_value(varstore, identifier, 64, &value) == 0);
+        assert(value == 0);
+    }
+
     ODEL(varstore);
 
     return 0;